@@ -1,63 +1,209 @@
 #include "GBA_Cpu.h"
+#include "assembler.h"
 #include "assembly.h"
+#include "bios.h"
+#include "compression.h"
+#include "decoder.h"
+#include "disassembly_search.h"
+#include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <charconv>
+#include <cstring>
 #include <bitset>
+#include <fstream>
+#include <array>
 #include "repl.h"
 
-GBA_Cpu::GBA_Cpu(GBA_Memory& memory)
-    : memory(memory)
- {
-    R[15] = 0x8000000; // ROM Start
-    flush_pipeline();
-    if (cs_open(CS_ARCH_ARM, CS_MODE_ARM, &cs_arm) != CS_ERR_OK)
-        throw std::runtime_error{ "Failed to instanciate Capstone ARM engine." };
-    if (cs_open(CS_ARCH_ARM, CS_MODE_THUMB, &cs_tmb) != CS_ERR_OK)
+namespace
+{
+    constexpr std::array<uint8_t, 32> make_bank_table()
     {
-        cs_close(&cs_arm);
-        throw std::runtime_error{ "Failed to instanciate Capstone ARM engine." };
+        std::array<uint8_t, 32> table{}; // Invalid modes fall back to the User bank
+        table[GBA_Cpu::USR] = GBA_Cpu::BANK_USR;
+        table[GBA_Cpu::SYS] = GBA_Cpu::BANK_USR;
+        table[GBA_Cpu::FIQ] = GBA_Cpu::BANK_FIQ;
+        table[GBA_Cpu::IRQ] = GBA_Cpu::BANK_IRQ;
+        table[GBA_Cpu::SVC] = GBA_Cpu::BANK_SVC;
+        table[GBA_Cpu::ABT] = GBA_Cpu::BANK_ABT;
+        table[GBA_Cpu::UND] = GBA_Cpu::BANK_UND;
+        return table;
     }
-}
 
-GBA_Cpu::~GBA_Cpu()
-{
-    cs_close(&cs_arm);
-    cs_close(&cs_tmb);
-}
+    /** Register bank of each value of the CPSR mode bits. */
+    constexpr std::array<uint8_t, 32> bank_index = make_bank_table();
 
-void GBA_Cpu::flush_pipeline()
-{
-    if (mode == ExecutionMode::ARM)
+    /** Registers and modes of the cpu, everything an instruction changes but memory. */
+    struct CpuState
+    {
+        explicit CpuState(const GBA_Cpu& cpu)
+            : CPSR(cpu.CPSR),
+              mode(cpu.mode),
+              instruction_size(cpu.instruction_size),
+              executing(cpu.executing),
+              cycles(cpu.cycles),
+              halted(cpu.halted)
+        {
+            std::memcpy(R, cpu.R, sizeof(R));
+            std::memcpy(banked_R8_R12, cpu.banked_R8_R12, sizeof(banked_R8_R12));
+            std::memcpy(banked_R13_R14, cpu.banked_R13_R14, sizeof(banked_R13_R14));
+            std::memcpy(SPSR, cpu.SPSR, sizeof(SPSR));
+        }
+
+        void restore(GBA_Cpu& cpu) const
+        {
+            std::memcpy(cpu.R, R, sizeof(R));
+            std::memcpy(cpu.banked_R8_R12, banked_R8_R12, sizeof(banked_R8_R12));
+            std::memcpy(cpu.banked_R13_R14, banked_R13_R14, sizeof(banked_R13_R14));
+            std::memcpy(cpu.SPSR, SPSR, sizeof(SPSR));
+            cpu.CPSR = CPSR;
+            cpu.mode = mode;
+            cpu.instruction_size = instruction_size;
+            cpu.executing = executing;
+            cpu.cycles = cycles;
+            cpu.halted = halted;
+        }
+
+        uint32_t R[16];
+        uint32_t banked_R8_R12[2][5];
+        uint32_t banked_R13_R14[GBA_Cpu::BANK_COUNT][2];
+        uint32_t SPSR[GBA_Cpu::BANK_COUNT];
+        uint32_t CPSR;
+        GBA_Cpu::ExecutionMode mode;
+        int instruction_size;
+        uint32_t executing;
+        uint64_t cycles;
+        bool halted;
+    };
+
+    /** Variable of a $V(...) instruction and the register standing in for it. */
+    struct BoundVariable
+    {
+        std::string name;
+        uint32_t index;
+    };
+
+    bool is_name_character(char c)
     {
-        executing = memory.read_word(R[15]);
-        R[15] += instruction_size;
-        decoding = memory.read_word(R[15]);
-        R[15] += instruction_size;
-        fetching = memory.read_word(R[15]);
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
     }
-    else
+
+    bool equals_ignore_case(std::string_view a, std::string_view b)
     {
-        executing = memory.read_halfword(R[15]);
-        R[15] += instruction_size;
-        decoding = memory.read_halfword(R[15]);
-        R[15] += instruction_size;
-        fetching = memory.read_halfword(R[15]);
+        return a.size() == b.size()
+            && std::equal(a.begin(), a.end(), b.begin(),
+                          [](unsigned char x, unsigned char y) { return std::toupper(x) == std::toupper(y); });
     }
-}
 
-void GBA_Cpu::fetch_next()
-{
-    R[15] += instruction_size;
-    executing = decoding;
-    decoding = fetching;
-    if (mode == ExecutionMode::ARM)
+    /** Register named by R0-R15, SP, LR or PC in any case, -1 if name isn't one. */
+    int register_number(std::string_view name)
     {
-        fetching = memory.read_word(R[15]);
+        if (equals_ignore_case(name, "SP")) return 13;
+        if (equals_ignore_case(name, "LR")) return 14;
+        if (equals_ignore_case(name, "PC")) return 15;
+        if (name.size() < 2 || std::toupper(static_cast<unsigned char>(name[0])) != 'R')
+            return -1;
+
+        unsigned index;
+        auto end = name.data() + name.size();
+        auto result = std::from_chars(name.data() + 1, end, index);
+        return result.ptr == end && result.ec == std::errc{} && index < 16 ? static_cast<int>(index) : -1;
     }
-    else
+
+    /**
+     * Replaces the $variables of an instruction by the lowest of R0-R12 the instruction
+     * doesn't name itself, each variable keeping its register.
+     */
+    std::string bind_variables(std::string_view text, std::vector<BoundVariable>& bound)
+    {
+        std::bitset<13> used;
+        for (size_t i = 0; i < text.size();)
+        {
+            auto end = i;
+            while (end < text.size() && is_name_character(text[end]))
+                end++;
+            if (end == i)
+            {
+                i++;
+                continue;
+            }
+
+            auto index = register_number(text.substr(i, end - i));
+            if ((i == 0 || text[i - 1] != '$') && index >= 0 && index < 13)
+                used[index] = true;
+            i = end;
+        }
+
+        std::string bound_text;
+        for (size_t i = 0; i < text.size();)
+        {
+            if (text[i] != '$')
+            {
+                bound_text += text[i++];
+                continue;
+            }
+
+            auto end = i + 1;
+            while (end < text.size() && is_name_character(text[end]))
+                end++;
+            auto name = text.substr(i + 1, end - i - 1);
+            if (name.empty())
+                throw std::runtime_error{ "Expected a variable name after $" };
+
+            auto variable = std::find_if(bound.begin(), bound.end(), [&](const BoundVariable& candidate) { return candidate.name == name; });
+            if (variable == bound.end())
+            {
+                uint32_t index = 0;
+                while (index < used.size() && used[index])
+                    index++;
+                if (index == used.size())
+                    throw std::runtime_error{ "Not enough free registers for the variables" };
+
+                used[index] = true;
+                bound.push_back({ std::string{ name }, index });
+                variable = bound.end() - 1;
+            }
+
+            bound_text += fmt::format("R{}", variable->index);
+            i = end;
+        }
+        return bound_text;
+    }
+
+    /** Replaces the {variables} of an instruction by their values. Other braces, as register lists, are kept. */
+    std::string interpolate_variables(std::string_view text, const std::map<std::string, uint32_t, std::less<>>& variables)
     {
-        fetching = memory.read_halfword(R[15]);
+        std::string result;
+        for (size_t i = 0; i < text.size(); i++)
+        {
+            auto end = text[i] == '{' ? text.find('}', i) : std::string_view::npos;
+            auto variable = end != std::string_view::npos ? variables.find(text.substr(i + 1, end - i - 1)) : variables.end();
+            if (variable == variables.end())
+            {
+                result += text[i];
+                continue;
+            }
+
+            result += fmt::format("{:#x}", variable->second);
+            i = end;
+        }
+        return result;
     }
-}   
+}
+
+GBA_Cpu::GBA_Cpu(GBA_Memory& memory)
+    : memory(memory),
+      disassembly_index(memory),
+      control_flow(memory)
+ {
+    R[15] = 0x8000000; // ROM Start
+    // Stacks set up by the BIOS before jumping to the ROM
+    SP = 0x03007F00;
+    banked_R13_R14[BANK_IRQ][0] = 0x03007FA0;
+    banked_R13_R14[BANK_SVC][0] = 0x03007FE0;
+    write_CPSR(SYS);
+    flush_pipeline();
+}
 
 GBA_Cpu::CPSR_pack::CPSR_pack(uint32_t value)
 {
@@ -90,236 +236,295 @@ GBA_Cpu::CPSR_pack::operator uint32_t() const
 
 bool GBA_Cpu::cycle_arm()
 {
-    debug_save_registers();
-    uint8_t* executing_bytes = reinterpret_cast<uint8_t*>(&executing);
-    auto ins_add = PC - instruction_size * 2;
-    auto debug_info = fmt::format(" ; PC={:#x}, Ins.Addr={:#x}, Opcode={:#x}, Bytes={:0>2x} {:0>2x} {:0>2x} {:0>2x}", PC, ins_add, executing,
-                                  (int)executing_bytes[0],
-                                  (int)executing_bytes[1],
-                                  (int)executing_bytes[2],
-                                  (int)executing_bytes[3]);
-    cs_insn* insn;
-    auto count = cs_disasm(cs_arm, executing_bytes, 4, ins_add, 0, &insn);
-    if (count != 1)
+    std::string info;
+    if (trace)
     {
-        return false;
+        auto ins_add = PC - instruction_size * 2;
+        debug_save_registers();
+        info = debug_info();
+        char disassembly[disassembly_buffer_size];
+        disassemble_arm(executing, ins_add, disassembly, sizeof(disassembly));
+        std::cout << disassembly;
     }
 
-    fmt::print("{}\t{}", insn[0].mnemonic, insn[0].op_str);
-    cs_free(insn, count);
-    auto handled = false;
+    auto handled = execute_arm(executing);
 
-    
-    if (is_LDR_immediate(executing)) // bits[27-26]=01 | bits[20]=1
+    if (!handled)
+    {
+        if constexpr (PerformanceCounters::enabled)
+            counters.unhandled++;
+        // Unhandled opcodes leave the cpu untouched, so the info can still be taken now
+        std::cout << "Unhandled opcode: " << (trace ? info : debug_info()) << std::endl;
+    }
+    else if (trace)
     {
-        handled = execute_LDR_immediate(*this, executing);
+        std::cout << info << std::endl;
+        debug_print_register_changes();
     }
-    else if (is_STR_immediate(executing))
+
+    return handled;
+}
+
+bool GBA_Cpu::cycle_thumb()
+{
+    auto opcode = static_cast<uint16_t>(executing);
+    std::string info;
+    if (trace)
     {
-        handled = execute_STR_immediate(*this, executing);
+        auto ins_add = PC - instruction_size * 2;
+        debug_save_registers();
+        info = debug_info();
+        char disassembly[disassembly_buffer_size];
+        disassemble_thumb(opcode, static_cast<uint16_t>(fetch_opcode(ins_add + 2)), ins_add, disassembly, sizeof(disassembly));
+        std::cout << disassembly;
     }
-    else if (is_B(executing)) // bits[27-25]=101
+
+    auto handled = execute_thumb(opcode);
+
+    if (!handled)
     {
-        handled = execute_B(*this, executing);
+        if constexpr (PerformanceCounters::enabled)
+            counters.unhandled++;
+        // Unhandled opcodes leave the cpu untouched, so the info can still be taken now
+        std::cout << "Unhandled opcode: " << (trace ? info : debug_info()) << std::endl;
     }
-    else if (is_ADD(executing))
+    else if (trace)
     {
-        handled = execute_ADD(*this, executing);
+        std::cout << info << std::endl;
+        debug_print_register_changes();
     }
-    else if (is_BX(executing))
+
+    return handled;
+}
+
+bool GBA_Cpu::execute_arm(uint32_t opcode)
+{
+    auto& handler = arm_handler(opcode);
+    auto handled = handler.execute(*this, opcode);
+    if constexpr (PerformanceCounters::enabled)
+        counters.handlers[static_cast<size_t>(handler.kind)] += handled;
+    return handled;
+}
+
+bool GBA_Cpu::execute_thumb(uint16_t opcode)
+{
+    auto& handler = thumb_handler(opcode);
+    auto handled = handler.execute(*this, opcode);
+    if constexpr (PerformanceCounters::enabled)
+        counters.handlers[static_cast<size_t>(handler.kind)] += handled;
+    return handled;
+}
+
+bool GBA_Cpu::execute_in_place(uint32_t opcode, uint32_t size)
+{
+    auto pc = PC;
+    uint32_t registers[16];
+    std::copy_n(R, 16, registers);
+    auto cpsr = CPSR;
+    auto elapsed = cycles;
+
+    bool handled;
+    if (mode == ExecutionMode::ARM)
     {
-        handled = execute_BX(*this, executing);
+        handled = execute_arm(opcode);
     }
-    else if (is_MOV(executing))
+    else
     {
-        handled = execute_MOV(*this, executing);
+        // The second half of BL runs on the PC the first half left
+        handled = execute_thumb(static_cast<uint16_t>(opcode));
+        if (handled && size == 4)
+            handled = execute_thumb(static_cast<uint16_t>(opcode >> 16));
     }
-        
-    if (!handled) // Skip this switch if already handled
-        switch ((executing >> 24) & 0b00001110) // Opcode mask
-        {
-        case 0b00000010: // ALU_imm
-        {
-            uint8_t condition = (executing >> 28);
-            switch ((executing >> 21) & 0x0F)
-            {
-            case 0X05: // ADC
-            {
-                int destination_reg = (executing >> 12) & 0x0F;
-                int operand_reg = (executing >> 16) & 0x0F;
-                bool set_condition = (executing >> 20) & 1;
-                uint8_t position = (executing >> 8) & 0x0F;
-                int8_t _8bit_imm = executing & 0xFF;
-                uint32_t second_operand = rotr32_shiftsq(_8bit_imm, position);
-
-                fmt::print("ADC{}{} R{}, R{}, {}",
-                    disasemble_condition(condition),
-                    set_condition ? "S" : "",
-                    destination_reg,
-                    operand_reg,
-                    second_operand);
-                fetch_next();
-                handled = true;
-                break;
-            }
-            case 0x0D: // MOV
-            {
-                int destination_reg = (executing >> 12) & 0x0F;
-                int operand_reg = (executing >> 16) & 0x0F;
-                assert(operand_reg == 0b0000);
-                bool set_condition = (executing >> 20) & 1;
-                uint8_t position = (executing >> 8) & 0x0F;
-                int8_t _8bit_imm = executing & 0xFF;
-                uint32_t second_operand = rotr32_shiftsq(_8bit_imm, position);
-
-                fmt::print("MOV{}{} R{}, #{}",
-                    disasemble_condition(condition),
-                    set_condition ? "S" : "",
-                    destination_reg,
-                    second_operand);
-                fetch_next();
-                handled = true;
-                break;
-            }
-            }
-            break;
-        }
-        case 0b00000000: // MSR Transfers
-        /*
-         * MSR are instructions used for moving values (bit[25]=1) or register values (bit[25]=0)
-         * to the specified CPSR registers. Which flags will be written to is marked by bit[16..20], where:
-         *      bit[16]=Control
-         *      bit[17]=eXtension
-         *      bit[18]=Status
-         *      bit[19]=Flags
-         */
-        {
-            uint8_t condition = (executing >> 28);
-            if (((executing >> 23) & 0x03) == 0x02) // PSR Transfer
-            {
-                uint8_t psr = (executing >> 22) & 0x01;
-                assert(((executing >> 20) & 0x01) == 0); // Must be 0 for this. Otherwise TST, TEQ, CMP, CMN
-                if (((executing >> 21) & 0x01) == 0) // MRS
-                {
-                }
-                else // MSR
-                {
-                    //  msr cpsr_fc, r0
-                    bool write_to_flags = (executing >> 19) & 0x01;
-                    bool write_to_status = (executing >> 18) & 0x01;
-                    bool write_to_extension = (executing >> 17) & 0x01;
-                    bool write_to_control = (executing >> 16) & 0x01;
-                    assert(((executing >> 12) & 0x0F) == 0x0F);
-
-                    if (!(((executing >> 4) & 0xFF) == 0x0))
-                        break;
-
-                    assert(((executing >> 4) & 0xFF) == 0x0); // Must be 0 for this. Otherwise BX
-                    int src_register = executing & 0x0F;
-                    using namespace std::string_literals;
-                    std::string disassembled = "MSR"s + disasemble_condition(condition) + " ";
-                    if (psr == 0) // CPSR
-                    {
-                        disassembled += "CPSR_";
-                        if (write_to_flags) disassembled += 'F';
-                        if (write_to_status) disassembled += 'S';
-                        if (write_to_extension) disassembled += 'E';
-                        if (write_to_control) disassembled += 'C';
-
-                        disassembled += fmt::format(" R{}", src_register);
-                        std::cout << disassembled;
-                        fetch_next();
-                        handled = true;
-                        break;
-                    }
-                }
-            }
-            break;
-        }
-        }
 
-    if (!handled) 
-        std::cout << "Unhandled opcode: " << debug_info << std::endl;
-    else 
-        std::cout << debug_info << std::endl;
-    
-    debug_print_register_changes();
-    
+    if (!handled)
+    {
+        std::copy_n(registers, 16, R);
+        CPSR = cpsr;
+    }
+    cycles = elapsed;   // Instructions run from the REPL take no emulated time
+
+    // Handlers step PC past the opcode, or leave it when the condition failed. A branch moved
+    // it to its target, and execution goes on from there
+    if (!handled || PC == pc || PC == pc + size)
+    {
+        PC = pc;
+    }
     return handled;
 }
 
-bool GBA_Cpu::cycle_thumb()
+bool GBA_Cpu::cycle()
 {
-    debug_save_registers();
-    uint8_t* executing_bytes = reinterpret_cast<uint8_t*>(&executing);
-    auto ins_add = PC - instruction_size * 2;
-    auto debug_info = fmt::format(" ; PC={:#x}, Ins.Addr={:#x}, Opcode={:#x}, Bytes={:0>2x} {:0>2x}", PC, ins_add, static_cast<uint16_t>(executing),
-        (int)executing_bytes[0],
-        (int)executing_bytes[1]);
-    cs_insn* insn;
-    auto count = cs_disasm(cs_tmb, executing_bytes, 2, ins_add, 0, &insn);
-    if (count != 1)
+    if (memory.io_state.interrupts.pending)
     {
-        return false;
+        enter_IRQ();
     }
 
-    fmt::print("{}\t{}", insn[0].mnemonic, insn[0].op_str);
-    cs_free(insn, count);
-
-    auto handled = false;
+    if (halted)
+    {
+        auto idle_cycles = io::cycles_until_event(memory);
+        cycles += idle_cycles;
+        io::tick(memory, idle_cycles);
+        return true;
+    }
 
-    auto opcode = static_cast<uint16_t>(executing);
-    if (is_LDR_thumb_1(opcode))
+    auto start_cycles = cycles;
+    auto instr_addr = PC - instruction_size * 2;
+    if (instr_addr < bios_size && execute_bios_address(*this, instr_addr))
     {
-        handled = execute_LDR_thumb_1(*this, opcode);
+        if constexpr (PerformanceCounters::enabled)
+            counters.bios_calls++;
+        cycles++;
+        if (memory.watch_hit.triggered)
+        {
+            run_memory_triggers(instr_addr);
+        }
+        io::tick(memory, static_cast<uint32_t>(cycles - start_cycles));
+        return true;
     }
-    else if (is_LDR_thumb_3(opcode))
+
+    auto at_break_point = std::find(break_points.begin(), break_points.end(), instr_addr) != break_points.end();
+    if constexpr (PerformanceCounters::enabled)
     {
-        handled = execute_LDR_thumb_3(*this, opcode);
+        counters.break_point_checks += !break_points.empty();
+        counters.break_point_hits += at_break_point;
     }
-    else if (is_LSLS_thumb_1(opcode))
+    if (at_break_point)
     {
-        handled = execute_LSLS_thumb_1(*this, opcode);
+        enter_break(instr_addr);
     }
-    else if (is_B_thumb_1(opcode))
+
+    if (exec_trigger_pages[(instr_addr >> trigger_page_bits) % exec_trigger_pages.size()] && run_exec_triggers(instr_addr))
     {
-        handled = execute_B_thumb_1(*this, opcode);
+        io::tick(memory, static_cast<uint32_t>(cycles - start_cycles));
+        return true;
     }
-    else if (is_B_thumb_2(opcode))
+
+    // Fetched here, after the break point and the triggers, so that code they patch runs
+    auto pc = PC;
+    executing = fetch_opcode(pc - instruction_size * 2);
+    if (coverage_enabled)
     {
-        handled = execute_B_thumb_2(*this, opcode);
+        track_coverage(instr_addr);
     }
-    else if (is_MOVS_thumb_1(opcode))
+    // A break handler may stop() the run, which must end after this instruction
+    if (mode == ExecutionMode::THUMB && fuse_instructions && !at_break_point && !trace && memory.watchpoints.empty()
+        && cycle_fused(instr_addr))
     {
-        handled = execute_MOVS_thumb_1(*this, opcode);
+        if (coverage_enabled)
+        {
+            track_coverage(instr_addr + 2);
+        }
+        io::tick(memory, static_cast<uint32_t>(cycles - start_cycles));
+        return true;
     }
-    else if (is_MOVS_thumb_2(opcode))
+    auto handled = mode == ExecutionMode::ARM ? cycle_arm() : cycle_thumb();
+    if (handled)
     {
-        handled = execute_MOVS_thumb_2(*this, opcode);
+        cycles += fetch_cycles(pc);
     }
-    else if (is_MOVS_thumb_3(opcode))
+    if (memory.watch_hit.triggered)
     {
-        handled = execute_MOVS_thumb_3(*this, opcode);
+        run_memory_triggers(instr_addr);
     }
+    io::tick(memory, static_cast<uint32_t>(cycles - start_cycles));
+    return handled;
+}
 
-    
-
-    if (!handled)
-        std::cout << "Unhandled opcode: " << debug_info << std::endl;
+bool GBA_Cpu::run(uint64_t cycle_limit)
+{
+    auto handled = true;
+    if (backend == Backend::THREADED)
+    {
+        handled = run_threaded(cycle_limit);
+    }
     else
-        std::cout << debug_info << std::endl;
-    
-    debug_print_register_changes();
-    
+    {
+        while (!stop_requested && (cycle_limit == 0 || cycles < cycle_limit))
+        {
+            if (!cycle())
+            {
+                handled = false;
+                break;
+            }
+        }
+    }
+
+    stop_requested = false;
     return handled;
 }
 
-bool GBA_Cpu::cycle()
+bool GBA_Cpu::cycle_fused(uint32_t instruction_address)
 {
-    auto instr_addr = PC - instruction_size * 2;
-    if (std::find(break_points.begin(), break_points.end(), instr_addr) != break_points.end())
+    auto second_address = instruction_address + 2;
+    auto second = static_cast<uint16_t>(fetch_opcode(second_address));
+    auto fusion = fuse_thumb(static_cast<uint16_t>(executing), second);
+    if (fusion == ThumbFusion::NONE)
+    {
+        return false;
+    }
+
+    // Whatever stops at the second instruction sees it on its own
+    if (std::find(break_points.begin(), break_points.end(), second_address) != break_points.end()
+        || exec_trigger_pages[(second_address >> trigger_page_bits) % exec_trigger_pages.size()])
+    {
+        return false;
+    }
+
+    // The first instruction is a sequential step, plus the literal load of LDR
+    auto pc = PC;
+    auto& wait_states = memory.io_state.wait_states;
+    uint32_t first_fetch = wait_states.fetch[((pc + instruction_size) >> 24) & 0xF][io::width_index(instruction_size)];
+    uint32_t first_cycles = first_fetch;
+    if (fusion == ThumbFusion::LDR_BX)
     {
-        std::cout << "Breakpoint! @" << std::hex << instr_addr << std::endl;
+        auto literal = (pc & ~2u) + (executing & 0xFF) * 4;
+        first_cycles += wait_states.non_sequential[(literal >> 24) & 0xF][io::width_index(4)] + 1;
+    }
+
+    // An interrupt raised while the first instruction runs is taken before the second one
+    if (first_cycles >= io::cycles_until_event(memory))
+    {
+        return false;
+    }
+
+    execute_fused_thumb(*this, fusion, executing | (uint32_t{ second } << 16));
+    if constexpr (PerformanceCounters::enabled)
+    {
+        // The second instruction was looked up above, otherwise its own cycle() looks it up
+        counters.break_point_checks += !break_points.empty();
+        counters.fused_pairs++;
+        counters.handlers[static_cast<size_t>(thumb_handler(static_cast<uint16_t>(executing)).kind)]++;
+        counters.handlers[static_cast<size_t>(thumb_handler(second).kind)]++;
+    }
+    cycles += first_fetch + fetch_cycles(pc + instruction_size);
+    return true;
+}
+
+uint32_t GBA_Cpu::fetch_cycles(uint32_t previous_pc) const
+{
+    auto& wait_states = memory.io_state.wait_states;
+    auto region = (PC >> 24) & 0xF;
+    auto width = io::width_index(instruction_size);
+
+    if (PC == previous_pc + instruction_size)
+    {
+        return wait_states.fetch[region][width];
+    }
+    return wait_states.non_sequential[region][width] + 2 * wait_states.fetch[region][width];
+}
+
+void GBA_Cpu::enter_break(uint32_t instruction_address)
+{
+    // Memory accessed from the break isn't accessed by the program
+    auto watch_hit = memory.watch_hit;
+
+    if (break_handler)
+    {
+        break_handler(*this, instruction_address);
+    }
+    else
+    {
+        std::cout << "Breakpoint! @" << std::hex << instruction_address << std::endl;
 
         REPL repl;
 
@@ -333,35 +538,124 @@ bool GBA_Cpu::cycle()
         }
     }
 
-    if (mode == ExecutionMode::ARM)
-    {
-        return cycle_arm();
-    }
-    else
-    {
-        return cycle_thumb();
-    }
+    memory.watch_hit = watch_hit;
 }
 
 void GBA_Cpu::set_mode(ExecutionMode new_mode)
 {
     bool has_changed = mode != new_mode;
+    CPSR = (CPSR & ~0x20u) | (new_mode == ExecutionMode::THUMB ? 0x20u : 0u); // T bit
     if (new_mode == ExecutionMode::ARM)
     {
         mode = ExecutionMode::ARM;
         instruction_size = 4;
-        if (has_changed)
+        if (has_changed && trace)
             std::cout << ".ARM";
     }
     else
     {
         mode = ExecutionMode::THUMB;
         instruction_size = 2;
-        if (has_changed)
+        if (has_changed && trace)
             std::cout << ".THUMB";
     }
 }
 
+void GBA_Cpu::write_CPSR(uint32_t value)
+{
+    switch_register_bank(CPSR & 0x1F, value & 0x1F);
+    CPSR = value;
+
+    bool irq_disabled = (value >> 7) & 1;
+    auto& interrupts = memory.io_state.interrupts;
+    if (interrupts.cpu_irq_disabled != irq_disabled)
+    {
+        interrupts.cpu_irq_disabled = irq_disabled;
+        io::update_interrupts(memory);
+    }
+}
+
+void GBA_Cpu::switch_register_bank(uint8_t old_mode, uint8_t new_mode)
+{
+    auto old_bank = bank_index[old_mode];
+    auto new_bank = bank_index[new_mode];
+    if (old_bank == new_bank)
+    {
+        return;
+    }
+
+    banked_R13_R14[old_bank][0] = R[13];
+    banked_R13_R14[old_bank][1] = R[14];
+    R[13] = banked_R13_R14[new_bank][0];
+    R[14] = banked_R13_R14[new_bank][1];
+
+    if ((old_bank == BANK_FIQ) != (new_bank == BANK_FIQ))
+    {
+        std::copy_n(R + 8, 5, banked_R8_R12[old_bank == BANK_FIQ]);
+        std::copy_n(banked_R8_R12[new_bank == BANK_FIQ], 5, R + 8);
+    }
+}
+
+uint32_t& GBA_Cpu::current_SPSR()
+{
+    return SPSR[bank_index[CPSR & 0x1F]];
+}
+
+void GBA_Cpu::enter_exception(ProcessorMode exception_mode, uint32_t vector, uint32_t return_address)
+{
+    auto saved_CPSR = CPSR;
+
+    CPSR_pack cpsr{ CPSR };
+    cpsr.mode_bits = exception_mode;
+    cpsr.IRQ_disable = true;
+    cpsr.state_bit = false;
+    write_CPSR(static_cast<uint32_t>(cpsr));
+
+    current_SPSR() = saved_CPSR;
+    LR = return_address;
+
+    set_mode(ExecutionMode::ARM);
+    PC = vector;
+    flush_pipeline();
+}
+
+void GBA_Cpu::return_from_exception(uint32_t return_address)
+{
+    if (bank_index[CPSR & 0x1F] != BANK_USR)
+    {
+        write_CPSR(current_SPSR());
+    }
+
+    set_mode(CPSR_pack{ CPSR }.state_bit ? ExecutionMode::THUMB : ExecutionMode::ARM);
+    PC = return_address;
+    flush_pipeline();
+}
+
+void GBA_Cpu::enter_IRQ()
+{
+    enter_exception(IRQ, bios_irq_vector, PC - instruction_size * 2 + 4);
+    halted = false;
+}
+
+void GBA_Cpu::return_from_IRQ()
+{
+    return_from_exception(LR - 4);
+}
+
+std::string GBA_Cpu::debug_info() const
+{
+    auto ins_add = PC - instruction_size * 2;
+    auto bytes = reinterpret_cast<const uint8_t*>(&executing);
+
+    if (mode == ExecutionMode::ARM)
+    {
+        return fmt::format(" ; PC={:#x}, Ins.Addr={:#x}, Opcode={:#x}, Bytes={:0>2x} {:0>2x} {:0>2x} {:0>2x}", PC, ins_add, executing,
+                           (int)bytes[0], (int)bytes[1], (int)bytes[2], (int)bytes[3]);
+    }
+    return fmt::format(" ; PC={:#x}, Ins.Addr={:#x}, Opcode={:#x}, Bytes={:0>2x} {:0>2x}", PC, ins_add, static_cast<uint16_t>(executing),
+                       (int)bytes[0], (int)bytes[1]);
+}
+
 void GBA_Cpu::debug_save_registers()
 {
     std::copy_n(R, 15, R_bak);
@@ -424,7 +718,7 @@ bool GBA_Cpu::test_cond(uint8_t condition_bits) const
         case 0xA:   return cpsr.sign_flag == cpsr.overflow_flag; // GE
         case 0xB:   return cpsr.sign_flag != cpsr.overflow_flag; // LT
         case 0xC:   return !cpsr.zero_flag && cpsr.sign_flag == cpsr.overflow_flag; // GT
-        case 0xD:   return cpsr.zero_flag || cpsr.sign_flag == cpsr.overflow_flag; // LE
+        case 0xD:   return cpsr.zero_flag || cpsr.sign_flag != cpsr.overflow_flag; // LE
         case 0xE:   return true;
         case 0xF:   return false;
         default:    return true;
@@ -436,20 +730,799 @@ void GBA_Cpu::add_break_point(uint32_t instruction_address)
     break_points.push_back(instruction_address);
 }
 
-void GBA_Cpu::find_command(const std::vector<std::string>& tokens) const
+uint32_t GBA_Cpu::add_trigger(Trigger trigger)
 {
-    auto value = REPL_Argument::get_integer(tokens[1]);
-    auto range = REPL_Argument::get_range(tokens[2]);
-    
-    auto address = memory.find_word(value, range.first, range.second);
+    trigger.id = next_trigger_id++;
+    triggers.push_back(std::move(trigger));
+    update_triggers();
+    return triggers.back().id;
+}
 
-    std::cout << std::hex << address << std::endl;
-    
+bool GBA_Cpu::remove_trigger(uint32_t id)
+{
+    auto found = std::find_if(triggers.begin(), triggers.end(), [id](const Trigger& trigger) { return trigger.id == id; });
+    if (found == triggers.end())
+    {
+        return false;
+    }
+
+    triggers.erase(found);
+    update_triggers();
+    return true;
 }
 
-void GBA_Cpu::dump_command(const REPL_Signature& tokens) const
+void GBA_Cpu::update_triggers()
 {
-    auto range = REPL_Argument::get_range(tokens[1]);
+    exec_trigger_pages.reset();
+    auto& watchpoints = memory.watchpoints;
+    watchpoints.erase(std::remove_if(watchpoints.begin(), watchpoints.end(),
+                                     [](const GBA_Memory::Watchpoint& watchpoint) { return watchpoint.owner != 0; }),
+                      watchpoints.end());
+
+    for (auto& trigger : triggers)
+    {
+        if (trigger.begin >= trigger.end)
+            continue;
+
+        switch (trigger.kind)
+        {
+            case Trigger::Kind::EXEC:
+            {
+                auto last_page = std::min<size_t>((trigger.end - 1) >> trigger_page_bits, exec_trigger_pages.size() - 1);
+                for (size_t page = trigger.begin >> trigger_page_bits; page <= last_page; page++)
+                    exec_trigger_pages.set(page);
+                break;
+            }
+            case Trigger::Kind::READ:
+                watchpoints.push_back({ trigger.begin, trigger.end, GBA_Memory::WATCH_READ, trigger.id });
+                break;
+            case Trigger::Kind::WRITE:
+                watchpoints.push_back({ trigger.begin, trigger.end, GBA_Memory::WATCH_WRITE, trigger.id });
+                break;
+            case Trigger::Kind::ACCESS:
+                watchpoints.push_back({ trigger.begin, trigger.end, GBA_Memory::WATCH_ACCESS, trigger.id });
+                break;
+        }
+    }
+}
 
-    std::cout << memory.dump(4, range.first, range.second);
+bool GBA_Cpu::run_exec_triggers(uint32_t instruction_address)
+{
+    bool intercepted = false;
+
+    // Indexed, the REPL opened by a trigger may add or remove triggers
+    for (size_t i = 0; i < triggers.size(); i++)
+    {
+        auto& trigger = triggers[i];
+        if (trigger.kind != Trigger::Kind::EXEC || !trigger.contains(instruction_address))
+            continue;
+
+        trigger.hits++;
+        if (!trigger.condition.evaluate(*this, { trigger.hits, instruction_address }))
+            continue;
+
+        if (trigger.handler != Trigger::Handler::INTERCEPT)
+        {
+            fire_trigger(trigger, instruction_address, instruction_address);
+            continue;
+        }
+
+        // The REPL stands in for the instruction, unless it moved PC elsewhere
+        auto pc = PC;
+        fire_trigger(trigger, instruction_address, instruction_address);
+        if (PC == pc)
+            fetch_next();
+        intercepted = true;
+        break;
+    }
+
+    return intercepted;
+}
+
+void GBA_Cpu::run_memory_triggers(uint32_t instruction_address)
+{
+    auto hit = memory.watch_hit;
+    if (!hit.triggered || hit.owner == 0)
+    {
+        return;
+    }
+    memory.watch_hit.triggered = false;
+
+    // Every trigger on the address counts the hit, not only the one whose watchpoint recorded it
+    constexpr std::array<uint8_t, 4> kind_access = { 0, GBA_Memory::WATCH_READ, GBA_Memory::WATCH_WRITE, GBA_Memory::WATCH_ACCESS };
+    for (size_t i = 0; i < triggers.size(); i++)
+    {
+        auto& trigger = triggers[i];
+        if (!(kind_access[static_cast<size_t>(trigger.kind)] & hit.operation) || !trigger.contains(hit.address))
+            continue;
+
+        trigger.hits++;
+        if (trigger.condition.evaluate(*this, { trigger.hits, hit.address }))
+            fire_trigger(trigger, hit.address, instruction_address);
+    }
+}
+
+void GBA_Cpu::fire_trigger(const Trigger& trigger, uint32_t address, uint32_t instruction_address)
+{
+    if (trigger.handler == Trigger::Handler::WARN)
+    {
+        std::cout << YELLOW << fmt::format("Trigger {} hit by {:#010x} @{:#010x}", trigger.description(), address,
+                                           instruction_address) << RESET << std::endl;
+        return;
+    }
+
+    if (!break_handler)
+    {
+        std::cout << fmt::format("Trigger {} hit by {:#010x}", trigger.description(), address) << std::endl;
+    }
+    enter_break(instruction_address);
+}
+
+std::optional<uint32_t> GBA_Cpu::find_command(const REPL_Arguments& arguments)
+{
+    auto value = arguments[0].value;
+    auto& range = arguments[1];
+
+    return memory.find_word(value, range.value, range.end);
+}
+
+std::optional<uint32_t> GBA_Cpu::readb_command(const REPL_Arguments& arguments)
+{
+    return memory.read_byte(arguments[0].value);
+}
+
+std::optional<uint32_t> GBA_Cpu::readh_command(const REPL_Arguments& arguments)
+{
+    return memory.read_halfword(arguments[0].value);
+}
+
+std::optional<uint32_t> GBA_Cpu::readw_command(const REPL_Arguments& arguments)
+{
+    return memory.read_word(arguments[0].value);
+}
+
+std::optional<uint32_t> GBA_Cpu::fillb_command(const REPL_Arguments& arguments)
+{
+    fill(arguments, 1);
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::fillh_command(const REPL_Arguments& arguments)
+{
+    fill(arguments, 2);
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::fillw_command(const REPL_Arguments& arguments)
+{
+    fill(arguments, 4);
+    return std::nullopt;
+}
+
+void GBA_Cpu::fill(const REPL_Arguments& arguments, uint32_t element_size) const
+{
+    auto value = arguments[0].value;
+    auto& range = arguments[1];
+
+    for (uint32_t address = range.value & ~(element_size - 1); address + element_size <= range.end; address += element_size)
+    {
+        switch (element_size)
+        {
+            case 1: memory.write_byte(address, static_cast<uint8_t>(value)); break;
+            case 2: memory.write_halfword(address, static_cast<uint16_t>(value)); break;
+            default: memory.write_word(address, value); break;
+        }
+    }
+}
+
+std::optional<uint32_t> GBA_Cpu::dump_command(const REPL_Arguments& arguments)
+{
+    auto& range = arguments[0];
+
+    std::cout << memory.dump(4, range.value, range.end);
+
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::dissa_command(const REPL_Arguments& arguments)
+{
+    auto& range = arguments[0];
+    char disassembly[disassembly_buffer_size];
+
+    for (uint32_t address = range.value & ~3u; address < range.end; address += 4)
+    {
+        auto text = disassembly_index.disassemble(address, InstructionSet::ARM, disassembly, sizeof(disassembly));
+        std::cout << fmt::format("[0x{:0>8x}] {:0>8x}  {}", address, memory.read_word(address), text) << '\n';
+    }
+    std::cout << std::flush;
+
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::disst_command(const REPL_Arguments& arguments)
+{
+    auto& range = arguments[0];
+    char disassembly[disassembly_buffer_size];
+
+    for (uint32_t address = range.value & ~1u; address < range.end; address += 2)
+    {
+        auto text = disassembly_index.disassemble(address, InstructionSet::THUMB, disassembly, sizeof(disassembly));
+        std::cout << fmt::format("[0x{:0>8x}] {:0>4x}  {}", address, memory.read_halfword(address), text) << '\n';
+    }
+    std::cout << std::flush;
+
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::uncomp_command(const REPL_Arguments& arguments)
+{
+    auto source = arguments[0].value;
+    auto destination = arguments[1].value;
+    CompressionHeader header{ memory.read_word(source) };
+
+    auto consumed = decompress(memory.pointer(source), memory.contiguous_size(source),
+                               memory.pointer(destination), memory.contiguous_size(destination));
+
+    std::cout << fmt::format("Decompressed {:#x} bytes ({:#x} compressed) to [{:#x}:{:#x}]",
+                             header.decompressed_size, consumed, destination, destination + header.decompressed_size) << std::endl;
+
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::uncompf_command(const REPL_Arguments& arguments)
+{
+    auto source = arguments[0].value;
+    CompressionHeader header{ memory.read_word(source) };
+    std::vector<uint8_t> output(header.decompressed_size);
+
+    auto consumed = decompress(memory.pointer(source), memory.contiguous_size(source), output.data(), output.size());
+
+    std::ofstream file{ std::string{ arguments[1].text }, std::ios::binary };
+    if (!file.is_open())
+    {
+        throw std::runtime_error{ fmt::format("Could not open {}", arguments[1].text) };
+    }
+    file.write(reinterpret_cast<const char*>(output.data()), output.size());
+
+    std::cout << fmt::format("Decompressed {:#x} bytes ({:#x} compressed) to {}",
+                             header.decompressed_size, consumed, arguments[1].text) << std::endl;
+
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::scanlz_command(const REPL_Arguments& arguments)
+{
+    constexpr uint32_t max_decompressed_size = 0x40000; // EWRAM, the largest destination available
+    auto& range = arguments[0];
+    auto begin = range.value & ~3u;
+
+    if (begin >= range.end)
+    {
+        return std::nullopt;
+    }
+
+    auto streams = lz77_scan(memory.pointer(begin), memory.contiguous_size(begin), begin,
+                             range.end - begin, max_decompressed_size);
+
+    for (auto& stream : streams)
+    {
+        std::cout << fmt::format("[0x{:0>8x}] LZ77 {:#x} -> {:#x} bytes", stream.address,
+                                 stream.compressed_size, stream.decompressed_size) << std::endl;
+    }
+    std::cout << fmt::format("{} streams found", streams.size()) << std::endl;
+
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::finda_command(const REPL_Arguments& arguments)
+{
+    find_instruction(arguments, InstructionSet::ARM);
+
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::findt_command(const REPL_Arguments& arguments)
+{
+    find_instruction(arguments, InstructionSet::THUMB);
+
+    return std::nullopt;
+}
+
+void GBA_Cpu::find_instruction(const REPL_Arguments& arguments, InstructionSet set) const
+{
+    InstructionMatcher matcher{ arguments[0].text, set };
+    auto& range = arguments[1];
+    auto hits = search_disassembly(disassembly_index, memory, range.value, range.end, set, matcher);
+    char disassembly[disassembly_buffer_size];
+
+    for (auto& hit : hits)
+    {
+        auto text = disassembly_index.disassemble(hit.address, set, disassembly, sizeof(disassembly));
+        std::cout << fmt::format("[0x{:0>8x}] {:>8}  {}", hit.address, hit.index, text) << '\n';
+    }
+    std::cout << fmt::format("{} matches", hits.size()) << std::endl;
+}
+
+std::optional<uint32_t> GBA_Cpu::entry_command(const REPL_Arguments& arguments)
+{
+    auto code_address = arguments[0].value;
+    control_flow.add_entry_point(code_address);
+    std::cout << fmt::format("Added {} entry point {:#010x}", code_address & 1 ? "THUMB" : "ARM", code_address & ~1u) << std::endl;
+
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::funcs_command(const REPL_Arguments& arguments)
+{
+    auto& range = arguments[0];
+    auto& graph = analysed_control_flow();
+    size_t count = 0;
+
+    for (auto& function : graph.functions())
+    {
+        if (function.entry < range.value || function.entry >= range.end)
+            continue;
+
+        std::cout << fmt::format("[0x{:0>8x}] {:<5} {}  {} blocks, {} calls, {} callers",
+                                 function.entry, function.set == InstructionSet::ARM ? "ARM" : "THUMB",
+                                 ControlFlowGraph::function_name(function), function.blocks.size(),
+                                 function.calls.size(), function.callers.size()) << '\n';
+        count++;
+    }
+    std::cout << fmt::format("{} functions", count) << std::endl;
+
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::func_command(const REPL_Arguments& arguments)
+{
+    auto functions = functions_at(arguments[0].value);
+
+    for (auto function : functions)
+    {
+        std::cout << fmt::format("{} ({}, entry 0x{:0>8x})", ControlFlowGraph::function_name(*function),
+                                 function->set == InstructionSet::ARM ? "ARM" : "THUMB", function->entry) << '\n';
+        for (auto& block : function->blocks)
+        {
+            std::cout << fmt::format("  [0x{:0>8x}:0x{:0>8x}]", block.begin, block.end);
+            for (auto successor : block.successors)
+                std::cout << fmt::format(" -> 0x{:0>8x}", successor);
+            std::cout << '\n';
+        }
+    }
+    std::cout << fmt::format("{} functions", functions.size()) << std::endl;
+
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::callers_command(const REPL_Arguments& arguments)
+{
+    auto& graph = analysed_control_flow();
+    size_t count = 0;
+
+    for (auto function : functions_at(arguments[0].value))
+    {
+        for (auto& call : function->callers)
+        {
+            std::cout << fmt::format("[0x{:0>8x}] {} -> {}", call.address, graph.symbolize(call.address),
+                                     ControlFlowGraph::function_name(*function)) << '\n';
+            count++;
+        }
+    }
+    std::cout << fmt::format("{} callers", count) << std::endl;
+
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::callees_command(const REPL_Arguments& arguments)
+{
+    auto& graph = analysed_control_flow();
+    size_t count = 0;
+
+    for (auto function : functions_at(arguments[0].value))
+    {
+        for (auto& call : function->calls)
+        {
+            auto callee = graph.function(call.target);
+            std::cout << fmt::format("[0x{:0>8x}] {} -> {}", call.address, ControlFlowGraph::function_name(*function),
+                                     callee != nullptr ? ControlFlowGraph::function_name(*callee)
+                                                       : fmt::format("{:#010x}", call.target)) << '\n';
+            count++;
+        }
+    }
+    std::cout << fmt::format("{} callees", count) << std::endl;
+
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::trigger_command(const REPL_Arguments& arguments)
+{
+    constexpr std::array<std::string_view, 3> handler_names = { "break", "intercept", "warn" };
+    constexpr std::array<std::string_view, 4> kind_names = { "exec", "read", "write", "access" };
+
+    auto handler = std::find(handler_names.begin(), handler_names.end(), arguments[0].text);
+    if (handler == handler_names.end())
+    {
+        throw std::runtime_error{ fmt::format("Unknown trigger handler {}, expected break, intercept or warn", arguments[0].text) };
+    }
+    auto kind = std::find(kind_names.begin(), kind_names.end(), arguments[1].text);
+    if (kind == kind_names.end())
+    {
+        throw std::runtime_error{ fmt::format("Unknown trigger kind {}, expected exec, read, write or access", arguments[1].text) };
+    }
+
+    Trigger trigger;
+    trigger.handler = static_cast<Trigger::Handler>(handler - handler_names.begin());
+    trigger.kind = static_cast<Trigger::Kind>(kind - kind_names.begin());
+    trigger.begin = arguments[2].value;
+    trigger.end = arguments[2].end;
+    if (trigger.handler == Trigger::Handler::INTERCEPT && trigger.kind != Trigger::Kind::EXEC)
+    {
+        throw std::runtime_error{"Only exec triggers can intercept, memory triggers run after the access"};
+    }
+    if (arguments.count > 3)
+    {
+        trigger.condition = Condition{ arguments[3].text, *arguments.variables };
+    }
+
+    add_trigger(std::move(trigger));
+    std::cout << fmt::format("Added trigger {}", triggers.back().description()) << std::endl;
+
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::triggers_command(const REPL_Arguments&)
+{
+    for (auto& trigger : triggers)
+        std::cout << trigger.description() << '\n';
+    std::cout << fmt::format("{} triggers", triggers.size()) << std::endl;
+
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::untrigger_command(const REPL_Arguments& arguments)
+{
+    if (!remove_trigger(arguments[0].value))
+    {
+        throw std::runtime_error{ fmt::format("There is no trigger #{}", arguments[0].value) };
+    }
+    std::cout << fmt::format("Removed trigger #{}", arguments[0].value) << std::endl;
+
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::execute_command(const REPL_Arguments& arguments)
+{
+    auto instruction = *REPL_Instruction::parse(arguments[0].text);
+    auto set = mode == ExecutionMode::ARM ? InstructionSet::ARM : InstructionSet::THUMB;
+    if (instruction.set != set)
+    {
+        throw std::runtime_error{ set == InstructionSet::ARM ? "The cpu is in ARM mode, use $(...)" : "The cpu is in THUMB mode, use T(...)" };
+    }
+
+    std::vector<BoundVariable> bound;
+    std::string text{ instruction.text };
+    if (instruction.binding == REPL_Instruction::Binding::VARIABLES)
+        text = bind_variables(instruction.text, bound);
+    else if (instruction.binding == REPL_Instruction::Binding::INTERPOLATION)
+        text = interpolate_variables(instruction.text, *arguments.variables);
+
+    auto assembled = assemble(text, PC - instruction_size * 2, set);
+
+    if (instruction.binding != REPL_Instruction::Binding::VARIABLES)
+    {
+        debug_save_registers();
+        if (!execute_in_place(assembled.opcode, assembled.size))
+        {
+            throw std::runtime_error{ fmt::format("{} isn't handled by the interpreter", text) };
+        }
+        debug_print_register_changes();
+        return std::nullopt;
+    }
+
+    // Scratch register file: the variables are loaded in their registers and read back, the
+    // cpu is left as it was. Only memory writes stay
+    auto& variables = *arguments.variables;
+    CpuState state{ *this };
+    for (auto& variable : bound)
+    {
+        auto value = variables.find(variable.name);
+        R[variable.index] = value != variables.end() ? value->second : 0;
+    }
+
+    auto handled = execute_in_place(assembled.opcode, assembled.size);
+    uint32_t results[16];
+    std::copy_n(R, 16, results);
+    state.restore(*this);
+    if (!handled)
+    {
+        throw std::runtime_error{ fmt::format("{} isn't handled by the interpreter", text) };
+    }
+
+    for (auto& variable : bound)
+    {
+        auto [value, created] = variables.try_emplace(variable.name, 0);
+        if (created || value->second != results[variable.index])
+        {
+            value->second = results[variable.index];
+            std::cout << RED << fmt::format("${} -> {:#x}", variable.name, value->second) << RESET << std::endl;
+        }
+    }
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::ass_command(const REPL_Arguments& arguments)
+{
+    auto instruction = *REPL_Instruction::parse(arguments[0].text);
+    if (instruction.binding == REPL_Instruction::Binding::VARIABLES)
+    {
+        throw std::runtime_error{ "Variables can't be bound to written code, use {variable}" };
+    }
+
+    // $(MOV r0, #0)(loop: SUBS r0, #1)(BNE loop) is a program of three lines
+    std::string source{ instruction.text };
+    if (instruction.binding == REPL_Instruction::Binding::INTERPOLATION)
+        source = interpolate_variables(instruction.text, *arguments.variables);
+    for (auto separator = source.find(")("); separator != std::string::npos; separator = source.find(")(", separator))
+        source.replace(separator, 2, "\n");
+
+    auto program = assemble_program(source, arguments[1].value, instruction.set);
+    load_program(program, arguments);
+
+    char disassembly[disassembly_buffer_size];
+    for (auto& assembled : program.instructions)
+    {
+        auto opcode = assembled.instruction.opcode;
+        if (assembled.set == InstructionSet::ARM)
+            disassemble_arm(opcode, assembled.address, disassembly, sizeof(disassembly));
+        else
+            disassemble_thumb(static_cast<uint16_t>(opcode), static_cast<uint16_t>(opcode >> 16), assembled.address, disassembly, sizeof(disassembly));
+        std::cout << fmt::format("[0x{:0>8x}] {:0>{}x}  {}", assembled.address, opcode, assembled.instruction.size * 2, disassembly) << '\n';
+    }
+    std::cout << std::flush;
+
+    if (program.instructions.empty())
+    {
+        return std::nullopt;
+    }
+    return program.instructions.front().instruction.opcode;
+}
+
+std::optional<uint32_t> GBA_Cpu::assf_command(const REPL_Arguments& arguments)
+{
+    std::ifstream file{ std::string{ arguments[0].text } };
+    if (!file.is_open())
+    {
+        throw std::runtime_error{ fmt::format("Could not open {}", arguments[0].text) };
+    }
+    std::string source{ std::istreambuf_iterator<char>{ file }, std::istreambuf_iterator<char>{} };
+
+    auto program = assemble_program(source, arguments[1].value, InstructionSet::ARM);
+    load_program(program, arguments);
+
+    for (auto& [name, value] : program.symbols)
+        std::cout << fmt::format("${} = {:#x}", name, value) << '\n';
+    std::cout << fmt::format("Assembled {} instructions, {:#x} bytes to [{:#x}:{:#x}]", program.instructions.size(),
+                             program.bytes.size(), program.origin, program.origin + program.bytes.size()) << std::endl;
+
+    return std::nullopt;
+}
+
+void GBA_Cpu::enable_coverage(bool enable)
+{
+    if (enable)
+    {
+        coverage.allocate();
+        coverage_run = {};
+    }
+    else if (coverage_enabled)
+    {
+        flush_coverage();
+    }
+    coverage_enabled = enable;
+}
+
+CoverageMap& GBA_Cpu::flush_coverage()
+{
+    coverage.mark(coverage_run.begin, coverage_run.end, coverage_run.thumb);
+    coverage_run.begin = coverage_run.end;
+    return coverage;
+}
+
+std::optional<uint32_t> GBA_Cpu::coverage_command(const REPL_Arguments& arguments)
+{
+    auto action = arguments[0].text;
+    if (action == "on" || action == "off")
+    {
+        enable_coverage(action == "on");
+    }
+    else if (action == "clear")
+    {
+        flush_coverage().clear();
+    }
+    else
+    {
+        throw std::runtime_error{ fmt::format("Unknown coverage action {}, expected on, off or clear", action) };
+    }
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::covranges_command(const REPL_Arguments& arguments)
+{
+    auto& range = arguments[0];
+    auto ranges = flush_coverage().ranges(range.value, range.end);
+
+    size_t covered = 0;
+    for (auto& [begin, end] : ranges)
+    {
+        std::cout << fmt::format("[0x{:0>8x}:0x{:0>8x}] {:#x} bytes", begin, end, end - begin) << '\n';
+        covered += (end - begin) / 2;
+    }
+    std::cout << fmt::format("{} ranges, {} halfwords executed", ranges.size(), covered) << std::endl;
+
+    return static_cast<uint32_t>(covered);
+}
+
+std::optional<uint32_t> GBA_Cpu::covsave_command(const REPL_Arguments& arguments)
+{
+    flush_coverage().save(std::string{ arguments[0].text });
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::covmerge_command(const REPL_Arguments& arguments)
+{
+    flush_coverage().merge_file(std::string{ arguments[0].text });
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::covlist_command(const REPL_Arguments& arguments)
+{
+    auto& range = arguments[0];
+    std::string path{ arguments[1].text };
+    auto& executed = flush_coverage();
+
+    std::ofstream listing{ path };
+    std::ofstream tracefile{ path + ".info" };
+    if (!listing.is_open() || !tracefile.is_open())
+    {
+        throw std::runtime_error{ fmt::format("Could not open {} or {}.info", path, path) };
+    }
+
+    // Executed instructions are disassembled in the set they ran in, the others in the set of
+    // the last executed one before them
+    char disassembly[disassembly_buffer_size];
+    auto set = InstructionSet::ARM;
+    uint32_t line = 1;
+    uint32_t lines_hit = 0;
+    listing << fmt::format("; Coverage of [0x{:0>8x}:0x{:0>8x}], * marks the executed instructions", range.value, range.end) << '\n';
+    tracefile << "TN:\nSF:" << path << '\n';
+
+    for (uint32_t address = range.value & ~1u; address < range.end; )
+    {
+        auto hit = executed.covered(address);
+        if (hit)
+            set = executed.thumb(address) ? InstructionSet::THUMB : InstructionSet::ARM;
+        auto line_set = set == InstructionSet::ARM && (address & 2) == 0 ? InstructionSet::ARM : InstructionSet::THUMB;
+
+        auto text = disassembly_index.disassemble(address, line_set, disassembly, sizeof(disassembly));
+        auto opcode = line_set == InstructionSet::ARM ? fmt::format("{:0>8x}", memory.read_word(address))
+                                                      : fmt::format("{:0>4x}    ", memory.read_halfword(address));
+        listing << fmt::format("{} [0x{:0>8x}] {}  {}", hit ? '*' : ' ', address, opcode, text) << '\n';
+
+        line++;
+        lines_hit += hit;
+        tracefile << fmt::format("DA:{},{}", line, hit ? 1 : 0) << '\n';
+        address += line_set == InstructionSet::ARM ? 4 : 2;
+    }
+    tracefile << fmt::format("LH:{}\nLF:{}\nend_of_record", lines_hit, line - 1) << '\n';
+
+    std::cout << fmt::format("{} of {} instructions executed, listed to {} and {}.info", lines_hit, line - 1, path, path) << std::endl;
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::stats_command(const REPL_Arguments& arguments)
+{
+    if (arguments.count > 0)
+    {
+        if (arguments[0].text != "reset")
+        {
+            throw std::runtime_error{ fmt::format("Unknown stats action {}, expected reset", arguments[0].text) };
+        }
+        counters.reset();
+        return std::nullopt;
+    }
+
+    std::cout << counters.report() << std::flush;
+    return std::nullopt;
+}
+
+std::optional<uint32_t> GBA_Cpu::keys_command(const REPL_Arguments& arguments)
+{
+    // In KEYINPUT bit order
+    constexpr std::array<std::string_view, 10> key_names = { "A", "B", "SELECT", "START", "RIGHT", "LEFT", "UP", "DOWN", "R", "L" };
+
+    uint16_t keypad = io::keys_none;
+    std::string_view names = arguments[0].text;
+    while (!names.empty() && names != "none")
+    {
+        auto name = names.substr(0, names.find('+'));
+        names.remove_prefix(std::min(names.size(), name.size() + 1));
+
+        auto key = std::find_if(key_names.begin(), key_names.end(), [&](std::string_view key_name)
+        {
+            return std::equal(key_name.begin(), key_name.end(), name.begin(), name.end(),
+                              [](char a, char b) { return a == std::toupper(static_cast<unsigned char>(b)); });
+        });
+        if (key == key_names.end())
+        {
+            throw std::runtime_error{ fmt::format("Unknown key {}, expected A, B, SELECT, START, RIGHT, LEFT, UP, DOWN, R, L or none", name) };
+        }
+        keypad &= ~(1u << (key - key_names.begin()));
+    }
+
+    memory.io_state.keypad = keypad;
+    return keypad;
+}
+
+std::optional<uint32_t> GBA_Cpu::frame_command(const REPL_Arguments&)
+{
+    std::cout << fmt::format("Frame {}, line {}", memory.io_state.frame, memory.read_halfword(io::base + io::VCOUNT)) << std::endl;
+    return memory.io_state.frame;
+}
+
+void GBA_Cpu::load_program(const AssembledProgram& program, const REPL_Arguments& arguments)
+{
+    write_code(program.origin, program.bytes);
+    for (auto& [name, value] : program.symbols)
+        (*arguments.variables)[name] = value;
+}
+
+void GBA_Cpu::write_code(uint32_t address, const std::vector<uint8_t>& bytes)
+{
+    // Only where code can be fetched from, IO registers excluded, and without crossing into the next mirror
+    auto window = memory.code_window(address);
+    if (window.begin == window.end || window.end - address < bytes.size())
+    {
+        throw std::runtime_error{ fmt::format("[{:#x}:{:#x}] doesn't fit in a memory region", address, address + bytes.size()) };
+    }
+    if (bytes.empty())
+    {
+        return;
+    }
+    std::memcpy(memory.pointer(address), bytes.data(), bytes.size());
+
+    // The code may run from any mirror of the bytes written
+    auto size = static_cast<uint32_t>(bytes.size());
+    auto backing = GBA_Memory::mirror(address);
+    control_flow.invalidate(address, address + size);
+    if (backing != address)
+    {
+        control_flow.invalidate(backing, backing + size);
+    }
+    code_window = {};
+    for (auto& decoded : decoded_instructions)
+    {
+        auto instruction = GBA_Memory::mirror(decoded.key & ~1u);
+        if (instruction < backing + size && instruction + 4 > backing)
+            decoded = {};
+    }
+}
+
+const ControlFlowGraph& GBA_Cpu::analysed_control_flow() const
+{
+    if (!control_flow.analysed())
+    {
+        control_flow.analyse();
+        std::cout << fmt::format("Control flow analysed, {} functions found", control_flow.functions().size()) << std::endl;
+    }
+    return control_flow;
+}
+
+std::vector<const Function*> GBA_Cpu::functions_at(uint32_t code_address) const
+{
+    auto& graph = analysed_control_flow();
+    auto function = graph.function(code_address);
+    if (function != nullptr)
+        return { function };
+    return graph.enclosing_functions(code_address & ~1u);
 }
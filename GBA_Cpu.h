@@ -3,9 +3,19 @@
 #include "GBA_Memory.h"
 #include "opcodes.h"
 #include <fmt/core.h>
+#include <functional>
 #include <iostream>
+#include <optional>
 #include "bit_utils.h"
-#include <capstone/capstone.h>
+#include "disassembly_index.h"
+#include "control_flow.h"
+#include "trigger.h"
+#include "coverage.h"
+#include "performance_counters.h"
+#include <bitset>
+
+struct REPL_Arguments;
+struct AssembledProgram;
 
 //the following are UBUNTU/LINUX, and MacOS ONLY terminal color codes.
 #define RESET   "\033[0m"
@@ -32,31 +42,98 @@ class GBA_Cpu
 public:
     enum class ExecutionMode { ARM, THUMB };
 
+    /** Interpreters run() can execute with. */
+    enum class Backend
+    {
+        SWITCH,     // cycle() for every instruction
+        THREADED    // Pre-decoded instructions, each handler dispatching the next one
+    };
+
+    /** Register banks. User and System modes share the same bank. */
+    enum RegisterBank : uint8_t
+    {
+        BANK_USR,
+        BANK_FIQ,
+        BANK_IRQ,
+        BANK_SVC,
+        BANK_ABT,
+        BANK_UND,
+        BANK_COUNT
+    };
+
+    /** Values of the CPSR mode bits. */
+    enum ProcessorMode : uint8_t
+    {
+        USR = 0x10,
+        FIQ = 0x11,
+        IRQ = 0x12,
+        SVC = 0x13,
+        ABT = 0x17,
+        UND = 0x1B,
+        SYS = 0x1F
+    };
+
     GBA_Cpu(GBA_Memory& memory);
-    ~GBA_Cpu();
     GBA_Cpu(const GBA_Cpu&) = delete;
     GBA_Cpu& operator=(const GBA_Cpu&) = delete;
     GBA_Cpu(GBA_Cpu&&) = delete;
     GBA_Cpu& operator=(GBA_Cpu&&) = delete;
 
     /**
-     * @brief Flushes the execution pipeline.
-     * 
-     * Whenever a branch instruction occurs, the pipeline must be flushed.
-     * Flushing the pipeline basically means skipping 2 instructions.
-     * This will make PC point to 2 words after the executing instruction.
+     * @brief Refills the execution pipeline, after PC was written.
      * 
+     * Makes PC point 2 instructions after the one it was set to, PC+8 in ARM and PC+4 in THUMB,
+     * as the real pipeline would. Nothing is read: cycle() fetches the opcode it executes.
      */
-    void flush_pipeline();
+    void flush_pipeline()
+    {
+        if constexpr (PerformanceCounters::enabled)
+            counters.pipeline_flushes++;
+        R[15] += 2 * instruction_size;
+    }
     
     /**
-     * @brief Step the execution pipeline.
+     * @brief Steps the execution pipeline, making PC point to the next instruction.
+     */
+    void fetch_next()
+    {
+        R[15] += instruction_size;
+    }
+
+    /**
+     * @brief Opcode of the current instruction set at an address.
      * 
-     * This will make PC point to the next instruction. And the already fetched opcodes
-     * follow the following pipeline: word@PC -> fetching -> decoding -> executing.
+     * Reads through code_window, only resolved again when address leaves it. While there are
+     * watchpoints, or in the IO region, opcodes are read through the regular accessors.
      */
-    void fetch_next();
-    
+    uint32_t fetch_opcode(uint32_t address)
+    {
+        address &= ~uint32_t(instruction_size - 1);
+        if (memory.watchpoints.empty())
+        {
+            if (address - code_window.begin >= code_window.end - code_window.begin)
+            {
+                if constexpr (PerformanceCounters::enabled)
+                    counters.code_window_refills++;
+                code_window = memory.code_window(address);
+            }
+
+            if (code_window.begin != code_window.end)
+            {
+                auto bytes = code_window.bytes + (address - code_window.begin);
+                if (mode == ExecutionMode::ARM)
+                {
+                    uint32_t opcode;
+                    std::memcpy(&opcode, bytes, sizeof(opcode));
+                    return opcode;
+                }
+                uint16_t opcode;
+                std::memcpy(&opcode, bytes, sizeof(opcode));
+                return opcode;
+            }
+        }
+        return mode == ExecutionMode::ARM ? memory.read<uint32_t>(address) : memory.read<uint16_t>(address);
+    }
     
     /**
      * @brief Cycles one instruction.
@@ -64,15 +141,56 @@ public:
      * Execute the current instruction. This can potentially move the PC more than 1 word,
      * depending on the instruction type.
      * 
+     * While halted by the BIOS no instruction is executed, the cpu only idles until the
+     * awaited interrupt flags are set.
+     * 
      * @return bool Returns false is the opcode wasn't processed.
      */
     bool cycle();
+
+    /**
+     * @brief Executes instructions with the selected backend until an unhandled opcode, stop()
+     * or the cycle limit.
+     * 
+     * Both backends run the same handlers and give the same results. The threaded one hands
+     * instructions with a break point, a trigger, a pending interrupt or in the BIOS to cycle(),
+     * and runs all of them through cycle() while tracing or with watchpoints set.
+     * 
+     * @param cycle_limit Stops before the first instruction once cycles reaches it, 0 for no limit.
+     * @return bool False if it stopped on an unhandled opcode.
+     */
+    bool run(uint64_t cycle_limit = 0);
+
+    /**
+     * @brief Makes run() return before the next instruction. Meant for break handlers.
+     */
+    void stop()
+    {
+        stop_requested = true;
+    }
+
+    /**
+     * @brief Starts or stops recording the executed instructions in coverage.
+     * 
+     * The bitmaps are allocated the first time, and kept when stopping so they can be exported.
+     */
+    void enable_coverage(bool enable);
+
+    /**
+     * @brief Coverage, with the run of instructions still being executed marked in it.
+     */
+    CoverageMap& flush_coverage();
     
 
     
     void debug_save_registers();
     
     void debug_print_register_changes() const;
+
+    /**
+     * @brief Describes the executing instruction: PC, address, opcode and its bytes.
+     */
+    std::string debug_info() const;
     
     struct CPSR_pack
     {
@@ -93,34 +211,310 @@ public:
     bool test_cond(uint8_t condition_bits) const;
 
     void add_break_point(uint32_t instruction_address);
-    void find_command(const std::vector<std::string>& tokens) const;
-    void dump_command(const std::vector<std::string>& tokens) const;
-    void dissa_command(const std::vector<std::string>& tokens) const;
-    void disst_command(const std::vector<std::string>& tokens) const;
+
+    /**
+     * @brief Adds a trigger, giving it the next id.
+     * 
+     * @return uint32_t Id of the trigger.
+     */
+    uint32_t add_trigger(Trigger trigger);
+
+    /**
+     * @return bool False if there is no trigger with that id.
+     */
+    bool remove_trigger(uint32_t id);
+
+    /** REPL commands. Commands that yield a value return it, the others return std::nullopt. */
+    std::optional<uint32_t> find_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> readb_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> readh_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> readw_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> fillb_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> fillh_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> fillw_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> dump_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> dissa_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> disst_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> uncomp_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> uncompf_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> scanlz_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> finda_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> findt_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> entry_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> funcs_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> func_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> callers_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> callees_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> trigger_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> triggers_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> untrigger_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> execute_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> ass_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> assf_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> coverage_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> covranges_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> covsave_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> covmerge_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> covlist_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> stats_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> keys_command(const REPL_Arguments& arguments);
+    std::optional<uint32_t> frame_command(const REPL_Arguments& arguments);
+
+    /**
+     * @brief Executes an opcode in place of the executing instruction, as if it were at its address.
+     * 
+     * Runs the same handlers as cycle(), without fetching anything: PC is left as it was, so the
+     * executing instruction still runs next. Unless the opcode wrote PC, the cpu then
+     * continues from there. THUMB BL takes both halfwords, the first in the low half of opcode.
+     * 
+     * @param opcode Opcode of the current instruction set.
+     * @param size Size of the opcode in bytes.
+     * @return bool False if the interpreter doesn't handle the opcode, the registers are left untouched then.
+     */
+    bool execute_in_place(uint32_t opcode, uint32_t size);
+
+    /**
+     * @brief Writes code to memory, dropping what was derived from the bytes it replaces.
+     * 
+     * Opcodes are fetched as they execute, so patching the executing instruction takes effect
+     * right away. The control flow graph is analysed again if it walked the bytes replaced, and
+     * the instructions the threaded backend decoded from them are decoded again.
+     * 
+     * @throws std::runtime_error If the bytes don't fit in the block of the memory region of
+     * address, see GBA_Memory::code_window, or address is in the IO registers.
+     */
+    void write_code(uint32_t address, const std::vector<uint8_t>& bytes);
+
+    /**
+     * @brief Data read of an instruction, charging the cycles of a non sequential access.
+     */
+    template<typename T>
+    T load(uint32_t address)
+    {
+        if constexpr (PerformanceCounters::enabled)
+            counters.reads[(address >> 24) & 0xF]++;
+        cycles += memory.io_state.wait_states.non_sequential[(address >> 24) & 0xF][io::width_index(sizeof(T))];
+        return memory.read<T>(address);
+    }
+
+    /**
+     * @brief Data write of an instruction, charging the cycles of a non sequential access.
+     */
+    template<typename T>
+    void store(uint32_t address, T value)
+    {
+        if constexpr (PerformanceCounters::enabled)
+            counters.writes[(address >> 24) & 0xF]++;
+        cycles += memory.io_state.wait_states.non_sequential[(address >> 24) & 0xF][io::width_index(sizeof(T))];
+        memory.write<T>(address, value);
+    }
 
     void set_mode(ExecutionMode new_mode);
 
+    /**
+     * @brief Writes to CPSR, keeping the cached interrupt state in sync.
+     * 
+     * Any write that may change the I bit or the mode bits must go through here.
+     * A change of mode swaps the banked registers. Writes that only touch the condition
+     * flags can assign CPSR directly.
+     * 
+     * @param value New CPSR value.
+     */
+    void write_CPSR(uint32_t value);
+
+    /**
+     * @brief SPSR of the current mode.
+     * 
+     * User and System modes have no SPSR, a scratch register is returned for them.
+     */
+    uint32_t& current_SPSR();
+
+    /**
+     * @brief Enters an exception mode.
+     * 
+     * Saves CPSR into the SPSR of the new mode, switches to its registers, disables IRQs,
+     * switches to ARM state, stores return_address in its LR and jumps to vector.
+     * 
+     * @param exception_mode Mode to be entered.
+     * @param vector Exception vector address.
+     * @param return_address Value of LR in the new mode.
+     */
+    void enter_exception(ProcessorMode exception_mode, uint32_t vector, uint32_t return_address);
+
+    /**
+     * @brief Returns from an exception mode, as MOVS/SUBS PC, LR do.
+     * 
+     * Restores CPSR from the SPSR of the current mode (and with it the registers and state
+     * of the interrupted mode) and jumps to return_address.
+     */
+    void return_from_exception(uint32_t return_address);
+
+    /**
+     * @brief Enters IRQ mode.
+     * 
+     * The return address + 4 is stored in LR_irq and the cpu jumps to the IRQ vector (0x18).
+     */
+    void enter_IRQ();
+
+    /**
+     * @brief Returns from IRQ mode, as SUBS PC, LR, #4 does.
+     */
+    void return_from_IRQ();
+
 private:
     bool cycle_arm();
     bool cycle_thumb();
+    /** Runs the handler of an opcode. @return bool False if there is none. */
+    bool execute_arm(uint32_t opcode);
+    bool execute_thumb(uint16_t opcode);
+    /**
+     * @brief Cycles of the opcode fetches of the instruction that ran: one sequential fetch if
+     * it stepped the pipeline, the non sequential and sequential fetches refilling it otherwise.
+     */
+    uint32_t fetch_cycles(uint32_t previous_pc) const;
+    /**
+     * @brief Executes the THUMB instruction and the one after it as one, if they form a pair
+     * fuse_thumb knows and nothing could observe the cpu between them.
+     * 
+     * @return bool False if the pair can't be fused, nothing was executed then.
+     */
+    bool cycle_fused(uint32_t instruction_address);
+    /**
+     * @brief Extends the run of consecutive instructions about to execute. The previous run is
+     * only marked in coverage once execution leaves it, so straight line code costs a compare.
+     */
+    void track_coverage(uint32_t instruction_address)
+    {
+        bool thumb = mode == ExecutionMode::THUMB;
+        if (instruction_address != coverage_run.end || thumb != coverage_run.thumb)
+        {
+            coverage.mark(coverage_run.begin, coverage_run.end, coverage_run.thumb);
+            coverage_run = { instruction_address, instruction_address, thumb };
+        }
+        coverage_run.end = instruction_address + instruction_size;
+    }
+    /** run() with the threaded backend, see threaded_interpreter.cpp. */
+    bool run_threaded(uint64_t cycle_limit);
+
+    /** Opcode pre-decoded by the threaded backend. */
+    struct DecodedInstruction
+    {
+        uint32_t key = 1;       // Address, with bit 0 set for THUMB. Address 0 never runs outside the BIOS
+        uint32_t opcode = 0;    // Decoded again when the opcode fetched differs
+        OpcodeHandler handler = OpcodeHandler::UNHANDLED;
+        HandlerFunction execute = nullptr;
+        const void* target = nullptr;   // Label of the handler, with computed goto
+    };
+    /** Direct mapped by address, sized on the first threaded run. */
+    static constexpr uint32_t decoded_instruction_bits = 12;
+    std::vector<DecodedInstruction> decoded_instructions;
+    bool stop_requested = false;
+    /** Consecutive instructions executed since the last jump, not yet marked in coverage. */
+    struct CoverageRun
+    {
+        uint32_t begin = 0;
+        uint32_t end = 0;
+        bool thumb = false;
+    } coverage_run;
+    /** Opens the REPL, or calls break_handler, before the instruction executes. */
+    void enter_break(uint32_t instruction_address);
+    /**
+     * @brief Runs the exec triggers matching the instruction.
+     * 
+     * @return bool True if one intercepted it, so it must not be executed.
+     */
+    bool run_exec_triggers(uint32_t instruction_address);
+    /** Runs the trigger whose watchpoint the last instruction hit, if any. */
+    void run_memory_triggers(uint32_t instruction_address);
+    void fire_trigger(const Trigger& trigger, uint32_t address, uint32_t instruction_address);
+    /** Rebuilds exec_trigger_pages and the memory watchpoints of the triggers. */
+    void update_triggers();
+    void find_instruction(const REPL_Arguments& arguments, InstructionSet set) const;
+    void fill(const REPL_Arguments& arguments, uint32_t element_size) const;
+    /** Writes an assembled program with write_code, its labels becoming REPL variables. */
+    void load_program(const AssembledProgram& program, const REPL_Arguments& arguments);
+    /** Control flow graph, analysed on first use. */
+    const ControlFlowGraph& analysed_control_flow() const;
+    /** Function starting at code_address or, failing that, the functions enclosing it. */
+    std::vector<const Function*> functions_at(uint32_t code_address) const;
+    void switch_register_bank(uint8_t old_mode, uint8_t new_mode);
 public:
+    /** Opcode of the instruction cycle() is executing, at PC - 2 instructions. */
     uint32_t executing = 0x69696969;
-    uint32_t decoding = 0x69696969;
-    uint32_t fetching = 0x69696969;
+    /** Bytes of the code region PC fetches from. */
+    GBA_Memory::CodeWindow code_window;
     
     int instruction_size = 4;
     GBA_Memory& memory;
     uint32_t R[16] = { 0 };
     uint32_t CPSR = 0;
+    /**
+     * Registers of the inactive banks. The active bank always lives in R.
+     * R8..R12 are only banked for FIQ: [0] User and every other mode, [1] FIQ.
+     */
+    uint32_t banked_R8_R12[2][5] = { { 0 } };
+    uint32_t banked_R13_R14[BANK_COUNT][2] = { { 0 } };
+    /** SPSR of each bank. The User/System entry is never saved to or restored from. */
+    uint32_t SPSR[BANK_COUNT] = { 0 };
     uint32_t& PC = R[15];
     uint32_t& LR = R[14];
     uint32_t& SP = R[13];
     ExecutionMode mode = ExecutionMode::ARM;
+
+    /**
+     * Elapsed cycles. Instructions are charged their opcode fetches, sequential unless they
+     * branched, the data accesses of load() and store() and their internal cycles, with the
+     * wait states of io::WaitStates. BIOS calls charge the estimated cost of the real routine.
+     */
+    uint64_t cycles = 0;
+
+    /** Set by IntrWait/VBlankIntrWait. The cpu won't execute instructions while halted. */
+    bool halted = false;
+    /** Interrupt flags the halted cpu is waiting for. */
+    uint16_t intr_wait_flags = 0;
     
     uint32_t R_bak[16];
     uint32_t CPSR_bak;
     std::vector<uint32_t> break_points;
 
-    csh cs_arm;
-    csh cs_tmb;
+    /** Conditional break points and memory triggers, see add_trigger. */
+    std::vector<Trigger> triggers;
+    uint32_t next_trigger_id = 1;
+
+    /** Pages of 2^trigger_page_bits bytes holding an exec trigger. Only those pages look the triggers up. */
+    static constexpr uint32_t trigger_page_bits = 12;
+    std::bitset<((1u << 28) >> trigger_page_bits)> exec_trigger_pages;
+
+    /**
+     * Called with the instruction address when a break point is hit. When empty, the
+     * interactive REPL is opened instead.
+     */
+    std::function<void(GBA_Cpu&, uint32_t)> break_handler;
+
+    /** Print every executed instruction and the registers it changed. */
+    bool trace = true;
+
+    /**
+     * Execute common THUMB instruction pairs, as BL, in one cycle(). Never while tracing, and
+     * pairs with a break point on either instruction, a trigger or a watchpoint in between are
+     * executed one by one.
+     * Clear it to have each cycle() execute exactly one instruction.
+     */
+    bool fuse_instructions = true;
+
+    /** Interpreter run() executes with. */
+    Backend backend = Backend::SWITCH;
+
+    /** Instructions executed while coverage_enabled, see enable_coverage. */
+    CoverageMap coverage;
+    bool coverage_enabled = false;
+
+    /** Events counted as instructions execute, printed by the stats command. Reset with counters.reset(). */
+    PerformanceCounters counters;
+
+    /** Disassembly cache of dissa/disst. Built on first use, hence mutable. */
+    mutable DisassemblyIndex disassembly_index;
+
+    /** Functions found by walking the code, for the REPL queries. Analysed on first use. */
+    mutable ControlFlowGraph control_flow;
 };
@@ -1,5 +1,6 @@
 #include "GBA_Memory.h"
 
+#include <algorithm>
 #include <cassert>
 #include <sstream>
 #include <fmt/core.h>
@@ -7,6 +8,8 @@
 GBA_Memory::GBA_Memory()
     : memory_buffer(0x0FFFFFFF, 0u)
 {
+    memory_buffer[io::base + io::KEYINPUT] = 0xFF; // No key pressed
+    memory_buffer[io::base + io::KEYINPUT + 1] = 0x03;
 }
 
 void GBA_Memory::load_rom(std::ifstream& gba_file, GBA_CartridgeHeader* header_ptr)
@@ -19,36 +22,10 @@ void GBA_Memory::load_rom(std::ifstream& gba_file, GBA_CartridgeHeader* header_p
         assert(header_ptr->fixed_value == 0x96);
     }
     gba_file.seekg(0);    
-    std::copy(std::istreambuf_iterator<char>(gba_file),
-              std::istreambuf_iterator<char>(),
-              memory_buffer.begin() + rom_base);
-}
-
-uint32_t GBA_Memory::read_word(uint32_t address) const
-{
-    return memory_buffer[size_t(address)]
-        | (memory_buffer[size_t(address) + 1] << 8)
-        | (memory_buffer[size_t(address) + 2] << 16)
-        | (memory_buffer[size_t(address) + 3] << 24);
-}
-
-uint16_t GBA_Memory::read_halfword(uint32_t address) const
-{
-    return memory_buffer[size_t(address)]
-        | (memory_buffer[size_t(address) + 1] << 8);
-}
-
-uint8_t GBA_Memory::read_byte(uint32_t address) const
-{
-    return memory_buffer[size_t(address)];
-}
-
-void GBA_Memory::write_word(uint32_t address, uint32_t word)
-{
-    memory_buffer[size_t(address)] = word & 0xFF;
-    memory_buffer[size_t(address) + 1] = (word >> 8) & 0xFF;
-    memory_buffer[size_t(address) + 2] = (word >> 16) & 0xFF;
-    memory_buffer[size_t(address) + 3] = (word >> 24) & 0xFF;
+    auto end = std::copy(std::istreambuf_iterator<char>(gba_file),
+                         std::istreambuf_iterator<char>(),
+                         memory_buffer.begin() + rom_base);
+    rom_size = static_cast<uint32_t>(std::distance(memory_buffer.begin() + rom_base, end));
 }
 
 std::string GBA_Memory::dump(uint32_t align, uint32_t begin, uint32_t end)
@@ -88,10 +65,107 @@ uint32_t GBA_Memory::find_word(uint32_t value, uint32_t begin, uint32_t end) con
         return end;
     }
 
-    for (; begin != end; begin++)
+    // Searches the bytes as they are, at any alignment and without triggering watchpoints
+    for (; begin != end && contiguous_size(begin) >= word_size; begin++)
     {
-        if (read_word(begin) == value) break;
+        uint32_t word;
+        std::memcpy(&word, pointer(begin), word_size);
+        if (word == value) break;
     }
 
     return begin;
 }
+
+uint32_t GBA_Memory::peek_word(uint32_t address) const
+{
+    uint32_t word = 0;
+    std::memcpy(&word, pointer(address), std::min<size_t>(contiguous_size(address), word_size));
+    return word;
+}
+
+std::pair<uint32_t, uint32_t> GBA_Memory::linear_block(uint32_t address)
+{
+    auto& region = region_mirrors[(address >> 24) & 0xF];
+    auto begin = address & ~region.mask;
+    auto size = region.mask + 1;
+    if (region.base == vram_base)
+    {
+        // The last 32KB of each 128KB block repeat the 32KB before them
+        auto offset = address & region.mask;
+        begin += offset < 0x18000 ? 0 : 0x18000;
+        size = offset < 0x18000 ? 0x18000 : 0x8000;
+    }
+    return { begin, begin + size };
+}
+
+GBA_Memory::CodeWindow GBA_Memory::code_window(uint32_t address) const
+{
+    if (address >= mapped_end || (address >> 24) == (io::base >> 24))
+    {
+        return { address, address, nullptr };
+    }
+
+    auto [begin, end] = linear_block(address);
+    return { begin, end, memory_buffer.data() + mirror(begin) };
+}
+
+uint8_t* GBA_Memory::pointer(uint32_t address)
+{
+    return memory_buffer.data() + mirror(address);
+}
+
+const uint8_t* GBA_Memory::pointer(uint32_t address) const
+{
+    return memory_buffer.data() + mirror(address);
+}
+
+size_t GBA_Memory::contiguous_size(uint32_t address) const
+{
+    return address < mapped_end ? linear_block(address).second - address : 0;
+}
+
+void GBA_Memory::check_watchpoints(uint32_t address, uint32_t size, WatchAccess access) const
+{
+    if (watch_hit.triggered)
+    {
+        return;
+    }
+
+    for (auto& watchpoint : watchpoints)
+    {
+        if ((watchpoint.access & access) && address < watchpoint.end && watchpoint.begin < address + size)
+        {
+            watch_hit = { std::max(address, watchpoint.begin), watchpoint.access, access, watchpoint.owner, true };
+            return;
+        }
+    }
+}
+
+uint16_t GBA_Memory::read_io(uint32_t address) const
+{
+    auto offset = (address - io::base) & ~1u;
+    const auto& io_register = io::register_table[offset / 2];
+
+    if (io_register.read == nullptr)
+    {
+        return (memory_buffer[io::base + offset] | (memory_buffer[io::base + offset + 1] << 8)) & io_register.read_mask;
+    }
+
+    return io_register.read(*this, offset) & io_register.read_mask;
+}
+
+void GBA_Memory::write_io(uint32_t address, uint16_t value, uint16_t mask)
+{
+    auto offset = (address - io::base) & ~1u;
+    const auto& io_register = io::register_table[offset / 2];
+    mask &= io_register.write_mask;
+
+    if (io_register.write == nullptr)
+    {
+        memory_buffer[io::base + offset] = (memory_buffer[io::base + offset] & ~mask) | (value & mask);
+        memory_buffer[io::base + offset + 1] = (memory_buffer[io::base + offset + 1] & ~(mask >> 8)) | ((value & mask) >> 8);
+        return;
+    }
+
+    io_register.write(*this, offset, value, mask);
+}
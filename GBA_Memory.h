@@ -1,8 +1,17 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <type_traits>
+#include <utility>
 #include <vector>
+#include "io_registers.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "GBA_Memory loads and stores the little endian values of the GBA as they are"
+#endif
 
 struct GBA_CartridgeHeader
 {
@@ -34,27 +43,259 @@ public:
     void load_rom(std::ifstream& gba_file, GBA_CartridgeHeader* header_ptr);
     
     /**
-     * @brief Reads a word (32 bit value) from memory.
+     * @brief Reads a value of the width of T from the bus: uint8_t, uint16_t or uint32_t.
+     * 
+     * As on the hardware, the address is aligned down to the width and mirrored inside its
+     * region, see mirror(). IO registers go through their handlers, other regions are a single
+     * little endian load. Nothing is mapped from 0x10000000 on, it reads as 0.
      * 
-     * This includes the bytes at address to address + 3, so the next word would be at address + 4.
+     * A misaligned LDR must rotate the word it reads itself, the bus doesn't.
      * 
      * @param address Address to read.
-     * @return uint32_t Word at address.
+     * @return T Value at address.
      */
-    uint32_t read_word(uint32_t address) const;
-    
-    uint16_t read_halfword(uint32_t address) const;
+    template<typename T>
+    T read(uint32_t address) const
+    {
+        check_width<T>();
+        address &= ~uint32_t(sizeof(T) - 1);
+        if (!watchpoints.empty())
+            check_watchpoints(address, sizeof(T), WATCH_READ);
+
+        if (address >= mapped_end)
+            return 0;
+        if (is_io(address))
+        {
+            if constexpr (sizeof(T) == 4)
+                return read_io(address) | (uint32_t(read_io(address + 2)) << 16);
+            else
+                return static_cast<T>(read_io(address) >> ((address & 1) * 8));
+        }
+
+        T value;
+        std::memcpy(&value, memory_buffer.data() + mirror(address), sizeof(T));
+        return value;
+    }
+
+    /**
+     * @brief Writes a value of the width of T to the bus, aligned and mirrored as read() does.
+     * 
+     * Writes from 0x10000000 on are ignored.
+     */
+    template<typename T>
+    void write(uint32_t address, T value)
+    {
+        check_width<T>();
+        address &= ~uint32_t(sizeof(T) - 1);
+        if (!watchpoints.empty())
+            check_watchpoints(address, sizeof(T), WATCH_WRITE);
+
+        if (address >= mapped_end)
+            return;
+        if (is_io(address))
+        {
+            if constexpr (sizeof(T) == 4)
+            {
+                write_io(address, value & 0xFFFF, 0xFFFF);
+                write_io(address + 2, value >> 16, 0xFFFF);
+            }
+            else
+            {
+                auto shift = (address & 1) * 8;
+                write_io(address, static_cast<uint16_t>(value << shift), static_cast<uint16_t>(T(~0u) << shift));
+            }
+            return;
+        }
+
+        std::memcpy(memory_buffer.data() + mirror(address), &value, sizeof(T));
+    }
+
+    uint32_t read_word(uint32_t address) const { return read<uint32_t>(address); }
 
-    uint8_t read_byte(uint32_t address) const;
+    uint16_t read_halfword(uint32_t address) const { return read<uint16_t>(address); }
 
-    void write_word(uint32_t address, uint32_t word);
+    uint8_t read_byte(uint32_t address) const { return read<uint8_t>(address); }
+
+    void write_word(uint32_t address, uint32_t word) { write<uint32_t>(address, word); }
+
+    void write_halfword(uint32_t address, uint16_t halfword) { write<uint16_t>(address, halfword); }
+
+    void write_byte(uint32_t address, uint8_t byte) { write<uint8_t>(address, byte); }
+
+    /**
+     * @brief Address backing an address of a mirrored region, the one pointer() sees.
+     * 
+     * EWRAM repeats every 256KB, IWRAM every 32KB, palette RAM and OAM every 1KB, the 96KB of
+     * VRAM every 128KB (its last 32KB repeating the 32KB before) and SRAM every 64KB. The ROM
+     * shows at 0x08000000, 0x0A000000 and 0x0C000000, one for each wait state.
+     */
+    static constexpr uint32_t mirror(uint32_t address)
+    {
+        auto& region = region_mirrors[(address >> 24) & 0xF];
+        auto offset = address & region.mask;
+        if (region.base == vram_base && offset >= 0x18000)
+            offset -= 0x8000;
+        return region.base | offset;
+    }
+
+    /**
+     * @brief Addresses backed by consecutive bytes of the buffer, for the opcode fetches.
+     */
+    struct CodeWindow
+    {
+        uint32_t begin = 0;
+        uint32_t end = 0;               // Exclusive, begin when the window is empty
+        const uint8_t* bytes = nullptr; // Backing begin
+    };
+
+    /**
+     * @brief Largest window containing address whose mirroring is linear: the whole region, or
+     * the block of it address is in for the mirrored ones.
+     * 
+     * @return CodeWindow Empty for the IO registers, whose reads have side effects, and from
+     * 0x10000000 on.
+     */
+    CodeWindow code_window(uint32_t address) const;
 
     std::string dump(uint32_t align, uint32_t begin, uint32_t end);
 
     uint32_t find_word(uint32_t value, uint32_t begin, uint32_t end) const;
+
+    /**
+     * @brief The 4 bytes at address as they are, for the tools looking at code rather than
+     * running it: any alignment, so a THUMB address gets its own halfword and the next, and none
+     * of the side effects of read(), so worker threads can call it.
+     * 
+     * Bytes past contiguous_size(address) read as 0.
+     */
+    uint32_t peek_word(uint32_t address) const;
+
+    /**
+     * @brief Direct pointer to the bytes backing an address, after mirror().
+     * 
+     * Allows bulk operations (decompression, scans...) to work over memory without copying it.
+     * Accesses through this pointer bypass any side effect of the regular accessors, and must
+     * stay within contiguous_size(address) bytes.
+     * 
+     * @param address Address to access.
+     * @return uint8_t* Pointer to the byte at address.
+     */
+    uint8_t* pointer(uint32_t address);
+
+    const uint8_t* pointer(uint32_t address) const;
+
+    /**
+     * @brief Amount of bytes that can be accessed through pointer(address): up to the end of the
+     * block of the region address is in, as code_window() has it, IO registers included.
+     * 0 from 0x10000000 on.
+     */
+    size_t contiguous_size(uint32_t address) const;
+
+    /**
+     * @brief Reads an IO register through the dispatch table.
+     * 
+     * @param address Address of the register. The lowest bit is ignored.
+     * @return uint16_t Value of the halfword register.
+     */
+    uint16_t read_io(uint32_t address) const;
+
+    /**
+     * @brief Writes an IO register through the dispatch table.
+     * 
+     * @param address Address of the register. The lowest bit is ignored.
+     * @param value Value to be written.
+     * @param mask Bits of value to be written.
+     */
+    void write_io(uint32_t address, uint16_t value, uint16_t mask);
+
+    static bool is_io(uint32_t address)
+    {
+        return (address & ~(io::size - 1)) == io::base;
+    }
+
+    /** Kinds of access a watchpoint reacts to. */
+    enum WatchAccess : uint8_t
+    {
+        WATCH_READ = 1,
+        WATCH_WRITE = 2,
+        WATCH_ACCESS = WATCH_READ | WATCH_WRITE
+    };
+
+    struct Watchpoint
+    {
+        uint32_t begin;
+        uint32_t end;   // Exclusive
+        WatchAccess access;
+        uint32_t owner = 0;     // Id of the GBA_Cpu trigger that set it, 0 for the debugger
+    };
+
+    /** The first watched access since watch_hit was last cleared. */
+    struct WatchHit
+    {
+        uint32_t address;
+        WatchAccess access;     // Access of the watchpoint that was hit
+        WatchAccess operation;  // Read or write that hit it
+        uint32_t owner;
+        bool triggered = false;
+    };
+private:
+    /**
+     * @brief Records the access in watch_hit if it touches a watchpoint.
+     */
+    void check_watchpoints(uint32_t address, uint32_t size, WatchAccess access) const;
+
+    template<typename T>
+    static constexpr void check_width()
+    {
+        static_assert(std::is_same_v<T, uint8_t> || std::is_same_v<T, uint16_t> || std::is_same_v<T, uint32_t>,
+                      "The bus is 8, 16 or 32 bits wide");
+    }
+
+    /** Block around address whose mirroring is linear, [begin, end). See code_window. */
+    static std::pair<uint32_t, uint32_t> linear_block(uint32_t address);
+
+    /** An address of the region maps to base | (address & mask). */
+    struct RegionMirror
+    {
+        uint32_t base;
+        uint32_t mask;
+    };
+
+    static constexpr uint32_t vram_base = 0x06000000;
+    static constexpr uint32_t mapped_end = 0x10000000;
+
+    /** Indexed by the top byte of the address. */
+    static constexpr std::array<RegionMirror, 16> region_mirrors = { {
+        { 0x00000000, 0x00FFFFFF },     // BIOS
+        { 0x01000000, 0x00FFFFFF },
+        { 0x02000000, 0x0003FFFF },     // EWRAM
+        { 0x03000000, 0x00007FFF },     // IWRAM
+        { 0x04000000, 0x00FFFFFF },     // IO registers
+        { 0x05000000, 0x000003FF },     // Palette RAM
+        { vram_base, 0x0001FFFF },      // VRAM
+        { 0x07000000, 0x000003FF },     // OAM
+        { 0x08000000, 0x01FFFFFF },     // ROM, wait state 0
+        { 0x08000000, 0x01FFFFFF },
+        { 0x08000000, 0x01FFFFFF },     // ROM, wait state 1
+        { 0x08000000, 0x01FFFFFF },
+        { 0x08000000, 0x01FFFFFF },     // ROM, wait state 2
+        { 0x08000000, 0x01FFFFFF },
+        { 0x0E000000, 0x0000FFFF },     // SRAM
+        { 0x0E000000, 0x0000FFFF }
+    } };
 public:
     static constexpr uint32_t rom_base = 0x08000000;
     static constexpr uint32_t word_size = 4;
+    /** Size of the last loaded ROM. */
+    uint32_t rom_size = 0;
+    io::State io_state;
+
+    /**
+     * Watched address ranges. Every read and write accessor checks them while there is any,
+     * instruction fetches included.
+     */
+    std::vector<Watchpoint> watchpoints;
+    mutable WatchHit watch_hit;
 private:
     std::vector<uint8_t> memory_buffer;
 };
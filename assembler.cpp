@@ -0,0 +1,1466 @@
+#include "assembler.h"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fmt/core.h>
+
+namespace
+{
+    constexpr std::array<std::string_view, 16> condition_names = {
+        "EQ", "NE", "CS", "CC", "MI", "PL", "VS", "VC",
+        "HI", "LS", "GE", "LT", "GT", "LE", "AL", "NV"
+    };
+
+    constexpr uint32_t condition_always = 0xE;
+
+    constexpr std::array<std::string_view, 4> shift_names = { "LSL", "LSR", "ASR", "ROR" };
+
+    bool equals_ignore_case(std::string_view a, std::string_view b)
+    {
+        return a.size() == b.size()
+            && std::equal(a.begin(), a.end(), b.begin(),
+                          [](unsigned char x, unsigned char y) { return std::toupper(x) == std::toupper(y); });
+    }
+
+    bool is_name_character(char c)
+    {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '.';
+    }
+
+    uint32_t rotate_left(uint32_t value, uint32_t amount)
+    {
+        amount &= 31;
+        return amount ? (value << amount) | (value >> (32 - amount)) : value;
+    }
+
+    /** Register named R0-R15, SP, LR or PC, -1 if name isn't one. */
+    int register_number(std::string_view name)
+    {
+        if (equals_ignore_case(name, "SP")) return 13;
+        if (equals_ignore_case(name, "LR")) return 14;
+        if (equals_ignore_case(name, "PC")) return 15;
+        if (name.size() < 2 || std::toupper(static_cast<unsigned char>(name[0])) != 'R')
+            return -1;
+
+        unsigned index;
+        auto end = name.data() + name.size();
+        auto result = std::from_chars(name.data() + 1, end, index);
+        return result.ptr == end && result.ec == std::errc{} && index < 16 ? static_cast<int>(index) : -1;
+    }
+
+    /** Condition field of a suffix, AL when it's empty. HS and LO stand for CS and CC. */
+    std::optional<uint32_t> parse_condition(std::string_view suffix)
+    {
+        if (suffix.empty())
+            return condition_always;
+        if (suffix == "HS")
+            return 0x2;
+        if (suffix == "LO")
+            return 0x3;
+
+        auto found = std::find(condition_names.begin(), condition_names.end() - 1, suffix);
+        if (found == condition_names.end() - 1)
+            return std::nullopt;
+        return static_cast<uint32_t>(found - condition_names.begin());
+    }
+
+    struct Suffixes
+    {
+        size_t suffix;      // Index of the suffix matched
+        uint32_t condition;
+    };
+
+    /** Splits the rest of a mnemonic in one of suffixes and a condition, written in either order. */
+    template<size_t N>
+    std::optional<Suffixes> match_suffixes(std::string_view rest, const std::array<std::string_view, N>& suffixes)
+    {
+        for (size_t i = 0; i < N; i++)
+        {
+            auto suffix = suffixes[i];
+            if (rest.size() < suffix.size())
+                continue;
+
+            if (rest.substr(0, suffix.size()) == suffix)
+                if (auto condition = parse_condition(rest.substr(suffix.size())))
+                    return Suffixes{ i, *condition };
+            if (rest.substr(rest.size() - suffix.size()) == suffix)
+                if (auto condition = parse_condition(rest.substr(0, rest.size() - suffix.size())))
+                    return Suffixes{ i, *condition };
+        }
+        return std::nullopt;
+    }
+
+    /**
+     * Reads the operands of an instruction, consuming the text as it goes. Errors quote the
+     * whole instruction, if given.
+     */
+    class OperandReader
+    {
+    public:
+        OperandReader(std::string_view text, std::string_view instruction, const SymbolTable* symbols)
+            : text(text),
+              instruction(instruction),
+              symbols(symbols)
+        {
+        }
+
+        [[noreturn]] void fail(std::string_view message) const
+        {
+            if (instruction.empty())
+                throw std::runtime_error{ std::string{ message } };
+            throw std::runtime_error{ fmt::format("{}: {}", message, instruction) };
+        }
+
+        bool at_end()
+        {
+            skip_spaces();
+            return text.empty();
+        }
+
+        void finish()
+        {
+            if (!at_end())
+                fail(fmt::format("Unexpected {}", text));
+        }
+
+        bool consume(char c)
+        {
+            skip_spaces();
+            if (text.empty() || text.front() != c)
+                return false;
+            text.remove_prefix(1);
+            return true;
+        }
+
+        void expect(char c)
+        {
+            if (!consume(c))
+                fail(fmt::format("Expected {}", c));
+        }
+
+        std::string_view peek_word()
+        {
+            skip_spaces();
+            size_t length = 0;
+            while (length < text.size() && is_name_character(text[length]))
+                length++;
+            return text.substr(0, length);
+        }
+
+        std::string_view word()
+        {
+            auto name = peek_word();
+            text.remove_prefix(name.size());
+            return name;
+        }
+
+        std::optional<uint32_t> try_register()
+        {
+            auto index = register_number(peek_word());
+            if (index < 0)
+                return std::nullopt;
+            word();
+            return static_cast<uint32_t>(index);
+        }
+
+        uint32_t register_operand()
+        {
+            if (auto index = try_register())
+                return *index;
+            fail("Expected a register");
+        }
+
+        /** R0-R7, for most THUMB operands. */
+        uint32_t low_register()
+        {
+            auto index = register_operand();
+            if (index > 7)
+                fail("Expected a register between R0 and R7");
+            return index;
+        }
+
+        /** Value added and subtracted from numbers and symbols: 0x10, -4, loop+8, end-start. */
+        int64_t number()
+        {
+            auto value = term();
+            for (;;)
+            {
+                if (consume('+'))
+                    value += term();
+                else if (consume('-'))
+                    value -= term();
+                else
+                    return value;
+            }
+        }
+
+        /** #number, the # being optional when optional_hash is set. */
+        int64_t immediate(bool optional_hash = false)
+        {
+            if (!consume('#') && !optional_hash)
+                fail("Expected an immediate");
+            return number();
+        }
+
+        /** Number between minimum and maximum. */
+        uint32_t immediate_in(int64_t minimum, int64_t maximum)
+        {
+            auto value = immediate();
+            if (value < minimum || value > maximum)
+                fail(fmt::format("Immediate out of range [{}, {}]", minimum, maximum));
+            return static_cast<uint32_t>(value);
+        }
+
+        /** Any 32 bit value, negative ones wrapping around. */
+        uint32_t word_immediate()
+        {
+            auto value = immediate();
+            if (value < -0x80000000LL)
+                fail("Immediate out of range");
+            return static_cast<uint32_t>(value);
+        }
+
+        /** {R0-R3, LR} */
+        uint16_t register_list()
+        {
+            expect('{');
+            uint16_t list = 0;
+            if (consume('}'))
+                return list;
+            do
+            {
+                auto first = register_operand();
+                auto last = consume('-') ? register_operand() : first;
+                if (last < first)
+                    fail("Invalid register range");
+                for (auto i = first; i <= last; i++)
+                    list |= 1 << i;
+            } while (consume(','));
+            expect('}');
+            return list;
+        }
+    private:
+        /** Signed number, 0x prefixed hexadecimal or decimal, or a symbol. */
+        int64_t term()
+        {
+            bool negative = consume('-');
+            if (!negative)
+                consume('+');
+            skip_spaces();
+
+            if (!text.empty() && !std::isdigit(static_cast<unsigned char>(text.front())))
+            {
+                auto name = word();
+                if (name.empty())
+                    fail("Expected a number");
+                auto symbol = symbols ? symbols->find(name) : SymbolTable::const_iterator{};
+                if (!symbols || symbol == symbols->end())
+                    fail(fmt::format("Unknown symbol {}", name));
+                return negative ? -int64_t(symbol->second) : int64_t(symbol->second);
+            }
+
+            uint64_t value = 0;
+            std::from_chars_result result;
+            const auto end = text.data() + text.size();
+            if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X'))
+                result = std::from_chars(text.data() + 2, end, value, 16);
+            else
+                result = std::from_chars(text.data(), end, value);
+
+            if (result.ec != std::errc{} || value > 0xFFFFFFFF)
+                fail("Expected a number");
+            text.remove_prefix(result.ptr - text.data());
+            return negative ? -static_cast<int64_t>(value) : static_cast<int64_t>(value);
+        }
+
+        void skip_spaces()
+        {
+            while (!text.empty() && std::isspace(static_cast<unsigned char>(text.front())))
+                text.remove_prefix(1);
+        }
+
+        std::string_view text;
+        std::string_view instruction;
+        const SymbolTable* symbols;
+    };
+
+    /** Mnemonic in upper case and its operands. */
+    struct Instruction
+    {
+        std::string mnemonic;
+        std::string_view operands;
+    };
+
+    Instruction split_instruction(std::string_view text)
+    {
+        auto begin = text.find_first_not_of(" \t");
+        if (begin == std::string_view::npos)
+            throw std::runtime_error{ "Empty instruction" };
+        text.remove_prefix(begin);
+
+        auto end = std::min(text.find_first_of(" \t"), text.size());
+        Instruction instruction{ std::string{ text.substr(0, end) }, text.substr(end) };
+        for (auto& c : instruction.mnemonic)
+            c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+        return instruction;
+    }
+
+    /** Offset of a branch, checked for alignment and range. */
+    int64_t branch_offset(OperandReader& reader, uint32_t pc, uint32_t alignment, uint32_t bits)
+    {
+        auto target = reader.number();
+        auto offset = target - static_cast<int64_t>(pc);
+        auto limit = int64_t(alignment) << (bits - 1);
+        if (offset % alignment)
+            reader.fail("Misaligned branch target");
+        if (offset < -limit || offset >= limit)
+            reader.fail("Branch target out of range");
+        return offset / alignment;
+    }
+
+    // ARM
+
+    enum class ArmSyntax : uint8_t
+    {
+        DATA_PROCESSING, SHIFT, MULTIPLY, MULTIPLY_LONG, SWAP, TRANSFER, BLOCK, PUSH_POP,
+        BRANCH, BX, SWI, MRS, MSR, ADR, NOP
+    };
+
+    struct ArmMnemonic
+    {
+        std::string_view name;
+        ArmSyntax syntax;
+        uint32_t operation;
+    };
+
+    /** BL before B, so that BLEQ isn't taken for B with a condition LEQ. */
+    constexpr std::array<ArmMnemonic, 44> arm_mnemonics = { {
+        { "AND", ArmSyntax::DATA_PROCESSING, 0x0 }, { "EOR", ArmSyntax::DATA_PROCESSING, 0x1 },
+        { "SUB", ArmSyntax::DATA_PROCESSING, 0x2 }, { "RSB", ArmSyntax::DATA_PROCESSING, 0x3 },
+        { "ADD", ArmSyntax::DATA_PROCESSING, 0x4 }, { "ADC", ArmSyntax::DATA_PROCESSING, 0x5 },
+        { "SBC", ArmSyntax::DATA_PROCESSING, 0x6 }, { "RSC", ArmSyntax::DATA_PROCESSING, 0x7 },
+        { "TST", ArmSyntax::DATA_PROCESSING, 0x8 }, { "TEQ", ArmSyntax::DATA_PROCESSING, 0x9 },
+        { "CMP", ArmSyntax::DATA_PROCESSING, 0xA }, { "CMN", ArmSyntax::DATA_PROCESSING, 0xB },
+        { "ORR", ArmSyntax::DATA_PROCESSING, 0xC }, { "MOV", ArmSyntax::DATA_PROCESSING, 0xD },
+        { "BIC", ArmSyntax::DATA_PROCESSING, 0xE }, { "MVN", ArmSyntax::DATA_PROCESSING, 0xF },
+        { "LSL", ArmSyntax::SHIFT, 0 }, { "ASL", ArmSyntax::SHIFT, 0 }, { "LSR", ArmSyntax::SHIFT, 1 },
+        { "ASR", ArmSyntax::SHIFT, 2 }, { "ROR", ArmSyntax::SHIFT, 3 }, { "RRX", ArmSyntax::SHIFT, 4 },
+        { "MUL", ArmSyntax::MULTIPLY, 0 }, { "MLA", ArmSyntax::MULTIPLY, 1 },
+        { "UMULL", ArmSyntax::MULTIPLY_LONG, 0 }, { "UMLAL", ArmSyntax::MULTIPLY_LONG, 1 },
+        { "SMULL", ArmSyntax::MULTIPLY_LONG, 2 }, { "SMLAL", ArmSyntax::MULTIPLY_LONG, 3 },
+        { "SWP", ArmSyntax::SWAP, 0 },
+        { "LDR", ArmSyntax::TRANSFER, 1 }, { "STR", ArmSyntax::TRANSFER, 0 },
+        { "LDM", ArmSyntax::BLOCK, 1 }, { "STM", ArmSyntax::BLOCK, 0 },
+        { "PUSH", ArmSyntax::PUSH_POP, 0 }, { "POP", ArmSyntax::PUSH_POP, 1 },
+        { "BX", ArmSyntax::BX, 0 }, { "BL", ArmSyntax::BRANCH, 1 }, { "B", ArmSyntax::BRANCH, 0 },
+        { "SWI", ArmSyntax::SWI, 0 }, { "SVC", ArmSyntax::SWI, 0 },
+        { "MRS", ArmSyntax::MRS, 0 }, { "MSR", ArmSyntax::MSR, 0 },
+        { "ADR", ArmSyntax::ADR, 0 }, { "NOP", ArmSyntax::NOP, 0 }
+    } };
+
+    constexpr std::array<std::string_view, 1> no_suffixes = { "" };
+    constexpr std::array<std::string_view, 2> flag_suffixes = { "", "S" };
+    constexpr std::array<std::string_view, 2> byte_suffixes = { "", "B" };
+    /** B, T and BT are single data transfers, the others halfword transfers. */
+    constexpr std::array<std::string_view, 7> transfer_suffixes = { "", "B", "T", "BT", "H", "SB", "SH" };
+    /** Indexed by P and U, then the stack modes in the order of the LDM aliases. */
+    constexpr std::array<std::string_view, 9> block_suffixes = { "DA", "IA", "DB", "IB", "FA", "FD", "EA", "ED", "" };
+
+    std::optional<Suffixes> match_arm_suffixes(ArmSyntax syntax, std::string_view rest)
+    {
+        switch (syntax)
+        {
+            case ArmSyntax::DATA_PROCESSING:
+            case ArmSyntax::SHIFT:
+            case ArmSyntax::MULTIPLY:
+            case ArmSyntax::MULTIPLY_LONG:
+                return match_suffixes(rest, flag_suffixes);
+            case ArmSyntax::SWAP:
+                return match_suffixes(rest, byte_suffixes);
+            case ArmSyntax::TRANSFER:
+                return match_suffixes(rest, transfer_suffixes);
+            case ArmSyntax::BLOCK:
+                return match_suffixes(rest, block_suffixes);
+            default:
+                return match_suffixes(rest, no_suffixes);
+        }
+    }
+
+    /** Encodes value as an 8 bit immediate rotated right by an even amount. */
+    std::optional<uint32_t> encode_arm_immediate(uint32_t value)
+    {
+        for (uint32_t rotation = 0; rotation < 16; rotation++)
+        {
+            auto imm8 = rotate_left(value, rotation * 2);
+            if (imm8 <= 0xFF)
+                return (rotation << 8) | imm8;
+        }
+        return std::nullopt;
+    }
+
+    /** Shift of a register operand after its comma: LSL #n, LSR Rs, RRX... Returns bits [4, 11]. */
+    uint32_t arm_shift(OperandReader& reader, bool allow_register_shift)
+    {
+        auto name = reader.word();
+        if (equals_ignore_case(name, "RRX"))
+            return 3 << 5;
+
+        auto found = std::find_if(shift_names.begin(), shift_names.end(),
+                                  [&](std::string_view shift) { return equals_ignore_case(name, shift); });
+        if (equals_ignore_case(name, "ASL"))
+            found = shift_names.begin();
+        if (found == shift_names.end())
+            reader.fail("Expected a shift");
+        uint32_t type = static_cast<uint32_t>(found - shift_names.begin());
+
+        if (auto shift_register = reader.try_register())
+        {
+            if (!allow_register_shift)
+                reader.fail("Shift by register isn't allowed here");
+            return (*shift_register << 8) | (type << 5) | 0x10;
+        }
+
+        auto amount = reader.immediate_in(0, type == 1 || type == 2 ? 32 : 31);
+        if (amount == 0)
+            return 0; // LSR #0, ASR #0 and ROR #0 would encode LSR #32, ASR #32 and RRX
+        return ((amount & 0x1F) << 7) | (type << 5);
+    }
+
+    bool is_shift_name(std::string_view name)
+    {
+        return equals_ignore_case(name, "RRX") || equals_ignore_case(name, "ASL")
+            || std::any_of(shift_names.begin(), shift_names.end(),
+                           [&](std::string_view shift) { return equals_ignore_case(name, shift); });
+    }
+
+    /** Operation with an immediate complementary to operation's, for immediates that can't be encoded. */
+    std::optional<std::pair<uint32_t, uint32_t>> complementary_operation(uint32_t operation, uint32_t immediate)
+    {
+        switch (operation)
+        {
+            case 0x0: return std::pair{ 0xEu, ~immediate };         // AND / BIC
+            case 0xE: return std::pair{ 0x0u, ~immediate };
+            case 0x2: return std::pair{ 0x4u, 0u - immediate };     // SUB / ADD
+            case 0x4: return std::pair{ 0x2u, 0u - immediate };
+            case 0x5: return std::pair{ 0x6u, ~immediate };         // ADC / SBC
+            case 0x6: return std::pair{ 0x5u, ~immediate };
+            case 0xA: return std::pair{ 0xBu, 0u - immediate };     // CMP / CMN
+            case 0xB: return std::pair{ 0xAu, 0u - immediate };
+            case 0xD: return std::pair{ 0xFu, ~immediate };         // MOV / MVN
+            case 0xF: return std::pair{ 0xDu, ~immediate };
+            default:  return std::nullopt;
+        }
+    }
+
+    /** Second operand of a data processing instruction: #imm, Rm or Rm, shift. Returns bits [0, 11] and I. */
+    uint32_t arm_operand2(OperandReader& reader, uint32_t& operation)
+    {
+        if (reader.consume('#'))
+        {
+            auto value = reader.number();
+            if (value < -0x80000000LL)
+                reader.fail("Immediate out of range");
+            auto immediate = static_cast<uint32_t>(value);
+
+            if (auto encoded = encode_arm_immediate(immediate))
+                return (1 << 25) | *encoded;
+            if (auto complement = complementary_operation(operation, immediate))
+            {
+                if (auto encoded = encode_arm_immediate(complement->second))
+                {
+                    operation = complement->first;
+                    return (1 << 25) | *encoded;
+                }
+            }
+            reader.fail(fmt::format("Immediate {:#x} can't be encoded", immediate));
+        }
+
+        auto Rm = reader.register_operand();
+        return reader.consume(',') ? arm_shift(reader, true) | Rm : Rm;
+    }
+
+    uint32_t assemble_data_processing(OperandReader& reader, uint32_t operation, bool set_flags)
+    {
+        bool is_test = operation >= 0x8 && operation <= 0xB;
+        bool is_move = operation == 0xD || operation == 0xF;
+        uint32_t Rd = 0;
+        uint32_t Rn = 0;
+
+        if (is_test)
+        {
+            Rn = reader.register_operand();
+            set_flags = true;
+            reader.expect(',');
+        }
+        else if (is_move)
+        {
+            Rd = reader.register_operand();
+            reader.expect(',');
+        }
+        else
+        {
+            // ADD Rd, op2 is ADD Rd, Rd, op2, told apart from ADD Rd, Rn, op2 by what follows the register
+            Rd = Rn = reader.register_operand();
+            reader.expect(',');
+            auto lookahead = reader;
+            auto first = lookahead.try_register();
+            if (first && lookahead.consume(',') && !is_shift_name(lookahead.peek_word()))
+            {
+                Rn = *first;
+                reader = lookahead;
+            }
+        }
+
+        auto operand2 = arm_operand2(reader, operation);
+        return (operation << 21) | (set_flags << 20) | (Rn << 16) | (Rd << 12) | operand2;
+    }
+
+    /** LSL Rd, Rm, #n and the like are MOV Rd, Rm, LSL #n. */
+    uint32_t assemble_shift(OperandReader& reader, uint32_t type, bool set_flags)
+    {
+        auto Rd = reader.register_operand();
+        reader.expect(',');
+        auto Rm = reader.register_operand();
+        uint32_t shift = 3 << 5;
+
+        if (type != 4)
+        {
+            reader.expect(',');
+            if (auto Rs = reader.try_register())
+            {
+                shift = (*Rs << 8) | (type << 5) | 0x10;
+            }
+            else
+            {
+                auto amount = reader.immediate_in(0, type == 1 || type == 2 ? 32 : 31);
+                shift = amount ? ((amount & 0x1F) << 7) | (type << 5) : 0;
+            }
+        }
+        return 0x01A00000 | (set_flags << 20) | (Rd << 12) | shift | Rm;
+    }
+
+    /** Address operand of LDR/STR: [Rn, #-4]!, [Rn], Rm, LSL #2, or an address loaded PC relative. */
+    uint32_t assemble_single_data_transfer(OperandReader& reader, uint32_t address, bool load, bool byte, bool translated)
+    {
+        auto Rd = reader.register_operand();
+        reader.expect(',');
+        uint32_t opcode = 0x04000000 | (load << 20) | (byte << 22) | (Rd << 12);
+
+        if (!reader.consume('['))
+        {
+            if (translated)
+                reader.fail("T transfers can't be PC relative");
+            auto offset = reader.number() - (static_cast<int64_t>(address) + 8);
+            if (offset < -0xFFF || offset > 0xFFF)
+                reader.fail("Address out of range of PC");
+            return opcode | (1 << 24) | ((offset >= 0) << 23) | (15 << 16) | static_cast<uint32_t>(offset >= 0 ? offset : -offset);
+        }
+
+        opcode |= reader.register_operand() << 16;
+        bool pre_indexed = !reader.consume(']');
+        if (!pre_indexed && !reader.consume(','))
+        {
+            // [Rn]{!} is [Rn, #0]{!}, or [Rn], #0 for the T transfers which are always post indexed
+            if (translated)
+                return opcode | (1 << 23) | (1 << 21);
+            return opcode | (1 << 24) | (1 << 23) | (reader.consume('!') << 21);
+        }
+        if (pre_indexed)
+            reader.expect(',');
+
+        if (reader.consume('#'))
+        {
+            bool subtract = reader.consume('-');
+            auto offset = reader.number();
+            if (offset < 0 || offset > 0xFFF)
+                reader.fail("Offset out of range [-4095, 4095]");
+            opcode |= (!subtract << 23) | static_cast<uint32_t>(offset);
+        }
+        else
+        {
+            bool subtract = reader.consume('-');
+            if (!subtract)
+                reader.consume('+');
+            auto Rm = reader.register_operand();
+            opcode |= (1 << 25) | (!subtract << 23) | Rm;
+            if (reader.consume(','))
+                opcode |= arm_shift(reader, false);
+        }
+
+        if (pre_indexed)
+        {
+            if (translated)
+                reader.fail("T transfers must be post indexed");
+            reader.expect(']');
+            opcode |= (1 << 24) | (reader.consume('!') << 21);
+        }
+        else if (translated)
+        {
+            opcode |= 1 << 21;
+        }
+        return opcode;
+    }
+
+    /** LDRH/STRH/LDRSB/LDRSH, type 1 for H, 2 for SB and 3 for SH. */
+    uint32_t assemble_halfword_transfer(OperandReader& reader, bool load, uint32_t type)
+    {
+        if (!load && type != 1)
+            reader.fail("Only halfwords can be stored");
+
+        auto Rd = reader.register_operand();
+        reader.expect(',');
+        reader.expect('[');
+        uint32_t opcode = 0x00000090 | (load << 20) | (reader.register_operand() << 16) | (Rd << 12) | (type << 5);
+
+        bool pre_indexed = !reader.consume(']');
+        if (!pre_indexed && !reader.consume(','))
+            return opcode | (1 << 24) | (1 << 23) | (1 << 22) | (reader.consume('!') << 21);
+        if (pre_indexed)
+            reader.expect(',');
+
+        if (reader.consume('#'))
+        {
+            bool subtract = reader.consume('-');
+            auto offset = reader.number();
+            if (offset < 0 || offset > 0xFF)
+                reader.fail("Offset out of range [-255, 255]");
+            opcode |= (1 << 22) | (!subtract << 23) | ((offset & 0xF0) << 4) | (offset & 0x0F);
+        }
+        else
+        {
+            bool subtract = reader.consume('-');
+            if (!subtract)
+                reader.consume('+');
+            opcode |= (!subtract << 23) | reader.register_operand();
+        }
+
+        if (pre_indexed)
+        {
+            reader.expect(']');
+            opcode |= (1 << 24) | (reader.consume('!') << 21);
+        }
+        return opcode;
+    }
+
+    uint32_t assemble_block_data_transfer(OperandReader& reader, bool load, size_t mode)
+    {
+        // Stack modes: full/empty and descending/ascending stacks, whose P and U depend on load
+        constexpr std::array<uint32_t, 4> load_stack_modes = { 0, 1, 2, 3 }; // FA=DA, FD=IA, EA=DB, ED=IB
+        constexpr std::array<uint32_t, 4> store_stack_modes = { 3, 2, 1, 0 }; // FA=IB, FD=DB, EA=IA, ED=DA
+
+        uint32_t index;
+        if (mode < 4)
+            index = static_cast<uint32_t>(mode);
+        else if (mode < 8)
+            index = load ? load_stack_modes[mode - 4] : store_stack_modes[mode - 4];
+        else
+            index = 1; // IA
+
+        auto Rn = reader.register_operand();
+        bool write_back = reader.consume('!');
+        reader.expect(',');
+        auto list = reader.register_list();
+        bool user_bank = reader.consume('^');
+
+        return 0x08000000 | (index << 23) | (user_bank << 22) | (write_back << 21) | (load << 20) | (Rn << 16) | list;
+    }
+
+    uint32_t assemble_msr(OperandReader& reader)
+    {
+        auto name = reader.word();
+        auto field = name.substr(std::min<size_t>(4, name.size()));
+        auto psr = name.substr(0, 4);
+        bool spsr = equals_ignore_case(psr, "SPSR");
+        if (!spsr && !equals_ignore_case(psr, "CPSR"))
+            reader.fail("Expected CPSR or SPSR");
+
+        uint32_t mask = 0;
+        if (field.empty() || equals_ignore_case(field, "_all"))
+        {
+            mask = 0x9; // fc
+        }
+        else
+        {
+            if (field.front() != '_')
+                reader.fail("Expected the fields of the PSR");
+            for (auto c : field.substr(1))
+            {
+                switch (std::tolower(static_cast<unsigned char>(c)))
+                {
+                    case 'c': mask |= 0x1; break;
+                    case 'x': mask |= 0x2; break;
+                    case 's': mask |= 0x4; break;
+                    case 'f': mask |= 0x8; break;
+                    default: reader.fail("Expected the fields of the PSR");
+                }
+            }
+        }
+
+        reader.expect(',');
+        uint32_t opcode = 0x0120F000 | (spsr << 22) | (mask << 16);
+        if (auto Rm = reader.try_register())
+            return opcode | *Rm;
+
+        auto immediate = reader.word_immediate();
+        auto encoded = encode_arm_immediate(immediate);
+        if (!encoded)
+            reader.fail(fmt::format("Immediate {:#x} can't be encoded", immediate));
+        return opcode | (1 << 25) | *encoded;
+    }
+
+    uint32_t assemble_arm_operands(OperandReader& reader, const ArmMnemonic& mnemonic, size_t suffix, uint32_t address)
+    {
+        switch (mnemonic.syntax)
+        {
+            case ArmSyntax::DATA_PROCESSING:
+                return assemble_data_processing(reader, mnemonic.operation, suffix == 1);
+            case ArmSyntax::SHIFT:
+                return assemble_shift(reader, mnemonic.operation, suffix == 1);
+            case ArmSyntax::MULTIPLY:
+            {
+                auto Rd = reader.register_operand();
+                reader.expect(',');
+                auto Rm = reader.register_operand();
+                reader.expect(',');
+                auto Rs = reader.register_operand();
+                uint32_t Rn = 0;
+                if (mnemonic.operation)
+                {
+                    reader.expect(',');
+                    Rn = reader.register_operand();
+                }
+                return 0x00000090 | (mnemonic.operation << 21) | ((suffix == 1) << 20) | (Rd << 16) | (Rn << 12) | (Rs << 8) | Rm;
+            }
+            case ArmSyntax::MULTIPLY_LONG:
+            {
+                auto RdLo = reader.register_operand();
+                reader.expect(',');
+                auto RdHi = reader.register_operand();
+                reader.expect(',');
+                auto Rm = reader.register_operand();
+                reader.expect(',');
+                auto Rs = reader.register_operand();
+                return 0x00800090 | (mnemonic.operation << 21) | ((suffix == 1) << 20) | (RdHi << 16) | (RdLo << 12) | (Rs << 8) | Rm;
+            }
+            case ArmSyntax::SWAP:
+            {
+                auto Rd = reader.register_operand();
+                reader.expect(',');
+                auto Rm = reader.register_operand();
+                reader.expect(',');
+                reader.expect('[');
+                auto Rn = reader.register_operand();
+                reader.expect(']');
+                return 0x01000090 | ((suffix == 1) << 22) | (Rn << 16) | (Rd << 12) | Rm;
+            }
+            case ArmSyntax::TRANSFER:
+            {
+                bool load = mnemonic.operation;
+                if (suffix >= 4)
+                    return assemble_halfword_transfer(reader, load, static_cast<uint32_t>(suffix - 3));
+                return assemble_single_data_transfer(reader, address, load, suffix == 1 || suffix == 3, suffix == 2 || suffix == 3);
+            }
+            case ArmSyntax::BLOCK:
+                return assemble_block_data_transfer(reader, mnemonic.operation, suffix);
+            case ArmSyntax::PUSH_POP:
+            {
+                auto list = reader.register_list();
+                return (mnemonic.operation ? 0x08BD0000 : 0x092D0000) | list;
+            }
+            case ArmSyntax::BRANCH:
+            {
+                auto offset = branch_offset(reader, address + 8, 4, 24);
+                return 0x0A000000 | (mnemonic.operation << 24) | (static_cast<uint32_t>(offset) & 0x00FFFFFF);
+            }
+            case ArmSyntax::BX:
+                return 0x012FFF10 | reader.register_operand();
+            case ArmSyntax::SWI:
+            {
+                auto comment = reader.immediate(true);
+                if (comment < 0 || comment > 0xFFFFFF)
+                    reader.fail("Comment out of range");
+                return 0x0F000000 | static_cast<uint32_t>(comment);
+            }
+            case ArmSyntax::MRS:
+            {
+                auto Rd = reader.register_operand();
+                reader.expect(',');
+                auto psr = reader.word();
+                bool spsr = equals_ignore_case(psr, "SPSR");
+                if (!spsr && !equals_ignore_case(psr, "CPSR"))
+                    reader.fail("Expected CPSR or SPSR");
+                return 0x010F0000 | (spsr << 22) | (Rd << 12);
+            }
+            case ArmSyntax::MSR:
+                return assemble_msr(reader);
+            case ArmSyntax::ADR:
+            {
+                // ADD/SUB Rd, PC, #offset
+                auto Rd = reader.register_operand();
+                reader.expect(',');
+                auto offset = reader.number() - (static_cast<int64_t>(address) + 8);
+                auto encoded = encode_arm_immediate(static_cast<uint32_t>(offset >= 0 ? offset : -offset));
+                if (!encoded)
+                    reader.fail("Address can't be reached from PC");
+                return (offset >= 0 ? 0x028F0000 : 0x024F0000) | (Rd << 12) | *encoded;
+            }
+            case ArmSyntax::NOP:
+                return 0x01A00000; // MOV R0, R0
+        }
+        return 0;
+    }
+
+    // THUMB
+
+    /** Mnemonic without the S of the flag setting instructions, which is optional. */
+    std::string_view thumb_base_name(std::string_view mnemonic)
+    {
+        constexpr std::array<std::string_view, 16> flag_setting = {
+            "AND", "EOR", "LSL", "LSR", "ASR", "ADC", "SBC", "ROR",
+            "NEG", "ORR", "MUL", "BIC", "MVN", "ADD", "SUB", "MOV"
+        };
+        if (mnemonic.size() == 4 && mnemonic.back() == 'S'
+            && std::find(flag_setting.begin(), flag_setting.end(), mnemonic.substr(0, 3)) != flag_setting.end())
+            return mnemonic.substr(0, 3);
+        return mnemonic;
+    }
+
+    /** Operations of the ALU format, in encoding order. */
+    constexpr std::array<std::string_view, 16> thumb_alu_names = {
+        "AND", "EOR", "LSL", "LSR", "ASR", "ADC", "SBC", "ROR",
+        "TST", "NEG", "CMP", "CMN", "ORR", "MUL", "BIC", "MVN"
+    };
+
+    uint32_t thumb_alu(uint32_t operation, uint32_t Rd, uint32_t Rs)
+    {
+        return 0x4000 | (operation << 6) | (Rs << 3) | Rd;
+    }
+
+    /** ADD/CMP/MOV on any registers and BX. */
+    uint32_t thumb_hi_register(uint32_t operation, uint32_t Rd, uint32_t Rs)
+    {
+        return 0x4400 | (operation << 8) | ((Rd & 0x8) << 4) | (Rs << 3) | (Rd & 0x7);
+    }
+
+    /** Word offset of a THUMB instruction, multiple of scale and below 32 * scale. */
+    uint32_t scaled_offset(OperandReader& reader, int64_t offset, uint32_t scale, uint32_t count)
+    {
+        if (offset < 0 || offset % scale || offset >= int64_t(scale) * count)
+            reader.fail(fmt::format("Offset must be a multiple of {} in [0, {}]", scale, scale * (count - 1)));
+        return static_cast<uint32_t>(offset / scale);
+    }
+
+    uint32_t assemble_thumb_add_subtract(OperandReader& reader, bool subtract, bool set_flags)
+    {
+        auto Rd = reader.register_operand();
+        reader.expect(',');
+
+        if (Rd == 13 && !set_flags)
+        {
+            // ADD SP, #imm or ADD SP, SP, #imm
+            auto lookahead = reader;
+            if (lookahead.try_register() == 13u && lookahead.consume(','))
+                reader = lookahead;
+            if (reader.consume('#'))
+            {
+                auto offset = reader.number();
+                if (offset < 0)
+                    subtract = !subtract, offset = -offset;
+                return 0xB000 | (subtract << 7) | scaled_offset(reader, offset, 4, 128);
+            }
+        }
+
+        if (reader.consume('#'))
+        {
+            if (Rd > 7)
+                reader.fail("Expected a register between R0 and R7");
+            auto value = reader.number();
+            if (value < 0 || value > 0xFF)
+                reader.fail("Immediate out of range [0, 255]");
+            return 0x3000 | (subtract << 11) | (Rd << 8) | static_cast<uint32_t>(value);
+        }
+
+        auto Rs = reader.register_operand();
+        if (!reader.consume(','))
+        {
+            if (subtract || set_flags)
+            {
+                if (Rd > 7 || Rs > 7)
+                    reader.fail("Expected registers between R0 and R7");
+                return 0x1800 | (subtract << 9) | (Rs << 6) | (Rd << 3) | Rd;
+            }
+            return thumb_hi_register(0, Rd, Rs);
+        }
+
+        if (!subtract && (Rs == 13 || Rs == 15))
+        {
+            // ADD Rd, PC/SP, #imm
+            if (Rd > 7)
+                reader.fail("Expected a register between R0 and R7");
+            return 0xA000 | ((Rs == 13) << 11) | (Rd << 8) | scaled_offset(reader, reader.immediate(), 4, 256);
+        }
+
+        if (Rd > 7 || Rs > 7)
+            reader.fail("Expected registers between R0 and R7");
+        if (reader.consume('#'))
+        {
+            auto value = reader.number();
+            if (value >= 0 && value <= 7)
+                return 0x1C00 | (subtract << 9) | (static_cast<uint32_t>(value) << 6) | (Rs << 3) | Rd;
+            if (Rd == Rs && value >= 0 && value <= 0xFF)
+                return 0x3000 | (subtract << 11) | (Rd << 8) | static_cast<uint32_t>(value);
+            reader.fail("Immediate out of range [0, 7]");
+        }
+        return 0x1800 | (subtract << 9) | (reader.low_register() << 6) | (Rs << 3) | Rd;
+    }
+
+    /** Transfers from [Rb, Ro], [Rb, #imm], [SP, #imm] and [PC, #imm] or PC relative addresses. */
+    uint32_t assemble_thumb_transfer(OperandReader& reader, std::string_view name, uint32_t address)
+    {
+        // Names in the order of the register offset formats, STR to LDRSH
+        constexpr std::array<std::string_view, 8> names = { "STR", "STRB", "LDR", "LDRB", "STRH", "LDRSB", "LDRH", "LDRSH" };
+        auto found = std::find(names.begin(), names.end(), name);
+        if (found == names.end())
+            reader.fail("Unknown instruction");
+        auto index = static_cast<uint32_t>(found - names.begin());
+        bool load = name[0] == 'L';
+        bool word = name == "LDR" || name == "STR";
+
+        auto Rd = reader.low_register();
+        reader.expect(',');
+
+        if (!reader.consume('['))
+        {
+            if (name != "LDR")
+                reader.fail("Only LDR can be PC relative");
+            auto offset = reader.number() - static_cast<int64_t>((address + 4) & ~3u);
+            return 0x4800 | (Rd << 8) | scaled_offset(reader, offset, 4, 256);
+        }
+
+        auto Rb = reader.register_operand();
+        int64_t offset = 0;
+        if (reader.consume(','))
+        {
+            if (auto Ro = reader.try_register())
+            {
+                reader.expect(']');
+                if (Rb > 7 || *Ro > 7)
+                    reader.fail("Expected registers between R0 and R7");
+                return (index < 4 ? 0x5000 : 0x5200) | ((index & 3) << 10) | (*Ro << 6) | (Rb << 3) | Rd;
+            }
+            offset = reader.immediate();
+        }
+        reader.expect(']');
+
+        if (Rb == 15 || Rb == 13)
+        {
+            if (!word || (Rb == 15 && !load))
+                reader.fail("Invalid base register");
+            if (Rb == 15)
+                return 0x4800 | (Rd << 8) | scaled_offset(reader, offset, 4, 256);
+            return 0x9000 | (load << 11) | (Rd << 8) | scaled_offset(reader, offset, 4, 256);
+        }
+        if (Rb > 7)
+            reader.fail("Expected a register between R0 and R7");
+
+        if (word)
+            return 0x6000 | (load << 11) | (scaled_offset(reader, offset, 4, 32) << 6) | (Rb << 3) | Rd;
+        if (name == "LDRB" || name == "STRB")
+            return 0x7000 | (load << 11) | (scaled_offset(reader, offset, 1, 32) << 6) | (Rb << 3) | Rd;
+        if (name == "LDRH" || name == "STRH")
+            return 0x8000 | (load << 11) | (scaled_offset(reader, offset, 2, 32) << 6) | (Rb << 3) | Rd;
+        reader.fail("Signed loads only take a register offset");
+    }
+
+    AssembledInstruction assemble_thumb_operands(OperandReader& reader, std::string_view mnemonic, uint32_t address)
+    {
+        auto name = thumb_base_name(mnemonic);
+        bool set_flags = name.size() != mnemonic.size();
+
+        if (name == "ADD" || name == "SUB")
+            return { assemble_thumb_add_subtract(reader, name == "SUB", set_flags), 2 };
+
+        if (name == "MOV" || name == "CMP")
+        {
+            auto Rd = reader.register_operand();
+            reader.expect(',');
+            if (reader.consume('#'))
+            {
+                if (Rd > 7)
+                    reader.fail("Expected a register between R0 and R7");
+                auto value = reader.number();
+                if (value < 0 || value > 0xFF)
+                    reader.fail("Immediate out of range [0, 255]");
+                return { (name == "MOV" ? 0x2000u : 0x2800u) | (Rd << 8) | static_cast<uint32_t>(value), 2 };
+            }
+
+            auto Rs = reader.register_operand();
+            if (Rd < 8 && Rs < 8)
+            {
+                if (name == "CMP")
+                    return { thumb_alu(0xA, Rd, Rs), 2 };
+                if (set_flags)
+                    return { (Rs << 3) | Rd, 2 }; // LSLS Rd, Rs, #0
+            }
+            else if (set_flags)
+            {
+                reader.fail("Expected registers between R0 and R7");
+            }
+            return { thumb_hi_register(name == "MOV" ? 2 : 1, Rd, Rs), 2 };
+        }
+
+        auto alu = std::find(thumb_alu_names.begin(), thumb_alu_names.end(), name);
+        if (alu != thumb_alu_names.end())
+        {
+            auto operation = static_cast<uint32_t>(alu - thumb_alu_names.begin());
+            auto Rd = reader.low_register();
+            reader.expect(',');
+            auto Rs = reader.low_register();
+
+            if (operation >= 2 && operation <= 4 && reader.consume(','))
+            {
+                // LSLS/LSRS/ASRS Rd, Rs, #imm
+                auto amount = reader.immediate_in(0, operation == 2 ? 31 : 32);
+                return { ((operation - 2) << 11) | ((amount & 0x1F) << 6) | (Rs << 3) | Rd, 2 };
+            }
+            if (operation == 0xD && reader.consume(','))
+            {
+                // MULS Rd, Rm, Rd
+                if (reader.low_register() != Rd)
+                    reader.fail("MUL must write to its last operand");
+            }
+            return { thumb_alu(operation, Rd, Rs), 2 };
+        }
+
+        if (name == "BX")
+            return { thumb_hi_register(3, 0, reader.register_operand()), 2 };
+
+        if (name.substr(0, 3) == "LDR" || name.substr(0, 3) == "STR")
+            return { assemble_thumb_transfer(reader, name, address), 2 };
+
+        if (name == "PUSH" || name == "POP")
+        {
+            bool pop = name == "POP";
+            auto list = reader.register_list();
+            uint32_t extra = pop ? 1 << 15 : 1 << 14;
+            if (list & ~(0xFF | extra))
+                reader.fail(pop ? "POP takes R0-R7 and PC" : "PUSH takes R0-R7 and LR");
+            return { 0xB400u | (pop << 11) | ((list & extra) ? 0x100 : 0) | (list & 0xFF), 2 };
+        }
+
+        if (name == "LDMIA" || name == "STMIA" || name == "LDM" || name == "STM")
+        {
+            auto Rb = reader.low_register();
+            reader.expect('!');
+            reader.expect(',');
+            auto list = reader.register_list();
+            if (list & ~0xFF)
+                reader.fail("Only R0-R7 can be transferred");
+            return { 0xC000 | ((name[0] == 'L') << 11) | (Rb << 8) | list, 2 };
+        }
+
+        if (name == "SWI" || name == "SVC")
+        {
+            auto comment = reader.immediate(true);
+            if (comment < 0 || comment > 0xFF)
+                reader.fail("Comment out of range [0, 255]");
+            return { 0xDF00 | static_cast<uint32_t>(comment), 2 };
+        }
+
+        if (name == "BL")
+        {
+            auto offset = static_cast<uint32_t>(branch_offset(reader, address + 4, 2, 22));
+            uint32_t high = 0xF000 | ((offset >> 11) & 0x7FF);
+            uint32_t low = 0xF800 | (offset & 0x7FF);
+            return { high | (low << 16), 4 };
+        }
+
+        if (name[0] == 'B')
+        {
+            auto condition = parse_condition(name.substr(1));
+            if (!condition)
+                reader.fail("Unknown instruction");
+            if (*condition == condition_always)
+                return { 0xE000 | (static_cast<uint32_t>(branch_offset(reader, address + 4, 2, 11)) & 0x7FF), 2 };
+            return { 0xD000 | (*condition << 8) | (static_cast<uint32_t>(branch_offset(reader, address + 4, 2, 8)) & 0xFF), 2 };
+        }
+
+        if (name == "ADR")
+        {
+            // ADD Rd, PC, #offset
+            auto Rd = reader.low_register();
+            reader.expect(',');
+            auto offset = reader.number() - static_cast<int64_t>((address + 4) & ~3u);
+            return { 0xA000 | (Rd << 8) | scaled_offset(reader, offset, 4, 256), 2 };
+        }
+
+        if (name == "NOP")
+            return { 0x46C0, 2 }; // MOV R8, R8
+
+        reader.fail("Unknown instruction");
+    }
+
+    std::string_view trim(std::string_view text)
+    {
+        auto begin = text.find_first_not_of(" \t\r");
+        if (begin == std::string_view::npos)
+            return {};
+        return text.substr(begin, text.find_last_not_of(" \t\r") - begin + 1);
+    }
+
+    /** Comma separated values of a data directive. */
+    std::vector<std::string_view> split_values(std::string_view text)
+    {
+        std::vector<std::string_view> values;
+        for (;;)
+        {
+            auto comma = text.find(',');
+            auto value = trim(text.substr(0, comma));
+            if (value.empty())
+                throw std::runtime_error{ "Expected a value" };
+            values.push_back(value);
+            if (comma == std::string_view::npos)
+                return values;
+            text.remove_prefix(comma + 1);
+        }
+    }
+
+    int64_t evaluate(std::string_view expression, const SymbolTable& symbols)
+    {
+        OperandReader reader{ expression, {}, &symbols };
+        auto value = reader.number();
+        reader.finish();
+        return value;
+    }
+
+    /** Whether the symbols the expression names are all defined yet. */
+    bool is_defined(std::string_view expression, const SymbolTable& symbols)
+    {
+        size_t i = 0;
+        while (i < expression.size())
+        {
+            size_t length = 0;
+            while (i + length < expression.size() && is_name_character(expression[i + length]))
+                length++;
+            auto name = expression.substr(i, length);
+            if (!name.empty() && !std::isdigit(static_cast<unsigned char>(name[0])) && symbols.find(name) == symbols.end())
+                return false;
+            i += std::max<size_t>(length, 1);
+        }
+        return true;
+    }
+
+    /** Statement of a program, laid out by the first pass and encoded by the second. */
+    struct Statement
+    {
+        enum class Kind : uint8_t { INSTRUCTION, DATA, PADDING };
+
+        Kind kind;
+        InstructionSet set;
+        uint32_t line;
+        uint32_t address;
+        uint32_t size;          // In bytes
+        uint32_t unit;          // Size of each value of DATA
+        std::string text;       // Instruction or values of DATA
+    };
+
+    /**
+     * First pass of assemble_program: gives every statement its address, every label its value
+     * and every literal its slot in a pool.
+     */
+    class ProgramLayout
+    {
+    public:
+        ProgramLayout(uint32_t origin, InstructionSet set, SymbolTable& symbols)
+            : address(origin),
+              set(set),
+              symbols(symbols)
+        {
+        }
+
+        void add(std::string_view text, uint32_t line)
+        {
+            // Any number of labels may precede the statement
+            text = trim(text);
+            for (;;)
+            {
+                size_t length = 0;
+                while (length < text.size() && is_name_character(text[length]))
+                    length++;
+                auto rest = trim(text.substr(length));
+                if (length == 0 || rest.empty() || rest.front() != ':')
+                    break;
+                define(text.substr(0, length), address);
+                text = trim(rest.substr(1));
+            }
+            if (text.empty())
+                return;
+
+            auto name_end = std::min(text.find_first_of(" \t="), text.size());
+            auto name = text.substr(0, name_end);
+            auto operands = trim(text.substr(name_end));
+            if (name.front() == '.')
+                directive(name, operands, line);
+            else if (!operands.empty() && operands.front() == '=')
+                define(name, evaluate(trim(operands.substr(1)), symbols));
+            else
+                instruction(text, line);
+        }
+
+        /** Places the literals loaded since the last pool. */
+        void place_pool(uint32_t line)
+        {
+            if (literals.empty())
+                return;
+
+            align(4, line);
+            for (size_t i = 0; i < literals.size(); i++)
+            {
+                for (auto load : literal_loads[i])
+                    statements[load].text += fmt::format("{:#x}", address);
+                push({ Statement::Kind::DATA, set, statements[literal_loads[i].front()].line, address, 4, 4, literals[i] });
+            }
+            literals.clear();
+            literal_loads.clear();
+        }
+
+        std::vector<Statement> statements;
+        uint32_t address;
+    private:
+        void define(std::string_view name, int64_t value)
+        {
+            if (std::isdigit(static_cast<unsigned char>(name.front())) || register_number(name) >= 0)
+                throw std::runtime_error{ fmt::format("{} can't name a symbol", name) };
+            if (!symbols.emplace(name, static_cast<uint32_t>(value)).second)
+                throw std::runtime_error{ fmt::format("Symbol {} is already defined", name) };
+        }
+
+        void directive(std::string_view name, std::string_view operands, uint32_t line)
+        {
+            if (equals_ignore_case(name, ".arm") || (equals_ignore_case(name, ".code") && operands == "32"))
+                set = InstructionSet::ARM;
+            else if (equals_ignore_case(name, ".thumb") || (equals_ignore_case(name, ".code") && operands == "16"))
+                set = InstructionSet::THUMB;
+            else if (equals_ignore_case(name, ".word"))
+                data(4, operands, line);
+            else if (equals_ignore_case(name, ".hword"))
+                data(2, operands, line);
+            else if (equals_ignore_case(name, ".byte"))
+                data(1, operands, line);
+            else if (equals_ignore_case(name, ".align"))
+            {
+                auto boundary = operands.empty() ? 4 : evaluate(operands, symbols);
+                if (boundary <= 0 || boundary > 0x10000 || (boundary & (boundary - 1)))
+                    throw std::runtime_error{ "Alignment must be a power of 2" };
+                align(static_cast<uint32_t>(boundary), line);
+            }
+            else if (equals_ignore_case(name, ".equ"))
+            {
+                auto comma = operands.find(',');
+                if (comma == std::string_view::npos)
+                    throw std::runtime_error{ "Expected .equ name, value" };
+                define(trim(operands.substr(0, comma)), evaluate(operands.substr(comma + 1), symbols));
+            }
+            else if (equals_ignore_case(name, ".pool") || equals_ignore_case(name, ".ltorg"))
+                place_pool(line);
+            else
+                throw std::runtime_error{ fmt::format("Unknown directive {}", name) };
+        }
+
+        void data(uint32_t unit, std::string_view operands, uint32_t line)
+        {
+            auto count = static_cast<uint32_t>(split_values(operands).size());
+            push({ Statement::Kind::DATA, set, line, address, unit * count, unit, std::string{ operands } });
+        }
+
+        void align(uint32_t boundary, uint32_t line)
+        {
+            auto padding = (0u - address) & (boundary - 1);
+            if (padding)
+                push({ Statement::Kind::PADDING, set, line, address, padding, 1, {} });
+        }
+
+        void instruction(std::string_view text, uint32_t line)
+        {
+            auto split = split_instruction(text);
+            uint32_t size = set == InstructionSet::ARM || split.mnemonic == "BL" ? 4 : 2;
+            if (address % (set == InstructionSet::ARM ? 4 : 2))
+                throw std::runtime_error{ fmt::format("Misaligned {} instruction, use .align", set == InstructionSet::ARM ? "ARM" : "THUMB") };
+
+            auto equals = text.find('=');
+            if (equals == std::string_view::npos)
+            {
+                push({ Statement::Kind::INSTRUCTION, set, line, address, size, size, std::string{ text } });
+                return;
+            }
+
+            // LDR Rd, =value
+            std::string_view mnemonic = split.mnemonic;
+            auto condition = mnemonic.substr(0, 3) == "LDR" ? parse_condition(mnemonic.substr(3)) : std::nullopt;
+            if (!condition || (set == InstructionSet::THUMB && mnemonic != "LDR"))
+                throw std::runtime_error{ fmt::format("Only LDR loads literals: {}", text) };
+
+            auto load = std::string{ text.substr(0, equals) };
+            auto expression = trim(text.substr(equals + 1));
+            if (set == InstructionSet::ARM && is_defined(expression, symbols))
+            {
+                // A constant an immediate can hold doesn't need the pool
+                auto value = static_cast<uint32_t>(evaluate(expression, symbols));
+                if (encode_arm_immediate(value) || encode_arm_immediate(~value))
+                {
+                    load.replace(0, 3, "MOV");
+                    push({ Statement::Kind::INSTRUCTION, set, line, address, size, size, fmt::format("{}#{:#x}", load, value) });
+                    return;
+                }
+            }
+
+            auto found = std::find(literals.begin(), literals.end(), expression);
+            if (found == literals.end())
+            {
+                literals.emplace_back(expression);
+                literal_loads.emplace_back();
+                found = literals.end() - 1;
+            }
+            literal_loads[found - literals.begin()].push_back(statements.size());
+            push({ Statement::Kind::INSTRUCTION, set, line, address, size, size, load });
+        }
+
+        void push(Statement statement)
+        {
+            address += statement.size;
+            statements.push_back(std::move(statement));
+        }
+
+        InstructionSet set;
+        SymbolTable& symbols;
+        std::vector<std::string> literals;              // Pending, by expression
+        std::vector<std::vector<size_t>> literal_loads; // Statements loading each literal
+    };
+
+    /** Second pass of assemble_program. */
+    void encode(const Statement& statement, AssembledProgram& program)
+    {
+        auto output = program.bytes.data() + (statement.address - program.origin);
+        auto store = [&](uint32_t value, uint32_t size)
+        {
+            for (uint32_t i = 0; i < size; i++)
+                *output++ = static_cast<uint8_t>(value >> (8 * i));
+        };
+
+        switch (statement.kind)
+        {
+            case Statement::Kind::INSTRUCTION:
+            {
+                auto assembled = assemble(statement.text, statement.address, statement.set, &program.symbols);
+                store(assembled.opcode, assembled.size);
+                program.instructions.push_back({ statement.address, statement.set, assembled });
+                break;
+            }
+            case Statement::Kind::DATA:
+                for (auto value : split_values(statement.text))
+                {
+                    auto number = evaluate(value, program.symbols);
+                    auto bits = 8 * statement.unit;
+                    if (number < -(int64_t(1) << (bits - 1)) || number >= (int64_t(1) << bits))
+                        throw std::runtime_error{ fmt::format("{} doesn't fit in {} bits", value, bits) };
+                    store(static_cast<uint32_t>(number), statement.unit);
+                }
+                break;
+            case Statement::Kind::PADDING:
+                break;
+        }
+    }
+}
+
+AssembledInstruction assemble_arm(std::string_view text, uint32_t address, const SymbolTable* symbols)
+{
+    auto instruction = split_instruction(text);
+    std::string_view mnemonic = instruction.mnemonic;
+
+    for (auto& candidate : arm_mnemonics)
+    {
+        if (mnemonic.substr(0, candidate.name.size()) != candidate.name)
+            continue;
+        auto suffixes = match_arm_suffixes(candidate.syntax, mnemonic.substr(candidate.name.size()));
+        if (!suffixes)
+            continue;
+
+        OperandReader reader{ instruction.operands, text, symbols };
+        auto opcode = assemble_arm_operands(reader, candidate, suffixes->suffix, address);
+        reader.finish();
+        return { (suffixes->condition << 28) | opcode, 4 };
+    }
+
+    throw std::runtime_error{ fmt::format("Unknown instruction: {}", text) };
+}
+
+AssembledInstruction assemble_thumb(std::string_view text, uint32_t address, const SymbolTable* symbols)
+{
+    auto instruction = split_instruction(text);
+    OperandReader reader{ instruction.operands, text, symbols };
+    auto assembled = assemble_thumb_operands(reader, instruction.mnemonic, address);
+    reader.finish();
+    return assembled;
+}
+
+AssembledInstruction assemble(std::string_view text, uint32_t address, InstructionSet set, const SymbolTable* symbols)
+{
+    if (set == InstructionSet::ARM)
+        return assemble_arm(text, address, symbols);
+    else
+        return assemble_thumb(text, address, symbols);
+}
+
+AssembledProgram assemble_program(std::string_view source, uint32_t origin, InstructionSet set)
+{
+    AssembledProgram program;
+    program.origin = origin;
+    ProgramLayout layout{ origin, set, program.symbols };
+
+    uint32_t line_number = 0;
+    while (!source.empty())
+    {
+        auto line_end = source.find('\n');
+        auto line = source.substr(0, line_end);
+        source.remove_prefix(line_end == std::string_view::npos ? source.size() : line_end + 1);
+        line_number++;
+
+        line = line.substr(0, std::min(line.find('@'), line.find("//")));
+        try
+        {
+            for (;;)
+            {
+                auto separator = line.find(';');
+                layout.add(line.substr(0, separator), line_number);
+                if (separator == std::string_view::npos)
+                    break;
+                line.remove_prefix(separator + 1);
+            }
+        }
+        catch (std::runtime_error& e)
+        {
+            throw std::runtime_error{ fmt::format("Line {}: {}", line_number, e.what()) };
+        }
+    }
+    layout.place_pool(line_number);
+
+    program.bytes.resize(layout.address - origin);
+    for (auto& statement : layout.statements)
+    {
+        try
+        {
+            encode(statement, program);
+        }
+        catch (std::runtime_error& e)
+        {
+            throw std::runtime_error{ fmt::format("Line {}: {}", statement.line, e.what()) };
+        }
+    }
+    return program;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "decoder.h"
+
+/** Values of the labels and constants of a program. */
+typedef std::map<std::string, uint32_t, std::less<>> SymbolTable;
+
+/**
+ * @brief An assembled instruction.
+ */
+struct AssembledInstruction
+{
+    uint32_t opcode;    // THUMB BL holds its first halfword in the low half
+    uint32_t size;      // In bytes, 4 for ARM and THUMB BL, 2 for the other THUMB instructions
+};
+
+/**
+ * @brief Assembles one ARM instruction.
+ *
+ * Reads the syntax disassemble_arm writes, so disassembled instructions assemble back. Case is
+ * ignored, immediates may be decimal or negative and branch targets are absolute addresses.
+ * Also accepted: the pre-UAL suffix order (ADDEQS, LDREQB), two operand data processing
+ * (ADD R0, #1), LSL/LSR/ASR/ROR/RRX as instructions, PUSH/POP, the stack modes of LDM/STM,
+ * SVC, NOP and LDR Rd, address for PC relative loads. An immediate that can't be encoded is
+ * tried on the complementary instruction, MOV R0, #-1 is assembled as MVN R0, #0.
+ *
+ * Values are numbers or symbols, added and subtracted: loop, table+8, end-start. ADR Rd, label
+ * assembles to an ADD or SUB from PC.
+ *
+ * @param text The instruction.
+ * @param address Address the instruction is assembled at.
+ * @param symbols Values of the symbols the operands name, if any.
+ * @throws std::runtime_error If the instruction is invalid or can't be encoded.
+ */
+AssembledInstruction assemble_arm(std::string_view text, uint32_t address, const SymbolTable* symbols = nullptr);
+
+/**
+ * @brief Assembles one THUMB instruction.
+ *
+ * Reads the syntax disassemble_thumb writes. The S of the flag setting instructions is optional,
+ * except for MOVS Rd, Rs and ADDS Rd, Rs which, on low registers, pick the flag setting encodings
+ * over the high register ones. BL assembles to both of its halfwords.
+ *
+ * @throws std::runtime_error If the instruction is invalid or can't be encoded.
+ */
+AssembledInstruction assemble_thumb(std::string_view text, uint32_t address, const SymbolTable* symbols = nullptr);
+
+AssembledInstruction assemble(std::string_view text, uint32_t address, InstructionSet set, const SymbolTable* symbols = nullptr);
+
+/**
+ * @brief Instruction of an assembled program.
+ */
+struct ProgramInstruction
+{
+    uint32_t address;
+    InstructionSet set;
+    AssembledInstruction instruction;
+};
+
+/**
+ * @brief Machine code of a program and the symbols it defined.
+ */
+struct AssembledProgram
+{
+    uint32_t origin = 0;
+    std::vector<uint8_t> bytes;
+    std::vector<ProgramInstruction> instructions;
+    SymbolTable symbols;
+};
+
+/**
+ * @brief Assembles a program in two passes: the first one lays out the statements and gives
+ * the labels their address, the second one encodes them.
+ *
+ * One statement per line, or separated by ;. @ and // start comments.
+ *      label:                  Address of the next statement, several may precede it
+ *      .arm / .thumb           Instruction set of the statements that follow (.code 32/16 too)
+ *      .word / .hword / .byte  Comma separated values
+ *      .align [n]              Pads with zeros up to a multiple of n bytes, 4 by default
+ *      .equ name, value        Constant, also written name = value. Only earlier symbols may be used
+ *      LDR Rd, =value          Loads value from the literal pool. ARM loads a constant that fits
+ *                              an immediate with MOV or MVN instead
+ *      .pool / .ltorg          Places the pending literals here, the rest go after the program
+ *
+ * Literals with the same text share their slot of the pool. A pool must be within reach of
+ * its loads: 4KB either way for ARM, 1KB forward for THUMB.
+ *
+ * @param source The program.
+ * @param origin Address of the first statement.
+ * @param set Instruction set the program starts in.
+ * @throws std::runtime_error On the first error, quoting its line.
+ */
+AssembledProgram assemble_program(std::string_view source, uint32_t origin, InstructionSet set);
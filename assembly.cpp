@@ -1,24 +1,372 @@
 #include "assembly.h"
-#include "GBA_Cpu.h"
-#include <fmt/core.h>
+#include "decoder.h"
+#include "bit_utils.h"
 
-std::string disassemble_register_name(uint8_t register_number)
+namespace
 {
-    if (register_number == 15)
+    const char* const register_names[16] = {
+        "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7",
+        "R8", "R9", "R10", "R11", "R12", "SP", "LR", "PC"
+    };
+
+    const char* const shift_names[4] = { "LSL", "LSR", "ASR", "ROR" };
+
+    const char* const arm_alu_names[16] = {
+        "AND", "EOR", "SUB", "RSB", "ADD", "ADC", "SBC", "RSC",
+        "TST", "TEQ", "CMP", "CMN", "ORR", "MOV", "BIC", "MVN"
+    };
+
+    const char* const thumb_alu_names[16] = {
+        "ANDS", "EORS", "LSLS", "LSRS", "ASRS", "ADCS", "SBCS", "RORS",
+        "TST", "NEGS", "CMP", "CMN", "ORRS", "MULS", "BICS", "MVNS"
+    };
+
+    /*
+     * Appends text to a fixed buffer. Writes past the end are dropped, the buffer is
+     * always left null terminated.
+     */
+    class TextWriter
     {
-        return "PC";
+    public:
+        TextWriter(char* buffer, size_t size)
+            : begin(buffer), out(buffer), end(buffer + (size ? size - 1 : 0)), capacity(size)
+        {
+        }
+
+        size_t finish()
+        {
+            if (capacity)
+                *out = '\0';
+            return out - begin;
+        }
+
+        void put(char c)
+        {
+            if (out < end)
+                *out++ = c;
+        }
+
+        void put(const char* text)
+        {
+            while (*text)
+                put(*text++);
+        }
+
+        void put_hex(uint32_t value)
+        {
+            put("0x");
+            int digit = 28;
+            while (digit > 0 && ((value >> digit) & 0xF) == 0)
+                digit -= 4;
+            for (; digit >= 0; digit -= 4)
+                put("0123456789abcdef"[(value >> digit) & 0xF]);
+        }
+
+        void put_decimal(uint32_t value)
+        {
+            char digits[10];
+            int count = 0;
+            do
+            {
+                digits[count++] = '0' + value % 10;
+                value /= 10;
+            } while (value);
+            while (count)
+                put(digits[--count]);
+        }
+
+        void put_immediate(uint32_t value)
+        {
+            put('#');
+            put_hex(value);
+        }
+
+        void put_signed_immediate(bool add, uint32_t value)
+        {
+            put('#');
+            if (!add)
+                put('-');
+            put_hex(value);
+        }
+
+        void put_register(uint32_t number)
+        {
+            put(register_names[number & 0x0F]);
+        }
+
+        void put_separator()
+        {
+            put(", ");
+        }
+
+        void put_mnemonic(const char* name, uint8_t condition, const char* suffix = "")
+        {
+            put(name);
+            put(suffix);
+            put(disasemble_condition(condition));
+            put(' ');
+        }
+
+        /* Register list of LDM/STM/PUSH/POP, consecutive registers are collapsed: {R0-R3, LR} */
+        void put_register_list(uint16_t list)
+        {
+            put('{');
+            bool first = true;
+            for (uint32_t i = 0; i < 16; i++)
+            {
+                if (!((list >> i) & 1))
+                    continue;
+
+                uint32_t last = i;
+                while (last < 15 && ((list >> (last + 1)) & 1))
+                    last++;
+
+                if (!first)
+                    put_separator();
+                put_register(i);
+                if (last > i + 1)
+                {
+                    put('-');
+                    put_register(last);
+                }
+                else if (last == i + 1)
+                {
+                    put_separator();
+                    put_register(last);
+                }
+
+                first = false;
+                i = last;
+            }
+            put('}');
+        }
+
+    private:
+        char* begin;
+        char* out;
+        char* end;
+        size_t capacity;
+    };
+
+    /* Shifted register operand: Rm / Rm, LSL #n / Rm, LSL Rs / Rm, RRX */
+    void put_shifted_register(TextWriter& text, uint32_t opcode, bool allow_register_shift)
+    {
+        uint32_t type = (opcode >> 5) & 0x03;
+        text.put_register(opcode);
+
+        if (allow_register_shift && (opcode & 0x10))
+        {
+            text.put_separator();
+            text.put(shift_names[type]);
+            text.put(' ');
+            text.put_register(opcode >> 8);
+            return;
+        }
+
+        uint32_t amount = (opcode >> 7) & 0x1F;
+        if (amount == 0)
+        {
+            if (type == 0) // LSL #0
+                return;
+            if (type == 3)
+            {
+                text.put(", RRX");
+                return;
+            }
+            amount = 32; // LSR #0 and ASR #0 encode LSR #32 and ASR #32
+        }
+
+        text.put_separator();
+        text.put(shift_names[type]);
+        text.put(" #");
+        text.put_decimal(amount);
     }
-    else if (register_number == 14)
+
+    void disassemble_data_processing(TextWriter& text, uint32_t opcode, uint8_t condition)
     {
-        return "LR";
+        uint32_t operation = (opcode >> 21) & 0x0F;
+        bool _I = (opcode >> 25) & 1;
+        bool _S = (opcode >> 20) & 1;
+        bool is_test = operation >= 0x8 && operation <= 0xB; // TST, TEQ, CMP, CMN
+        bool is_move = operation == 0xD || operation == 0xF; // MOV, MVN
+
+        text.put_mnemonic(arm_alu_names[operation], condition, _S && !is_test ? "S" : "");
+
+        if (!is_test)
+        {
+            text.put_register(opcode >> 12);
+            text.put_separator();
+        }
+        if (!is_move)
+        {
+            text.put_register(opcode >> 16);
+            text.put_separator();
+        }
+
+        if (_I)
+            text.put_immediate(rotr32_shiftsq(opcode & 0xFF, (opcode >> 8) & 0x0F));
+        else
+            put_shifted_register(text, opcode, true);
     }
-    else if (register_number == 13)
+
+    /* [Rn, offset]{!} or [Rn], offset. offset is written by put_offset. */
+    template<class OffsetWriter>
+    void put_address(TextWriter& text, uint32_t opcode, bool has_offset, OffsetWriter put_offset)
     {
-        return "SP";
+        bool _P = (opcode >> 24) & 1;
+        bool _W = (opcode >> 21) & 1;
+
+        text.put('[');
+        text.put_register(opcode >> 16);
+        if (_P)
+        {
+            if (has_offset)
+            {
+                text.put_separator();
+                put_offset();
+            }
+            text.put(']');
+            if (_W)
+                text.put('!');
+        }
+        else
+        {
+            text.put("], ");
+            put_offset();
+        }
     }
-    else
+
+    void disassemble_single_data_transfer(TextWriter& text, uint32_t opcode, uint8_t condition)
+    {
+        bool _I = (opcode >> 25) & 1; // 1=Register 0=Immediate
+        bool _P = (opcode >> 24) & 1;
+        bool _U = (opcode >> 23) & 1;
+        bool _B = (opcode >> 22) & 1;
+        bool _W = (opcode >> 21) & 1;
+        bool _L = (opcode >> 20) & 1;
+
+        const char* suffix = _B ? (!_P && _W ? "BT" : "B") : (!_P && _W ? "T" : "");
+        text.put_mnemonic(_L ? "LDR" : "STR", condition, suffix);
+        text.put_register(opcode >> 12);
+        text.put_separator();
+
+        put_address(text, opcode, _I || (opcode & 0xFFF) != 0, [&]()
+        {
+            if (_I)
+            {
+                if (!_U)
+                    text.put('-');
+                put_shifted_register(text, opcode, false);
+            }
+            else
+            {
+                text.put_signed_immediate(_U, opcode & 0xFFF);
+            }
+        });
+    }
+
+    void disassemble_halfword_transfer(TextWriter& text, uint32_t opcode, uint8_t condition)
+    {
+        bool _U = (opcode >> 23) & 1;
+        bool _I = (opcode >> 22) & 1; // 1=Immediate 0=Register
+        bool _L = (opcode >> 20) & 1;
+        uint32_t type = (opcode >> 5) & 0x03; // 1=H 2=SB 3=SH
+        uint32_t offset = ((opcode >> 4) & 0xF0) | (opcode & 0x0F);
+
+        if (!_L && type != 1) // LDRD/STRD are ARMv5
+        {
+            text.put("UND");
+            return;
+        }
+
+        const char* suffixes[4] = { "", "H", "SB", "SH" };
+        text.put_mnemonic(_L ? "LDR" : "STR", condition, suffixes[type]);
+        text.put_register(opcode >> 12);
+        text.put_separator();
+
+        put_address(text, opcode, !_I || offset != 0, [&]()
+        {
+            if (_I)
+            {
+                text.put_signed_immediate(_U, offset);
+            }
+            else
+            {
+                if (!_U)
+                    text.put('-');
+                text.put_register(opcode);
+            }
+        });
+    }
+
+    void disassemble_block_data_transfer(TextWriter& text, uint32_t opcode, uint8_t condition)
+    {
+        const char* modes[4] = { "DA", "IA", "DB", "IB" };
+        bool _S = (opcode >> 22) & 1;
+        bool _W = (opcode >> 21) & 1;
+        bool _L = (opcode >> 20) & 1;
+
+        text.put_mnemonic(_L ? "LDM" : "STM", condition, modes[(opcode >> 23) & 0x03]);
+        text.put_register(opcode >> 16);
+        if (_W)
+            text.put('!');
+        text.put_separator();
+        text.put_register_list(opcode & 0xFFFF);
+        if (_S)
+            text.put('^');
+    }
+
+    void disassemble_coprocessor(TextWriter& text, uint32_t opcode, uint8_t condition, ArmInstruction instruction)
     {
-        return 'R' + std::to_string(register_number);
+        bool _L = (opcode >> 20) & 1;
+        auto put_coprocessor_register = [&](uint32_t number)
+        {
+            text.put('c');
+            text.put_decimal(number & 0x0F);
+        };
+
+        if (instruction == ArmInstruction::CoprocessorTransfer)
+        {
+            bool _N = (opcode >> 22) & 1;
+            text.put_mnemonic(_L ? "LDC" : "STC", condition, _N ? "L" : "");
+        }
+        else if (instruction == ArmInstruction::CoprocessorRegister)
+        {
+            text.put_mnemonic(_L ? "MRC" : "MCR", condition);
+        }
+        else
+        {
+            text.put_mnemonic("CDP", condition);
+        }
+
+        text.put('p');
+        text.put_decimal((opcode >> 8) & 0x0F);
+        text.put_separator();
+
+        if (instruction == ArmInstruction::CoprocessorTransfer)
+        {
+            put_coprocessor_register(opcode >> 12);
+            text.put_separator();
+            put_address(text, opcode, (opcode & 0xFF) != 0, [&]()
+            {
+                text.put_signed_immediate((opcode >> 23) & 1, (opcode & 0xFF) * 4);
+            });
+            return;
+        }
+
+        bool is_register = instruction == ArmInstruction::CoprocessorRegister;
+        text.put_decimal(is_register ? (opcode >> 21) & 0x07 : (opcode >> 20) & 0x0F);
+        text.put_separator();
+        if (is_register)
+            text.put_register(opcode >> 12);
+        else
+            put_coprocessor_register(opcode >> 12);
+        text.put_separator();
+        put_coprocessor_register(opcode >> 16);
+        text.put_separator();
+        put_coprocessor_register(opcode);
+        text.put_separator();
+        text.put_decimal((opcode >> 5) & 0x07);
     }
 }
 
@@ -46,223 +394,306 @@ const char* disasemble_condition(uint8_t cond_bits)
         }
 }
 
-
-std::string disassemble_LDR_STR_immediate(uint32_t self)
+size_t disassemble_arm(uint32_t opcode, uint32_t address, char* buffer, size_t size)
 {
-    uint8_t condition = (self >> 28);
-    bool _I = (self >> 25) & 1; // 1=Register 0=Imm
-    bool _P = (self >> 24) & 1; // 1=Pre-indexed 0=Post-indexed
-    bool _U = (self >> 23) & 1; // 1=Add offset 0=Substract offset
-    bool _B = (self >> 22) & 1; // 1=u8 0=i32
-    bool _W = (self >> 21) & 1; // P=1 1=Write back P=0 1=User mode access
-    bool _L = (self >> 20) & 1; // 1=Load 0=Store
-    uint8_t _Rn = (self >> 16) & 0xF; // Base register
-    uint8_t _Rd = (self >> 12) & 0xF; // Destination register
-    int offset = self & 0xFFF;
-            
-    if (!_I) // Register
+    TextWriter text{ buffer, size };
+    uint8_t condition = opcode >> 28;
+    auto instruction = decode_arm(opcode);
+
+    switch (instruction)
     {
-        if (_P)
+        case ArmInstruction::DataProcessing:
+            disassemble_data_processing(text, opcode, condition);
+            break;
+        case ArmInstruction::Multiply:
         {
-            return fmt::format("{}{}{} {}, [{} {}#{:#x}]{}",
-                _L ? "LDR" : "STR",
-                disasemble_condition(condition),
-                _B ? "B" : "",
-                disassemble_register_name(_Rd),
-                disassemble_register_name(_Rn),
-                _U ? "" : "-",
-                offset,
-                _W ? "!" : "");
+            bool _A = (opcode >> 21) & 1;
+            text.put_mnemonic(_A ? "MLA" : "MUL", condition, (opcode >> 20) & 1 ? "S" : "");
+            text.put_register(opcode >> 16);
+            text.put_separator();
+            text.put_register(opcode);
+            text.put_separator();
+            text.put_register(opcode >> 8);
+            if (_A)
+            {
+                text.put_separator();
+                text.put_register(opcode >> 12);
+            }
+            break;
         }
-    }
-    
-    return "opcode?";
-}
-
-
-std::string disassemble_B(const GBA_Cpu& cpu, uint32_t self)
-{
-    uint8_t condition = (self >> 28);
-    if (condition == 0x0F) // BLX
-    {
-        // uint32_t _25bit_offset = executing & 0x01FFFFFF;
-        // cpu.R[14] = cpu.R[15] + cpu.instruction_size; // Save the address
-        // Change to thumb mode i guess
-        return "BLX?";
-    }
-    else
-    {
-        bool _L = (self >> 24) & 1; // 1=BL 0=B
-
-        int32_t _24bit_offset = self & 0x00FFFFFF;
-        int32_t decoded_offset = _24bit_offset * 4 + 8;
-        uint32_t target_address = cpu.PC + decoded_offset;
-        if (_L) // BL
-        {    
-            return fmt::format("BL{} #{:#x} // ${:#x}", disasemble_condition(condition), decoded_offset, target_address);
+        case ArmInstruction::MultiplyLong:
+        {
+            const char* names[4] = { "UMULL", "UMLAL", "SMULL", "SMLAL" };
+            text.put_mnemonic(names[(opcode >> 21) & 0x03], condition, (opcode >> 20) & 1 ? "S" : "");
+            text.put_register(opcode >> 12);
+            text.put_separator();
+            text.put_register(opcode >> 16);
+            text.put_separator();
+            text.put_register(opcode);
+            text.put_separator();
+            text.put_register(opcode >> 8);
+            break;
         }
-        else
+        case ArmInstruction::Swap:
+            text.put_mnemonic("SWP", condition, (opcode >> 22) & 1 ? "B" : "");
+            text.put_register(opcode >> 12);
+            text.put_separator();
+            text.put_register(opcode);
+            text.put(", [");
+            text.put_register(opcode >> 16);
+            text.put(']');
+            break;
+        case ArmInstruction::HalfwordTransfer:
+            disassemble_halfword_transfer(text, opcode, condition);
+            break;
+        case ArmInstruction::MRS:
+            text.put_mnemonic("MRS", condition);
+            text.put_register(opcode >> 12);
+            text.put((opcode >> 22) & 1 ? ", SPSR" : ", CPSR");
+            break;
+        case ArmInstruction::MSR:
         {
-            return fmt::format("B{} #{:#x} // ${:#x}", disasemble_condition(condition), decoded_offset, target_address);
+            text.put_mnemonic("MSR", condition);
+            text.put((opcode >> 22) & 1 ? "SPSR_" : "CPSR_");
+            if (opcode & (1 << 19)) text.put('f');
+            if (opcode & (1 << 18)) text.put('s');
+            if (opcode & (1 << 17)) text.put('x');
+            if (opcode & (1 << 16)) text.put('c');
+            text.put_separator();
+            if ((opcode >> 25) & 1)
+                text.put_immediate(rotr32_shiftsq(opcode & 0xFF, (opcode >> 8) & 0x0F));
+            else
+                text.put_register(opcode);
+            break;
         }
+        case ArmInstruction::BX:
+            text.put_mnemonic("BX", condition);
+            text.put_register(opcode);
+            break;
+        case ArmInstruction::SingleDataTransfer:
+            disassemble_single_data_transfer(text, opcode, condition);
+            break;
+        case ArmInstruction::BlockDataTransfer:
+            disassemble_block_data_transfer(text, opcode, condition);
+            break;
+        case ArmInstruction::Branch:
+            text.put_mnemonic((opcode >> 24) & 1 ? "BL" : "B", condition);
+            text.put_hex(address + 8 + sign_extend_24_32(opcode & 0x00FFFFFF) * 4);
+            break;
+        case ArmInstruction::CoprocessorTransfer:
+        case ArmInstruction::CoprocessorData:
+        case ArmInstruction::CoprocessorRegister:
+            disassemble_coprocessor(text, opcode, condition, instruction);
+            break;
+        case ArmInstruction::SoftwareInterrupt:
+            text.put_mnemonic("SWI", condition);
+            text.put_immediate(opcode & 0x00FFFFFF);
+            break;
+        case ArmInstruction::Undefined:
+            text.put("UND");
+            break;
     }
-}
 
-std::string disassemble_ADD(uint32_t self)
-{
-    uint8_t condition = (self >> 28);
-    
-    bool _I = (self >> 25) & 1; // 2nd operand is 1=Immediate 0=Register
-    bool _S = (self >> 20) & 1; // 0=ADD 1=ADDS
-    uint8_t dest = (self >> 12) & 0x0F;
-    uint8_t op_1 = (self >> 16) & 0x0F;
-    
-    if (!_S && _I) {
-        uint8_t shift = (self >> 8) & 0x0F;
-        uint8_t immediate = self & 0xFF;
-        
-        auto op_2 = rotr32_shiftsq(immediate, shift);
-        return fmt::format("ADD{}{} {}, {}, #{:#x}",
-            _S ? "S" : "",
-            disasemble_condition(condition),
-            disassemble_register_name(dest),
-            disassemble_register_name(op_1),
-            op_2);
-    }
-    return "opcode?";
+    return text.finish();
 }
 
-std::string disassemble_BX(const GBA_Cpu& cpu, uint32_t self)
+size_t disassemble_thumb(uint16_t opcode, uint16_t next_opcode, uint32_t address, char* buffer, size_t size)
 {
-    uint8_t condition = (self >> 28);
-    uint8_t _B = (self >> 4) & 0x0F;
-    uint8_t _Rn = self & 0x0F;
-    
-    if (_B == 0b0001)
-    {
-        return fmt::format("BX{} {} // ${:#x}",
-                           disasemble_condition(condition), 
-                           disassemble_register_name(_Rn), 
-                           cpu.R[_Rn]);
-    }
-    else if (_B == 0b0010)
-    {
-        return "BXJ?";
-    }
-    else if (_B == 0b0011)
-    {
-        return fmt::format("BLX{} {} // ${:#x}",
-                           disasemble_condition(condition), 
-                           disassemble_register_name(_Rn), 
-                           cpu.R[_Rn]);
-    }
-    
-    return "BX?";
-}
+    TextWriter text{ buffer, size };
+    uint32_t Rd = opcode & 0x07;
+    uint32_t Rs = (opcode >> 3) & 0x07;
+    uint32_t Rb = Rs;
 
-std::string disassemble_MOV(uint32_t self)
-{
-    uint8_t condition = self >> 28;
-    bool _I = (self >> 25) & 1;
-    bool _S = (self >> 20) & 1;
-    uint8_t _Rd = (self >> 12) & 0x0F;
-    uint8_t shift = (self >> 8) & 0x0F;
-    uint8_t immediate = self & 0xFF;
-        
-    if (_I)
+    auto put_memory_operand = [&](uint32_t base, uint32_t offset)
     {
-        uint32_t op_2 = rotr32_shiftsq(immediate, shift);
-        return fmt::format("MOV{}{} {} #{:#x}",
-                           _S ? "S" : "",
-                           disasemble_condition(condition),
-                           disassemble_register_name(_Rd),
-                           op_2);
-    }
-    
-    return "MOV?";
-}
-
-std::string disassemble_LDR_thumb_3(uint16_t self)
-{
-    uint8_t _V = self & 0xFF;
-    uint8_t _Rd = (self >> 8) & 0x07;
-
-    return fmt::format("LDR {}, [PC, #{:#x}]",
-                       disassemble_register_name(_Rd),
-                       _V * 4);
-   
-}
-
-std::string disassemble_LSLS_thumb_1(uint16_t self)
-{
-    uint8_t _V = (self >> 6) & 0x1F;
-    uint8_t _Rn = (self >> 3) & 0x07;
-    uint8_t _Rd = self & 0x07;
-
-    return fmt::format("LSLS {}, {}, #{:#x}",
-                       disassemble_register_name(_Rd),
-                       disassemble_register_name(_Rn),
-                       _V);
-}
-
-std::string disassemble_LDR_thumb_1(uint16_t self)
-{
-    uint8_t _V = (self >> 6) & 0x1F;
-    uint8_t _Rs = (self >> 3) & 0x07;
-    uint8_t _Rd = self & 0x07;
-
-    return fmt::format("LDR {}, [{}, #{:#x}]",
-                       disassemble_register_name(_Rd),
-                       disassemble_register_name(_Rs),
-                       _V * 4);
-}
-
-std::string disassemble_B_thumb_1(const GBA_Cpu& cpu, uint16_t self)
-{
-    uint8_t condition = (self >> 8) & 0x0F;
-    uint8_t target = self & 0xFF;
-    
-    return fmt::format("B{} #{:#x} // ${:#x}",
-                       disasemble_condition(condition),
-                       target,
-                       2 * (cpu.PC + target) + cpu.instruction_size * 2);
-}
-
-std::string disassemble_B_thumb_2(const GBA_Cpu& cpu, uint16_t self)
-{
-    uint16_t target = self & 0x7FF;
-    
-    return fmt::format("B #{:#x} // ${:#x}",
-                       target,
-                       2 * (cpu.PC + target) + cpu.instruction_size * 2);
-}
+        text.put('[');
+        text.put_register(base);
+        if (offset != 0)
+        {
+            text.put_separator();
+            text.put_immediate(offset);
+        }
+        text.put(']');
+    };
 
-std::string disassemble_MOVS_thumb_1(uint16_t self)
-{
-    uint8_t Rd = (self >> 10) & 0x07;
-    uint8_t value = (self & 0xFF);
+    switch (decode_thumb(opcode))
+    {
+        case ThumbInstruction::MoveShifted:
+        {
+            const char* names[3] = { "LSLS ", "LSRS ", "ASRS " };
+            uint32_t operation = (opcode >> 11) & 0x03;
+            uint32_t amount = (opcode >> 6) & 0x1F;
+            if (amount == 0 && operation != 0)
+                amount = 32;
 
-    return fmt::format("MOVS {}, #{:#x}",
-                       disassemble_register_name(Rd),
-                       value);
-}
+            text.put(names[operation]);
+            text.put_register(Rd);
+            text.put_separator();
+            text.put_register(Rs);
+            text.put(", #");
+            text.put_decimal(amount);
+            break;
+        }
+        case ThumbInstruction::AddSubtract:
+        {
+            bool _I = (opcode >> 10) & 1;
+            uint32_t operand = (opcode >> 6) & 0x07;
+            text.put((opcode >> 9) & 1 ? "SUBS " : "ADDS ");
+            text.put_register(Rd);
+            text.put_separator();
+            text.put_register(Rs);
+            text.put_separator();
+            if (_I)
+                text.put_immediate(operand);
+            else
+                text.put_register(operand);
+            break;
+        }
+        case ThumbInstruction::Immediate:
+        {
+            const char* names[4] = { "MOVS ", "CMP ", "ADDS ", "SUBS " };
+            text.put(names[(opcode >> 11) & 0x03]);
+            text.put_register((opcode >> 8) & 0x07);
+            text.put_separator();
+            text.put_immediate(opcode & 0xFF);
+            break;
+        }
+        case ThumbInstruction::ALU:
+            text.put(thumb_alu_names[(opcode >> 6) & 0x0F]);
+            text.put(' ');
+            text.put_register(Rd);
+            text.put_separator();
+            text.put_register(Rs);
+            break;
+        case ThumbInstruction::HiRegister:
+        {
+            const char* names[4] = { "ADD ", "CMP ", "MOV ", "BX " };
+            uint32_t operation = (opcode >> 8) & 0x03;
+            uint32_t source = (opcode >> 3) & 0x0F; // H2 is bit 6
+            uint32_t destination = ((opcode >> 4) & 0x08) | Rd; // H1 is bit 7
 
-std::string disassemble_MOVS_thumb_2(uint16_t self)
-{
-    uint8_t Rs = (self >> 3) & 0x07;
-    uint8_t Rd = self & 0x07;
+            text.put(names[operation]);
+            if (operation != 3)
+            {
+                text.put_register(destination);
+                text.put_separator();
+            }
+            text.put_register(source);
+            break;
+        }
+        case ThumbInstruction::LoadPC:
+            text.put("LDR ");
+            text.put_register((opcode >> 8) & 0x07);
+            text.put_separator();
+            put_memory_operand(15, (opcode & 0xFF) * 4);
+            break;
+        case ThumbInstruction::LoadStoreRegister:
+        case ThumbInstruction::LoadStoreSigned:
+        {
+            const char* names[8] = { "STR ", "STRB ", "LDR ", "LDRB ", "STRH ", "LDRSB ", "LDRH ", "LDRSH " };
+            bool is_signed = decode_thumb(opcode) == ThumbInstruction::LoadStoreSigned;
+            text.put(names[(is_signed ? 4 : 0) + ((opcode >> 10) & 0x03)]);
+            text.put_register(Rd);
+            text.put(", [");
+            text.put_register(Rb);
+            text.put_separator();
+            text.put_register((opcode >> 6) & 0x07);
+            text.put(']');
+            break;
+        }
+        case ThumbInstruction::LoadStoreImmediate:
+        {
+            bool _B = (opcode >> 12) & 1;
+            bool _L = (opcode >> 11) & 1;
+            uint32_t offset = (opcode >> 6) & 0x1F;
+            text.put(_L ? (_B ? "LDRB " : "LDR ") : (_B ? "STRB " : "STR "));
+            text.put_register(Rd);
+            text.put_separator();
+            put_memory_operand(Rb, _B ? offset : offset * 4);
+            break;
+        }
+        case ThumbInstruction::LoadStoreHalfword:
+            text.put((opcode >> 11) & 1 ? "LDRH " : "STRH ");
+            text.put_register(Rd);
+            text.put_separator();
+            put_memory_operand(Rb, ((opcode >> 6) & 0x1F) * 2);
+            break;
+        case ThumbInstruction::LoadStoreSP:
+            text.put((opcode >> 11) & 1 ? "LDR " : "STR ");
+            text.put_register((opcode >> 8) & 0x07);
+            text.put_separator();
+            put_memory_operand(13, (opcode & 0xFF) * 4);
+            break;
+        case ThumbInstruction::LoadAddress:
+            text.put("ADD ");
+            text.put_register((opcode >> 8) & 0x07);
+            text.put((opcode >> 11) & 1 ? ", SP, " : ", PC, ");
+            text.put_immediate((opcode & 0xFF) * 4);
+            break;
+        case ThumbInstruction::AddSP:
+            text.put((opcode >> 7) & 1 ? "SUB SP, " : "ADD SP, ");
+            text.put_immediate((opcode & 0x7F) * 4);
+            break;
+        case ThumbInstruction::PushPop:
+        {
+            bool _L = (opcode >> 11) & 1;
+            bool _R = (opcode >> 8) & 1; // PUSH LR / POP PC
+            uint16_t list = opcode & 0xFF;
+            if (_R)
+                list |= _L ? (1 << 15) : (1 << 14);
+            text.put(_L ? "POP " : "PUSH ");
+            text.put_register_list(list);
+            break;
+        }
+        case ThumbInstruction::LoadStoreMultiple:
+            text.put((opcode >> 11) & 1 ? "LDMIA " : "STMIA ");
+            text.put_register((opcode >> 8) & 0x07);
+            text.put("!, ");
+            text.put_register_list(opcode & 0xFF);
+            break;
+        case ThumbInstruction::ConditionalBranch:
+            text.put_mnemonic("B", (opcode >> 8) & 0x0F);
+            text.put_hex(address + 4 + sign_extend<uint32_t>(opcode & 0xFF, 8) * 2);
+            break;
+        case ThumbInstruction::SoftwareInterrupt:
+            text.put("SWI ");
+            text.put_immediate(opcode & 0xFF);
+            break;
+        case ThumbInstruction::Branch:
+            text.put("B ");
+            text.put_hex(address + 4 + sign_extend<uint32_t>(opcode & 0x7FF, 11) * 2);
+            break;
+        case ThumbInstruction::LongBranchPrefix:
+        {
+            uint32_t offset = sign_extend<uint32_t>(opcode & 0x7FF, 11) << 12;
+            if (decode_thumb(next_opcode) == ThumbInstruction::LongBranchSuffix)
+            {
+                text.put("BL ");
+                text.put_hex(address + 4 + offset + (next_opcode & 0x7FF) * 2);
+            }
+            else
+            {
+                text.put("BL.hi ");
+                text.put_immediate(offset);
+            }
+            break;
+        }
+        case ThumbInstruction::LongBranchSuffix:
+            text.put("BL.lo ");
+            text.put_immediate((opcode & 0x7FF) * 2);
+            break;
+        case ThumbInstruction::Undefined:
+            text.put("UND");
+            break;
+    }
 
-    return fmt::format("MOVS {}, {}",
-                       disassemble_register_name(Rd),
-                       disassemble_register_name(Rs));
+    return text.finish();
 }
 
-std::string disassemble_MOVS_thumb_3(uint16_t self)
+size_t disassemble(uint32_t word, uint32_t address, InstructionSet set, char* buffer, size_t size)
 {
-    uint8_t Rs = (self & 0x80) | ((self >> 3) & 0x07);
-    uint8_t Rd = (self & 0x40) | (self & 0x07);
-
-    return fmt::format("MOVS {}, {}",
-                       disassemble_register_name(Rd),
-                       disassemble_register_name(Rs));
+    if (set == InstructionSet::ARM)
+        return disassemble_arm(word, address, buffer, size);
+    else
+        return disassemble_thumb(word & 0xFFFF, word >> 16, address, buffer, size);
 }
@@ -1,36 +1,48 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
-#include <ostream>
+#include "decoder.h"
 
-class GBA_Cpu;
-
-std::string disassemble_register_name(uint8_t register_number);
+/** Buffer size large enough for any disassembled instruction, including the null terminator. */
+constexpr size_t disassembly_buffer_size = 64;
 
 const char* disasemble_condition(uint8_t cond_bits);
 
-std::string disassemble_LDR_STR_immediate(uint32_t self);
-
-std::string disassemble_ADD(uint32_t self);
-
-std::string disassemble_B(const GBA_Cpu& cpu, uint32_t self);
-
-std::string disassemble_BX(const GBA_Cpu& cpu, uint32_t self);
-
-std::string disassemble_MOV(uint32_t self);
-
-std::string disassemble_LDR_thumb_1(uint16_t self);
-
-std::string disassemble_LDR_thumb_3(uint16_t self);
-
-std::string disassemble_LSLS_thumb_1(uint16_t self);
-
-std::string disassemble_B_thumb_1(const GBA_Cpu& cpu, uint16_t self);
-
-std::string disassemble_B_thumb_2(const GBA_Cpu& cpu, uint16_t self);
-
-std::string disassemble_MOVS_thumb_1(uint16_t self);
-
-std::string disassemble_MOVS_thumb_2(uint16_t self);
-
-std::string disassemble_MOVS_thumb_3(uint16_t self);
\ No newline at end of file
+/**
+ * @brief Disassembles an ARM opcode.
+ *
+ * The text is written to a caller supplied buffer, nothing is allocated. It's always null
+ * terminated and truncated if it doesn't fit. Branch targets are printed as absolute addresses.
+ *
+ * Syntax follows UAL: ADDSEQ R0, R1, #0x10 / LDRB R0, [R1, -R2, LSL #2]! / LDMIA SP!, {R4-R7, PC}
+ *
+ * @param opcode The opcode to be disassembled.
+ * @param address Address of the opcode.
+ * @param buffer Output buffer.
+ * @param size Capacity of buffer, disassembly_buffer_size is always enough.
+ * @return size_t Length of the text, without the null terminator.
+ */
+size_t disassemble_arm(uint32_t opcode, uint32_t address, char* buffer, size_t size);
+
+/**
+ * @brief Disassembles a THUMB opcode.
+ *
+ * BL is encoded in two halfwords. When opcode is the first half and next_opcode the second,
+ * the whole BL is printed. Otherwise each half is printed on its own as BL.hi/BL.lo.
+ *
+ * @param opcode The opcode to be disassembled.
+ * @param next_opcode The halfword following opcode.
+ * @param address Address of the opcode.
+ * @param buffer Output buffer.
+ * @param size Capacity of buffer, disassembly_buffer_size is always enough.
+ * @return size_t Length of the text, without the null terminator.
+ */
+size_t disassemble_thumb(uint16_t opcode, uint16_t next_opcode, uint32_t address, char* buffer, size_t size);
+
+/**
+ * @brief Disassembles the instruction starting with word.
+ *
+ * @param word Word at address. For THUMB, bits [16, 31] are the next halfword.
+ */
+size_t disassemble(uint32_t word, uint32_t address, InstructionSet set, char* buffer, size_t size);
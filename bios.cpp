@@ -0,0 +1,359 @@
+#include "bios.h"
+#include "GBA_Cpu.h"
+#include "compression.h"
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+
+namespace
+{
+    constexpr uint32_t bios_intr_flags_address = 0x03007FF8; // Mirrored at 0x03FFFFF8
+    constexpr uint32_t io_IME_address = 0x04000208;
+    constexpr double pi = 3.14159265358979323846;
+
+    /*
+     * Approximate cost of the real BIOS routines. The constant part covers the SWI entry/exit and
+     * argument setup, the variable part is charged per unit of work (transfer unit, output byte...).
+     */
+    constexpr uint32_t swi_overhead_cycles = 20;
+    constexpr uint32_t div_cycles = 60;
+    constexpr uint32_t sqrt_cycles = 150;
+    constexpr uint32_t arctan_cycles = 50;
+    constexpr uint32_t cpu_set_unit_cycles = 6;
+    constexpr uint32_t cpu_fast_set_unit_cycles = 2;
+    constexpr uint32_t affine_set_unit_cycles = 100;
+    constexpr uint32_t lz77_byte_cycles = 10;
+    constexpr uint32_t huffman_byte_cycles = 40;
+    constexpr uint32_t rl_byte_cycles = 6;
+
+    typedef size_t (*Decompressor)(const uint8_t*, size_t, uint8_t*, size_t);
+
+    uint32_t bios_div(GBA_Cpu& cpu, int32_t numerator, int32_t denominator)
+    {
+        if (denominator == 0)
+        {
+            // The real BIOS never returns. Produce the same values most emulators settled on.
+            cpu.R[0] = numerator < 0 ? -1 : 1;
+            cpu.R[1] = numerator;
+            cpu.R[3] = 1;
+            return div_cycles;
+        }
+
+        // 64 bit math, so INT32_MIN / -1 does not trap.
+        int64_t quotient = int64_t{ numerator } / denominator;
+        int64_t remainder = int64_t{ numerator } % denominator;
+
+        cpu.R[0] = static_cast<uint32_t>(quotient);
+        cpu.R[1] = static_cast<uint32_t>(remainder);
+        cpu.R[3] = static_cast<uint32_t>(std::abs(quotient));
+        return div_cycles;
+    }
+
+    uint32_t bios_sqrt(GBA_Cpu& cpu)
+    {
+        uint32_t value = cpu.R[0];
+        uint32_t root = 0;
+        uint32_t bit = 1u << 30;
+
+        while (bit > value)
+            bit >>= 2;
+
+        while (bit != 0)
+        {
+            if (value >= root + bit)
+            {
+                value -= root + bit;
+                root = (root >> 1) + bit;
+            }
+            else
+            {
+                root >>= 1;
+            }
+            bit >>= 2;
+        }
+
+        cpu.R[0] = root;
+        return sqrt_cycles;
+    }
+
+    /*
+     * Same polynomial approximation used by the BIOS. Input is tan(θ) as 1.14 fixed point,
+     * output is θ in the range -0x4000..0x4000 (-π/2..π/2).
+     */
+    uint32_t bios_arctan(GBA_Cpu& cpu)
+    {
+        int32_t i = static_cast<int16_t>(cpu.R[0]);
+        int32_t a = -((i * i) >> 14);
+        int32_t b = ((0xA9 * a) >> 14) + 0x390;
+        b = ((b * a) >> 14) + 0x91C;
+        b = ((b * a) >> 14) + 0xFB6;
+        b = ((b * a) >> 14) + 0x16AA;
+        b = ((b * a) >> 14) + 0x2081;
+        b = ((b * a) >> 14) + 0x3651;
+        b = ((b * a) >> 14) + 0xA2F9;
+
+        cpu.R[0] = static_cast<uint32_t>((i * b) >> 16);
+        cpu.R[1] = static_cast<uint32_t>(a);
+        cpu.R[3] = static_cast<uint32_t>(b);
+        return arctan_cycles;
+    }
+
+    /*
+     * r0 = Source address
+     * r1 = Destination address
+     * r2 = [0, 20] Unit count, [24] 1=Fill 0=Copy, [26] 1=32bit units 0=16bit units
+     */
+    uint32_t bios_cpu_set(GBA_Cpu& cpu)
+    {
+        uint32_t source = cpu.R[0];
+        uint32_t destination = cpu.R[1];
+        uint32_t count = cpu.R[2] & 0x1FFFFF;
+        bool fill = (cpu.R[2] >> 24) & 1;
+        bool words = (cpu.R[2] >> 26) & 1;
+
+        if (words)
+        {
+            source &= ~3u;
+            destination &= ~3u;
+            uint32_t fill_value = cpu.memory.read_word(source);
+            for (uint32_t i = 0; i < count; i++)
+            {
+                cpu.memory.write_word(destination + i * 4, fill ? fill_value : cpu.memory.read_word(source + i * 4));
+            }
+        }
+        else
+        {
+            source &= ~1u;
+            destination &= ~1u;
+            uint16_t fill_value = cpu.memory.read_halfword(source);
+            for (uint32_t i = 0; i < count; i++)
+            {
+                cpu.memory.write_halfword(destination + i * 2, fill ? fill_value : cpu.memory.read_halfword(source + i * 2));
+            }
+        }
+
+        return count * cpu_set_unit_cycles;
+    }
+
+    /*
+     * r0 = Source address
+     * r1 = Destination address
+     * r2 = [0, 20] Word count (rounded up to a multiple of 8), [24] 1=Fill 0=Copy
+     */
+    uint32_t bios_cpu_fast_set(GBA_Cpu& cpu)
+    {
+        uint32_t source = cpu.R[0] & ~3u;
+        uint32_t destination = cpu.R[1] & ~3u;
+        uint32_t count = ((cpu.R[2] & 0x1FFFFF) + 7) & ~7u;
+        bool fill = (cpu.R[2] >> 24) & 1;
+
+        uint32_t fill_value = cpu.memory.read_word(source);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            cpu.memory.write_word(destination + i * 4, fill ? fill_value : cpu.memory.read_word(source + i * 4));
+        }
+
+        return count * cpu_fast_set_unit_cycles;
+    }
+
+    /*
+     * r0 = Source address, r1 = Destination address, r2 = Count
+     *
+     * Source (20 bytes): s32 origin x, s32 origin y (19.8), s16 display x, s16 display y,
+     * s16 scale x, s16 scale y (7.8), u16 angle (only the upper 8 bits are used).
+     * Destination (16 bytes): s16 PA, PB, PC, PD (7.8), s32 start x, start y (19.8)
+     */
+    uint32_t bios_bg_affine_set(GBA_Cpu& cpu)
+    {
+        uint32_t source = cpu.R[0];
+        uint32_t destination = cpu.R[1];
+        uint32_t count = cpu.R[2];
+
+        for (uint32_t i = 0; i < count; i++, source += 20, destination += 16)
+        {
+            double origin_x = static_cast<int32_t>(cpu.memory.read_word(source)) / 256.0;
+            double origin_y = static_cast<int32_t>(cpu.memory.read_word(source + 4)) / 256.0;
+            double display_x = static_cast<int16_t>(cpu.memory.read_halfword(source + 8));
+            double display_y = static_cast<int16_t>(cpu.memory.read_halfword(source + 10));
+            double scale_x = static_cast<int16_t>(cpu.memory.read_halfword(source + 12)) / 256.0;
+            double scale_y = static_cast<int16_t>(cpu.memory.read_halfword(source + 14)) / 256.0;
+            double theta = (cpu.memory.read_halfword(source + 16) >> 8) / 128.0 * pi;
+
+            double pa = std::cos(theta) * scale_x;
+            double pb = -std::sin(theta) * scale_x;
+            double pc = std::sin(theta) * scale_y;
+            double pd = std::cos(theta) * scale_y;
+            double start_x = origin_x - (pa * display_x + pb * display_y);
+            double start_y = origin_y - (pc * display_x + pd * display_y);
+
+            cpu.memory.write_halfword(destination, static_cast<int16_t>(pa * 256));
+            cpu.memory.write_halfword(destination + 2, static_cast<int16_t>(pb * 256));
+            cpu.memory.write_halfword(destination + 4, static_cast<int16_t>(pc * 256));
+            cpu.memory.write_halfword(destination + 6, static_cast<int16_t>(pd * 256));
+            cpu.memory.write_word(destination + 8, static_cast<int32_t>(start_x * 256));
+            cpu.memory.write_word(destination + 12, static_cast<int32_t>(start_y * 256));
+        }
+
+        return count * affine_set_unit_cycles;
+    }
+
+    /*
+     * r0 = Source address, r1 = Destination address, r2 = Count,
+     * r3 = Offset in bytes between each parameter (2 for a plain array, 8 for OAM)
+     *
+     * Source (8 bytes): s16 scale x, s16 scale y (7.8), u16 angle (upper 8 bits), u16 padding
+     */
+    uint32_t bios_obj_affine_set(GBA_Cpu& cpu)
+    {
+        uint32_t source = cpu.R[0];
+        uint32_t destination = cpu.R[1];
+        uint32_t count = cpu.R[2];
+        uint32_t offset = cpu.R[3];
+
+        for (uint32_t i = 0; i < count; i++, source += 8, destination += offset * 4)
+        {
+            double scale_x = static_cast<int16_t>(cpu.memory.read_halfword(source)) / 256.0;
+            double scale_y = static_cast<int16_t>(cpu.memory.read_halfword(source + 2)) / 256.0;
+            double theta = (cpu.memory.read_halfword(source + 4) >> 8) / 128.0 * pi;
+
+            cpu.memory.write_halfword(destination, static_cast<int16_t>(std::cos(theta) * scale_x * 256));
+            cpu.memory.write_halfword(destination + offset, static_cast<int16_t>(-std::sin(theta) * scale_x * 256));
+            cpu.memory.write_halfword(destination + offset * 2, static_cast<int16_t>(std::sin(theta) * scale_y * 256));
+            cpu.memory.write_halfword(destination + offset * 3, static_cast<int16_t>(std::cos(theta) * scale_y * 256));
+        }
+
+        return count * affine_set_unit_cycles;
+    }
+
+    /*
+     * r0 = Source address (stream header), r1 = Destination address
+     *
+     * The WRAM and VRAM variants only differ on the size of the writes performed by the BIOS,
+     * which makes no difference here. The stream is decoded in place, straight from the source region.
+     */
+    uint32_t bios_uncomp(GBA_Cpu& cpu, Decompressor decompressor, uint32_t byte_cycles)
+    {
+        uint32_t source = cpu.R[0];
+        uint32_t destination = cpu.R[1];
+        CompressionHeader header{ cpu.memory.read_word(source) };
+
+        try
+        {
+            decompressor(cpu.memory.pointer(source), cpu.memory.contiguous_size(source),
+                         cpu.memory.pointer(destination), cpu.memory.contiguous_size(destination));
+        }
+        catch (const std::runtime_error& e)
+        {
+            // The real BIOS doesn't validate anything and would just write garbage
+            std::cout << YELLOW << "BIOS: " << e.what() << RESET << std::endl;
+        }
+
+        return header.decompressed_size * byte_cycles;
+    }
+
+    /*
+     * r0 = 1=Discard old flags 0=Return immediately if the flags are already set
+     * r1 = Interrupt flags to wait for
+     */
+    uint32_t bios_intr_wait(GBA_Cpu& cpu, bool discard_old_flags, uint16_t flags)
+    {
+        if (discard_old_flags)
+        {
+            auto pending = cpu.memory.read_halfword(bios_intr_flags_address);
+            cpu.memory.write_halfword(bios_intr_flags_address, pending & ~flags);
+        }
+
+        cpu.memory.write_halfword(io_IME_address, 1);
+        cpu.intr_wait_flags = flags;
+        cpu.halted = true;
+        poll_bios_intr_wait(cpu);
+        return swi_overhead_cycles;
+    }
+}
+
+bool execute_bios_call(GBA_Cpu& cpu, uint8_t call)
+{
+    uint32_t cycles;
+    switch (static_cast<BiosCall>(call))
+    {
+        case BiosCall::IntrWait:        cycles = bios_intr_wait(cpu, cpu.R[0] & 1, cpu.R[1] & 0xFFFF); break;
+        case BiosCall::VBlankIntrWait:  cycles = bios_intr_wait(cpu, true, 0x0001); break;
+        case BiosCall::Div:             cycles = bios_div(cpu, cpu.R[0], cpu.R[1]); break;
+        case BiosCall::DivArm:          cycles = bios_div(cpu, cpu.R[1], cpu.R[0]); break;
+        case BiosCall::Sqrt:            cycles = bios_sqrt(cpu); break;
+        case BiosCall::ArcTan:          cycles = bios_arctan(cpu); break;
+        case BiosCall::CpuSet:          cycles = bios_cpu_set(cpu); break;
+        case BiosCall::CpuFastSet:      cycles = bios_cpu_fast_set(cpu); break;
+        case BiosCall::BgAffineSet:     cycles = bios_bg_affine_set(cpu); break;
+        case BiosCall::ObjAffineSet:    cycles = bios_obj_affine_set(cpu); break;
+        case BiosCall::LZ77UnCompWram:  cycles = bios_uncomp(cpu, lz77_decompress, lz77_byte_cycles); break;
+        case BiosCall::LZ77UnCompVram:  cycles = bios_uncomp(cpu, lz77_decompress, lz77_byte_cycles); break;
+        case BiosCall::HuffUnComp:      cycles = bios_uncomp(cpu, huffman_decompress, huffman_byte_cycles); break;
+        case BiosCall::RLUnCompWram:    cycles = bios_uncomp(cpu, rl_decompress, rl_byte_cycles); break;
+        case BiosCall::RLUnCompVram:    cycles = bios_uncomp(cpu, rl_decompress, rl_byte_cycles); break;
+        default:                        return false;
+    }
+
+    if constexpr (PerformanceCounters::enabled)
+        cpu.counters.bios_calls++;
+    cpu.cycles += swi_overhead_cycles + cycles;
+    return true;
+}
+
+bool poll_bios_intr_wait(GBA_Cpu& cpu)
+{
+    auto pending = cpu.memory.read_halfword(bios_intr_flags_address);
+    if ((pending & cpu.intr_wait_flags) == 0)
+        return false;
+
+    cpu.memory.write_halfword(bios_intr_flags_address, pending & ~cpu.intr_wait_flags);
+    cpu.intr_wait_flags = 0;
+    cpu.halted = false;
+    return true;
+}
+
+bool execute_bios_address(GBA_Cpu& cpu, uint32_t address)
+{
+    if (address == bios_irq_vector)
+    {
+        // stmfd sp!, {r0-r3, r12, lr}
+        const int saved[] = { 0, 1, 2, 3, 12, 14 };
+        cpu.SP -= sizeof(saved) / sizeof(saved[0]) * 4;
+        for (size_t i = 0; i < sizeof(saved) / sizeof(saved[0]); i++)
+        {
+            cpu.memory.write_word(cpu.SP + i * 4, cpu.R[saved[i]]);
+        }
+
+        // mov r0, #0x04000000; add lr, pc, #0; ldr pc, [r0, #-4]
+        cpu.R[0] = 0x04000000;
+        cpu.LR = bios_irq_return_address;
+        cpu.PC = cpu.memory.read_word(bios_irq_handler_pointer) & ~3u;
+        cpu.flush_pipeline();
+        cpu.cycles += swi_overhead_cycles;
+        return true;
+    }
+    else if (address == bios_irq_return_address)
+    {
+        // ldmfd sp!, {r0-r3, r12, lr}
+        const int saved[] = { 0, 1, 2, 3, 12, 14 };
+        for (size_t i = 0; i < sizeof(saved) / sizeof(saved[0]); i++)
+        {
+            cpu.R[saved[i]] = cpu.memory.read_word(cpu.SP + i * 4);
+        }
+        cpu.SP += sizeof(saved) / sizeof(saved[0]) * 4;
+
+        // subs pc, lr, #4
+        cpu.return_from_IRQ();
+        cpu.cycles += swi_overhead_cycles;
+
+        // An IntrWait interrupted by this IRQ keeps waiting unless its flags were set
+        if (cpu.intr_wait_flags != 0)
+        {
+            cpu.halted = true;
+            poll_bios_intr_wait(cpu);
+        }
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+
+class GBA_Cpu;
+
+/**
+ * @brief BIOS functions reachable through SWI.
+ *
+ * The value is the SWI comment field. In ARM state it is stored in bits [16, 23] of the opcode
+ * (swi 0x060000), in THUMB state in bits [0, 7] (swi 0x06).
+ */
+enum class BiosCall : uint8_t
+{
+    SoftReset = 0x00,
+    RegisterRamReset = 0x01,
+    Halt = 0x02,
+    Stop = 0x03,
+    IntrWait = 0x04,
+    VBlankIntrWait = 0x05,
+    Div = 0x06,
+    DivArm = 0x07,
+    Sqrt = 0x08,
+    ArcTan = 0x09,
+    ArcTan2 = 0x0A,
+    CpuSet = 0x0B,
+    CpuFastSet = 0x0C,
+    GetBiosChecksum = 0x0D,
+    BgAffineSet = 0x0E,
+    ObjAffineSet = 0x0F,
+    BitUnPack = 0x10,
+    LZ77UnCompWram = 0x11,
+    LZ77UnCompVram = 0x12,
+    HuffUnComp = 0x13,
+    RLUnCompWram = 0x14,
+    RLUnCompVram = 0x15,
+};
+
+/** Size of the BIOS region. Addresses below it are BIOS code. */
+constexpr uint32_t bios_size = 0x4000;
+/** Exception vector the cpu jumps to when entering IRQ mode. */
+constexpr uint32_t bios_irq_vector = 0x18;
+/** Address the user IRQ handler returns to, inside the BIOS IRQ dispatcher. */
+constexpr uint32_t bios_irq_return_address = 0x138;
+/** Pointer to the user IRQ handler (mirrored at 0x03FFFFFC). */
+constexpr uint32_t bios_irq_handler_pointer = 0x03007FFC;
+
+/**
+ * @brief Executes a BIOS function natively (High Level Emulation).
+ *
+ * No BIOS image is loaded, so instead of jumping to the SWI vector the call is intercepted and
+ * implemented in C++. Arguments and results follow the BIOS register convention (r0..r3).
+ * The approximate amount of cycles the real BIOS would take is charged to cpu.cycles.
+ *
+ * @param cpu The cpu who's calling the BIOS.
+ * @param call The SWI comment field.
+ * @return bool Whether the call is implemented.
+ */
+bool execute_bios_call(GBA_Cpu& cpu, uint8_t call);
+
+/**
+ * @brief Checks if an interrupt requested through IntrWait/VBlankIntrWait arrived.
+ *
+ * The BIOS acknowledges interrupts through the flags at 0x03007FF8, which the user IRQ handler
+ * is expected to set. The matching flags are cleared and the cpu leaves the halted state.
+ *
+ * @param cpu The halted cpu.
+ * @return bool True if the cpu was woken up.
+ */
+bool poll_bios_intr_wait(GBA_Cpu& cpu);
+
+/**
+ * @brief Executes the BIOS code at an address natively, if it has a High Level Emulation.
+ *
+ * Covers the IRQ dispatcher: at bios_irq_vector the scratch registers are saved on the IRQ stack
+ * and the user handler at bios_irq_handler_pointer is called (in ARM state, as with LDR PC).
+ * When the handler returns to bios_irq_return_address, the registers are restored and the cpu
+ * returns from IRQ mode.
+ *
+ * @param cpu The cpu executing BIOS code.
+ * @param address Address of the instruction being executed.
+ * @return bool Whether the address was handled.
+ */
+bool execute_bios_address(GBA_Cpu& cpu, uint32_t address);
@@ -17,6 +17,15 @@ uint32_t rotr32(uint8_t value, uint8_t shift);
 
 uint32_t rotl32(uint8_t value, uint8_t shift);
 
+/**
+ * @brief Rotates a word to the right, as the ROR shift does.
+ */
+inline uint32_t rotate_right(uint32_t value, uint32_t amount)
+{
+    amount &= 31;
+    return amount ? (value >> amount) | (value << (32 - amount)) : value;
+}
+
 /**
  * @brief Extends a signed int to the desired size.
  * 
@@ -0,0 +1,301 @@
+#include "compression.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <fmt/core.h>
+
+namespace
+{
+    /*
+     * Shared LZ77 decoder. When Write is false nothing is written to the output and errors
+     * are reported by returning 0 instead of throwing, so it can be used to probe for streams.
+     */
+    template<bool Write>
+    size_t lz77_decode(const uint8_t* source, size_t source_size, uint8_t* destination, uint32_t size)
+    {
+        auto fail = [](const char* reason) -> size_t
+        {
+            if constexpr (Write)
+                throw std::runtime_error{ fmt::format("Malformed LZ77 stream: {}", reason) };
+            else
+                return 0;
+        };
+
+        const uint8_t* in = source + 4;
+        const uint8_t* in_end = source + source_size;
+        uint32_t written = 0;
+
+        while (written < size)
+        {
+            if (in == in_end)
+                return fail("truncated");
+
+            uint8_t flags = *in++;
+
+            // Fast path: 8 literal bytes in a row
+            if (flags == 0 && in_end - in >= 8 && size - written >= 8)
+            {
+                if constexpr (Write)
+                    std::memcpy(destination + written, in, 8);
+                in += 8;
+                written += 8;
+                continue;
+            }
+
+            for (int block = 0; block < 8 && written < size; block++, flags <<= 1)
+            {
+                if (flags & 0x80)
+                {
+                    if (in_end - in < 2)
+                        return fail("truncated");
+
+                    uint32_t length = (in[0] >> 4) + 3;
+                    uint32_t displacement = (((in[0] & 0x0F) << 8) | in[1]) + 1;
+                    in += 2;
+
+                    if (displacement > written)
+                        return fail("back reference before the start of the output");
+
+                    length = std::min(length, size - written);
+                    if constexpr (Write)
+                    {
+                        uint8_t* out = destination + written;
+                        const uint8_t* from = out - displacement;
+                        if (displacement >= length)
+                        {
+                            std::memcpy(out, from, length);
+                        }
+                        else // Overlapping copy, repeats the last displacement bytes
+                        {
+                            for (uint32_t i = 0; i < length; i++)
+                                out[i] = from[i];
+                        }
+                    }
+                    written += length;
+                }
+                else
+                {
+                    if (in == in_end)
+                        return fail("truncated");
+
+                    if constexpr (Write)
+                        destination[written] = *in;
+                    in++;
+                    written++;
+                }
+            }
+        }
+
+        return in - source;
+    }
+
+    CompressionHeader read_header(const uint8_t* source, size_t source_size, CompressionType expected, size_t destination_size)
+    {
+        if (source_size < 4)
+            throw std::runtime_error{ "Compressed stream is too small to contain a header" };
+
+        CompressionHeader header{ uint32_t(source[0]) | (source[1] << 8) | (source[2] << 16) | (uint32_t(source[3]) << 24) };
+        if (header.type != expected)
+            throw std::runtime_error{ fmt::format("Unexpected compression type {:#x}", static_cast<int>(header.type)) };
+        if (header.decompressed_size > destination_size)
+            throw std::runtime_error{ fmt::format("Decompressed size {:#x} doesn't fit in {:#x} bytes",
+                                                  header.decompressed_size, destination_size) };
+        return header;
+    }
+}
+
+CompressionHeader::CompressionHeader(uint32_t value)
+    : type(static_cast<CompressionType>((value >> 4) & 0x0F)),
+      data_bits(value & 0x0F),
+      decompressed_size(value >> 8)
+{
+}
+
+size_t decompress(const uint8_t* source, size_t source_size, uint8_t* destination, size_t destination_size)
+{
+    if (source_size < 4)
+        throw std::runtime_error{ "Compressed stream is too small to contain a header" };
+
+    switch (static_cast<CompressionType>((source[0] >> 4) & 0x0F))
+    {
+        case CompressionType::LZ77:         return lz77_decompress(source, source_size, destination, destination_size);
+        case CompressionType::Huffman:      return huffman_decompress(source, source_size, destination, destination_size);
+        case CompressionType::RunLength:    return rl_decompress(source, source_size, destination, destination_size);
+        default:                            throw std::runtime_error{ fmt::format("Unknown compression type {:#x}", source[0] >> 4) };
+    }
+}
+
+size_t lz77_decompress(const uint8_t* source, size_t source_size, uint8_t* destination, size_t destination_size)
+{
+    auto header = read_header(source, source_size, CompressionType::LZ77, destination_size);
+    return lz77_decode<true>(source, source_size, destination, header.decompressed_size);
+}
+
+size_t rl_decompress(const uint8_t* source, size_t source_size, uint8_t* destination, size_t destination_size)
+{
+    auto header = read_header(source, source_size, CompressionType::RunLength, destination_size);
+    const uint8_t* in = source + 4;
+    const uint8_t* in_end = source + source_size;
+    uint32_t size = header.decompressed_size;
+    uint32_t written = 0;
+
+    while (written < size)
+    {
+        if (in == in_end)
+            throw std::runtime_error{ "Malformed RL stream: truncated" };
+
+        uint8_t flag = *in++;
+        if (flag & 0x80) // Compressed
+        {
+            if (in == in_end)
+                throw std::runtime_error{ "Malformed RL stream: truncated" };
+
+            uint32_t length = std::min<uint32_t>((flag & 0x7F) + 3, size - written);
+            std::memset(destination + written, *in++, length);
+            written += length;
+        }
+        else
+        {
+            uint32_t length = std::min<uint32_t>((flag & 0x7F) + 1, size - written);
+            if (static_cast<size_t>(in_end - in) < length)
+                throw std::runtime_error{ "Malformed RL stream: truncated" };
+
+            std::memcpy(destination + written, in, length);
+            in += length;
+            written += length;
+        }
+    }
+
+    return in - source;
+}
+
+size_t huffman_decompress(const uint8_t* source, size_t source_size, uint8_t* destination, size_t destination_size)
+{
+    auto header = read_header(source, source_size, CompressionType::Huffman, destination_size);
+    if (header.data_bits != 4 && header.data_bits != 8)
+        throw std::runtime_error{ fmt::format("Malformed Huffman stream: {} bit data", header.data_bits) };
+    if (source_size < 5)
+        throw std::runtime_error{ "Malformed Huffman stream: truncated" };
+
+    /*
+     * Tree nodes: [0, 5] offset to the children, [6] node 1 is data, [7] node 0 is data.
+     * Children are at (node_offset & ~1) + offset * 2 + 2 (node 0) and + 1 (node 1).
+     */
+    const size_t tree_root = 5;
+    const size_t tree_end = 4 + (source[4] + 1) * 2;
+    size_t bitstream = tree_end;
+    uint32_t size = header.decompressed_size;
+    uint32_t data_mask = (1u << header.data_bits) - 1;
+
+    size_t node = tree_root;
+    uint32_t output = 0;
+    uint32_t output_bits = 0;
+    uint32_t written = 0;
+
+    while (written < size)
+    {
+        if (bitstream + 4 > source_size)
+            throw std::runtime_error{ "Malformed Huffman stream: truncated" };
+
+        uint32_t bits = source[bitstream]
+            | (source[bitstream + 1] << 8)
+            | (source[bitstream + 2] << 16)
+            | (uint32_t(source[bitstream + 3]) << 24);
+        bitstream += 4;
+
+        for (int i = 31; i >= 0 && written < size; i--)
+        {
+            if (node >= tree_end)
+                throw std::runtime_error{ "Malformed Huffman stream: node outside of the tree" };
+
+            bool direction = (bits >> i) & 1;
+            uint8_t value = source[node];
+            size_t child = (node & ~size_t(1)) + (value & 0x3F) * 2 + 2 + direction;
+            bool is_data = direction ? (value & 0x40) : (value & 0x80);
+
+            if (child >= tree_end)
+                throw std::runtime_error{ "Malformed Huffman stream: node outside of the tree" };
+
+            if (!is_data)
+            {
+                node = child;
+                continue;
+            }
+
+            output |= (source[child] & data_mask) << output_bits;
+            output_bits += header.data_bits;
+            node = tree_root;
+
+            if (output_bits == 32)
+            {
+                // The BIOS writes whole words, the tail of the last one is dropped here
+                for (uint32_t b = 0; b < 4 && written < size; b++, output >>= 8)
+                    destination[written++] = output & 0xFF;
+                output = 0;
+                output_bits = 0;
+            }
+        }
+    }
+
+    return bitstream;
+}
+
+size_t lz77_validate(const uint8_t* source, size_t source_size, uint32_t max_size)
+{
+    if (source_size < 4 || source[0] != (static_cast<uint8_t>(CompressionType::LZ77) << 4))
+        return 0;
+
+    uint32_t size = source[1] | (source[2] << 8) | (source[3] << 16);
+    if (size == 0 || size > max_size)
+        return 0;
+
+    return lz77_decode<false>(source, source_size, nullptr, size);
+}
+
+std::vector<CompressedStream> lz77_scan(const uint8_t* data, size_t data_size, uint32_t base_address,
+                                        size_t scan_size, uint32_t max_size, unsigned thread_count)
+{
+    if (thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    scan_size = std::min(scan_size, data_size);
+    const size_t word_count = scan_size / 4;
+    const size_t chunk_words = (word_count + thread_count - 1) / thread_count;
+
+    std::vector<std::vector<CompressedStream>> results(thread_count);
+    std::vector<std::thread> workers;
+
+    for (unsigned t = 0; t < thread_count; t++)
+    {
+        size_t first = std::min(word_count, t * chunk_words);
+        size_t last = std::min(word_count, first + chunk_words);
+
+        workers.emplace_back([=, &results]()
+        {
+            for (size_t offset = first * 4; offset < last * 4; offset += 4)
+            {
+                auto consumed = lz77_validate(data + offset, data_size - offset, max_size);
+                if (consumed != 0)
+                {
+                    results[t].push_back({
+                        static_cast<uint32_t>(base_address + offset),
+                        static_cast<uint32_t>(consumed),
+                        static_cast<uint32_t>(data[offset + 1] | (data[offset + 2] << 8) | (data[offset + 3] << 16))
+                    });
+                }
+            }
+        });
+    }
+
+    for (auto& worker : workers)
+        worker.join();
+
+    // Chunks are contiguous and in order, so concatenating keeps the result sorted
+    std::vector<CompressedStream> streams;
+    for (auto& result : results)
+        streams.insert(streams.end(), result.begin(), result.end());
+
+    return streams;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/**
+ * @brief Compression formats understood by the BIOS decompression functions.
+ *
+ * Stored in bits [4, 7] of the stream header.
+ */
+enum class CompressionType : uint8_t
+{
+    LZ77 = 0x1,
+    Huffman = 0x2,
+    RunLength = 0x3
+};
+
+/**
+ * @brief First word of every compressed stream.
+ *
+ * Encoding
+ * [0, 3] Huffman data size in bits (4 or 8), 0 for other formats
+ * [4, 7] Compression type
+ * [8, 31] Decompressed size in bytes
+ */
+struct CompressionHeader
+{
+    CompressionType type;
+    uint8_t data_bits;
+    uint32_t decompressed_size;
+
+    explicit CompressionHeader(uint32_t value);
+};
+
+/**
+ * @brief A compressed stream found inside a memory range.
+ */
+struct CompressedStream
+{
+    uint32_t address;
+    uint32_t compressed_size;
+    uint32_t decompressed_size;
+};
+
+/**
+ * @brief Decompresses a stream, picking the format from its header.
+ *
+ * Source and destination are plain buffers, so a stream can be decoded straight from
+ * the ROM region returned by GBA_Memory::pointer without copying it first.
+ *
+ * @param source Pointer to the stream header.
+ * @param source_size Bytes readable from source.
+ * @param destination Output buffer.
+ * @param destination_size Capacity of destination. Must hold the decompressed size from the header.
+ * @return size_t Amount of source bytes consumed, including the header.
+ * @throws std::runtime_error If the stream is malformed, truncated or doesn't fit destination.
+ */
+size_t decompress(const uint8_t* source, size_t source_size, uint8_t* destination, size_t destination_size);
+
+size_t lz77_decompress(const uint8_t* source, size_t source_size, uint8_t* destination, size_t destination_size);
+
+size_t rl_decompress(const uint8_t* source, size_t source_size, uint8_t* destination, size_t destination_size);
+
+size_t huffman_decompress(const uint8_t* source, size_t source_size, uint8_t* destination, size_t destination_size);
+
+/**
+ * @brief Checks if a valid LZ77 stream starts at source, without writing the output.
+ *
+ * A stream is valid if its header has the LZ77 type, its decompressed size is in [1, max_size] and
+ * every block can be decoded: no back reference points before the start of the output and the
+ * stream doesn't end before the output is complete.
+ *
+ * @param source Pointer to the stream header.
+ * @param source_size Bytes readable from source.
+ * @param max_size Largest decompressed size accepted.
+ * @return size_t Amount of source bytes the stream uses, or 0 if it isn't valid.
+ */
+size_t lz77_validate(const uint8_t* source, size_t source_size, uint32_t max_size);
+
+/**
+ * @brief Finds every valid LZ77 stream starting at a word aligned address of a range.
+ *
+ * The range is split in chunks which are scanned in parallel.
+ *
+ * @param data Pointer to the first byte of the range, must be word aligned.
+ * @param data_size Bytes readable from data. Streams may extend past scan_size up to this limit.
+ * @param base_address Address of data, used to fill CompressedStream::address.
+ * @param scan_size Size of the range where streams can start.
+ * @param max_size Largest decompressed size accepted.
+ * @param thread_count Amount of worker threads. 0 uses the hardware concurrency.
+ * @return std::vector<CompressedStream> Streams found, sorted by address.
+ */
+std::vector<CompressedStream> lz77_scan(const uint8_t* data, size_t data_size, uint32_t base_address,
+                                        size_t scan_size, uint32_t max_size, unsigned thread_count = 0);
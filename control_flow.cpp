@@ -0,0 +1,783 @@
+#include "control_flow.h"
+#include "bios.h"
+#include "bit_utils.h"
+#include "GBA_Memory.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <fmt/core.h>
+
+namespace
+{
+    constexpr uint8_t register_SP = 13;
+    constexpr uint8_t register_LR = 14;
+    constexpr uint8_t register_PC = 15;
+    constexpr uint8_t condition_always = 0xE;
+
+    /** What an instruction does to the flow of its function. */
+    enum class Flow : uint8_t
+    {
+        Next,       // Continues with the next instruction
+        Jump,       // Branches inside the function
+        Call,       // Calls target and continues with the next instruction
+        TailCall,   // Jumps to another function
+        Return,
+        Indirect,   // Jumps somewhere that can't be known statically
+        Invalid     // Not code
+    };
+
+    struct InstructionFlow
+    {
+        Flow flow = Flow::Next;
+        bool conditional = false;   // The flow may not be taken, execution can continue after it
+        uint32_t size = 4;
+        uint32_t target = 0;        // Jump: address, Call/TailCall: code address
+    };
+
+    /**
+     * Register values known at some point of a block. Only what's needed to resolve branches
+     * through registers is tracked, everything else just makes the register unknown.
+     */
+    class KnownRegisters
+    {
+    public:
+        bool get(uint8_t r, uint32_t& value) const
+        {
+            value = values[r];
+            return (known >> r) & 1;
+        }
+
+        void set(uint8_t r, uint32_t value)
+        {
+            values[r] = value;
+            known |= 1 << r;
+        }
+
+        void forget(uint8_t r)
+        {
+            known &= ~(1 << r);
+        }
+
+        void forget_list(uint16_t list)
+        {
+            known &= ~list;
+        }
+
+        /** R0-R3, R12 and LR don't survive calls. */
+        void forget_scratch()
+        {
+            forget_list(0x500F);
+        }
+
+    private:
+        uint32_t values[16] = { 0 };
+        uint16_t known = 0;
+    };
+
+    bool is_code_address(const GBA_Memory& memory, uint32_t address)
+    {
+        return address < bios_size
+            || (address >= 0x02000000 && address < 0x02040000)     // EWRAM
+            || (address >= 0x03000000 && address < 0x03008000)     // IWRAM
+            || (address >= GBA_Memory::rom_base && address - GBA_Memory::rom_base < memory.rom_size);
+    }
+
+    bool read_literal(const GBA_Memory& memory, uint32_t address, uint32_t& value)
+    {
+        if (!is_code_address(memory, address) || !is_code_address(memory, address + 3))
+            return false;
+        value = memory.peek_word(address);
+        return true;
+    }
+
+    /** Where a branch to a register value lands. BX uses bit 0 to select the instruction set. */
+    void branch_to_register(InstructionFlow& result, uint32_t value, bool interworking, InstructionSet set)
+    {
+        if (interworking ? value & 1 : set == InstructionSet::THUMB)
+            result.target = (value & ~1u) | 1;
+        else
+            result.target = value & ~3u;
+    }
+
+    /**
+     * A jump to a known address is a call when LR already holds the return address,
+     * as after MOV LR, PC.
+     */
+    Flow call_or_tail_call(const KnownRegisters& registers, uint32_t return_address)
+    {
+        uint32_t link;
+        return registers.get(register_LR, link) && (link & ~1u) == return_address ? Flow::Call : Flow::TailCall;
+    }
+
+    InstructionFlow analyse_arm(const GBA_Memory& memory, uint32_t address, KnownRegisters& registers)
+    {
+        InstructionFlow result;
+        auto opcode = memory.peek_word(address);
+        auto condition = static_cast<uint8_t>(opcode >> 28);
+        result.conditional = condition != condition_always;
+
+        auto value_of = [&](uint8_t r, uint32_t& value)
+        {
+            if (r == register_PC)
+            {
+                value = address + 8;
+                return true;
+            }
+            return registers.get(r, value);
+        };
+
+        // Conditional writes leave the register unknown, it depends on the flags
+        auto write = [&](uint8_t r, bool is_known, uint32_t value)
+        {
+            if (is_known && !result.conditional)
+                registers.set(r, value);
+            else
+                registers.forget(r);
+        };
+
+        switch (decode_arm(opcode))
+        {
+            case ArmInstruction::Branch:
+                result.target = address + 8 + sign_extend_24_32(opcode & 0x00FFFFFF) * 4;
+                if ((opcode >> 24) & 1)
+                {
+                    result.flow = Flow::Call;
+                    registers.forget_scratch();
+                }
+                else
+                {
+                    result.flow = Flow::Jump;
+                }
+                break;
+            case ArmInstruction::BX:
+            {
+                uint8_t rm = opcode & 0x0F;
+                uint32_t value;
+                if (rm == register_LR)
+                {
+                    result.flow = Flow::Return;
+                }
+                else if (value_of(rm, value))
+                {
+                    branch_to_register(result, value, true, InstructionSet::ARM);
+                    result.flow = call_or_tail_call(registers, address + 4);
+                    if (result.flow == Flow::Call)
+                        registers.forget_scratch();
+                }
+                else
+                {
+                    result.flow = Flow::Indirect;
+                }
+                break;
+            }
+            case ArmInstruction::DataProcessing:
+            {
+                uint8_t operation = (opcode >> 21) & 0x0F;
+                uint8_t rd = (opcode >> 12) & 0x0F;
+                uint8_t rn = (opcode >> 16) & 0x0F;
+                uint8_t rm = opcode & 0x0F;
+                bool immediate = (opcode >> 25) & 1;
+
+                if (operation >= 0x8 && operation <= 0xB) // TST, TEQ, CMP, CMN
+                    break;
+
+                uint32_t operand = 0;
+                uint32_t base = 0;
+                bool is_known = true;
+                if (immediate)
+                    operand = rotr32_shiftsq(opcode & 0xFF, (opcode >> 8) & 0x0F);
+                else
+                    is_known = ((opcode >> 4) & 0xFF) == 0 && value_of(rm, operand); // Unshifted register
+
+                uint32_t value = 0;
+                switch (operation)
+                {
+                    case 0xD: // MOV
+                        value = operand;
+                        break;
+                    case 0x4: // ADD
+                        is_known = is_known && value_of(rn, base);
+                        value = base + operand;
+                        break;
+                    case 0x2: // SUB
+                        is_known = is_known && value_of(rn, base);
+                        value = base - operand;
+                        break;
+                    default:
+                        is_known = false;
+                        break;
+                }
+
+                if (rd != register_PC)
+                {
+                    write(rd, is_known, value);
+                    break;
+                }
+
+                // MOV PC, LR / SUBS PC, LR, #4
+                bool from_link = operation == 0xD ? !immediate && rm == register_LR : rn == register_LR;
+                if (from_link)
+                {
+                    result.flow = Flow::Return;
+                }
+                else if (is_known)
+                {
+                    branch_to_register(result, value, false, InstructionSet::ARM);
+                    result.flow = call_or_tail_call(registers, address + 4);
+                }
+                else
+                {
+                    result.flow = Flow::Indirect; // Jump tables, ADD PC, PC, R0, LSL #2
+                }
+                break;
+            }
+            case ArmInstruction::SingleDataTransfer:
+            {
+                bool load = (opcode >> 20) & 1;
+                bool pre_indexed = (opcode >> 24) & 1;
+                bool writeback = !pre_indexed || ((opcode >> 21) & 1);
+                uint8_t rd = (opcode >> 12) & 0x0F;
+                uint8_t rn = (opcode >> 16) & 0x0F;
+
+                if (load)
+                {
+                    // LDR Rd, [PC, #offset], a literal pool
+                    uint32_t value = 0;
+                    bool is_known = false;
+                    if (rn == register_PC && !((opcode >> 25) & 1) && pre_indexed && !((opcode >> 22) & 1))
+                    {
+                        uint32_t offset = opcode & 0xFFF;
+                        uint32_t literal = address + 8 + ((opcode >> 23) & 1 ? offset : -offset);
+                        is_known = read_literal(memory, literal, value);
+                    }
+
+                    if (rd == register_PC)
+                    {
+                        if (rn == register_SP)
+                        {
+                            result.flow = Flow::Return; // LDR PC, [SP], #4
+                        }
+                        else if (is_known)
+                        {
+                            branch_to_register(result, value, false, InstructionSet::ARM);
+                            result.flow = call_or_tail_call(registers, address + 4);
+                        }
+                        else
+                        {
+                            result.flow = Flow::Indirect;
+                        }
+                    }
+                    else
+                    {
+                        write(rd, is_known, value);
+                    }
+                }
+
+                if (writeback)
+                    registers.forget(rn);
+                break;
+            }
+            case ArmInstruction::BlockDataTransfer:
+            {
+                uint16_t list = opcode & 0xFFFF;
+                uint8_t rn = (opcode >> 16) & 0x0F;
+                if ((opcode >> 20) & 1)
+                {
+                    registers.forget_list(list);
+                    if ((list >> register_PC) & 1)
+                        result.flow = rn == register_SP ? Flow::Return : Flow::Indirect;
+                }
+                if ((opcode >> 21) & 1)
+                    registers.forget(rn);
+                break;
+            }
+            case ArmInstruction::HalfwordTransfer:
+            {
+                uint8_t rd = (opcode >> 12) & 0x0F;
+                if ((opcode >> 20) & 1)
+                {
+                    registers.forget(rd);
+                    if (rd == register_PC)
+                        result.flow = Flow::Indirect;
+                }
+                if (!((opcode >> 24) & 1) || ((opcode >> 21) & 1))
+                    registers.forget((opcode >> 16) & 0x0F);
+                break;
+            }
+            case ArmInstruction::Multiply:
+                registers.forget((opcode >> 16) & 0x0F);
+                break;
+            case ArmInstruction::MultiplyLong:
+                registers.forget((opcode >> 16) & 0x0F);
+                registers.forget((opcode >> 12) & 0x0F);
+                break;
+            case ArmInstruction::Swap:
+            case ArmInstruction::MRS:
+                registers.forget((opcode >> 12) & 0x0F);
+                break;
+            case ArmInstruction::MSR:
+                break;
+            case ArmInstruction::SoftwareInterrupt:
+                registers.forget_list(0x000F); // BIOS calls return in R0-R3
+                break;
+            case ArmInstruction::CoprocessorTransfer:
+            case ArmInstruction::CoprocessorData:
+            case ArmInstruction::CoprocessorRegister:
+            case ArmInstruction::Undefined:
+                result.flow = Flow::Invalid; // The GBA has no coprocessors, this is data
+                break;
+        }
+
+        return result;
+    }
+
+    InstructionFlow analyse_thumb(const GBA_Memory& memory, uint32_t address, KnownRegisters& registers)
+    {
+        InstructionFlow result;
+        result.size = 2;
+        auto opcode = static_cast<uint16_t>(memory.peek_word(address));
+        const uint32_t pc = address + 4;
+
+        switch (decode_thumb(opcode))
+        {
+            case ThumbInstruction::MoveShifted:
+            case ThumbInstruction::AddSubtract:
+            case ThumbInstruction::ALU:
+            case ThumbInstruction::LoadStoreRegister:
+            case ThumbInstruction::LoadStoreSigned:
+            case ThumbInstruction::LoadStoreImmediate:
+            case ThumbInstruction::LoadStoreHalfword:
+                registers.forget(opcode & 0x07);
+                break;
+            case ThumbInstruction::Immediate:
+            {
+                uint8_t rd = (opcode >> 8) & 0x07;
+                uint32_t immediate = opcode & 0xFF;
+                uint32_t value;
+                switch ((opcode >> 11) & 0x03)
+                {
+                    case 0: // MOV
+                        registers.set(rd, immediate);
+                        break;
+                    case 1: // CMP
+                        break;
+                    case 2: // ADD
+                        if (registers.get(rd, value))
+                            registers.set(rd, value + immediate);
+                        break;
+                    case 3: // SUB
+                        if (registers.get(rd, value))
+                            registers.set(rd, value - immediate);
+                        break;
+                }
+                break;
+            }
+            case ThumbInstruction::HiRegister:
+            {
+                uint8_t operation = (opcode >> 8) & 0x03;
+                uint8_t rs = (opcode >> 3) & 0x0F;
+                uint8_t rd = (opcode & 0x07) | ((opcode >> 4) & 0x08);
+                uint32_t value = pc;
+                bool is_known = rs == register_PC || registers.get(rs, value);
+
+                if (operation == 3) // BX
+                {
+                    if (rs == register_LR)
+                    {
+                        result.flow = Flow::Return;
+                    }
+                    else if (is_known)
+                    {
+                        branch_to_register(result, value, true, InstructionSet::THUMB);
+                        result.flow = call_or_tail_call(registers, address + 2);
+                        if (result.flow == Flow::Call)
+                            registers.forget_scratch();
+                    }
+                    else
+                    {
+                        result.flow = Flow::Indirect;
+                    }
+                }
+                else if (operation == 2) // MOV
+                {
+                    if (rd != register_PC)
+                    {
+                        if (is_known)
+                            registers.set(rd, value);
+                        else
+                            registers.forget(rd);
+                    }
+                    else if (rs == register_LR)
+                    {
+                        result.flow = Flow::Return;
+                    }
+                    else if (is_known)
+                    {
+                        branch_to_register(result, value, false, InstructionSet::THUMB);
+                        result.flow = call_or_tail_call(registers, address + 2);
+                    }
+                    else
+                    {
+                        result.flow = Flow::Indirect;
+                    }
+                }
+                else if (operation == 0) // ADD
+                {
+                    if (rd == register_PC)
+                        result.flow = Flow::Indirect; // Jump tables
+                    else
+                        registers.forget(rd);
+                }
+                break;
+            }
+            case ThumbInstruction::LoadPC:
+            {
+                uint8_t rd = (opcode >> 8) & 0x07;
+                uint32_t value;
+                if (read_literal(memory, (pc & ~2u) + (opcode & 0xFF) * 4, value))
+                    registers.set(rd, value);
+                else
+                    registers.forget(rd);
+                break;
+            }
+            case ThumbInstruction::LoadAddress:
+            {
+                uint8_t rd = (opcode >> 8) & 0x07;
+                if ((opcode >> 11) & 1) // ADD Rd, SP, #offset
+                    registers.forget(rd);
+                else
+                    registers.set(rd, (pc & ~2u) + (opcode & 0xFF) * 4);
+                break;
+            }
+            case ThumbInstruction::LoadStoreSP:
+                registers.forget((opcode >> 8) & 0x07);
+                break;
+            case ThumbInstruction::AddSP:
+                registers.forget(register_SP);
+                break;
+            case ThumbInstruction::PushPop:
+                if ((opcode >> 11) & 1)
+                {
+                    registers.forget_list(opcode & 0xFF);
+                    if ((opcode >> 8) & 1) // POP {..., PC}
+                        result.flow = Flow::Return;
+                }
+                registers.forget(register_SP);
+                break;
+            case ThumbInstruction::LoadStoreMultiple:
+                if ((opcode >> 11) & 1)
+                    registers.forget_list(opcode & 0xFF);
+                registers.forget((opcode >> 8) & 0x07);
+                break;
+            case ThumbInstruction::ConditionalBranch:
+                result.flow = Flow::Jump;
+                result.conditional = true;
+                result.target = pc + sign_extend<uint32_t>(opcode & 0xFF, 8) * 2;
+                break;
+            case ThumbInstruction::SoftwareInterrupt:
+                registers.forget_list(0x000F);
+                break;
+            case ThumbInstruction::Branch:
+                result.flow = Flow::Jump;
+                result.target = pc + sign_extend<uint32_t>(opcode & 0x7FF, 11) * 2;
+                break;
+            case ThumbInstruction::LongBranchPrefix:
+            {
+                auto suffix = static_cast<uint16_t>(memory.peek_word(address) >> 16);
+                if (decode_thumb(suffix) == ThumbInstruction::LongBranchSuffix)
+                {
+                    result.flow = Flow::Call;
+                    result.size = 4;
+                    result.target = (pc + (sign_extend<uint32_t>(opcode & 0x7FF, 11) << 12) + (suffix & 0x7FF) * 2) | 1;
+                    registers.forget_scratch();
+                }
+                else
+                {
+                    registers.forget(register_LR);
+                }
+                break;
+            }
+            case ThumbInstruction::LongBranchSuffix:
+                // Lone second half, a call through whatever LR holds
+                registers.forget_scratch();
+                break;
+            case ThumbInstruction::Undefined:
+                result.flow = Flow::Invalid;
+                break;
+        }
+
+        return result;
+    }
+
+    /**
+     * Walks the code reachable from a function entry without following calls, then splits the
+     * instructions found into basic blocks.
+     */
+    Function explore(const GBA_Memory& memory, uint32_t code_address)
+    {
+        Function function;
+        function.set = code_address & 1 ? InstructionSet::THUMB : InstructionSet::ARM;
+        function.entry = code_address & (function.set == InstructionSet::THUMB ? ~1u : ~3u);
+
+        std::map<uint32_t, InstructionFlow> instructions;
+        std::unordered_set<uint32_t> leaders{ function.entry };
+        std::vector<uint32_t> pending{ function.entry };
+
+        while (!pending.empty())
+        {
+            auto address = pending.back();
+            pending.pop_back();
+            KnownRegisters registers;
+
+            while (is_code_address(memory, address) && instructions.count(address) == 0)
+            {
+                auto result = function.set == InstructionSet::ARM
+                    ? analyse_arm(memory, address, registers)
+                    : analyse_thumb(memory, address, registers);
+
+                if (result.flow == Flow::Invalid)
+                    break;
+
+                instructions.emplace(address, result);
+                auto next = address + result.size;
+
+                if (result.flow == Flow::Call || result.flow == Flow::TailCall)
+                {
+                    function.calls.push_back({ address, function.code_address(), result.target });
+                }
+                else if (result.flow == Flow::Jump && leaders.insert(result.target).second)
+                {
+                    pending.push_back(result.target);
+                }
+
+                if (result.flow == Flow::Next || result.flow == Flow::Call)
+                {
+                    address = next;
+                }
+                else if (result.conditional)
+                {
+                    leaders.insert(next);
+                    address = next;
+                }
+                else
+                {
+                    break;
+                }
+            }
+        }
+
+        // Blocks end after branches and before the targets of other branches
+        BasicBlock* block = nullptr;
+        const InstructionFlow* last = nullptr;
+
+        auto close_block = [&]()
+        {
+            auto next = block->end;
+            bool falls_through = last->flow == Flow::Next || last->flow == Flow::Call || last->conditional;
+            if (last->flow == Flow::Jump && instructions.count(last->target) != 0)
+                block->successors.push_back(last->target);
+            if (falls_through && instructions.count(next) != 0 && next != last->target)
+                block->successors.push_back(next);
+        };
+
+        for (auto& [address, result] : instructions)
+        {
+            bool starts_block = block == nullptr
+                || block->end != address
+                || leaders.count(address) != 0
+                || (last->flow != Flow::Next && last->flow != Flow::Call);
+
+            if (starts_block)
+            {
+                if (block != nullptr)
+                    close_block();
+                function.blocks.push_back({ address, address, {} });
+                block = &function.blocks.back();
+            }
+
+            block->end = address + result.size;
+            last = &result;
+        }
+
+        if (block != nullptr)
+            close_block();
+
+        return function;
+    }
+
+    bool precedes(const Function& function, uint32_t code_address)
+    {
+        return function.code_address() < code_address;
+    }
+}
+
+ControlFlowGraph::ControlFlowGraph(const GBA_Memory& memory)
+    : memory(memory)
+{
+}
+
+void ControlFlowGraph::add_entry_point(uint32_t code_address)
+{
+    entry_points.push_back(code_address);
+    is_analysed = false;
+}
+
+void ControlFlowGraph::analyse(unsigned thread_count)
+{
+    if (thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<uint32_t> worklist = entry_points;
+    if (memory.rom_size != 0)
+        worklist.push_back(GBA_Memory::rom_base);
+
+    // Installed by the game at startup, the BIOS jumps to it in ARM state
+    auto irq_handler = memory.peek_word(bios_irq_handler_pointer);
+    if (irq_handler != 0 && is_code_address(memory, irq_handler))
+        worklist.push_back(irq_handler & ~3u);
+
+    std::unordered_set<uint32_t> queued{ worklist.begin(), worklist.end() };
+    std::vector<Function> found;
+    std::mutex mutex;
+    std::condition_variable changed;
+    unsigned busy = 0;
+
+    auto worker = [&]()
+    {
+        std::unique_lock<std::mutex> lock{ mutex };
+        while (true)
+        {
+            changed.wait(lock, [&]() { return !worklist.empty() || busy == 0; });
+            if (worklist.empty())
+                break;
+
+            auto code_address = worklist.back();
+            worklist.pop_back();
+            busy++;
+
+            lock.unlock();
+            auto function = explore(memory, code_address);
+            lock.lock();
+
+            for (auto& call : function.calls)
+            {
+                if (queued.insert(call.target).second)
+                    worklist.push_back(call.target);
+            }
+            if (!function.blocks.empty())
+                found.push_back(std::move(function));
+
+            busy--;
+            changed.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < thread_count; t++)
+        workers.emplace_back(worker);
+    for (auto& thread : workers)
+        thread.join();
+
+    std::sort(found.begin(), found.end(),
+              [](auto& a, auto& b) { return a.code_address() < b.code_address(); });
+    function_list = std::move(found);
+
+    for (auto& caller : function_list)
+    {
+        for (auto& call : caller.calls)
+        {
+            auto callee = std::lower_bound(function_list.begin(), function_list.end(), call.target, precedes);
+            if (callee != function_list.end() && callee->code_address() == call.target)
+                callee->callers.push_back(call);
+        }
+    }
+
+    block_index.clear();
+    for (uint32_t i = 0; i < function_list.size(); i++)
+    {
+        auto& function = function_list[i];
+        std::sort(function.callers.begin(), function.callers.end(),
+                  [](auto& a, auto& b) { return a.address < b.address; });
+        for (auto& block : function.blocks)
+            block_index.push_back({ block.begin, block.end, 0, i });
+    }
+
+    std::sort(block_index.begin(), block_index.end(),
+              [](auto& a, auto& b) { return a.begin < b.begin; });
+    uint32_t max_end = 0;
+    for (auto& entry : block_index)
+    {
+        max_end = std::max(max_end, entry.end);
+        entry.max_end = max_end;
+    }
+
+    is_analysed = true;
+}
+
+void ControlFlowGraph::invalidate(uint32_t begin, uint32_t end)
+{
+    if (!is_analysed)
+        return;
+
+    // max_end of the last block starting before end is the largest end of all of them
+    auto entry = std::lower_bound(block_index.begin(), block_index.end(), end,
+                                  [](auto& entry, uint32_t value) { return entry.begin < value; });
+    if (entry != block_index.begin() && std::prev(entry)->max_end > begin)
+        is_analysed = false;
+}
+
+const Function* ControlFlowGraph::function(uint32_t code_address) const
+{
+    auto found = std::lower_bound(function_list.begin(), function_list.end(), code_address, precedes);
+    if (found == function_list.end() || found->code_address() != code_address)
+        return nullptr;
+    return &*found;
+}
+
+std::vector<const Function*> ControlFlowGraph::enclosing_functions(uint32_t address) const
+{
+    std::vector<const Function*> enclosing;
+    auto entry = std::upper_bound(block_index.begin(), block_index.end(), address,
+                                  [](uint32_t value, auto& entry) { return value < entry.begin; });
+
+    while (entry != block_index.begin())
+    {
+        --entry;
+        if (entry->max_end <= address)
+            break;
+        if (address < entry->end)
+        {
+            auto function = &function_list[entry->function];
+            if (std::find(enclosing.begin(), enclosing.end(), function) == enclosing.end())
+                enclosing.push_back(function);
+        }
+    }
+
+    return enclosing;
+}
+
+std::string ControlFlowGraph::symbolize(uint32_t address) const
+{
+    auto enclosing = enclosing_functions(address);
+    if (enclosing.empty())
+        return {};
+
+    // With shared code, the closest entry before the address reads best
+    auto function = *std::min_element(enclosing.begin(), enclosing.end(), [&](auto a, auto b)
+    {
+        return address - a->entry < address - b->entry;
+    });
+
+    if (address == function->entry)
+        return function_name(*function);
+    return fmt::format("{}+{:#x}", function_name(*function), address - function->entry);
+}
+
+std::string ControlFlowGraph::function_name(const Function& function)
+{
+    return fmt::format("sub_{:0>8x}", function.entry);
+}
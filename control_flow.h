@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "decoder.h"
+
+class GBA_Memory;
+
+/**
+ * @brief Straight line code, entered only at begin and left only after its last instruction.
+ */
+struct BasicBlock
+{
+    uint32_t begin;
+    uint32_t end;                       // Exclusive
+    std::vector<uint32_t> successors;   // Blocks of the same function reached from this one
+};
+
+/**
+ * @brief A call (BL, MOV LR, PC + BX...) or a tail jump from one function to another.
+ *
+ * Functions are identified by their code address, the entry with bit 0 set for THUMB, as BX
+ * takes it.
+ */
+struct CallSite
+{
+    uint32_t address;   // Address of the call instruction
+    uint32_t caller;    // Code address of the calling function
+    uint32_t target;    // Code address of the called function
+};
+
+/**
+ * @brief Code reachable from an entry point without following calls.
+ */
+struct Function
+{
+    uint32_t entry = 0;
+    InstructionSet set = InstructionSet::ARM;
+    std::vector<BasicBlock> blocks;     // Sorted by address
+    std::vector<CallSite> calls;        // Sorted by address
+    std::vector<CallSite> callers;      // Sorted by address
+
+    uint32_t code_address() const { return set == InstructionSet::THUMB ? entry | 1 : entry; }
+};
+
+/**
+ * @brief Control flow graph of the code reachable from a set of entry points.
+ *
+ * The walk starts at the beginning of the ROM, where the entry_point branch of
+ * GBA_CartridgeHeader lives, at the user IRQ handler once the game has installed it and at any
+ * address added with add_entry_point. B and conditional branches extend the current function,
+ * BL and interworking BX start new ones. Register values loaded from literal pools, ADR and
+ * MOV are tracked inside each block, so LDR R0, =function / BX R0 is followed to the right
+ * instruction set. Returns, jump tables and branches through unknown registers end the walk.
+ *
+ * Functions are explored in parallel: a worker walks a whole function on its own and queues the
+ * functions it calls. The graph is a snapshot of memory at the time of analyse().
+ */
+class ControlFlowGraph
+{
+public:
+    explicit ControlFlowGraph(const GBA_Memory& memory);
+
+    /**
+     * @brief Adds an entry point to the next analysis, dropping the current one.
+     *
+     * @param code_address Address of the function. Bit 0 selects THUMB, as in BX.
+     */
+    void add_entry_point(uint32_t code_address);
+
+    /**
+     * @brief Walks the code reachable from the entry points.
+     *
+     * @param thread_count Amount of worker threads. 0 uses the hardware concurrency.
+     */
+    void analyse(unsigned thread_count = 0);
+
+    /**
+     * @brief Drops the analysis if any of its blocks overlaps code rewritten in [begin, end).
+     */
+    void invalidate(uint32_t begin, uint32_t end);
+
+    bool analysed() const { return is_analysed; }
+
+    /**
+     * @brief Functions found, sorted by code address.
+     */
+    const std::vector<Function>& functions() const { return function_list; }
+
+    /**
+     * @brief Function starting at a code address (bit 0 set for THUMB).
+     *
+     * @return const Function* nullptr if there's none.
+     */
+    const Function* function(uint32_t code_address) const;
+
+    /**
+     * @brief Functions with a block containing address.
+     *
+     * There may be more than one when functions share code, as with tail merged epilogues.
+     */
+    std::vector<const Function*> enclosing_functions(uint32_t address) const;
+
+    /**
+     * @brief Describes an address as function + offset, e.g. sub_08000120+0x1c.
+     *
+     * @return std::string Empty if the address isn't in any function.
+     */
+    std::string symbolize(uint32_t address) const;
+
+    static std::string function_name(const Function& function);
+
+private:
+    /** Block of function_list[function], sorted by begin for enclosing_functions. */
+    struct BlockEntry
+    {
+        uint32_t begin;
+        uint32_t end;
+        uint32_t max_end;   // Largest end up to this entry, bounds the backwards search
+        uint32_t function;
+    };
+
+    const GBA_Memory& memory;
+    std::vector<uint32_t> entry_points;
+    std::vector<Function> function_list;
+    std::vector<BlockEntry> block_index;
+    bool is_analysed = false;
+};
@@ -0,0 +1,216 @@
+#include "coverage.h"
+#include <algorithm>
+#include <bitset>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <fmt/core.h>
+
+namespace
+{
+    constexpr char file_magic[8] = { 'G', 'B', 'A', 'C', 'O', 'V', '1', '\0' };
+    constexpr size_t word_count = CoverageMap::bit_count / 64;
+
+    static_assert(CoverageMap::bit_count % 64 == 0, "Areas must fill whole words");
+
+    void set_bits(std::vector<uint64_t>& words, size_t first, size_t last)
+    {
+        while (first < last)
+        {
+            auto shift = first % 64;
+            auto count = std::min<size_t>(64 - shift, last - first);
+            auto mask = count == 64 ? ~uint64_t{ 0 } : ((uint64_t{ 1 } << count) - 1) << shift;
+            words[first / 64] |= mask;
+            first += count;
+        }
+    }
+
+    bool test_bit(const std::vector<uint64_t>& words, size_t bit)
+    {
+        return (words[bit / 64] >> (bit % 64)) & 1;
+    }
+}
+
+size_t CoverageMap::bit_index(uint32_t address)
+{
+    switch (address >> 24)
+    {
+        case 0x02: return areas[1].first_bit + ((address & (areas[1].size - 1)) >> 1);
+        case 0x03: return areas[2].first_bit + ((address & (areas[2].size - 1)) >> 1);
+        case 0x08: case 0x09: case 0x0A: case 0x0B: case 0x0C: case 0x0D:
+            return areas[0].first_bit + ((address & (areas[0].size - 1)) >> 1);
+        default: return npos;
+    }
+}
+
+size_t CoverageMap::area_end(size_t bit)
+{
+    for (auto& area : areas)
+    {
+        if (bit < area.first_bit + area.size / 2)
+            return area.first_bit + area.size / 2;
+    }
+    return bit_count;
+}
+
+void CoverageMap::allocate()
+{
+    if (!allocated())
+    {
+        executed.assign(word_count, 0);
+        thumb_code.assign(word_count, 0);
+    }
+}
+
+void CoverageMap::clear()
+{
+    std::fill(executed.begin(), executed.end(), 0);
+    std::fill(thumb_code.begin(), thumb_code.end(), 0);
+}
+
+void CoverageMap::mark(uint32_t begin, uint32_t end, bool thumb)
+{
+    auto first = bit_index(begin);
+    if (end <= begin || first == npos || !allocated())
+    {
+        return;
+    }
+
+    auto last = std::min(first + (end - begin + 1) / 2, area_end(first));
+    set_bits(executed, first, last);
+    if (thumb)
+    {
+        set_bits(thumb_code, first, last);
+    }
+}
+
+bool CoverageMap::covered(uint32_t address) const
+{
+    auto bit = bit_index(address);
+    return bit != npos && allocated() && test_bit(executed, bit);
+}
+
+bool CoverageMap::thumb(uint32_t address) const
+{
+    auto bit = bit_index(address);
+    return bit != npos && allocated() && test_bit(thumb_code, bit);
+}
+
+size_t CoverageMap::count(uint32_t begin, uint32_t end) const
+{
+    size_t result = 0;
+    for (auto address = begin & ~1u; address < end && address >= (begin & ~1u); address += 2)
+    {
+        auto bit = bit_index(address);
+        if (bit == npos || !allocated())
+        {
+            continue;
+        }
+        // Whole words at once where the range allows it
+        if (bit % 64 == 0 && end - address >= 128 && area_end(bit) - bit >= 64)
+        {
+            result += std::bitset<64>(executed[bit / 64]).count();
+            address += 126;
+            continue;
+        }
+        result += test_bit(executed, bit);
+    }
+    return result;
+}
+
+std::vector<std::pair<uint32_t, uint32_t>> CoverageMap::ranges(uint32_t begin, uint32_t end) const
+{
+    std::vector<std::pair<uint32_t, uint32_t>> result;
+    for (auto address = begin & ~1u; address < end && address >= (begin & ~1u); address += 2)
+    {
+        auto bit = bit_index(address);
+        if (bit == npos || !allocated())
+        {
+            continue;
+        }
+        // Skips the empty words, most of a ROM is never executed
+        if (bit % 64 == 0 && end - address >= 128 && area_end(bit) - bit >= 64 && executed[bit / 64] == 0)
+        {
+            address += 126;
+            continue;
+        }
+        if (!test_bit(executed, bit))
+        {
+            continue;
+        }
+
+        if (!result.empty() && result.back().second == address)
+            result.back().second = address + 2;
+        else
+            result.emplace_back(address, address + 2);
+    }
+    return result;
+}
+
+void CoverageMap::merge(const CoverageMap& other)
+{
+    if (!other.allocated())
+    {
+        return;
+    }
+    allocate();
+    for (size_t i = 0; i < word_count; i++)
+    {
+        executed[i] |= other.executed[i];
+        thumb_code[i] |= other.thumb_code[i];
+    }
+}
+
+void CoverageMap::save(const std::string& path) const
+{
+    std::ofstream file{ path, std::ios::binary };
+    if (!file.is_open())
+    {
+        throw std::runtime_error{ fmt::format("Could not open {}", path) };
+    }
+
+    // A map never allocated is saved as empty
+    std::vector<uint64_t> none;
+    if (!allocated())
+        none.assign(word_count, 0);
+    auto& executed_words = allocated() ? executed : none;
+    auto& thumb_words = allocated() ? thumb_code : none;
+
+    uint64_t bits = bit_count;
+    file.write(file_magic, sizeof(file_magic));
+    file.write(reinterpret_cast<const char*>(&bits), sizeof(bits));
+    file.write(reinterpret_cast<const char*>(executed_words.data()), word_count * sizeof(uint64_t));
+    file.write(reinterpret_cast<const char*>(thumb_words.data()), word_count * sizeof(uint64_t));
+    if (!file)
+    {
+        throw std::runtime_error{ fmt::format("Could not write {}", path) };
+    }
+}
+
+void CoverageMap::merge_file(const std::string& path)
+{
+    std::ifstream file{ path, std::ios::binary };
+    if (!file.is_open())
+    {
+        throw std::runtime_error{ fmt::format("Could not open {}", path) };
+    }
+
+    char magic[sizeof(file_magic)];
+    uint64_t bits = 0;
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast<char*>(&bits), sizeof(bits));
+    if (!file || std::memcmp(magic, file_magic, sizeof(magic)) != 0 || bits != bit_count)
+    {
+        throw std::runtime_error{ fmt::format("{} isn't a coverage map", path) };
+    }
+
+    CoverageMap other;
+    other.allocate();
+    file.read(reinterpret_cast<char*>(other.executed.data()), word_count * sizeof(uint64_t));
+    file.read(reinterpret_cast<char*>(other.thumb_code.data()), word_count * sizeof(uint64_t));
+    if (!file)
+    {
+        throw std::runtime_error{ fmt::format("{} is truncated", path) };
+    }
+    merge(other);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Instructions executed, one bit per halfword of ROM, EWRAM and IWRAM.
+ *
+ * Mirrors share the bits of the address they mirror. A second bitmap keeps which halfwords ran
+ * as THUMB code, so listings disassemble them in the set they executed in. The BIOS is high
+ * level emulated and isn't covered.
+ *
+ * The cpu marks a run of consecutive instructions at a time, see GBA_Cpu::track_coverage, so
+ * the bits are only written when execution jumps.
+ */
+class CoverageMap
+{
+public:
+    /** Memory area with bits, from first_bit on. */
+    struct Area
+    {
+        uint32_t base;
+        uint32_t size;
+        size_t first_bit;
+    };
+
+    static constexpr std::array<Area, 3> areas = { {
+        { 0x08000000, 0x02000000, 0 },          // ROM, also its 0x0A000000 and 0x0C000000 mirrors
+        { 0x02000000, 0x00040000, 0x01000000 }, // EWRAM
+        { 0x03000000, 0x00008000, 0x01020000 }  // IWRAM
+    } };
+    static constexpr size_t bit_count = 0x01024000;
+
+    /** Allocates the bitmaps, nothing is covered until then. */
+    void allocate();
+    bool allocated() const { return !executed.empty(); }
+    void clear();
+
+    /**
+     * @brief Marks the halfwords of [begin, end) as executed.
+     *
+     * Addresses outside the covered areas are ignored, ranges are cut at the end of their area.
+     */
+    void mark(uint32_t begin, uint32_t end, bool thumb);
+
+    bool covered(uint32_t address) const;
+    /** Whether the halfword at address ran as THUMB code. */
+    bool thumb(uint32_t address) const;
+
+    /** Amount of executed halfwords inside [begin, end). */
+    size_t count(uint32_t begin, uint32_t end) const;
+
+    /** Executed ranges inside [begin, end), consecutive halfwords merged. */
+    std::vector<std::pair<uint32_t, uint32_t>> ranges(uint32_t begin, uint32_t end) const;
+
+    /** Adds the executed halfwords of another map, as if both runs had been one. */
+    void merge(const CoverageMap& other);
+
+    /**
+     * @brief Writes both bitmaps after a small header, to be merged back with merge_file.
+     *
+     * @throws std::runtime_error If the file can't be written.
+     */
+    void save(const std::string& path) const;
+
+    /**
+     * @brief Merges a map written by save.
+     *
+     * @throws std::runtime_error If the file can't be read or isn't a coverage map.
+     */
+    void merge_file(const std::string& path);
+
+private:
+    static constexpr size_t npos = ~size_t{ 0 };
+
+    /** Bit of the halfword at address, npos outside the areas. */
+    static size_t bit_index(uint32_t address);
+    /** Bit one past the last of the area holding bit. */
+    static size_t area_end(size_t bit);
+
+    std::vector<uint64_t> executed;
+    std::vector<uint64_t> thumb_code;
+};
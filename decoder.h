@@ -0,0 +1,179 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/**
+ * @brief Instruction set used to decode an address.
+ */
+enum class InstructionSet : uint8_t
+{
+    ARM,
+    THUMB
+};
+
+/**
+ * @brief Instruction classes of the ARMv4T ARM instruction set.
+ */
+enum class ArmInstruction : uint8_t
+{
+    DataProcessing,
+    Multiply,
+    MultiplyLong,
+    Swap,
+    HalfwordTransfer,
+    MRS,
+    MSR,
+    BX,
+    SingleDataTransfer,
+    BlockDataTransfer,
+    Branch,
+    CoprocessorTransfer,
+    CoprocessorData,
+    CoprocessorRegister,
+    SoftwareInterrupt,
+    Undefined
+};
+
+/**
+ * @brief Instruction formats of the THUMB instruction set.
+ */
+enum class ThumbInstruction : uint8_t
+{
+    MoveShifted,            // LSLS/LSRS/ASRS Rd, Rs, #imm5
+    AddSubtract,            // ADDS/SUBS Rd, Rs, Rn/#imm3
+    Immediate,              // MOVS/CMP/ADDS/SUBS Rd, #imm8
+    ALU,                    // Rd = Rd op Rs
+    HiRegister,             // ADD/CMP/MOV with high registers, BX
+    LoadPC,                 // LDR Rd, [PC, #imm8]
+    LoadStoreRegister,      // LDR/STR/LDRB/STRB Rd, [Rb, Ro]
+    LoadStoreSigned,        // STRH/LDRSB/LDRH/LDRSH Rd, [Rb, Ro]
+    LoadStoreImmediate,     // LDR/STR/LDRB/STRB Rd, [Rb, #imm5]
+    LoadStoreHalfword,      // LDRH/STRH Rd, [Rb, #imm5]
+    LoadStoreSP,            // LDR/STR Rd, [SP, #imm8]
+    LoadAddress,            // ADD Rd, PC/SP, #imm8
+    AddSP,                  // ADD SP, #+-imm7
+    PushPop,                // PUSH/POP {Rlist}
+    LoadStoreMultiple,      // LDMIA/STMIA Rb!, {Rlist}
+    ConditionalBranch,      // B{cond} label
+    SoftwareInterrupt,      // SWI #imm8
+    Branch,                 // B label
+    LongBranchPrefix,       // BL label, first half (offset high)
+    LongBranchSuffix,       // BL label, second half (offset low)
+    Undefined
+};
+
+/**
+ * @brief Classifies an ARM opcode from bits [20, 27] and [4, 7].
+ *
+ * @param index ((opcode >> 16) & 0xFF0) | ((opcode >> 4) & 0x0F)
+ */
+constexpr ArmInstruction classify_arm(uint32_t index)
+{
+    uint32_t high = index >> 4;     // bits [20, 27]
+    uint32_t low = index & 0x0F;    // bits [4, 7]
+
+    switch (high >> 5)              // bits [25, 27]
+    {
+        case 0b000:
+            if (high == 0x12 && low == 0x1)
+                return ArmInstruction::BX;
+            if (low == 0x9)
+            {
+                if ((high & 0xFC) == 0x00) return ArmInstruction::Multiply;
+                if ((high & 0xF8) == 0x08) return ArmInstruction::MultiplyLong;
+                if ((high & 0xFB) == 0x10) return ArmInstruction::Swap;
+                return ArmInstruction::Undefined;
+            }
+            if ((low & 0x9) == 0x9)
+                return ArmInstruction::HalfwordTransfer;
+            if ((high & 0x19) == 0x10) // TST/TEQ/CMP/CMN without S are PSR transfers
+            {
+                if ((high & 0x1B) == 0x10 && low == 0) return ArmInstruction::MRS;
+                if ((high & 0x1B) == 0x12 && low == 0) return ArmInstruction::MSR;
+                return ArmInstruction::Undefined;
+            }
+            return ArmInstruction::DataProcessing;
+        case 0b001:
+            if ((high & 0x1B) == 0x12)
+                return ArmInstruction::MSR;
+            if ((high & 0x19) == 0x10)
+                return ArmInstruction::Undefined;
+            return ArmInstruction::DataProcessing;
+        case 0b010:
+            return ArmInstruction::SingleDataTransfer;
+        case 0b011:
+            return (low & 1) ? ArmInstruction::Undefined : ArmInstruction::SingleDataTransfer;
+        case 0b100:
+            return ArmInstruction::BlockDataTransfer;
+        case 0b101:
+            return ArmInstruction::Branch;
+        case 0b110:
+            return ArmInstruction::CoprocessorTransfer;
+        default:
+            if (high & 0x10)
+                return ArmInstruction::SoftwareInterrupt;
+            return (low & 1) ? ArmInstruction::CoprocessorRegister : ArmInstruction::CoprocessorData;
+    }
+}
+
+/**
+ * @brief Classifies a THUMB opcode from bits [6, 15].
+ *
+ * @param index opcode >> 6
+ */
+constexpr ThumbInstruction classify_thumb(uint32_t index)
+{
+    uint32_t opcode = index << 6;
+
+    if ((opcode & 0xF800) == 0x1800) return ThumbInstruction::AddSubtract;
+    if ((opcode & 0xE000) == 0x0000) return ThumbInstruction::MoveShifted;
+    if ((opcode & 0xE000) == 0x2000) return ThumbInstruction::Immediate;
+    if ((opcode & 0xFC00) == 0x4000) return ThumbInstruction::ALU;
+    if ((opcode & 0xFC00) == 0x4400) return ThumbInstruction::HiRegister;
+    if ((opcode & 0xF800) == 0x4800) return ThumbInstruction::LoadPC;
+    if ((opcode & 0xF200) == 0x5000) return ThumbInstruction::LoadStoreRegister;
+    if ((opcode & 0xF200) == 0x5200) return ThumbInstruction::LoadStoreSigned;
+    if ((opcode & 0xE000) == 0x6000) return ThumbInstruction::LoadStoreImmediate;
+    if ((opcode & 0xF000) == 0x8000) return ThumbInstruction::LoadStoreHalfword;
+    if ((opcode & 0xF000) == 0x9000) return ThumbInstruction::LoadStoreSP;
+    if ((opcode & 0xF000) == 0xA000) return ThumbInstruction::LoadAddress;
+    if ((opcode & 0xFF00) == 0xB000) return ThumbInstruction::AddSP;
+    if ((opcode & 0xF600) == 0xB400) return ThumbInstruction::PushPop;
+    if ((opcode & 0xF000) == 0xC000) return ThumbInstruction::LoadStoreMultiple;
+    if ((opcode & 0xFF00) == 0xDF00) return ThumbInstruction::SoftwareInterrupt;
+    if ((opcode & 0xFF00) == 0xDE00) return ThumbInstruction::Undefined;
+    if ((opcode & 0xF000) == 0xD000) return ThumbInstruction::ConditionalBranch;
+    if ((opcode & 0xF800) == 0xE000) return ThumbInstruction::Branch;
+    if ((opcode & 0xF800) == 0xF000) return ThumbInstruction::LongBranchPrefix;
+    if ((opcode & 0xF800) == 0xF800) return ThumbInstruction::LongBranchSuffix;
+    return ThumbInstruction::Undefined;
+}
+
+template<class Instruction, size_t Size, class Classifier>
+constexpr std::array<Instruction, Size> make_decode_table(Classifier classifier)
+{
+    std::array<Instruction, Size> table{};
+    for (size_t i = 0; i < Size; i++)
+        table[i] = classifier(static_cast<uint32_t>(i));
+    return table;
+}
+
+/**
+ * Decode tables shared by the interpreter and the disassembler.
+ */
+inline constexpr std::array<ArmInstruction, 4096> arm_decode_table =
+    make_decode_table<ArmInstruction, 4096>(classify_arm);
+
+inline constexpr std::array<ThumbInstruction, 1024> thumb_decode_table =
+    make_decode_table<ThumbInstruction, 1024>(classify_thumb);
+
+inline ArmInstruction decode_arm(uint32_t opcode)
+{
+    return arm_decode_table[((opcode >> 16) & 0xFF0) | ((opcode >> 4) & 0x0F)];
+}
+
+inline ThumbInstruction decode_thumb(uint16_t opcode)
+{
+    return thumb_decode_table[opcode >> 6];
+}
@@ -0,0 +1,368 @@
+#include "disassembly_index.h"
+#include "assembly.h"
+#include "bios.h"
+#include "GBA_Memory.h"
+#include "GBA_Cpu.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <fmt/core.h>
+
+namespace
+{
+    struct AreaBounds
+    {
+        uint32_t base;
+        uint32_t size;
+    };
+
+    constexpr AreaBounds fixed_areas[] = {
+        { 0x00000000, bios_size },  // BIOS
+        { 0x02000000, 0x40000 },    // EWRAM
+        { 0x03000000, 0x8000 },     // IWRAM
+    };
+
+    /*
+     * Sidecar file layout, in host byte order:
+     *   SidecarHeader
+     *   Per section, at SidecarSection::offset:
+     *     uint32_t words[entry_count]
+     *     uint32_t text_offsets[entry_count]
+     *     char text[text_size]
+     */
+    constexpr char sidecar_magic[8] = { 'G', 'B', 'A', 'D', 'I', 'S', 'I', 'X' };
+    constexpr uint32_t sidecar_version = 2;
+
+    struct SidecarSection
+    {
+        uint32_t base;
+        uint32_t entry_count;
+        uint64_t offset;
+        uint64_t text_size;
+    };
+
+    struct SidecarHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t rom_size;
+        uint64_t rom_hash;
+        SidecarSection sections[2]; // ARM, THUMB
+    };
+
+    static_assert(sizeof(SidecarHeader) == 72, "SidecarHeader must not have padding");
+
+    size_t section_size(uint32_t entry_count, uint64_t text_size)
+    {
+        return entry_count * sizeof(uint32_t) * 2 + text_size;
+    }
+
+    uint64_t align_8(uint64_t value)
+    {
+        return (value + 7) & ~uint64_t(7);
+    }
+}
+
+DisassemblyIndex::DisassemblyIndex(const GBA_Memory& memory, std::string cache_directory)
+    : memory(memory),
+      cache_directory(std::move(cache_directory))
+{
+}
+
+const char* DisassemblyIndex::disassemble(uint32_t address, InstructionSet set, char* buffer, size_t size)
+{
+    auto indexed_region = region(address, set);
+    if (indexed_region != nullptr && (address - indexed_region->base) % indexed_region->step() == 0)
+    {
+        auto entry = indexed_region->entry(address);
+        if (is_current(*indexed_region, entry))
+        {
+            return indexed_region->entry_text(entry);
+        }
+    }
+
+    ::disassemble(memory.peek_word(address), address, set, buffer, size);
+    return buffer;
+}
+
+const DisassemblyRegion* DisassemblyIndex::region(uint32_t address, InstructionSet set)
+{
+    auto set_index = static_cast<size_t>(set);
+
+    if (address >= GBA_Memory::rom_base && address - GBA_Memory::rom_base < memory.rom_size)
+    {
+        if (!indexed[AREA_ROM][set_index] || indexed_rom_size != memory.rom_size)
+        {
+            load_rom_index();
+        }
+        auto& rom_region = regions[AREA_ROM][set_index];
+        return rom_region.contains(address) ? &rom_region : nullptr;
+    }
+
+    for (size_t area = 0; area < std::size(fixed_areas); area++)
+    {
+        auto& bounds = fixed_areas[area];
+        if (address < bounds.base || address - bounds.base >= bounds.size)
+        {
+            continue;
+        }
+
+        if (!indexed[area][set_index])
+        {
+            regions[area][set_index] = build(memory, bounds.base, bounds.size, set);
+            indexed[area][set_index] = true;
+        }
+        return &regions[area][set_index];
+    }
+
+    return nullptr;
+}
+
+bool DisassemblyIndex::is_current(const DisassemblyRegion& region, size_t entry) const
+{
+    return memory.peek_word(region.base + static_cast<uint32_t>(entry) * region.step()) == region.words[entry];
+}
+
+std::string DisassemblyIndex::sidecar_path() const
+{
+    return fmt::format("{}/{:016x}.gbaidx", cache_directory, rom_hash);
+}
+
+uint64_t DisassemblyIndex::hash_rom(const GBA_Memory& memory)
+{
+    uint64_t hash = 0xCBF29CE484222325;
+    auto rom = memory.pointer(GBA_Memory::rom_base);
+    for (uint32_t i = 0; i < memory.rom_size; i++)
+    {
+        hash = (hash ^ rom[i]) * 0x100000001B3;
+    }
+    return hash;
+}
+
+DisassemblyRegion DisassemblyIndex::build(const GBA_Memory& memory, uint32_t base, uint32_t size,
+                                          InstructionSet set, unsigned thread_count)
+{
+    if (thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    DisassemblyRegion region;
+    region.base = base;
+    region.set = set;
+    region.entry_count = size / region.step();
+
+    struct Chunk
+    {
+        std::vector<uint32_t> words;
+        std::vector<uint32_t> text_offsets;
+        std::string text;
+    };
+
+    const uint32_t step = region.step();
+    const uint32_t chunk_entries = (region.entry_count + thread_count - 1) / thread_count;
+    std::vector<Chunk> chunks(thread_count);
+    std::vector<std::thread> workers;
+
+    for (unsigned t = 0; t < thread_count; t++)
+    {
+        uint32_t first = std::min(region.entry_count, t * chunk_entries);
+        uint32_t last = std::min(region.entry_count, first + chunk_entries);
+
+        workers.emplace_back([=, &memory, &chunks]()
+        {
+            auto& chunk = chunks[t];
+            char buffer[disassembly_buffer_size];
+            chunk.words.reserve(last - first);
+            chunk.text_offsets.reserve(last - first);
+            chunk.text.reserve((last - first) * 20);
+
+            for (uint32_t entry = first; entry < last; entry++)
+            {
+                auto address = base + entry * step;
+                auto word = memory.peek_word(address);
+                auto length = ::disassemble(word, address, set, buffer, sizeof(buffer));
+
+                chunk.words.push_back(word);
+                chunk.text_offsets.push_back(static_cast<uint32_t>(chunk.text.size()));
+                chunk.text.append(buffer, length + 1);
+            }
+        });
+    }
+
+    for (auto& worker : workers)
+        worker.join();
+
+    size_t text_size = 0;
+    for (auto& chunk : chunks)
+        text_size += chunk.text.size();
+
+    auto storage = std::make_shared<std::vector<uint8_t>>(section_size(region.entry_count, text_size));
+    auto words = reinterpret_cast<uint32_t*>(storage->data());
+    auto text_offsets = words + region.entry_count;
+    auto text = reinterpret_cast<char*>(text_offsets + region.entry_count);
+
+    // Chunks are contiguous and in order, only the text offsets need to be rebased
+    size_t entry = 0;
+    size_t text_base = 0;
+    for (auto& chunk : chunks)
+    {
+        std::copy(chunk.words.begin(), chunk.words.end(), words + entry);
+        for (auto offset : chunk.text_offsets)
+            text_offsets[entry++] = static_cast<uint32_t>(text_base + offset);
+        std::memcpy(text + text_base, chunk.text.data(), chunk.text.size());
+        text_base += chunk.text.size();
+    }
+
+    region.words = words;
+    region.text_offsets = text_offsets;
+    region.text = text;
+    region.storage = storage;
+    return region;
+}
+
+void DisassemblyIndex::load_rom_index()
+{
+    rom_hash = hash_rom(memory);
+    indexed_rom_size = memory.rom_size;
+    auto path = sidecar_path();
+
+    if (!load_sidecar(path))
+    {
+        regions[AREA_ROM][0] = build(memory, GBA_Memory::rom_base, memory.rom_size, InstructionSet::ARM);
+        regions[AREA_ROM][1] = build(memory, GBA_Memory::rom_base, memory.rom_size, InstructionSet::THUMB);
+
+        try
+        {
+            save_sidecar(path);
+        }
+        catch (std::runtime_error& e)
+        {
+            std::cout << YELLOW << "Disassembly index not saved: " << e.what() << RESET << std::endl;
+        }
+    }
+
+    indexed[AREA_ROM][0] = true;
+    indexed[AREA_ROM][1] = true;
+}
+
+bool DisassemblyIndex::load_sidecar(const std::string& path)
+{
+    std::shared_ptr<MappedFile> file;
+    try
+    {
+        file = std::make_shared<MappedFile>(path);
+    }
+    catch (std::runtime_error&)
+    {
+        return false;
+    }
+
+    SidecarHeader header;
+    if (file->size() < sizeof(header))
+        return false;
+    std::memcpy(&header, file->data(), sizeof(header));
+
+    if (std::memcmp(header.magic, sidecar_magic, sizeof(sidecar_magic)) != 0
+        || header.version != sidecar_version
+        || header.rom_hash != rom_hash
+        || header.rom_size != memory.rom_size)
+    {
+        return false;
+    }
+
+    std::array<DisassemblyRegion, 2> loaded;
+    for (size_t set = 0; set < 2; set++)
+    {
+        auto& section = header.sections[set];
+        auto& region = loaded[set];
+        region.base = section.base;
+        region.set = static_cast<InstructionSet>(set);
+        region.entry_count = section.entry_count;
+
+        if (section.base != GBA_Memory::rom_base
+            || section.entry_count != memory.rom_size / region.step()
+            || section.offset % 8 != 0
+            || section.offset > file->size()
+            || section_size(section.entry_count, section.text_size) > file->size() - section.offset)
+        {
+            return false;
+        }
+
+        auto data = file->data() + section.offset;
+        region.words = reinterpret_cast<const uint32_t*>(data);
+        region.text_offsets = region.words + section.entry_count;
+        region.text = reinterpret_cast<const char*>(region.text_offsets + section.entry_count);
+        if (section.text_size == 0 || region.text[section.text_size - 1] != '\0')
+            return false;
+        // The text ends with a NUL, so every entry starting inside it reads as a string
+        for (uint32_t entry = 0; entry < section.entry_count; entry++)
+        {
+            if (region.text_offsets[entry] >= section.text_size)
+                return false;
+        }
+        region.storage = file;
+    }
+
+    regions[AREA_ROM][0] = loaded[0];
+    regions[AREA_ROM][1] = loaded[1];
+    return true;
+}
+
+void DisassemblyIndex::save_sidecar(const std::string& path) const
+{
+    SidecarHeader header{};
+    std::memcpy(header.magic, sidecar_magic, sizeof(sidecar_magic));
+    header.version = sidecar_version;
+    header.rom_size = indexed_rom_size;
+    header.rom_hash = rom_hash;
+
+    uint64_t offset = align_8(sizeof(header));
+    std::array<uint64_t, 2> text_sizes{};
+    for (size_t set = 0; set < 2; set++)
+    {
+        auto& region = regions[AREA_ROM][set];
+        text_sizes[set] = region.entry_count == 0 ? 0
+            : region.text_offsets[region.entry_count - 1] + std::strlen(region.entry_text(region.entry_count - 1)) + 1;
+        header.sections[set] = { region.base, region.entry_count, offset, text_sizes[set] };
+        offset = align_8(offset + section_size(region.entry_count, text_sizes[set]));
+    }
+
+    // Written to a temporary file first, so a crash never leaves a truncated index behind
+    auto temporary_path = path + ".tmp";
+    {
+        std::ofstream file{ temporary_path, std::ios::binary | std::ios::trunc };
+        if (!file.is_open())
+        {
+            throw std::runtime_error{ fmt::format("Could not open {}", temporary_path) };
+        }
+
+        const char padding[8] = { 0 };
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(padding, align_8(sizeof(header)) - sizeof(header));
+        for (size_t set = 0; set < 2; set++)
+        {
+            auto& region = regions[AREA_ROM][set];
+            auto size = section_size(region.entry_count, text_sizes[set]);
+            file.write(reinterpret_cast<const char*>(region.words), size);
+            file.write(padding, align_8(size) - size);
+        }
+
+        if (!file)
+        {
+            throw std::runtime_error{ fmt::format("Could not write {}", temporary_path) };
+        }
+    }
+
+    std::remove(path.c_str());
+    if (std::rename(temporary_path.c_str(), path.c_str()) != 0)
+    {
+        std::remove(temporary_path.c_str());
+        throw std::runtime_error{ fmt::format("Could not rename {} to {}", temporary_path, path) };
+    }
+}
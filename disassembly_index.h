@@ -0,0 +1,106 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include "decoder.h"
+
+class GBA_Memory;
+
+/**
+ * @brief Disassembly of every aligned address of a memory area, for one instruction set.
+ *
+ * Entries are laid out as three flat arrays so a region can be used straight from a mapped file:
+ * the word each entry was disassembled from, the offset of its text and the null terminated texts.
+ */
+struct DisassemblyRegion
+{
+    uint32_t base = 0;
+    uint32_t entry_count = 0;
+    InstructionSet set = InstructionSet::ARM;
+    const uint32_t* words = nullptr;        // THUMB entries keep the next halfword in [16, 31]
+    const uint32_t* text_offsets = nullptr;
+    const char* text = nullptr;
+    std::shared_ptr<const void> storage;    // Keeps the arrays alive (heap buffer or mapped file)
+
+    uint32_t step() const { return set == InstructionSet::ARM ? 4 : 2; }
+    uint32_t end() const { return base + entry_count * step(); }
+    bool contains(uint32_t address) const { return address >= base && address < end(); }
+    size_t entry(uint32_t address) const { return (address - base) / step(); }
+    const char* entry_text(size_t entry) const { return text + text_offsets[entry]; }
+};
+
+/**
+ * @brief Cache of disassembled code used by dissa/disst and the disassembly searches.
+ *
+ * The cartridge ROM is disassembled once, as ARM and as THUMB, in parallel chunks. The result is
+ * saved to a sidecar file named after the ROM hash and mapped back on later sessions, so repeated
+ * queries start instantly. BIOS, EWRAM and IWRAM are indexed on demand and never saved.
+ *
+ * Every entry remembers the word it was disassembled from. A lookup whose word changed since
+ * (code written to RAM, patched ROM) is disassembled again, so writes never return stale text
+ * and the write path of GBA_Memory doesn't pay anything for the cache.
+ */
+class DisassemblyIndex
+{
+public:
+    /**
+     * @param memory Memory to be disassembled.
+     * @param cache_directory Directory of the sidecar files.
+     */
+    explicit DisassemblyIndex(const GBA_Memory& memory, std::string cache_directory = ".");
+
+    /**
+     * @brief Disassembles an address.
+     *
+     * @param address Address of the instruction, aligned to the instruction size.
+     * @param set Instruction set used to decode it.
+     * @param buffer Used when the address isn't indexed or its entry is stale.
+     * @param size Capacity of buffer.
+     * @return const char* Text of the instruction, valid until the next call or until buffer is reused.
+     */
+    const char* disassemble(uint32_t address, InstructionSet set, char* buffer, size_t size);
+
+    /**
+     * @brief Region covering an address, indexing its memory area if needed.
+     *
+     * @return const DisassemblyRegion* nullptr if address isn't in an indexable area.
+     */
+    const DisassemblyRegion* region(uint32_t address, InstructionSet set);
+
+    /**
+     * @brief Whether an entry still matches the memory it was disassembled from.
+     */
+    bool is_current(const DisassemblyRegion& region, size_t entry) const;
+
+    /**
+     * @brief FNV-1a hash of the loaded ROM.
+     */
+    static uint64_t hash_rom(const GBA_Memory& memory);
+
+    /**
+     * @brief Disassembles a memory range into a new region.
+     *
+     * @param thread_count Amount of worker threads. 0 uses the hardware concurrency.
+     */
+    static DisassemblyRegion build(const GBA_Memory& memory, uint32_t base, uint32_t size,
+                                   InstructionSet set, unsigned thread_count = 0);
+
+private:
+    /** Memory areas that can hold code: BIOS, EWRAM, IWRAM and ROM. */
+    enum Area { AREA_BIOS, AREA_EWRAM, AREA_IWRAM, AREA_ROM, AREA_COUNT };
+
+    void load_rom_index();
+    std::string sidecar_path() const;
+    bool load_sidecar(const std::string& path);
+    void save_sidecar(const std::string& path) const;
+
+    const GBA_Memory& memory;
+    std::string cache_directory;
+    uint64_t rom_hash = 0;
+    uint32_t indexed_rom_size = 0;
+    std::array<std::array<DisassemblyRegion, 2>, AREA_COUNT> regions{};
+    std::array<std::array<bool, 2>, AREA_COUNT> indexed{};
+};
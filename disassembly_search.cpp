@@ -0,0 +1,417 @@
+#include "disassembly_search.h"
+#include "assembly.h"
+#include "disassembly_index.h"
+#include "GBA_Memory.h"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <stdexcept>
+#include <thread>
+#include <fmt/core.h>
+
+namespace
+{
+    bool is_word_character(char c)
+    {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '.';
+    }
+
+    bool is_digit(char c)
+    {
+        return std::isdigit(static_cast<unsigned char>(c));
+    }
+
+    bool equals_ignore_case(std::string_view a, std::string_view b)
+    {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y)
+        {
+            return std::toupper(static_cast<unsigned char>(x)) == std::toupper(static_cast<unsigned char>(y));
+        });
+    }
+
+    /* R13-R15 are printed as SP, LR and PC */
+    std::string_view register_alias(std::string_view word)
+    {
+        if (equals_ignore_case(word, "R13")) return "SP";
+        if (equals_ignore_case(word, "R14")) return "LR";
+        if (equals_ignore_case(word, "R15")) return "PC";
+        return word;
+    }
+
+    bool is_register(std::string_view word)
+    {
+        if (equals_ignore_case(word, "SP") || equals_ignore_case(word, "LR") || equals_ignore_case(word, "PC"))
+            return true;
+        if (word.size() < 2 || word.size() > 3 || std::toupper(static_cast<unsigned char>(word[0])) != 'R')
+            return false;
+
+        unsigned number = 0;
+        auto result = std::from_chars(word.data() + 1, word.data() + word.size(), number);
+        return result.ptr == word.data() + word.size() && number < 16;
+    }
+
+    /* Parses a decimal or 0x prefixed number, returns the position after it or nullptr */
+    const char* parse_number(const char* begin, const char* end, int64_t& value)
+    {
+        uint64_t parsed = 0;
+        std::from_chars_result result;
+        if (end - begin > 2 && begin[0] == '0' && (begin[1] == 'x' || begin[1] == 'X'))
+            result = std::from_chars(begin + 2, end, parsed, 16);
+        else
+            result = std::from_chars(begin, end, parsed);
+
+        if (result.ec != std::errc{} || (result.ptr != end && is_word_character(*result.ptr)))
+            return nullptr;
+
+        value = static_cast<int64_t>(parsed);
+        return result.ptr;
+    }
+
+    bool glob_matches(std::string_view glob, std::string_view text)
+    {
+        if (glob.empty())
+            return text.empty();
+        if (glob[0] == '*')
+        {
+            for (size_t i = 0; i <= text.size(); i++)
+                if (glob_matches(glob.substr(1), text.substr(i)))
+                    return true;
+            return false;
+        }
+        if (text.empty())
+            return false;
+        if (glob[0] != '?' && std::toupper(static_cast<unsigned char>(glob[0])) != std::toupper(static_cast<unsigned char>(text[0])))
+            return false;
+        return glob_matches(glob.substr(1), text.substr(1));
+    }
+
+    std::string_view mnemonic_of(std::string_view text)
+    {
+        return text.substr(0, text.find(' '));
+    }
+}
+
+/*
+ * Splits the operands of an instruction (or of a pattern, when is_pattern is set) in tokens.
+ * Returns the amount of tokens, which is capped at capacity.
+ */
+template<class Token, class TokenKind>
+static size_t tokenize(std::string_view text, Token* tokens, size_t capacity, bool is_pattern)
+{
+    size_t count = 0;
+    const char* i = text.data();
+    const char* end = text.data() + text.size();
+
+    auto push = [&](Token token)
+    {
+        if (count < capacity)
+            tokens[count++] = token;
+    };
+
+    auto parse_range = [&](const char*& position, Token& token, TokenKind range_kind)
+    {
+        if (is_pattern && end - position > 1 && position[0] == '-' && is_digit(position[1]))
+        {
+            auto next = parse_number(position + 1, end, token.last);
+            if (next == nullptr)
+                throw std::runtime_error{ fmt::format("Invalid range in pattern: {}", text) };
+            token.kind = range_kind;
+            position = next;
+        }
+    };
+
+    while (i < end)
+    {
+        const char* start = i;
+        if (*i == ' ')
+        {
+            i++;
+        }
+        else if (*i == '#')
+        {
+            i++;
+            if (is_pattern && i < end && *i == '?')
+            {
+                push({ TokenKind::AnyImmediate, { start, 2 } });
+                i++;
+                continue;
+            }
+
+            bool negative = i < end && *i == '-';
+            if (negative)
+                i++;
+
+            Token token{ TokenKind::Immediate, {} };
+            auto next = parse_number(i, end, token.value);
+            if (next == nullptr)
+            {
+                if (is_pattern)
+                    throw std::runtime_error{ fmt::format("Invalid immediate in pattern: {}", text) };
+                push({ TokenKind::Punctuation, { start, 1 } });
+                continue;
+            }
+            if (negative)
+                token.value = -token.value;
+            i = next;
+            parse_range(i, token, TokenKind::ImmediateRange);
+            token.text = { start, static_cast<size_t>(i - start) };
+            push(token);
+        }
+        else if (is_word_character(*i))
+        {
+            while (i < end && is_word_character(*i))
+                i++;
+            std::string_view word{ start, static_cast<size_t>(i - start) };
+
+            if (is_pattern && i < end && *i == '?' && equals_ignore_case(word, "R"))
+            {
+                i++;
+                push({ TokenKind::AnyRegister, { start, 2 } });
+            }
+            else if (is_digit(*start))
+            {
+                Token token{ TokenKind::Number, word };
+                if (parse_number(start, i, token.value) == nullptr)
+                {
+                    push({ TokenKind::Word, word });
+                    continue;
+                }
+                parse_range(i, token, TokenKind::NumberRange);
+                token.text = { start, static_cast<size_t>(i - start) };
+                push(token);
+            }
+            else
+            {
+                push({ TokenKind::Word, word });
+            }
+        }
+        else if (is_pattern && *i == '?')
+        {
+            push({ TokenKind::AnyToken, { start, 1 } });
+            i++;
+        }
+        else if (is_pattern && *i == '*')
+        {
+            push({ TokenKind::AnySequence, { start, 1 } });
+            i++;
+        }
+        else
+        {
+            push({ TokenKind::Punctuation, { start, 1 } });
+            i++;
+        }
+    }
+
+    return count;
+}
+
+InstructionMatcher::InstructionMatcher(std::string_view argument, InstructionSet set)
+    : set(set)
+{
+    if (!is_pattern(argument))
+    {
+        throw std::runtime_error{ fmt::format("Expected $(pattern) or $$(regex), got {}", argument) };
+    }
+
+    const size_t key_count = set == InstructionSet::ARM ? 0x10000 : 0x400;
+    is_regex = argument[1] == '$';
+    auto body = argument.substr(is_regex ? 3 : 2, argument.size() - (is_regex ? 4 : 3));
+
+    if (is_regex)
+    {
+        try
+        {
+            regex = std::regex{ std::string{ body }, std::regex::ECMAScript | std::regex::icase | std::regex::optimize };
+        }
+        catch (std::regex_error& e)
+        {
+            throw std::runtime_error{ fmt::format("Invalid regex {}: {}", body, e.what()) };
+        }
+        candidates.assign(key_count / 8, 0xFF);
+        return;
+    }
+
+    source = std::make_unique<std::string>(body);
+    std::string_view pattern{ *source };
+    auto first = pattern.find_first_not_of(' ');
+    if (first == std::string_view::npos)
+    {
+        throw std::runtime_error{ "Empty pattern" };
+    }
+    pattern.remove_prefix(first);
+    mnemonic = std::string{ mnemonic_of(pattern) };
+    pattern.remove_prefix(mnemonic.size());
+
+    operands.resize(pattern.size());
+    operands.resize(tokenize<Token, TokenKind>(pattern, operands.data(), operands.size(), true));
+
+    // The mnemonic only depends on the bits in the key, so one opcode per key is enough to know
+    // which keys can match
+    candidates.assign(key_count / 8, 0);
+    char buffer[disassembly_buffer_size];
+    for (uint32_t key = 0; key < key_count; key++)
+    {
+        bool accepted;
+        if (set == InstructionSet::ARM)
+        {
+            disassemble_arm(((key >> 4) << 20) | ((key & 0x0F) << 4), 0, buffer, sizeof(buffer));
+            accepted = mnemonic_matches(mnemonic_of(buffer));
+        }
+        else
+        {
+            // A BL prefix reads as BL or BL.hi depending on the next halfword
+            disassemble_thumb(key << 6, 0xF800, 0, buffer, sizeof(buffer));
+            accepted = mnemonic_matches(mnemonic_of(buffer));
+            disassemble_thumb(key << 6, 0x0000, 0, buffer, sizeof(buffer));
+            accepted = accepted || mnemonic_matches(mnemonic_of(buffer));
+        }
+
+        if (accepted)
+            candidates[key >> 3] |= 1 << (key & 7);
+    }
+}
+
+bool InstructionMatcher::is_pattern(std::string_view argument)
+{
+    return (argument.rfind("$(", 0) == 0 && argument.size() > 3 && argument.back() == ')')
+        || (argument.rfind("$$(", 0) == 0 && argument.size() > 4 && argument.back() == ')');
+}
+
+bool InstructionMatcher::matches(const char* text) const
+{
+    if (is_regex)
+    {
+        return std::regex_search(text, regex);
+    }
+
+    std::string_view instruction{ text };
+    auto instruction_mnemonic = mnemonic_of(instruction);
+    if (!mnemonic_matches(instruction_mnemonic))
+    {
+        return false;
+    }
+    instruction.remove_prefix(instruction_mnemonic.size());
+
+    std::array<Token, disassembly_buffer_size> tokens;
+    auto count = tokenize<Token, TokenKind>(instruction, tokens.data(), tokens.size(), false);
+    return operands_match(operands.data(), operands.size(), tokens.data(), count);
+}
+
+bool InstructionMatcher::mnemonic_matches(std::string_view instruction_mnemonic) const
+{
+    return glob_matches(mnemonic, instruction_mnemonic);
+}
+
+bool InstructionMatcher::operands_match(const Token* pattern, size_t pattern_size, const Token* text, size_t text_size) const
+{
+    if (pattern_size == 0)
+        return text_size == 0;
+
+    if (pattern->kind == TokenKind::AnySequence)
+    {
+        for (size_t skipped = 0; skipped <= text_size; skipped++)
+            if (operands_match(pattern + 1, pattern_size - 1, text + skipped, text_size - skipped))
+                return true;
+        return false;
+    }
+
+    if (text_size == 0)
+        return false;
+
+    bool matched = false;
+    switch (pattern->kind)
+    {
+        case TokenKind::AnyToken:
+            matched = true;
+            break;
+        case TokenKind::AnyRegister:
+            matched = text->kind == TokenKind::Word && is_register(text->text);
+            break;
+        case TokenKind::AnyImmediate:
+            matched = text->kind == TokenKind::Immediate;
+            break;
+        case TokenKind::ImmediateRange:
+            matched = text->kind == TokenKind::Immediate && text->value >= pattern->value && text->value <= pattern->last;
+            break;
+        case TokenKind::NumberRange:
+            matched = text->kind == TokenKind::Number && text->value >= pattern->value && text->value <= pattern->last;
+            break;
+        case TokenKind::Immediate:
+        case TokenKind::Number:
+            matched = text->kind == pattern->kind && text->value == pattern->value;
+            break;
+        case TokenKind::Word:
+            matched = text->kind == TokenKind::Word && equals_ignore_case(register_alias(pattern->text), text->text);
+            break;
+        default:
+            matched = text->kind == pattern->kind && text->text == pattern->text;
+            break;
+    }
+
+    return matched && operands_match(pattern + 1, pattern_size - 1, text + 1, text_size - 1);
+}
+
+std::vector<SearchHit> search_disassembly(DisassemblyIndex& index, const GBA_Memory& memory,
+                                          uint32_t begin, uint32_t end, InstructionSet set,
+                                          const InstructionMatcher& matcher, unsigned thread_count)
+{
+    if (thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    const uint32_t step = set == InstructionSet::ARM ? 4 : 2;
+    begin &= ~(step - 1);
+    if (begin >= end)
+    {
+        return {};
+    }
+
+    const uint32_t count = (end - begin + step - 1) / step;
+    const uint32_t chunk_entries = (count + thread_count - 1) / thread_count;
+    const DisassemblyRegion* region = index.region(begin, set); // Built here, workers only read it
+
+    std::vector<std::vector<SearchHit>> results(thread_count);
+    std::vector<std::thread> workers;
+
+    for (unsigned t = 0; t < thread_count; t++)
+    {
+        uint32_t first = std::min(count, t * chunk_entries);
+        uint32_t last = std::min(count, first + chunk_entries);
+
+        workers.emplace_back([=, &index, &memory, &matcher, &results]()
+        {
+            char buffer[disassembly_buffer_size];
+            for (uint32_t i = first; i < last; i++)
+            {
+                auto address = begin + i * step;
+                auto word = memory.peek_word(address);
+                if (!matcher.may_match(word))
+                {
+                    continue;
+                }
+
+                const char* text = buffer;
+                if (region != nullptr && region->contains(address) && index.is_current(*region, region->entry(address)))
+                    text = region->entry_text(region->entry(address));
+                else
+                    disassemble(word, address, set, buffer, sizeof(buffer));
+
+                if (matcher.matches(text))
+                {
+                    results[t].push_back({ address, i });
+                }
+            }
+        });
+    }
+
+    for (auto& worker : workers)
+        worker.join();
+
+    // Chunks are contiguous and in order, so concatenating keeps the result sorted
+    std::vector<SearchHit> hits;
+    for (auto& result : results)
+        hits.insert(hits.end(), result.begin(), result.end());
+
+    return hits;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "decoder.h"
+
+class GBA_Memory;
+class DisassemblyIndex;
+
+/**
+ * @brief An instruction found by search_disassembly.
+ */
+struct SearchHit
+{
+    uint32_t address;
+    uint32_t index;     // Instructions from the start of the searched range
+};
+
+/**
+ * @brief Matches disassembled instructions against a regex or a structured pattern.
+ *
+ * Syntax
+ * $$(regex) ECMAScript regex searched in the whole text, case insensitive: $$(BL .*)
+ * $(pattern) Structured pattern, matched operand by operand: $(STR* R?, [R?, #0x200-0x20A])
+ *
+ * The first word of a structured pattern is the mnemonic, * and ? work as in file globs (ADD* matches
+ * ADD, ADDS, ADDEQ...). The operands are made of
+ *      R?          any register (R13-R15 may also be written as SP, LR, PC)
+ *      #?          any immediate
+ *      #a-b        an immediate in [a, b]
+ *      a-b         a number (branch target) in [a, b]
+ *      ?           any single token
+ *      *           any sequence of tokens
+ * Anything else must appear as written. Numbers are compared by value, so #16 matches #0x10.
+ *
+ * Structured patterns also build a table of the opcodes whose mnemonic can match, so most
+ * instructions are rejected from their bits alone, without being disassembled.
+ */
+class InstructionMatcher
+{
+public:
+    /**
+     * @brief Parses a $(pattern) or $$(regex) argument.
+     *
+     * @throws std::runtime_error If the argument isn't a valid pattern.
+     */
+    InstructionMatcher(std::string_view argument, InstructionSet set);
+
+    static bool is_pattern(std::string_view argument);
+
+    /**
+     * @brief Whether an instruction can match, judging only from its opcode.
+     *
+     * @param word Opcode. For THUMB only bits [0, 15] are used.
+     */
+    bool may_match(uint32_t word) const
+    {
+        auto key = set == InstructionSet::ARM
+            ? ((word >> 16) & 0xFFF0) | ((word >> 4) & 0x0F)
+            : (word & 0xFFFF) >> 6;
+        return (candidates[key >> 3] >> (key & 7)) & 1;
+    }
+
+    /**
+     * @brief Whether a disassembled instruction matches.
+     */
+    bool matches(const char* text) const;
+
+private:
+    enum class TokenKind : uint8_t
+    {
+        Word,           // Mnemonics, registers, shifts...
+        Number,         // Branch targets and bare numbers
+        Immediate,      // #number
+        Punctuation,
+        AnyRegister,    // Pattern only
+        AnyImmediate,
+        ImmediateRange,
+        NumberRange,
+        AnyToken,
+        AnySequence
+    };
+
+    struct Token
+    {
+        TokenKind kind;
+        std::string_view text;
+        int64_t value = 0;
+        int64_t last = 0; // Upper bound of ranges
+    };
+
+    bool mnemonic_matches(std::string_view mnemonic) const;
+    bool operands_match(const Token* pattern, size_t pattern_size, const Token* text, size_t text_size) const;
+
+    InstructionSet set;
+    bool is_regex = false;
+    std::regex regex;
+    std::unique_ptr<std::string> source;   // Pattern tokens point into it
+    std::string mnemonic;
+    std::vector<Token> operands;
+    std::vector<uint8_t> candidates;       // Bitmap of the opcode keys accepted by may_match
+};
+
+/**
+ * @brief Finds every instruction of a range matching a pattern.
+ *
+ * The range is split in chunks which are searched in parallel. Text comes from the disassembly
+ * index when available, so only stale or unindexed addresses are disassembled.
+ *
+ * @param index Disassembly cache. The area of begin is indexed before the workers start.
+ * @param memory Memory to be searched.
+ * @param begin First address, aligned down to the instruction size.
+ * @param end End of the range (exclusive).
+ * @param matcher Pattern to be matched.
+ * @param thread_count Amount of worker threads. 0 uses the hardware concurrency.
+ * @return std::vector<SearchHit> Matches sorted by address.
+ */
+std::vector<SearchHit> search_disassembly(DisassemblyIndex& index, const GBA_Memory& memory,
+                                          uint32_t begin, uint32_t end, InstructionSet set,
+                                          const InstructionMatcher& matcher, unsigned thread_count = 0);
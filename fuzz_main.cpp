@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fmt/core.h>
+#include "fuzzer.h"
+
+namespace
+{
+    constexpr const char* usage =
+        "Usage: gba-fuzz [--mode backends|fusion|reference] [--cases <n>] [--threads <n>] [--seed <n>] [--failures <n>]\n"
+        "Each thread allocates the memory of two GBA (one in reference mode), 512MB.";
+
+    struct Options
+    {
+        FuzzMode mode = FuzzMode::BACKENDS;
+        uint64_t cases = 1000000;
+        uint32_t threads = std::max(1u, std::thread::hardware_concurrency());
+        uint64_t seed = std::random_device{}();
+        uint64_t max_failures = 10;
+    };
+
+    bool parse_options(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string_view argument = argv[i];
+            if (i + 1 >= argc)
+                return false;
+            std::string_view value = argv[++i];
+
+            if (argument == "--mode" && value == "backends")
+                options.mode = FuzzMode::BACKENDS;
+            else if (argument == "--mode" && value == "fusion")
+                options.mode = FuzzMode::FUSION;
+            else if (argument == "--mode" && value == "reference")
+                options.mode = FuzzMode::REFERENCE;
+            else if (argument == "--cases")
+                options.cases = std::stoull(std::string{ value }, nullptr, 0);
+            else if (argument == "--threads")
+                options.threads = std::max(1u, static_cast<uint32_t>(std::stoul(std::string{ value }, nullptr, 0)));
+            else if (argument == "--seed")
+                options.seed = std::stoull(std::string{ value }, nullptr, 0);
+            else if (argument == "--failures")
+                options.max_failures = std::max<uint64_t>(1, std::stoull(std::string{ value }, nullptr, 0));
+            else
+                return false;
+        }
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    try
+    {
+        if (!parse_options(argc, argv, options))
+        {
+            std::cerr << usage << std::endl;
+            return 1;
+        }
+    }
+    catch (std::exception&)
+    {
+        std::cerr << usage << std::endl;
+        return 1;
+    }
+
+    // The cpu reports unhandled opcodes on std::cout, most random opcodes are
+    std::cout.setstate(std::ios::badbit);
+
+    std::atomic<uint64_t> next_case{ 0 };
+    std::atomic<uint64_t> tested{ 0 };
+    std::atomic<uint64_t> skipped{ 0 };
+    std::atomic<uint64_t> failure_count{ 0 };
+    std::atomic<uint32_t> running{ options.threads };
+    std::mutex failures_mutex;
+    std::vector<FuzzFailure> failures;
+
+    fmt::print("Fuzzing {} cases on {} threads, seed {}\n", options.cases, options.threads, options.seed);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+    for (uint32_t index = 0; index < options.threads; index++)
+    {
+        workers.emplace_back([&, index]()
+        {
+            Fuzzer fuzzer{ options.mode, options.seed + index };
+            while (next_case++ < options.cases && failure_count < options.max_failures)
+            {
+                auto instructions = fuzzer.run_case();
+                tested += instructions;
+                skipped += instructions == 0;
+                if (fuzzer.failure())
+                {
+                    failure_count++;
+                    std::lock_guard<std::mutex> lock{ failures_mutex };
+                    failures.push_back(*fuzzer.failure());
+                }
+            }
+            running--;
+        });
+    }
+
+    auto elapsed = [&]()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    double last_report = 0;
+    while (running > 0)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (elapsed() - last_report >= 1.0 && running > 0)
+        {
+            last_report = elapsed();
+            fmt::print("{:>12} instructions  {:>10.0f}/s  {} failures\n", tested.load(), tested / last_report, failure_count.load());
+            std::fflush(stdout);
+        }
+    }
+    for (auto& worker : workers)
+        worker.join();
+
+    auto seconds = elapsed();
+    fmt::print("{} instructions tested in {:.2f}s, {:.0f} instructions/s, {} cases skipped, {} failures\n",
+               tested.load(), seconds, tested / seconds, skipped.load(), failures.size());
+    for (auto& failure : failures)
+        fmt::print("\n{}", failure.describe());
+
+    return failures.empty() ? 0 : 1;
+}
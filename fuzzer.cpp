@@ -0,0 +1,650 @@
+#include "fuzzer.h"
+#include "assembly.h"
+#include "bit_utils.h"
+#include "io_registers.h"
+#include <algorithm>
+#include <cstring>
+#include <fmt/core.h>
+
+struct Fuzzer::Side
+{
+    GBA_Memory memory;
+    GBA_Cpu cpu{ memory };
+};
+
+namespace
+{
+    constexpr uint32_t flag_mask = 0xF80000C0;     // NZCVQ, I and F
+    // Base registers of loads and stores point in the middle half, offsets can't leave the window from there
+    constexpr uint32_t base_begin = FuzzCase::window_address + FuzzCase::window_size / 4;
+    constexpr uint32_t base_size = FuzzCase::window_size / 2;
+
+    uint32_t instruction_size(InstructionSet set)
+    {
+        return set == InstructionSet::ARM ? 4 : 2;
+    }
+
+    /** SplitMix64, the window bytes of a seed don't depend on the generator of the cases. */
+    uint64_t split_mix(uint64_t& state)
+    {
+        auto z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    /** Window bytes of a case, its opcodes included. */
+    void fill_window(uint8_t* bytes, const FuzzCase& fuzz_case)
+    {
+        if (fuzz_case.window_seed == 0)
+        {
+            std::memset(bytes, 0, FuzzCase::window_size);
+        }
+        else
+        {
+            auto state = fuzz_case.window_seed;
+            for (uint32_t offset = 0; offset < FuzzCase::window_size; offset += sizeof(uint64_t))
+            {
+                auto value = split_mix(state);
+                std::memcpy(bytes + offset, &value, sizeof(value));
+            }
+        }
+
+        auto size = instruction_size(fuzz_case.set);
+        auto code = bytes + (FuzzCase::code_address - FuzzCase::window_address);
+        std::memcpy(code, &fuzz_case.opcodes[0], size);
+        std::memcpy(code + size, &fuzz_case.opcodes[1], size);
+    }
+
+    OpcodeHandler handler_kind(const FuzzCase& fuzz_case)
+    {
+        return fuzz_case.set == InstructionSet::ARM ? arm_handler(fuzz_case.opcodes[0]).kind
+                                                    : thumb_handler(static_cast<uint16_t>(fuzz_case.opcodes[0])).kind;
+    }
+
+    /** Whether every access of the case stays in the window, and it makes no BIOS call. */
+    bool valid(const FuzzCase& fuzz_case)
+    {
+        auto opcode = fuzz_case.opcodes[0];
+        switch (handler_kind(fuzz_case))
+        {
+            case OpcodeHandler::SWI:
+            case OpcodeHandler::SWI_thumb:
+                return false;
+            case OpcodeHandler::LDR_immediate:
+            case OpcodeHandler::STR_immediate:
+            {
+                auto Rn = (opcode >> 16) & 0x0F;
+                if (Rn == 15)
+                    return ((opcode >> 24) & 1) && !((opcode >> 21) & 1); // Pre-indexed, no write back
+                return fuzz_case.R[Rn] - base_begin < base_size;
+            }
+            case OpcodeHandler::LDR_thumb_1:
+                return fuzz_case.R[(opcode >> 3) & 0x07] - base_begin < base_size;
+            default:
+                return true;
+        }
+    }
+
+    /** Condition check written from the manual, apart from GBA_Cpu::test_cond. */
+    bool condition_passed(uint32_t cpsr, uint32_t condition)
+    {
+        bool N = (cpsr >> 31) & 1;
+        bool Z = (cpsr >> 30) & 1;
+        bool C = (cpsr >> 29) & 1;
+        bool V = (cpsr >> 28) & 1;
+        switch (condition)
+        {
+            case 0x0: return Z;
+            case 0x1: return !Z;
+            case 0x2: return C;
+            case 0x3: return !C;
+            case 0x4: return N;
+            case 0x5: return !N;
+            case 0x6: return V;
+            case 0x7: return !V;
+            case 0x8: return C && !Z;
+            case 0x9: return !C || Z;
+            case 0xA: return N == V;
+            case 0xB: return N != V;
+            case 0xC: return !Z && N == V;
+            case 0xD: return Z || N != V;
+            default:  return true;
+        }
+    }
+
+    const char* mode_name(FuzzMode mode)
+    {
+        switch (mode)
+        {
+            case FuzzMode::BACKENDS: return "backends";
+            case FuzzMode::FUSION: return "fusion";
+            default: return "reference";
+        }
+    }
+}
+
+bool FuzzOutcome::operator==(const FuzzOutcome& other) const
+{
+    return handled == other.handled
+        && std::equal(std::begin(R), std::end(R), std::begin(other.R))
+        && CPSR == other.CPSR
+        && cycles == other.cycles
+        && window == other.window;
+}
+
+std::string FuzzFailure::describe() const
+{
+    static const char* const sides[][2] = { { "switch", "threaded" }, { "one by one", "fused" }, { "reference", "interpreter" } };
+    auto& names = sides[static_cast<size_t>(mode)];
+    auto& fuzz_case = this->fuzz_case;
+    bool thumb = fuzz_case.set == InstructionSet::THUMB;
+
+    auto text = fmt::format("{} mismatch, {}:\n", mode_name(mode), thumb ? "THUMB" : "ARM");
+    char buffer[disassembly_buffer_size];
+    auto count = mode == FuzzMode::FUSION ? 2u : 1u;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        auto address = FuzzCase::code_address + i * instruction_size(fuzz_case.set);
+        auto opcode = fuzz_case.opcodes[i];
+        auto length = thumb ? disassemble_thumb(static_cast<uint16_t>(opcode), static_cast<uint16_t>(fuzz_case.opcodes[(i + 1) % 2]), address, buffer, sizeof(buffer))
+                            : disassemble_arm(opcode, address, buffer, sizeof(buffer));
+        text += fmt::format(thumb ? "    0x{:08x}: {:04x}      {}\n" : "    0x{:08x}: {:08x}  {}\n", address, opcode, std::string_view{ buffer, length });
+    }
+
+    text += "  Starting with";
+    for (uint32_t i = 0; i < 15; i++)
+    {
+        if (fuzz_case.R[i] != 0)
+            text += fmt::format(" r{}=0x{:x}", i, fuzz_case.R[i]);
+    }
+    text += fmt::format(" flags=0x{:08x} window seed=0x{:x}\n", fuzz_case.flags, fuzz_case.window_seed);
+
+    if (expected == actual)
+    {
+        text += "  Doesn't fail again on a fresh cpu, it depends on the state earlier cases left\n";
+        return text;
+    }
+
+    auto difference = [&](std::string_view what, auto expected_value, auto actual_value)
+    {
+        if (expected_value != actual_value)
+            text += fmt::format("  {:<8} {} 0x{:08x}, {} 0x{:08x}\n", what, names[0], expected_value, names[1], actual_value);
+    };
+    difference("handled", uint32_t{ expected.handled }, uint32_t{ actual.handled });
+    for (uint32_t i = 0; i < 16; i++)
+        difference(fmt::format("r{}", i), expected.R[i], actual.R[i]);
+    difference("cpsr", expected.CPSR, actual.CPSR);
+    difference("cycles", expected.cycles, actual.cycles);
+
+    for (uint32_t offset = 0; offset < FuzzCase::window_size; offset += 4)
+    {
+        uint32_t expected_word, actual_word;
+        std::memcpy(&expected_word, expected.window.data() + offset, sizeof(expected_word));
+        std::memcpy(&actual_word, actual.window.data() + offset, sizeof(actual_word));
+        difference(fmt::format("[{:08x}]", FuzzCase::window_address + offset), expected_word, actual_word);
+    }
+    return text;
+}
+
+Fuzzer::Fuzzer(FuzzMode mode, uint64_t seed)
+    : mode(mode),
+      random(seed)
+{
+    reset_sides();
+}
+
+Fuzzer::~Fuzzer() = default;
+
+void Fuzzer::reset_sides()
+{
+    auto count = mode == FuzzMode::REFERENCE ? 1 : 2;
+    for (int i = 0; i < count; i++)
+    {
+        sides[i].reset();
+        sides[i] = std::make_unique<Side>();
+        sides[i]->cpu.trace = false;
+    }
+}
+
+uint32_t Fuzzer::run_case()
+{
+    last_failure.reset();
+
+    auto fuzz_case = generate();
+    FuzzOutcome expected, actual;
+    if (!check(fuzz_case, expected, actual))
+    {
+        return 0;
+    }
+
+    if (expected != actual)
+    {
+        // The sides diverged, the case is minimised and checked again from fresh ones
+        FuzzFailure failure;
+        failure.mode = mode;
+        reset_sides();
+        failure.fuzz_case = minimise(fuzz_case);
+        check(failure.fuzz_case, failure.expected, failure.actual);
+        last_failure = std::move(failure);
+        reset_sides();
+    }
+    return mode == FuzzMode::FUSION ? 2 : 1;
+}
+
+FuzzCase Fuzzer::generate()
+{
+    FuzzCase fuzz_case;
+    do
+    {
+        // Registers are often 0 or small, so that the flags and the zero results are hit too
+        for (auto& value : fuzz_case.R)
+        {
+            switch (random() % 4)
+            {
+                case 0: value = 0; break;
+                case 1: value = random() % 0x100; break;
+                default: value = static_cast<uint32_t>(random()); break;
+            }
+        }
+        fuzz_case.flags = static_cast<uint32_t>(random()) & flag_mask;
+        fuzz_case.window_seed = random() | 1;
+
+        fuzz_case.set = mode == FuzzMode::FUSION || random() % 2 ? InstructionSet::THUMB : InstructionSet::ARM;
+        if (fuzz_case.set == InstructionSet::ARM)
+        {
+            fuzz_case.opcodes[0] = generate_arm();
+            fuzz_case.opcodes[1] = static_cast<uint32_t>(random());
+        }
+        else
+        {
+            fuzz_case.opcodes[0] = generate_thumb(fuzz_case.opcodes[1]);
+        }
+
+        // Loads and stores are given a base inside the window
+        auto offset = static_cast<uint32_t>(random()) % base_size;
+        auto opcode = fuzz_case.opcodes[0];
+        switch (handler_kind(fuzz_case))
+        {
+            case OpcodeHandler::LDR_immediate:
+            case OpcodeHandler::STR_immediate:
+                if (((opcode >> 16) & 0x0F) != 15)
+                    fuzz_case.R[(opcode >> 16) & 0x0F] = base_begin + offset;
+                break;
+            case OpcodeHandler::LDR_thumb_1:
+                fuzz_case.R[(opcode >> 3) & 0x07] = base_begin + offset;
+                break;
+            default:
+                break;
+        }
+    } while (!valid(fuzz_case));
+
+    return fuzz_case;
+}
+
+uint32_t Fuzzer::generate_arm()
+{
+    uint32_t condition = (random() % 15) << 28;    // NV left out, it encodes other instructions
+    auto bits = static_cast<uint32_t>(random());
+    // MRS and MSR aren't modeled by the reference, the fully random opcodes mostly aren't handled
+    auto families = mode == FuzzMode::REFERENCE ? 5 : 8;
+
+    switch (random() % families)
+    {
+        case 0: return condition | 0x0A000000 | (bits & 0x01FFFFFF);   // B, BL
+        case 1: return condition | 0x012FFF10 | (bits & 0x0000000F);   // BX Rm
+        case 2: return condition | 0x03A00000 | (bits & 0x0010FFFF);   // MOV{S} Rd, #imm
+        case 3: return condition | 0x02800000 | (bits & 0x001FFFFF);   // ADD{S} Rd, Rn, #imm
+        case 4: return condition | 0x04000000 | (bits & 0x01BFFFFF);   // LDR, STR Rd, [Rn, #imm]
+        case 5: return condition | 0x010F0000 | (bits & 0x0040F000);   // MRS Rd, PSR
+        case 6: return bits & 1 ? condition | 0x0120F000 | (bits & 0x004F000F)     // MSR PSR_fields, Rm
+                                : condition | 0x0320F000 | (bits & 0x004F0FFF);    // MSR PSR_fields, #imm
+        default: return bits;
+    }
+}
+
+uint32_t Fuzzer::generate_thumb(uint32_t& second)
+{
+    auto bits = static_cast<uint32_t>(random());
+    second = static_cast<uint32_t>(random()) & 0xFFFF;
+
+    if (mode == FuzzMode::FUSION)
+    {
+        uint32_t Rd = bits & 0x07;
+        switch (random() % 3)
+        {
+            case 0:     // BL
+                second = 0xF800 | ((bits >> 14) & 0x7FF);
+                return 0xF000 | ((bits >> 3) & 0x7FF);
+            case 1:     // LDR Rd, [PC, #imm] then BX Rd
+                second = 0x4700 | (Rd << 3);
+                return 0x4800 | (Rd << 8) | ((bits >> 3) & 0xFF);
+            default:    // MOVS Rd, #imm then LSLS Rd, Rd, #imm
+                second = (((bits >> 11) & 0x1F) << 6) | (Rd << 3) | Rd;
+                return 0x2000 | (Rd << 8) | ((bits >> 3) & 0xFF);
+        }
+    }
+
+    switch (random() % (mode == FuzzMode::REFERENCE ? 9 : 10))
+    {
+        case 0: return bits & 0x07FF;                                   // LSLS Rd, Rs, #imm
+        case 1: return 0x2000 | (bits & 0x07FF);                        // MOVS Rd, #imm
+        case 2: return 0x4800 | (bits & 0x07FF);                        // LDR Rd, [PC, #imm]
+        case 3: return 0x6800 | (bits & 0x07FF);                        // LDR Rd, [Rb, #imm]
+        case 4: return 0xD000 | ((random() % 14) << 8) | (bits & 0xFF); // B<cond>
+        case 5: return 0xE000 | (bits & 0x07FF);                        // B
+        case 6: return 0x4700 | ((bits & 0x0F) << 3);                   // BX Rs
+        case 7:                                                         // BL, both halves
+            second = 0xF800 | ((bits >> 11) & 0x07FF);
+            return 0xF000 | (bits & 0x07FF);
+        case 8: return 0xF800 | (bits & 0x07FF);                        // Second half of BL alone
+        default: return bits & 0xFFFF;
+    }
+}
+
+void Fuzzer::load(Side& side, const FuzzCase& fuzz_case) const
+{
+    auto& cpu = side.cpu;
+    fill_window(side.memory.pointer(FuzzCase::window_address), fuzz_case);
+
+    cpu.write_CPSR(GBA_Cpu::SYS | (fuzz_case.flags & flag_mask));
+    std::fill(&cpu.banked_R8_R12[0][0], &cpu.banked_R8_R12[0][0] + sizeof(cpu.banked_R8_R12) / sizeof(uint32_t), 0u);
+    std::fill(&cpu.banked_R13_R14[0][0], &cpu.banked_R13_R14[0][0] + sizeof(cpu.banked_R13_R14) / sizeof(uint32_t), 0u);
+    std::fill(std::begin(cpu.SPSR), std::end(cpu.SPSR), 0u);
+    std::copy(std::begin(fuzz_case.R), std::end(fuzz_case.R), cpu.R);
+
+    cpu.set_mode(fuzz_case.set == InstructionSet::THUMB ? GBA_Cpu::ExecutionMode::THUMB : GBA_Cpu::ExecutionMode::ARM);
+    cpu.PC = FuzzCase::code_address;
+    cpu.flush_pipeline();
+    cpu.cycles = 0;
+    cpu.halted = false;
+}
+
+FuzzOutcome Fuzzer::outcome(const Side& side, bool handled)
+{
+    FuzzOutcome result;
+    result.handled = handled;
+    std::copy(std::begin(side.cpu.R), std::end(side.cpu.R), result.R);
+    result.CPSR = side.cpu.CPSR;
+    result.cycles = side.cpu.cycles;
+    auto bytes = side.memory.pointer(FuzzCase::window_address);
+    result.window.assign(bytes, bytes + FuzzCase::window_size);
+    return result;
+}
+
+bool Fuzzer::check(const FuzzCase& fuzz_case, FuzzOutcome& expected, FuzzOutcome& actual)
+{
+    auto& first = *sides[0];
+    if (mode == FuzzMode::REFERENCE)
+    {
+        auto model = reference(fuzz_case);
+        if (!model)
+        {
+            return false;
+        }
+
+        load(first, fuzz_case);
+        first.cpu.fuse_instructions = false;
+        if (!first.cpu.cycle())
+        {
+            return false;
+        }
+        expected = std::move(*model);
+        actual = outcome(first, true);
+        actual.cycles = 0;
+        return true;
+    }
+
+    auto& second = *sides[1];
+    load(first, fuzz_case);
+    load(second, fuzz_case);
+
+    if (mode == FuzzMode::BACKENDS)
+    {
+        first.cpu.backend = GBA_Cpu::Backend::SWITCH;
+        second.cpu.backend = GBA_Cpu::Backend::THREADED;
+        first.cpu.fuse_instructions = second.cpu.fuse_instructions = false;
+        // Any instruction takes a cycle at least, a limit of 1 runs exactly one
+        auto first_handled = first.cpu.run(1);
+        auto second_handled = second.cpu.run(1);
+        expected = outcome(first, first_handled);
+        actual = outcome(second, second_handled);
+        return true;
+    }
+
+    // A pair isn't fused right before an event, both sides are stepped past it
+    auto until_event = io::cycles_until_event(first.memory);
+    if (until_event < 16)
+    {
+        io::tick(first.memory, until_event);
+        io::tick(second.memory, until_event);
+    }
+
+    first.cpu.fuse_instructions = false;
+    second.cpu.fuse_instructions = true;
+    auto first_handled = first.cpu.cycle() && first.cpu.cycle();
+    auto second_handled = second.cpu.cycle();
+    expected = outcome(first, first_handled);
+    actual = outcome(second, second_handled);
+    return true;
+}
+
+std::optional<FuzzOutcome> Fuzzer::reference(const FuzzCase& fuzz_case) const
+{
+    FuzzOutcome result;
+    result.handled = true;
+    result.window.resize(FuzzCase::window_size);
+    fill_window(result.window.data(), fuzz_case);
+    std::copy(std::begin(fuzz_case.R), std::end(fuzz_case.R), result.R);
+
+    auto& R = result.R;
+    auto cpsr = GBA_Cpu::SYS | (fuzz_case.flags & flag_mask);
+    bool thumb = fuzz_case.set == InstructionSet::THUMB;
+    auto size = instruction_size(fuzz_case.set);
+    auto address = FuzzCase::code_address;
+    auto pc = address + 2 * size;       // PC as the instruction reads it
+    auto next = address + size;         // Address of the instruction executing after it
+    auto opcode = fuzz_case.opcodes[0];
+
+    auto in_window = [](uint32_t at) { return at - FuzzCase::window_address < FuzzCase::window_size; };
+    auto load_word = [&](uint32_t at)
+    {
+        uint32_t value;
+        std::memcpy(&value, result.window.data() + ((at & ~3u) - FuzzCase::window_address), sizeof(value));
+        return rotate_right(value, (at & 3) * 8);
+    };
+    auto exchange = [&](uint32_t target)
+    {
+        thumb = target & 1;
+        next = target & (thumb ? ~1u : ~3u);
+    };
+    auto set_NZ = [&](uint32_t value)
+    {
+        cpsr = (cpsr & 0x3FFFFFFF) | (value & 0x80000000) | (value == 0 ? 0x40000000 : 0);
+    };
+
+    if (!thumb)
+    {
+        auto condition = opcode >> 28;
+        auto Rn = (opcode >> 16) & 0x0F;
+        auto Rd = (opcode >> 12) & 0x0F;
+        auto operand = [&](uint32_t index) { return index == 15 ? pc : R[index]; };
+
+        if (condition == 0x0F)
+        {
+            return std::nullopt;
+        }
+        if (!condition_passed(cpsr, condition))
+        {
+            // Skipped, whatever it is
+        }
+        else if ((opcode & 0x0E000000) == 0x0A000000)           // B, BL
+        {
+            if ((opcode >> 24) & 1)
+                R[14] = address + 4;
+            next = pc + (sign_extend<uint32_t>(opcode & 0x00FFFFFF, 24) << 2);
+        }
+        else if ((opcode & 0x0FFFFFF0) == 0x012FFF10)           // BX Rm
+        {
+            exchange(operand(opcode & 0x0F));
+        }
+        else if ((opcode & 0x0FF00000) == 0x03A00000 || (opcode & 0x0FF00000) == 0x02800000)   // MOV, ADD Rd, #imm
+        {
+            bool is_mov = (opcode & 0x0FF00000) == 0x03A00000;
+            if (Rd == 15 || (is_mov && Rn != 0))
+                return std::nullopt;
+            auto immediate = rotate_right(opcode & 0xFF, ((opcode >> 8) & 0x0F) * 2);
+            R[Rd] = is_mov ? immediate : operand(Rn) + immediate;
+        }
+        else if ((opcode & 0x0E400000) == 0x04000000)           // LDR, STR Rd, [Rn, #imm] of words
+        {
+            bool P = (opcode >> 24) & 1;
+            bool U = (opcode >> 23) & 1;
+            bool W = (opcode >> 21) & 1;
+            bool L = (opcode >> 20) & 1;
+            bool write_back = W || !P;
+            if (Rd == 15 || (write_back && (Rn == 15 || Rn == Rd)))
+                return std::nullopt;
+
+            auto base = operand(Rn);
+            auto offset = opcode & 0xFFF;
+            auto offset_address = U ? base + offset : base - offset;
+            auto at = P ? offset_address : base;
+            if (!in_window(at))
+                return std::nullopt;
+
+            if (write_back)
+                R[Rn] = offset_address;
+            if (L)
+                R[Rd] = load_word(at);
+            else
+                std::memcpy(result.window.data() + ((at & ~3u) - FuzzCase::window_address), &R[Rd], sizeof(uint32_t));
+        }
+        else
+        {
+            return std::nullopt;
+        }
+    }
+    else
+    {
+        auto Rd = opcode & 0x07;
+        auto Rs = (opcode >> 3) & 0x07;
+        auto Rd_high = (opcode >> 8) & 0x07;
+
+        if ((opcode & 0xF800) == 0x0000)                        // LSLS Rd, Rs, #imm
+        {
+            auto amount = (opcode >> 6) & 0x1F;
+            if (amount != 0)
+                cpsr = (cpsr & ~0x20000000u) | (((R[Rs] >> (32 - amount)) & 1) << 29);
+            R[Rd] = R[Rs] << amount;
+            set_NZ(R[Rd]);
+        }
+        else if ((opcode & 0xF800) == 0x2000)                   // MOVS Rd, #imm
+        {
+            R[Rd_high] = opcode & 0xFF;
+            set_NZ(R[Rd_high]);
+        }
+        else if ((opcode & 0xF800) == 0x4800)                   // LDR Rd, [PC, #imm]
+        {
+            R[Rd_high] = load_word((pc & ~2u) + (opcode & 0xFF) * 4);
+        }
+        else if ((opcode & 0xF800) == 0x6800)                   // LDR Rd, [Rb, #imm]
+        {
+            auto at = R[Rs] + ((opcode >> 6) & 0x1F) * 4;
+            if (!in_window(at))
+                return std::nullopt;
+            R[Rd] = load_word(at);
+        }
+        else if ((opcode & 0xF000) == 0xD000)                   // B<cond>
+        {
+            auto condition = (opcode >> 8) & 0x0F;
+            if (condition >= 0x0E)
+                return std::nullopt;
+            if (condition_passed(cpsr, condition))
+                next = pc + (sign_extend<uint32_t>(opcode & 0xFF, 8) << 1);
+        }
+        else if ((opcode & 0xF800) == 0xE000)                   // B
+        {
+            next = pc + (sign_extend<uint32_t>(opcode & 0x7FF, 11) << 1);
+        }
+        else if ((opcode & 0xFF87) == 0x4700)                   // BX Rs
+        {
+            auto Rs_high = (opcode >> 3) & 0x0F;
+            exchange(Rs_high == 15 ? pc : R[Rs_high]);
+        }
+        else if ((opcode & 0xF800) == 0xF000)                   // BL, first half
+        {
+            R[14] = pc + (sign_extend<uint32_t>(opcode & 0x7FF, 11) << 12);
+        }
+        else if ((opcode & 0xF800) == 0xF800)                   // BL, second half
+        {
+            next = (R[14] + ((opcode & 0x7FF) << 1)) & ~1u;
+            R[14] = (address + 2) | 1;
+        }
+        else
+        {
+            return std::nullopt;
+        }
+    }
+
+    result.CPSR = (cpsr & ~0x20u) | (thumb ? 0x20u : 0u);
+    R[15] = next + 2 * (thumb ? 2 : 4);
+    return result;
+}
+
+bool Fuzzer::fails(const FuzzCase& fuzz_case)
+{
+    FuzzOutcome expected, actual;
+    return check(fuzz_case, expected, actual) && expected != actual;
+}
+
+FuzzCase Fuzzer::minimise(FuzzCase fuzz_case)
+{
+    auto kind = handler_kind(fuzz_case);
+    auto attempt = [&](const FuzzCase& candidate)
+    {
+        if (!valid(candidate) || handler_kind(candidate) != kind || !fails(candidate))
+            return false;
+        fuzz_case = candidate;
+        return true;
+    };
+    // Tries clearing each set bit of a field, returns whether one stayed cleared
+    auto clear_bits = [&](auto field)
+    {
+        bool changed = false;
+        for (int bit = 31; bit >= 0; bit--)
+        {
+            auto candidate = fuzz_case;
+            auto& value = field(candidate);
+            if (((value >> bit) & 1) == 0)
+                continue;
+            value &= ~(1u << bit);
+            changed |= attempt(candidate);
+        }
+        return changed;
+    };
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        if (fuzz_case.window_seed != 0)
+        {
+            auto candidate = fuzz_case;
+            candidate.window_seed = 0;
+            changed |= attempt(candidate);
+        }
+        changed |= clear_bits([](FuzzCase& c) -> uint32_t& { return c.flags; });
+        for (uint32_t i = 0; i < 15; i++)
+        {
+            if (fuzz_case.R[i] == 0)
+                continue;
+            auto candidate = fuzz_case;
+            candidate.R[i] = 0;
+            changed |= attempt(candidate) || clear_bits([i](FuzzCase& c) -> uint32_t& { return c.R[i]; });
+        }
+        for (uint32_t i = 0; i < 2; i++)
+            changed |= clear_bits([i](FuzzCase& c) -> uint32_t& { return c.opcodes[i]; });
+    }
+    return fuzz_case;
+}
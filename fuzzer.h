@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+#include "GBA_Cpu.h"
+#include "decoder.h"
+
+/**
+ * @brief What gba-fuzz checks the interpreter against.
+ */
+enum class FuzzMode : uint8_t
+{
+    BACKENDS,   // Each instruction on the switch and the threaded backends
+    FUSION,     // Each THUMB pair fuse_thumb knows, fused and one instruction at a time
+    REFERENCE   // Each instruction against the evaluator of fuzzer.cpp, written from the ARM7TDMI manual
+};
+
+/**
+ * @brief Starting state of a fuzzed instruction.
+ *
+ * The cpu starts in System mode at code_address, with the registers and flags of the case. The
+ * memory window is filled from window_seed (zeroes for seed 0), then the opcodes are written at
+ * code_address. Loads and stores get a base register pointing inside the window, so every
+ * access an instruction makes stays in it.
+ */
+struct FuzzCase
+{
+    static constexpr uint32_t window_address = 0x03000000;  // IWRAM
+    static constexpr uint32_t window_size = 0x4000;
+    static constexpr uint32_t code_address = window_address + window_size / 2;
+
+    InstructionSet set = InstructionSet::ARM;
+    /** The instruction, and in THUMB the one after it: the second half of BL, or the other half of a fused pair. */
+    uint32_t opcodes[2] = { 0, 0 };
+    uint32_t R[15] = { 0 };
+    uint32_t flags = 0;         // NZCVQ, I and F bits of CPSR
+    uint64_t window_seed = 0;
+};
+
+/**
+ * @brief State a case leaves the cpu and its memory window in.
+ */
+struct FuzzOutcome
+{
+    bool handled = false;
+    uint32_t R[16] = { 0 };
+    uint32_t CPSR = 0;
+    uint64_t cycles = 0;        // Not compared in REFERENCE mode
+    std::vector<uint8_t> window;
+
+    bool operator==(const FuzzOutcome& other) const;
+    bool operator!=(const FuzzOutcome& other) const { return !(*this == other); }
+};
+
+/**
+ * @brief A case whose outcomes differ, minimised.
+ */
+struct FuzzFailure
+{
+    FuzzMode mode = FuzzMode::BACKENDS;
+    FuzzCase fuzz_case;
+    FuzzOutcome expected;       // Switch backend, one at a time or reference
+    FuzzOutcome actual;         // Threaded backend, fused or interpreter
+
+    /** The case, its disassembly and the registers, flags and bytes which differ. */
+    std::string describe() const;
+};
+
+/**
+ * @brief Generates random instructions and states and checks the interpreter on them.
+ *
+ * Each Fuzzer owns the memories and cpus it runs on, so one can run on each thread. Two
+ * GBA_Memory are allocated (one in REFERENCE mode), make them live across many cases.
+ */
+class Fuzzer
+{
+public:
+    Fuzzer(FuzzMode mode, uint64_t seed);
+    ~Fuzzer();
+
+    /**
+     * @brief Generates a case and checks it.
+     *
+     * Cases the checked pair can't tell apart, as an instruction the reference doesn't model or
+     * the interpreter doesn't handle, are skipped.
+     *
+     * @return uint32_t Instructions tested by the case, 0 if it was skipped.
+     */
+    uint32_t run_case();
+
+    /**
+     * @brief The failure of the last run_case, minimised, if its outcomes differed.
+     */
+    const std::optional<FuzzFailure>& failure() const { return last_failure; }
+
+    /**
+     * @brief Generates a case for the mode, with valid encodings of the handled instructions
+     * and, outside REFERENCE, some fully random opcodes.
+     */
+    FuzzCase generate();
+
+    /**
+     * @brief Runs a case on both sides of the comparison.
+     *
+     * @return bool False if the case was skipped, expected and actual are meaningless then.
+     */
+    bool check(const FuzzCase& fuzz_case, FuzzOutcome& expected, FuzzOutcome& actual);
+
+    /**
+     * @brief Simplifies a failing case while it keeps failing: zeroes the window, the flags, the
+     * registers and their bits, and clears the opcode bits that don't change its handler.
+     */
+    FuzzCase minimise(FuzzCase fuzz_case);
+
+private:
+    struct Side;
+
+    void load(Side& side, const FuzzCase& fuzz_case) const;
+    static FuzzOutcome outcome(const Side& side, bool handled);
+    /** Outcome computed by the evaluator, std::nullopt for instructions it doesn't model. */
+    std::optional<FuzzOutcome> reference(const FuzzCase& fuzz_case) const;
+    /** Whether the case still fails the same way while minimised. */
+    bool fails(const FuzzCase& fuzz_case);
+    /** Points the base register of a load or store inside the window, drops the encodings whose result is unpredictable. */
+    bool sanitise(FuzzCase& fuzz_case);
+    uint32_t generate_arm();
+    uint32_t generate_thumb(uint32_t& second);
+    /** Sides diverge when a case fails, they are replaced by fresh ones. */
+    void reset_sides();
+
+    FuzzMode mode;
+    std::mt19937_64 random;
+    std::unique_ptr<Side> sides[2];
+    std::optional<FuzzFailure> last_failure;
+};
@@ -0,0 +1,687 @@
+#include "gdb_stub.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+    /** r0-r15 and cpsr, in the order of the g packet. */
+    constexpr size_t register_count = 17;
+    constexpr size_t cpsr_index = 16;
+    constexpr uint32_t thumb_bit = 1 << 5;
+
+    constexpr std::string_view target_xml =
+        "<?xml version=\"1.0\"?>"
+        "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+        "<target version=\"1.0\">"
+        "<architecture>arm</architecture>"
+        "<feature name=\"org.gnu.gdb.arm.core\">"
+        "<reg name=\"r0\" bitsize=\"32\"/><reg name=\"r1\" bitsize=\"32\"/>"
+        "<reg name=\"r2\" bitsize=\"32\"/><reg name=\"r3\" bitsize=\"32\"/>"
+        "<reg name=\"r4\" bitsize=\"32\"/><reg name=\"r5\" bitsize=\"32\"/>"
+        "<reg name=\"r6\" bitsize=\"32\"/><reg name=\"r7\" bitsize=\"32\"/>"
+        "<reg name=\"r8\" bitsize=\"32\"/><reg name=\"r9\" bitsize=\"32\"/>"
+        "<reg name=\"r10\" bitsize=\"32\"/><reg name=\"r11\" bitsize=\"32\"/>"
+        "<reg name=\"r12\" bitsize=\"32\"/>"
+        "<reg name=\"sp\" bitsize=\"32\" type=\"data_ptr\"/>"
+        "<reg name=\"lr\" bitsize=\"32\"/>"
+        "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>"
+        "<reg name=\"cpsr\" bitsize=\"32\"/>"
+        "</feature>"
+        "</target>";
+
+    int hex_digit(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    /** Parses a big endian hex number, as addresses and lengths are sent. Stops at the first non hex character. */
+    uint32_t parse_hex(std::string_view& text)
+    {
+        uint32_t value = 0;
+        while (!text.empty() && hex_digit(text.front()) >= 0)
+        {
+            value = (value << 4) | hex_digit(text.front());
+            text.remove_prefix(1);
+        }
+        return value;
+    }
+
+    /** Register values are sent as little endian bytes. */
+    uint32_t parse_register(std::string_view text)
+    {
+        uint32_t value = 0;
+        for (size_t i = 0; i + 1 < text.size() && i < 8; i += 2)
+            value |= uint32_t(hex_digit(text[i]) << 4 | hex_digit(text[i + 1])) << (i * 4);
+        return value;
+    }
+
+    void append_byte(std::string& text, uint8_t byte)
+    {
+        constexpr const char* digits = "0123456789abcdef";
+        text += digits[byte >> 4];
+        text += digits[byte & 0xF];
+    }
+
+    void append_register(std::string& text, uint32_t value)
+    {
+        for (int i = 0; i < 4; i++)
+            append_byte(text, (value >> (i * 8)) & 0xFF);
+    }
+
+    /** Splits "addr,length" off a packet body, leaving text after them. */
+    bool parse_address_length(std::string_view& text, uint32_t& address, uint32_t& length)
+    {
+        address = parse_hex(text);
+        if (text.empty() || text.front() != ',')
+            return false;
+        text.remove_prefix(1);
+        length = parse_hex(text);
+        return true;
+    }
+
+    bool starts_with(std::string_view text, std::string_view prefix)
+    {
+        return text.substr(0, prefix.size()) == prefix;
+    }
+}
+
+GDB_Stub::GDB_Stub(GBA_Cpu& cpu, const std::string& address)
+    : cpu(cpu)
+{
+    if (starts_with(address, "unix:"))
+    {
+        socket_path = address.substr(5);
+        sockaddr_un socket_address{};
+        if (socket_path.empty() || socket_path.size() >= sizeof(socket_address.sun_path))
+        {
+            throw std::runtime_error(fmt::format("Invalid unix socket path {}", socket_path));
+        }
+        socket_address.sun_family = AF_UNIX;
+        std::copy(socket_path.begin(), socket_path.end(), socket_address.sun_path);
+
+        listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(socket_path.c_str());
+        if (listen_socket < 0
+            || bind(listen_socket, reinterpret_cast<sockaddr*>(&socket_address), sizeof(socket_address)) < 0)
+        {
+            throw std::runtime_error(fmt::format("Could not open {}: {}", socket_path, std::strerror(errno)));
+        }
+    }
+    else
+    {
+        std::string_view port_text = address;
+        auto port = std::stoul(address);
+        sockaddr_in socket_address{};
+        socket_address.sin_family = AF_INET;
+        socket_address.sin_port = htons(static_cast<uint16_t>(port));
+        socket_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        if (listen_socket < 0
+            || setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0
+            || bind(listen_socket, reinterpret_cast<sockaddr*>(&socket_address), sizeof(socket_address)) < 0)
+        {
+            throw std::runtime_error(fmt::format("Could not listen on port {}: {}", port_text, std::strerror(errno)));
+        }
+    }
+
+    if (listen(listen_socket, 1) < 0)
+    {
+        throw std::runtime_error(fmt::format("Could not listen on {}: {}", address, std::strerror(errno)));
+    }
+}
+
+GDB_Stub::~GDB_Stub()
+{
+    close_connection();
+    if (listen_socket >= 0)
+        close(listen_socket);
+    if (!socket_path.empty())
+        unlink(socket_path.c_str());
+    cpu.break_handler = nullptr;
+}
+
+void GDB_Stub::run()
+{
+    connection = accept(listen_socket, nullptr, nullptr);
+    if (connection < 0)
+    {
+        throw std::runtime_error(fmt::format("Could not accept gdb: {}", std::strerror(errno)));
+    }
+    fcntl(connection, F_SETFL, fcntl(connection, F_GETFL) | O_NONBLOCK);
+    if (socket_path.empty())
+    {
+        int no_delay = 1;
+        setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    }
+
+    cpu.break_handler = [this](GBA_Cpu&, uint32_t instruction_address) { on_break_point(instruction_address); };
+
+    // gdb asks for the stop reason itself once connected
+    stop_reply = "S05";
+    serve();
+
+    uint32_t since_poll = 0;
+    while (resume != Resume::KILL)
+    {
+        if (resume == Resume::DETACH)
+        {
+            cpu.break_handler = nullptr;
+            cpu.break_points.clear();
+            auto& watchpoints = cpu.memory.watchpoints;
+            watchpoints.erase(std::remove_if(watchpoints.begin(), watchpoints.end(),
+                                             [](const GBA_Memory::Watchpoint& watchpoint) { return watchpoint.owner == 0; }),
+                              watchpoints.end());
+            cpu.run();
+            return;
+        }
+
+        if (++since_poll == poll_interval)
+        {
+            since_poll = 0;
+            if (!fill_input(0))
+            {
+                return;
+            }
+            auto interrupt = input.find('\x03');
+            if (interrupt != std::string::npos)
+            {
+                input.erase(interrupt, 1);
+                stop("S02");
+                continue;
+            }
+        }
+
+        auto handled = cpu.cycle();
+        skip_break_point = false;
+
+        auto& watch_hit = cpu.memory.watch_hit;
+        if (!handled)
+        {
+            stop("S04");
+        }
+        else if (watch_hit.triggered && watch_hit.owner == 0)
+        {
+            std::string_view kind = watch_hit.access == GBA_Memory::WATCH_WRITE ? "watch"
+                                  : watch_hit.access == GBA_Memory::WATCH_READ ? "rwatch"
+                                  : "awatch";
+            stop(fmt::format("T05{}:{:x};", kind, watch_hit.address));
+        }
+        else if (stepping)
+        {
+            stop("S05");
+        }
+    }
+}
+
+void GDB_Stub::on_break_point(uint32_t instruction_address)
+{
+    if (skip_break_point && instruction_address == skipped_address)
+    {
+        return;
+    }
+
+    // The break point is checked before the instruction executes, so the cpu stops right here
+    stop("S05");
+}
+
+void GDB_Stub::stop(std::string_view reply)
+{
+    stop_reply = reply;
+    send_packet(stop_reply);
+    serve();
+}
+
+void GDB_Stub::serve()
+{
+    resume = Resume::NONE;
+    std::string packet;
+    while (resume == Resume::NONE)
+    {
+        if (!receive_packet(packet, true))
+        {
+            // gdb went away, the target goes with it
+            resume = Resume::KILL;
+            break;
+        }
+        resume = handle_packet(packet);
+    }
+
+    cpu.memory.watch_hit.triggered = false;
+    stepping = resume == Resume::STEP;
+    cpu.fuse_instructions = !stepping;
+    skip_break_point = true;
+    skipped_address = instruction_address();
+}
+
+GDB_Stub::Resume GDB_Stub::handle_packet(std::string_view packet)
+{
+    if (packet.empty())
+    {
+        send_packet("");
+        return Resume::NONE;
+    }
+
+    auto body = packet.substr(1);
+    switch (packet[0])
+    {
+        case '?':
+            send_packet(stop_reply);
+            return Resume::NONE;
+        case 'g':
+        {
+            std::string reply;
+            for (size_t i = 0; i < register_count; i++)
+                append_register(reply, read_register(i));
+            send_packet(reply);
+            return Resume::NONE;
+        }
+        case 'G':
+        {
+            if (body.size() < register_count * 8)
+            {
+                send_packet("E01");
+                return Resume::NONE;
+            }
+            for (size_t i = 0; i < register_count; i++)
+                write_register(i, parse_register(body.substr(i * 8, 8)));
+            send_packet("OK");
+            return Resume::NONE;
+        }
+        case 'p':
+        {
+            auto index = parse_hex(body);
+            if (index >= register_count)
+            {
+                send_packet("E01");
+                return Resume::NONE;
+            }
+            std::string reply;
+            append_register(reply, read_register(index));
+            send_packet(reply);
+            return Resume::NONE;
+        }
+        case 'P':
+        {
+            auto index = parse_hex(body);
+            if (index >= register_count || body.empty() || body.front() != '=')
+            {
+                send_packet("E01");
+                return Resume::NONE;
+            }
+            write_register(index, parse_register(body.substr(1)));
+            send_packet("OK");
+            return Resume::NONE;
+        }
+        case 'm':
+        {
+            uint32_t address, length;
+            if (!parse_address_length(body, address, length) || cpu.memory.contiguous_size(address) < length)
+            {
+                send_packet("E01");
+                return Resume::NONE;
+            }
+            std::string reply;
+            reply.reserve(length * 2);
+            for (uint32_t i = 0; i < length; i++)
+                append_byte(reply, cpu.memory.read_byte(address + i));
+            send_packet(reply);
+            return Resume::NONE;
+        }
+        case 'M':
+        case 'X':
+        {
+            uint32_t address, length;
+            if (!parse_address_length(body, address, length) || body.empty() || body.front() != ':'
+                || cpu.memory.contiguous_size(address) < length)
+            {
+                send_packet("E01");
+                return Resume::NONE;
+            }
+            body.remove_prefix(1);
+
+            if (packet[0] == 'M')
+            {
+                if (body.size() < length * 2)
+                {
+                    send_packet("E01");
+                    return Resume::NONE;
+                }
+                for (uint32_t i = 0; i < length; i++)
+                    cpu.memory.write_byte(address + i, hex_digit(body[i * 2]) << 4 | hex_digit(body[i * 2 + 1]));
+            }
+            else
+            {
+                // Binary data, '}' escapes the next byte xored with 0x20
+                uint32_t written = 0;
+                for (size_t i = 0; i < body.size() && written < length; i++)
+                {
+                    uint8_t byte = body[i];
+                    if (byte == '}' && i + 1 < body.size())
+                        byte = body[++i] ^ 0x20;
+                    cpu.memory.write_byte(address + written++, byte);
+                }
+            }
+
+            refill_pipeline(instruction_address());
+            send_packet("OK");
+            return Resume::NONE;
+        }
+        case 'c':
+        case 's':
+        case 'C':
+        case 'S':
+        {
+            // Signals of C and S are meaningless to the cpu, only their address is kept
+            if (packet[0] == 'C' || packet[0] == 'S')
+            {
+                auto separator = body.find(';');
+                body = separator == std::string_view::npos ? std::string_view{} : body.substr(separator + 1);
+            }
+            if (!body.empty())
+                refill_pipeline(parse_hex(body));
+            return packet[0] == 'c' || packet[0] == 'C' ? Resume::CONTINUE : Resume::STEP;
+        }
+        case 'v':
+            if (packet == "vCont?")
+            {
+                send_packet("vCont;c;C;s;S");
+            }
+            else if (starts_with(packet, "vCont;") && packet.size() > 6)
+            {
+                // A single thread, the first action applies to it
+                auto action = packet[6];
+                if (action == 'c' || action == 'C')
+                    return Resume::CONTINUE;
+                if (action == 's' || action == 'S')
+                    return Resume::STEP;
+                send_packet("E01");
+            }
+            else
+            {
+                send_packet("");
+            }
+            return Resume::NONE;
+        case 'q':
+        case 'Q':
+            handle_query(packet);
+            return Resume::NONE;
+        case 'Z':
+        case 'z':
+            handle_break_point(body, packet[0] == 'Z');
+            return Resume::NONE;
+        case 'H':
+        case 'T':
+            send_packet("OK");
+            return Resume::NONE;
+        case 'D':
+            send_packet("OK");
+            return Resume::DETACH;
+        case 'k':
+            return Resume::KILL;
+        default:
+            send_packet("");
+            return Resume::NONE;
+    }
+}
+
+void GDB_Stub::handle_query(std::string_view packet)
+{
+    if (starts_with(packet, "qSupported"))
+    {
+        send_packet("PacketSize=4000;qXfer:features:read+;QStartNoAckMode+");
+    }
+    else if (packet == "QStartNoAckMode")
+    {
+        send_packet("OK");
+        no_ack = true;
+    }
+    else if (starts_with(packet, "qXfer:features:read:target.xml:"))
+    {
+        auto body = packet.substr(32);
+        uint32_t offset, length;
+        if (!parse_address_length(body, offset, length))
+        {
+            send_packet("E01");
+            return;
+        }
+        offset = std::min<uint32_t>(offset, target_xml.size());
+        auto chunk = target_xml.substr(offset, length);
+        send_packet(fmt::format("{}{}", offset + chunk.size() < target_xml.size() ? 'm' : 'l', chunk));
+    }
+    else if (packet == "qAttached")
+    {
+        send_packet("1");
+    }
+    else if (packet == "qC")
+    {
+        send_packet("QC1");
+    }
+    else if (packet == "qfThreadInfo")
+    {
+        send_packet("m1");
+    }
+    else if (packet == "qsThreadInfo")
+    {
+        send_packet("l");
+    }
+    else
+    {
+        send_packet("");
+    }
+}
+
+void GDB_Stub::handle_break_point(std::string_view packet, bool insert)
+{
+    auto type = parse_hex(packet);
+    uint32_t address, kind;
+    if (packet.empty() || packet.front() != ',')
+    {
+        send_packet("E01");
+        return;
+    }
+    packet.remove_prefix(1);
+    if (!parse_address_length(packet, address, kind))
+    {
+        send_packet("E01");
+        return;
+    }
+
+    // Break points are checked in software, so software and hardware ones are the same
+    if (type == 0 || type == 1)
+    {
+        auto& break_points = cpu.break_points;
+        auto found = std::find(break_points.begin(), break_points.end(), address);
+        if (insert && found == break_points.end())
+            break_points.push_back(address);
+        else if (!insert && found != break_points.end())
+            break_points.erase(found);
+        send_packet("OK");
+        return;
+    }
+
+    if (type > 4)
+    {
+        send_packet("");
+        return;
+    }
+
+    auto access = type == 2 ? GBA_Memory::WATCH_WRITE
+                : type == 3 ? GBA_Memory::WATCH_READ
+                : GBA_Memory::WATCH_ACCESS;
+    auto& watchpoints = cpu.memory.watchpoints;
+    auto found = std::find_if(watchpoints.begin(), watchpoints.end(), [&](const GBA_Memory::Watchpoint& watchpoint)
+    {
+        return watchpoint.begin == address && watchpoint.end == address + kind && watchpoint.access == access
+            && watchpoint.owner == 0;
+    });
+    if (insert && found == watchpoints.end())
+        watchpoints.push_back({ address, address + kind, access });
+    else if (!insert && found != watchpoints.end())
+        watchpoints.erase(found);
+    send_packet("OK");
+}
+
+uint32_t GDB_Stub::instruction_address() const
+{
+    return cpu.PC - cpu.instruction_size * 2;
+}
+
+void GDB_Stub::refill_pipeline(uint32_t address)
+{
+    cpu.PC = address & ~static_cast<uint32_t>(cpu.instruction_size - 1);
+    cpu.flush_pipeline();
+}
+
+uint32_t GDB_Stub::read_register(size_t index) const
+{
+    if (index == 15)
+        return instruction_address();
+    if (index == cpsr_index)
+        return (cpu.CPSR & ~thumb_bit) | (cpu.mode == GBA_Cpu::ExecutionMode::THUMB ? thumb_bit : 0);
+    return cpu.R[index];
+}
+
+void GDB_Stub::write_register(size_t index, uint32_t value)
+{
+    if (index == 15)
+    {
+        refill_pipeline(value);
+    }
+    else if (index == cpsr_index)
+    {
+        auto address = instruction_address();
+        cpu.write_CPSR(value);
+        cpu.set_mode(value & thumb_bit ? GBA_Cpu::ExecutionMode::THUMB : GBA_Cpu::ExecutionMode::ARM);
+        refill_pipeline(address);
+    }
+    else
+    {
+        cpu.R[index] = value;
+    }
+}
+
+void GDB_Stub::send_packet(std::string_view payload)
+{
+    last_packet = "$";
+    uint8_t checksum = 0;
+    for (char c : payload)
+    {
+        if (c == '$' || c == '#' || c == '}' || c == '*')
+        {
+            last_packet += '}';
+            checksum += '}';
+            c ^= 0x20;
+        }
+        last_packet += c;
+        checksum += static_cast<uint8_t>(c);
+    }
+    last_packet += '#';
+    append_byte(last_packet, checksum);
+    send_raw(last_packet);
+}
+
+bool GDB_Stub::receive_packet(std::string& packet, bool wait)
+{
+    for (;;)
+    {
+        // Acks, and interrupts of an already stopped cpu, may come before the packet
+        auto start = input.find('$');
+        if (!no_ack && std::string_view{ input }.substr(0, start).find('-') != std::string_view::npos)
+            send_raw(last_packet);
+        input.erase(0, start);
+
+        auto end = input.find('#');
+        if (!input.empty() && end != std::string::npos && input.size() >= end + 3)
+        {
+            packet.assign(input, 1, end - 1);
+            uint8_t checksum = 0;
+            for (char c : packet)
+                checksum += static_cast<uint8_t>(c);
+            auto expected = hex_digit(input[end + 1]) << 4 | hex_digit(input[end + 2]);
+            input.erase(0, end + 3);
+
+            if (no_ack || checksum == expected)
+            {
+                if (!no_ack)
+                    send_raw("+");
+                return true;
+            }
+            send_raw("-");
+            continue;
+        }
+
+        if (!wait || !fill_input(-1))
+        {
+            return false;
+        }
+    }
+}
+
+bool GDB_Stub::fill_input(int timeout_ms)
+{
+    if (connection < 0)
+    {
+        return false;
+    }
+
+    pollfd descriptor{ connection, POLLIN, 0 };
+    if (poll(&descriptor, 1, timeout_ms) <= 0)
+    {
+        return true;
+    }
+
+    char buffer[4096];
+    auto received = recv(connection, buffer, sizeof(buffer), 0);
+    if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+        close_connection();
+        return false;
+    }
+    if (received > 0)
+        input.append(buffer, received);
+    return true;
+}
+
+void GDB_Stub::send_raw(std::string_view data)
+{
+    while (!data.empty() && connection >= 0)
+    {
+        auto sent = send(connection, data.data(), data.size(), MSG_NOSIGNAL);
+        if (sent > 0)
+        {
+            data.remove_prefix(sent);
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            pollfd descriptor{ connection, POLLOUT, 0 };
+            poll(&descriptor, 1, -1);
+        }
+        else
+        {
+            close_connection();
+        }
+    }
+}
+
+void GDB_Stub::close_connection()
+{
+    if (connection >= 0)
+    {
+        close(connection);
+        connection = -1;
+    }
+}
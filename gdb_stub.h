@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "GBA_Cpu.h"
+
+/**
+ * @brief GDB remote serial protocol server, debugging the emulated cpu from gdb-multiarch.
+ *
+ *      gba-emulator --gdb 2345 game.gba            (gdb) target remote localhost:2345
+ *      gba-emulator --gdb unix:/tmp/gba game.gba   (gdb) target remote /tmp/gba
+ *
+ * Supports register and memory reads and writes (m/M and the binary X packet), software and
+ * hardware breakpoints (both are kept in GBA_Cpu::break_points), write/read/access watchpoints,
+ * stepping, Ctrl-C and no-ack mode. The registers are described to gdb as r0-r15 and cpsr, with
+ * pc being the address of the next instruction to execute rather than the pipelined R15.
+ *
+ * While the cpu runs the socket is only polled every poll_interval instructions and never
+ * waited on. Only a stopped cpu waits for the next packet.
+ */
+class GDB_Stub
+{
+public:
+    /**
+     * @brief Listens on a TCP port of localhost, or on a Unix socket given as unix:path.
+     *
+     * @throws std::runtime_error If the socket can't be opened.
+     */
+    GDB_Stub(GBA_Cpu& cpu, const std::string& address);
+    ~GDB_Stub();
+    GDB_Stub(const GDB_Stub&) = delete;
+    GDB_Stub& operator=(const GDB_Stub&) = delete;
+
+    /**
+     * @brief Waits for gdb, then runs the cpu under its control.
+     *
+     * The cpu starts stopped. Returns when gdb kills the target, or when the cpu stops on an
+     * unhandled opcode after gdb detached.
+     */
+    void run();
+
+    /** Instructions executed between two checks for a Ctrl-C from gdb. */
+    static constexpr uint32_t poll_interval = 4096;
+private:
+    enum class Resume { NONE, CONTINUE, STEP, DETACH, KILL };
+
+    /** Stops on a break point, unless it is the one just resumed from. */
+    void on_break_point(uint32_t instruction_address);
+
+    /** Reports a stop to gdb and serves it until it resumes the cpu. */
+    void stop(std::string_view reply);
+    /** Handles packets until one resumes the cpu. */
+    void serve();
+
+    Resume handle_packet(std::string_view packet);
+    void handle_query(std::string_view packet);
+    void handle_break_point(std::string_view packet, bool insert);
+
+    /** Address of the instruction to be executed next. */
+    uint32_t instruction_address() const;
+    /** Refetches the pipeline, after gdb wrote PC, CPSR or the memory it holds. */
+    void refill_pipeline(uint32_t address);
+    uint32_t read_register(size_t index) const;
+    void write_register(size_t index, uint32_t value);
+
+    /** Sends a packet, escaping and checksumming it. Waits for the ack unless no-ack mode is on. */
+    void send_packet(std::string_view payload);
+    /** Reads the next packet, waiting for it when wait is set. Returns false if none is complete. */
+    bool receive_packet(std::string& packet, bool wait);
+    /** Reads what the socket has, waiting up to timeout_ms (-1 forever). Returns false once closed. */
+    bool fill_input(int timeout_ms);
+    void send_raw(std::string_view data);
+    void close_connection();
+private:
+    GBA_Cpu& cpu;
+    std::string socket_path;    // Unix socket to be unlinked, if any
+    int listen_socket = -1;
+    int connection = -1;
+
+    std::string input;
+    std::string last_packet;    // Resent when gdb answers '-'
+    bool no_ack = false;
+    std::string stop_reply;     // Answer to '?'
+
+    Resume resume = Resume::NONE;
+    bool stepping = false;
+    /** A resumed cpu ignores the break point it stopped at once. */
+    bool skip_break_point = false;
+    uint32_t skipped_address = 0;
+};
@@ -0,0 +1,406 @@
+#include "io_registers.h"
+#include "GBA_Memory.h"
+#include <algorithm>
+
+namespace
+{
+    uint16_t load(const GBA_Memory& memory, uint32_t offset)
+    {
+        auto bytes = memory.pointer(io::base + offset);
+        return bytes[0] | (bytes[1] << 8);
+    }
+
+    void store(GBA_Memory& memory, uint32_t offset, uint16_t value)
+    {
+        auto bytes = memory.pointer(io::base + offset);
+        bytes[0] = value & 0xFF;
+        bytes[1] = (value >> 8) & 0xFF;
+    }
+
+    uint32_t load_word(const GBA_Memory& memory, uint32_t offset)
+    {
+        return load(memory, offset) | (load(memory, offset + 2) << 16);
+    }
+
+    /*
+     * Performs the transfer of a DMA channel, from the addresses latched when it started.
+     *
+     * Control
+     * [5, 6] Destination adjust: 0=Increment 1=Decrement 2=Fixed 3=Increment/Reload
+     * [7, 8] Source adjust: 0=Increment 1=Decrement 2=Fixed
+     * [10] 1=32bit units 0=16bit units
+     * [14] Request an interrupt at the end of the transfer
+     */
+    void run_DMA(GBA_Memory& memory, uint32_t channel, uint16_t control)
+    {
+        auto channel_base = io::DMA0SAD + channel * io::DMA_channel_size;
+        auto& latched = memory.io_state.DMA[channel];
+        uint32_t count = load(memory, channel_base + io::DMA_CNT_L);
+        bool words = (control >> 10) & 1;
+        uint32_t unit = words ? 4 : 2;
+
+        if (count == 0)
+            count = channel == 3 ? 0x10000 : 0x4000;
+
+        auto step = [unit](uint16_t adjust) -> int32_t
+        {
+            switch (adjust)
+            {
+                case 1:     return -static_cast<int32_t>(unit);
+                case 2:     return 0;
+                default:    return unit;
+            }
+        };
+        int32_t destination_step = step((control >> 5) & 0x03);
+        int32_t source_step = step((control >> 7) & 0x03);
+
+        uint32_t source = latched.source & 0x0FFFFFFF & ~(unit - 1);
+        uint32_t destination = latched.destination & 0x0FFFFFFF & ~(unit - 1);
+
+        for (uint32_t i = 0; i < count; i++, source += source_step, destination += destination_step)
+        {
+            if (words)
+                memory.write_word(destination, memory.read_word(source));
+            else
+                memory.write_halfword(destination, memory.read_halfword(source));
+        }
+
+        latched.source = source;
+        latched.destination = destination;
+
+        if ((control >> 14) & 1)
+            io::request_interrupt(memory, io::interrupt_DMA0 << channel);
+    }
+
+    /*
+     * Runs the enabled channels waiting for a start timing (1=VBlank 2=HBlank).
+     * [9] Repeat: the channel stays enabled, waiting for the next trigger.
+     */
+    void trigger_DMA(GBA_Memory& memory, uint8_t timing)
+    {
+        for (uint32_t channel = 0; channel < 4; channel++)
+        {
+            auto control_offset = io::DMA0SAD + channel * io::DMA_channel_size + io::DMA_CNT_H;
+            uint16_t control = load(memory, control_offset);
+
+            if (!((control >> 15) & 1) || ((control >> 12) & 0x03) != timing)
+                continue;
+
+            run_DMA(memory, channel, control);
+
+            if (!((control >> 9) & 1))
+                store(memory, control_offset, control & 0x7FFF);
+            else if (((control >> 5) & 0x03) == 3)
+                memory.io_state.DMA[channel].destination = load_word(memory, control_offset - io::DMA_CNT_H + io::DMA_DAD);
+        }
+    }
+
+    constexpr uint32_t timer_prescaler_shift[4] = { 0, 6, 8, 10 };
+
+    /*
+     * Timer control
+     * [0, 1] Prescaler: 0=1 1=64 2=256 3=1024 cycles
+     * [2] Count up when the previous timer overflows
+     * [6] Request an interrupt on overflow
+     * [7] Enable
+     */
+    void tick_timers(GBA_Memory& memory, uint32_t cycles)
+    {
+        auto& state = memory.io_state;
+        uint32_t previous_overflows = 0;
+
+        for (uint32_t timer = 0; timer < 4; timer++)
+        {
+            uint16_t control = load(memory, io::TM0CNT_H + timer * io::timer_size);
+            uint32_t increments;
+
+            if (!((control >> 7) & 1))
+            {
+                previous_overflows = 0;
+                continue;
+            }
+
+            if (timer > 0 && ((control >> 2) & 1))
+            {
+                increments = previous_overflows;
+            }
+            else
+            {
+                auto shift = timer_prescaler_shift[control & 0x03];
+                state.timer_prescaler[timer] += cycles;
+                increments = state.timer_prescaler[timer] >> shift;
+                state.timer_prescaler[timer] &= (1u << shift) - 1;
+            }
+
+            uint32_t counter = state.timer_counter[timer] + increments;
+            previous_overflows = 0;
+
+            if (counter >= 0x10000)
+            {
+                uint32_t reload = state.timer_reload[timer];
+                uint32_t period = 0x10000 - reload;
+                uint32_t excess = counter - 0x10000;
+                previous_overflows = 1 + excess / period;
+                counter = reload + excess % period;
+
+                if ((control >> 6) & 1)
+                    io::request_interrupt(memory, io::interrupt_timer0 << timer);
+            }
+
+            state.timer_counter[timer] = static_cast<uint16_t>(counter);
+        }
+    }
+
+    constexpr uint32_t cycles_per_line = 1232;
+    constexpr uint32_t hdraw_cycles = 960;
+    constexpr uint32_t line_count = 228;
+    constexpr uint32_t vdraw_lines = 160;
+
+    /*
+     * DISPSTAT
+     * [0] VBlank flag [1] HBlank flag [2] VCount match flag
+     * [3] VBlank IRQ [4] HBlank IRQ [5] VCount IRQ
+     * [8, 15] VCount setting (LYC)
+     */
+    void start_hblank(GBA_Memory& memory)
+    {
+        uint16_t status = load(memory, io::DISPSTAT) | 0x0002;
+        store(memory, io::DISPSTAT, status);
+
+        if ((status >> 4) & 1)
+            io::request_interrupt(memory, io::interrupt_HBlank);
+        if (load(memory, io::VCOUNT) < vdraw_lines)
+            trigger_DMA(memory, 2);
+    }
+
+    void start_line(GBA_Memory& memory)
+    {
+        uint16_t line = (load(memory, io::VCOUNT) + 1) % line_count;
+        uint16_t status = load(memory, io::DISPSTAT) & ~0x0002;
+        store(memory, io::VCOUNT, line);
+
+        if (line == vdraw_lines)
+        {
+            auto& state = memory.io_state;
+            state.frame++;
+            if (state.frame_handler)
+                state.frame_handler();
+            io::latch_keypad(memory);
+
+            status |= 0x0001;
+            if ((status >> 3) & 1)
+                io::request_interrupt(memory, io::interrupt_VBlank);
+            trigger_DMA(memory, 1);
+        }
+        else if (line == line_count - 1)
+        {
+            status &= ~0x0001;
+        }
+
+        if (line == (status >> 8))
+        {
+            status |= 0x0004;
+            if ((status >> 5) & 1)
+                io::request_interrupt(memory, io::interrupt_VCount);
+        }
+        else
+        {
+            status &= ~0x0004;
+        }
+
+        store(memory, io::DISPSTAT, status);
+    }
+
+    void tick_display(GBA_Memory& memory, uint32_t cycles)
+    {
+        auto& line_cycle = memory.io_state.line_cycle;
+
+        while (cycles > 0)
+        {
+            uint32_t next_event = line_cycle < hdraw_cycles ? hdraw_cycles : cycles_per_line;
+            uint32_t step = std::min(cycles, next_event - line_cycle);
+            line_cycle += step;
+            cycles -= step;
+
+            if (line_cycle == hdraw_cycles)
+            {
+                start_hblank(memory);
+            }
+            else if (line_cycle == cycles_per_line)
+            {
+                line_cycle = 0;
+                start_line(memory);
+            }
+        }
+    }
+
+    void reset_FIFO(io::State::SoundFIFO& fifo)
+    {
+        fifo.head = 0;
+        fifo.count = 0;
+    }
+}
+
+namespace io
+{
+    void latch_keypad(GBA_Memory& memory)
+    {
+        store(memory, KEYINPUT, memory.io_state.keypad);
+    }
+
+    void write_SOUNDCNT_H(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask)
+    {
+        store(memory, offset, (load(memory, offset) & ~mask) | (value & mask));
+
+        if (value & mask & 0x0800)
+            reset_FIFO(memory.io_state.sound_FIFO[0]);
+        if (value & mask & 0x8000)
+            reset_FIFO(memory.io_state.sound_FIFO[1]);
+    }
+
+    void write_sound_FIFO(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask)
+    {
+        auto& fifo = memory.io_state.sound_FIFO[offset < FIFO_B ? 0 : 1];
+
+        for (int i = 0; i < 2; i++, value >>= 8, mask >>= 8)
+        {
+            if ((mask & 0xFF) == 0 || fifo.count == fifo.data.size())
+                continue;
+
+            fifo.data[(fifo.head + fifo.count) % fifo.data.size()] = value & 0xFF;
+            fifo.count++;
+        }
+    }
+
+    /*
+     * Control
+     * [12, 13] Start timing: 0=Immediately 1=VBlank 2=HBlank 3=Special
+     * [15] Enable
+     */
+    void write_DMA_control(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask)
+    {
+        uint32_t channel = (offset - DMA0SAD) / DMA_channel_size;
+        uint16_t previous = load(memory, offset);
+        uint16_t control = (previous & ~mask) | (value & mask);
+        store(memory, offset, control);
+
+        bool enabled = (control >> 15) & 1;
+        bool was_enabled = (previous >> 15) & 1;
+        uint8_t timing = (control >> 12) & 0x03;
+
+        if (!enabled || was_enabled)
+            return;
+
+        auto channel_base = DMA0SAD + channel * DMA_channel_size;
+        memory.io_state.DMA[channel].source = load_word(memory, channel_base + DMA_SAD);
+        memory.io_state.DMA[channel].destination = load_word(memory, channel_base + DMA_DAD);
+
+        // VBlank and HBlank transfers are started by tick, special (sound FIFO) ones aren't emulated
+        if (timing != 0)
+            return;
+
+        run_DMA(memory, channel, control);
+        store(memory, offset, control & 0x7FFF);
+    }
+
+    uint16_t read_timer_counter(const GBA_Memory& memory, uint32_t offset)
+    {
+        return memory.io_state.timer_counter[(offset - TM0CNT_L) / timer_size];
+    }
+
+    void write_timer_reload(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask)
+    {
+        auto& reload = memory.io_state.timer_reload[(offset - TM0CNT_L) / timer_size];
+        reload = (reload & ~mask) | (value & mask);
+    }
+
+    /*
+     * Control
+     * [0, 1] Prescaler: 0=1 1=64 2=256 3=1024 cycles
+     * [2] Count up when the previous timer overflows
+     * [6] Request an interrupt on overflow
+     * [7] Enable. The counter is reloaded when the timer starts
+     */
+    void write_timer_control(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask)
+    {
+        auto timer = (offset - TM0CNT_H) / timer_size;
+        uint16_t previous = load(memory, offset);
+        uint16_t control = (previous & ~mask) | (value & mask);
+        store(memory, offset, control);
+
+        if (!((previous >> 7) & 1) && ((control >> 7) & 1))
+        {
+            memory.io_state.timer_counter[timer] = memory.io_state.timer_reload[timer];
+            memory.io_state.timer_prescaler[timer] = 0;
+        }
+    }
+
+    void write_IE(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask)
+    {
+        store(memory, offset, (load(memory, offset) & ~mask) | (value & mask));
+        update_interrupts(memory);
+    }
+
+    /*
+     * Interrupts are acknowledged by writing 1 to their bits.
+     */
+    void write_IF(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask)
+    {
+        store(memory, offset, load(memory, offset) & ~(value & mask));
+        update_interrupts(memory);
+    }
+
+    void write_IME(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask)
+    {
+        store(memory, offset, (load(memory, offset) & ~mask) | (value & mask));
+        update_interrupts(memory);
+    }
+
+    void write_WAITCNT(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask)
+    {
+        auto waitcnt = static_cast<uint16_t>((load(memory, offset) & ~mask) | (value & mask));
+        store(memory, offset, waitcnt);
+        memory.io_state.wait_states = make_wait_states(waitcnt);
+    }
+
+    void request_interrupt(GBA_Memory& memory, uint16_t flags)
+    {
+        store(memory, IF, load(memory, IF) | flags);
+        update_interrupts(memory);
+    }
+
+    void update_interrupts(GBA_Memory& memory)
+    {
+        auto& interrupts = memory.io_state.interrupts;
+        interrupts.pending = !interrupts.cpu_irq_disabled
+            && (load(memory, IME) & 1)
+            && (load(memory, IE) & load(memory, IF) & 0x3FFF);
+    }
+
+    void tick(GBA_Memory& memory, uint32_t cycles)
+    {
+        tick_timers(memory, cycles);
+        tick_display(memory, cycles);
+    }
+
+    uint32_t cycles_until_event(const GBA_Memory& memory)
+    {
+        const auto& state = memory.io_state;
+        uint32_t cycles = (state.line_cycle < hdraw_cycles ? hdraw_cycles : cycles_per_line) - state.line_cycle;
+
+        for (uint32_t timer = 0; timer < 4; timer++)
+        {
+            uint16_t control = load(memory, TM0CNT_H + timer * timer_size);
+            bool counts_cycles = timer == 0 || !((control >> 2) & 1);
+
+            if (((control >> 7) & 1) && ((control >> 6) & 1) && counts_cycles)
+            {
+                auto shift = timer_prescaler_shift[control & 0x03];
+                uint32_t until_overflow = ((0x10000 - state.timer_counter[timer]) << shift) - state.timer_prescaler[timer];
+                cycles = std::min(cycles, until_overflow);
+            }
+        }
+
+        return cycles;
+    }
+}
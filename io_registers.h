@@ -0,0 +1,306 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+class GBA_Memory;
+
+/**
+ * @brief Memory mapped IO registers (0x0400_0000 to 0x0400_03FE).
+ *
+ * Every halfword register has an entry in a dispatch table generated at compile time. Plain
+ * registers only have masks and are served straight from the backing memory. Registers with
+ * side effects (DMA control, timers, interrupt acknowledge, sound FIFOs...) carry a handler.
+ */
+namespace io
+{
+    constexpr uint32_t base = 0x04000000;
+    constexpr uint32_t size = 0x400;
+
+    // Register offsets from io::base
+    constexpr uint32_t DISPCNT = 0x000;
+    constexpr uint32_t DISPSTAT = 0x004;
+    constexpr uint32_t VCOUNT = 0x006;
+    constexpr uint32_t BG0HOFS = 0x010;
+    constexpr uint32_t BG3VOFS = 0x01E;
+    constexpr uint32_t SOUNDCNT_H = 0x082;
+    constexpr uint32_t FIFO_A = 0x0A0;
+    constexpr uint32_t FIFO_B = 0x0A4;
+    constexpr uint32_t DMA0SAD = 0x0B0;
+    constexpr uint32_t DMA_channel_size = 0x00C;
+    constexpr uint32_t TM0CNT_L = 0x100;
+    constexpr uint32_t TM0CNT_H = 0x102;
+    constexpr uint32_t timer_size = 0x004;
+    constexpr uint32_t KEYINPUT = 0x130;
+    constexpr uint32_t IE = 0x200;
+    constexpr uint32_t IF = 0x202;
+    constexpr uint32_t WAITCNT = 0x204;
+    constexpr uint32_t IME = 0x208;
+
+    // Offsets inside a DMA channel
+    constexpr uint32_t DMA_SAD = 0x0;
+    constexpr uint32_t DMA_DAD = 0x4;
+    constexpr uint32_t DMA_CNT_L = 0x8;
+    constexpr uint32_t DMA_CNT_H = 0xA;
+
+    /**
+     * @brief Handles a write to a register.
+     *
+     * @param memory Memory owning the register.
+     * @param offset Offset of the halfword register from io::base.
+     * @param value Value being written.
+     * @param mask Bits of value being written (byte writes only touch half of the register).
+     */
+    typedef void (*WriteHandler)(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask);
+
+    /**
+     * @brief Produces the value read from a register.
+     *
+     * @param memory Memory owning the register.
+     * @param offset Offset of the halfword register from io::base.
+     */
+    typedef uint16_t (*ReadHandler)(const GBA_Memory& memory, uint32_t offset);
+
+    struct Register
+    {
+        uint16_t read_mask = 0xFFFF;  // Bits that can be read, write only bits read as 0
+        uint16_t write_mask = 0xFFFF; // Bits that can be written, read only bits are kept
+        ReadHandler read = nullptr;
+        WriteHandler write = nullptr;
+    };
+
+    void write_SOUNDCNT_H(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask);
+    void write_sound_FIFO(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask);
+    void write_DMA_control(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask);
+    uint16_t read_timer_counter(const GBA_Memory& memory, uint32_t offset);
+    void write_timer_reload(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask);
+    void write_timer_control(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask);
+    void write_IE(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask);
+    void write_IF(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask);
+    void write_IME(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask);
+    void write_WAITCNT(GBA_Memory& memory, uint32_t offset, uint16_t value, uint16_t mask);
+
+    // Interrupt flags, as in IE and IF
+    constexpr uint16_t interrupt_VBlank = 1 << 0;
+    constexpr uint16_t interrupt_HBlank = 1 << 1;
+    constexpr uint16_t interrupt_VCount = 1 << 2;
+    constexpr uint16_t interrupt_timer0 = 1 << 3;
+    constexpr uint16_t interrupt_DMA0 = 1 << 8;
+
+    // Keys, as in KEYINPUT. A clear bit is a pressed key
+    constexpr uint16_t keys_none = 0x03FF;
+
+    /**
+     * @brief Cached state of the interrupt lines.
+     *
+     * pending is only recomputed when IE, IF, IME or the CPSR I bit change, so the cpu run loop
+     * only has to test a single boolean to know if it must enter IRQ mode.
+     */
+    struct InterruptController
+    {
+        bool pending = false;          // IME && (IE & IF) && !CPSR.I
+        bool cpu_irq_disabled = true;  // Mirror of the CPSR I bit
+    };
+
+    /**
+     * @brief Cycles an access takes, by region (top byte of the address) and width.
+     *
+     * Non sequential accesses go to an unrelated address, sequential ones to the address after
+     * the previous access. Words on the 16 bit buses of EWRAM, palette RAM, VRAM and the ROM
+     * take two accesses, the second one sequential. Derived from WAITCNT, rebuilt when it's written.
+     */
+    struct WaitStates
+    {
+        typedef std::array<std::array<uint8_t, 3>, 16> Table;   // [(address >> 24) & 0xF][width_index]
+
+        Table non_sequential{};
+        Table sequential{};
+        Table fetch{};  // Sequential opcode fetches, the prefetch buffer hides the ROM wait states
+    };
+
+    /** Index of an access of size bytes in a WaitStates table. */
+    constexpr size_t width_index(uint32_t size)
+    {
+        return size >> 1;
+    }
+
+    /**
+     * @brief Access times for a value of WAITCNT.
+     *
+     * [0, 1] SRAM wait states: 4, 3, 2, 8
+     * [2, 3] ROM wait state 0, first access: 4, 3, 2, 8. [4] Second access: 2, 1
+     * [5, 6] ROM wait state 1, first access: 4, 3, 2, 8. [7] Second access: 4, 1
+     * [8, 9] ROM wait state 2, first access: 4, 3, 2, 8. [10] Second access: 8, 1
+     * [14] Prefetch buffer
+     */
+    constexpr WaitStates make_wait_states(uint16_t waitcnt)
+    {
+        constexpr uint8_t first_access[4] = { 4, 3, 2, 8 };
+        constexpr uint8_t second_access[3] = { 2, 4, 8 };
+
+        WaitStates states{};
+        auto set = [&](size_t region, uint8_t non_sequential, uint8_t sequential, bool wide_bus)
+        {
+            states.non_sequential[region] = { non_sequential, non_sequential, static_cast<uint8_t>(wide_bus ? non_sequential : non_sequential + sequential) };
+            states.sequential[region] = { sequential, sequential, static_cast<uint8_t>(wide_bus ? sequential : 2 * sequential) };
+        };
+
+        for (size_t region = 0; region < 16; region++)
+            set(region, 1, 1, true);    // BIOS, IWRAM, IO registers, OAM and unmapped
+        set(0x2, 3, 3, false);          // EWRAM
+        set(0x5, 1, 1, false);          // Palette RAM
+        set(0x6, 1, 1, false);          // VRAM
+
+        for (size_t wait_state = 0; wait_state < 3; wait_state++)
+        {
+            auto bits = waitcnt >> (2 + 3 * wait_state);
+            uint8_t non_sequential = 1 + first_access[bits & 0x3];
+            uint8_t sequential = 1 + ((bits & 0x4) ? 1 : second_access[wait_state]);
+            set(0x8 + 2 * wait_state, non_sequential, sequential, false);
+            set(0x9 + 2 * wait_state, non_sequential, sequential, false);
+        }
+
+        // 8 bit bus, every access is a first one
+        uint8_t sram = 1 + first_access[waitcnt & 0x3];
+        for (size_t region = 0xE; region < 16; region++)
+        {
+            states.non_sequential[region] = { sram, sram, sram };
+            states.sequential[region] = { sram, sram, sram };
+        }
+
+        states.fetch = states.sequential;
+        if (waitcnt & 0x4000)
+        {
+            for (size_t region = 0x8; region < 0xE; region++)
+                states.fetch[region] = { 1, 1, 2 };
+        }
+        return states;
+    }
+
+    /**
+     * @brief Internal state of the registers whose value isn't the one stored in IO memory.
+     */
+    struct State
+    {
+        struct DMAChannel
+        {
+            uint32_t source = 0;
+            uint32_t destination = 0;
+        };
+
+        struct SoundFIFO
+        {
+            std::array<uint8_t, 32> data{};
+            uint8_t head = 0;
+            uint8_t count = 0;
+        };
+
+        std::array<uint16_t, 4> timer_reload{};
+        std::array<uint16_t, 4> timer_counter{};
+        std::array<uint32_t, 4> timer_prescaler{}; // Cycles accumulated towards the next increment
+        std::array<SoundFIFO, 2> sound_FIFO{};
+        std::array<DMAChannel, 4> DMA{};           // Addresses latched when the channel starts
+        uint32_t line_cycle = 0;                   // Position inside the current scanline
+        InterruptController interrupts;
+        WaitStates wait_states = make_wait_states(0);
+
+        /** Frames started, a frame starting with VBlank. */
+        uint32_t frame = 0;
+        /** Keys held, copied to KEYINPUT as each frame starts so that input only changes between frames. */
+        uint16_t keypad = keys_none;
+        /** Called as each frame starts, before keypad is copied to KEYINPUT. See MovieSession. */
+        std::function<void()> frame_handler;
+    };
+
+    /**
+     * @brief Copies State::keypad to KEYINPUT, which the bus can't write.
+     */
+    void latch_keypad(GBA_Memory& memory);
+
+    /**
+     * @brief Sets interrupt flags in IF.
+     *
+     * @param memory Memory owning the register.
+     * @param flags Interrupt flags to be raised.
+     */
+    void request_interrupt(GBA_Memory& memory, uint16_t flags);
+
+    /**
+     * @brief Recomputes InterruptController::pending.
+     *
+     * Must be called whenever IE, IF, IME or InterruptController::cpu_irq_disabled change.
+     */
+    void update_interrupts(GBA_Memory& memory);
+
+    /**
+     * @brief Advances the timers and the display timing.
+     *
+     * Raises the timer overflow, VBlank, HBlank and VCount interrupts and starts the DMA channels
+     * waiting for VBlank or HBlank.
+     *
+     * @param memory Memory owning the registers.
+     * @param cycles Elapsed cycles.
+     */
+    void tick(GBA_Memory& memory, uint32_t cycles);
+
+    /**
+     * @brief Cycles until the next display event or interrupt requesting timer overflow.
+     *
+     * Used to skip ahead while the cpu is halted.
+     */
+    uint32_t cycles_until_event(const GBA_Memory& memory);
+
+    constexpr std::array<Register, size / 2> make_register_table()
+    {
+        std::array<Register, size / 2> table{};
+
+        table[DISPCNT / 2].write_mask = 0xFFF7; // [3] CGB mode, writable by the BIOS only
+        table[DISPSTAT / 2].write_mask = 0xFFB8; // [0, 2] VBlank/HBlank/VCount flags
+        table[VCOUNT / 2].write_mask = 0x0000;
+
+        for (uint32_t offset = BG0HOFS; offset <= BG3VOFS; offset += 2)
+            table[offset / 2].read_mask = 0x0000;
+
+        table[SOUNDCNT_H / 2].read_mask = 0x770F; // [11] [15] FIFO reset bits always read as 0
+        table[SOUNDCNT_H / 2].write = write_SOUNDCNT_H;
+
+        for (uint32_t offset = FIFO_A; offset < FIFO_B + 4; offset += 2)
+        {
+            table[offset / 2].read_mask = 0x0000;
+            table[offset / 2].write = write_sound_FIFO;
+        }
+
+        for (uint32_t channel = 0; channel < 4; channel++)
+        {
+            auto channel_base = DMA0SAD + channel * DMA_channel_size;
+            for (uint32_t offset = channel_base; offset < channel_base + DMA_CNT_H; offset += 2)
+                table[offset / 2].read_mask = 0x0000; // Addresses and count are write only
+            table[(channel_base + DMA_CNT_H) / 2].write = write_DMA_control;
+        }
+
+        for (uint32_t timer = 0; timer < 4; timer++)
+        {
+            auto timer_base = TM0CNT_L + timer * timer_size;
+            table[timer_base / 2].read = read_timer_counter;
+            table[timer_base / 2].write = write_timer_reload;
+            table[(timer_base + 2) / 2].write_mask = 0x00C7;
+            table[(timer_base + 2) / 2].write = write_timer_control;
+        }
+
+        table[KEYINPUT / 2].write_mask = 0x0000;
+        table[IE / 2].write_mask = 0x3FFF;
+        table[IE / 2].write = write_IE;
+        table[IF / 2].write_mask = 0x3FFF;
+        table[IF / 2].write = write_IF;
+        table[IME / 2].write_mask = 0x0001;
+        table[IME / 2].write = write_IME;
+        table[WAITCNT / 2].write_mask = 0x5FFF; // [15] Game Pak type, read only
+        table[WAITCNT / 2].write = write_WAITCNT;
+
+        return table;
+    }
+
+    inline constexpr std::array<Register, size / 2> register_table = make_register_table();
+}
@@ -1,12 +1,13 @@
 #include <iostream>
 #include <fstream>
+#include <string>
+#include <vector>
 #include "GBA_Memory.h"
 #include "GBA_Cpu.h"
 #include "repl.h"
+#include "script.h"
+#include "gdb_stub.h"
 
-extern "C" {
-    #include <capstone/capstone.h>
-}
 namespace tests
 {
     void test_mov()
@@ -30,7 +31,7 @@ namespace tests
         
         GBA_Cpu cpu { mem };
         cpu.add_break_point(0x800012a);
-        while (cpu.cycle());
+        cpu.run();
         
         
     }
@@ -38,8 +39,137 @@ namespace tests
 
 #define CODE "\x2e\x00\x00\xea"
 
-int main()
+namespace
+{
+    constexpr const char* usage =
+        "Usage: gba-emulator --script <file> [--output <file>] [--cycles <n>] [--trace] [--backend switch|threaded] [--coverage <file>] <rom>...\n"
+        "       gba-emulator [--script <file>] --play <movie> | --record <movie> [--hash-interval <frames>] [options as above] <rom>\n"
+        "       gba-emulator --gdb <port|unix:path> <rom>";
+
+    /**
+     * @brief Debug mode: runs a ROM under the control of gdb.
+     */
+    int run_gdb(int argc, char** argv)
+    {
+        if (argc != 4)
+        {
+            std::cerr << usage << std::endl;
+            return 1;
+        }
+
+        std::ifstream gba_file{ argv[3], std::ios::binary };
+        if (!gba_file.is_open())
+        {
+            std::cerr << "Could not open rom file " << argv[3] << std::endl;
+            return 1;
+        }
+
+        try
+        {
+            GBA_Memory mem;
+            mem.load_rom(gba_file, nullptr);
+            GBA_Cpu cpu{ mem };
+            cpu.trace = false;
+
+            GDB_Stub stub{ cpu, argv[2] };
+            std::cout << "Waiting for gdb on " << argv[2] << std::endl;
+            stub.run();
+        }
+        catch (std::exception& e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief Batch mode: runs every ROM under a command script, writing JSON lines to the output.
+     */
+    int run_script(int argc, char** argv)
+    {
+        std::string script_path;
+        std::string output_path = "-";
+        REPL_Script::RunOptions options;
+        std::vector<std::string> roms;
+
+        for (int i = 1; i < argc; i++)
+        {
+            std::string_view argument = argv[i];
+            bool has_value = i + 1 < argc;
+            if (argument == "--script" && has_value)
+                script_path = argv[++i];
+            else if (argument == "--output" && has_value)
+                output_path = argv[++i];
+            else if (argument == "--cycles" && has_value)
+                options.max_cycles = std::stoull(argv[++i], nullptr, 0);
+            else if (argument == "--trace")
+                options.trace = true;
+            else if (argument == "--backend" && has_value && (argv[i + 1] == std::string_view{ "switch" } || argv[i + 1] == std::string_view{ "threaded" }))
+                options.backend = argv[++i] == std::string_view{ "threaded" } ? GBA_Cpu::Backend::THREADED : GBA_Cpu::Backend::SWITCH;
+            else if (argument == "--coverage" && has_value)
+                options.coverage_path = argv[++i];
+            else if (argument == "--play" && has_value)
+                options.play_path = argv[++i];
+            else if (argument == "--record" && has_value)
+                options.record_path = argv[++i];
+            else if (argument == "--hash-interval" && has_value)
+                options.hash_interval = static_cast<uint32_t>(std::stoul(argv[++i], nullptr, 0));
+            else if (argument.substr(0, 2) != "--")
+                roms.emplace_back(argument);
+            else
+            {
+                std::cerr << usage << std::endl;
+                return 1;
+            }
+        }
+
+        // A movie belongs to one ROM. Replays need no script, their input comes from the movie
+        bool movie = !options.play_path.empty() || !options.record_path.empty();
+        if ((script_path.empty() && options.play_path.empty()) || roms.empty() || (movie && roms.size() > 1)
+            || (!options.play_path.empty() && !options.record_path.empty()))
+        {
+            std::cerr << usage << std::endl;
+            return 1;
+        }
+
+        try
+        {
+            auto script = script_path.empty() ? REPL_Script{} : REPL_Script{ script_path };
+
+            std::ofstream output_file;
+            if (output_path != "-")
+            {
+                output_file.open(output_path);
+                if (!output_file.is_open())
+                {
+                    std::cerr << "Could not open " << output_path << std::endl;
+                    return 1;
+                }
+            }
+            std::ostream& output = output_path == "-" ? std::cout : output_file;
+
+            for (auto& rom : roms)
+                script.run(rom, output, options);
+        }
+        catch (std::exception& e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+
+        return 0;
+    }
+}
+
+int main(int argc, char** argv)
 {    
+    if (argc > 1)
+    {
+        return std::string_view{ argv[1] } == "--gdb" ? run_gdb(argc, argv) : run_script(argc, argv);
+    }
+
     std::string source = "find 255 0xFF [0x08000000:0x0800FFFF] [0x0800FFFF]";
     
     REPL repl;
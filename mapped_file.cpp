@@ -0,0 +1,75 @@
+#include "mapped_file.h"
+
+#include <stdexcept>
+#include <fmt/core.h>
+
+#ifdef _WIN32
+#include <fstream>
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& path)
+{
+    std::ifstream file{ path, std::ios::binary };
+    if (!file.is_open())
+    {
+        throw std::runtime_error{ fmt::format("Could not open {}", path) };
+    }
+
+    buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    bytes = buffer.data();
+    length = buffer.size();
+}
+
+MappedFile::~MappedFile()
+{
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error{ fmt::format("Could not open {}", path) };
+    }
+
+    struct stat status;
+    if (::fstat(fd, &status) != 0)
+    {
+        ::close(fd);
+        throw std::runtime_error{ fmt::format("Could not stat {}", path) };
+    }
+
+    length = static_cast<size_t>(status.st_size);
+    if (length != 0)
+    {
+        void* mapping = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            ::close(fd);
+            throw std::runtime_error{ fmt::format("Could not map {}", path) };
+        }
+        bytes = static_cast<const uint8_t*>(mapping);
+    }
+
+    ::close(fd); // The mapping stays valid after closing the descriptor
+}
+
+MappedFile::~MappedFile()
+{
+    if (bytes != nullptr)
+    {
+        ::munmap(const_cast<uint8_t*>(bytes), length);
+    }
+}
+
+#endif
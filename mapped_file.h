@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Read only view of a whole file mapped into memory.
+ *
+ * Pages are only loaded when accessed, so large files can be opened instantly.
+ * Platforms without mmap read the file into memory instead.
+ */
+class MappedFile
+{
+public:
+    /**
+     * @brief Maps a file.
+     *
+     * @param path Path of the file.
+     * @throws std::runtime_error If the file can't be opened or mapped.
+     */
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const uint8_t* bytes = nullptr;
+    size_t length = 0;
+    std::vector<uint8_t> buffer; // Backing storage when mmap isn't available
+};
@@ -0,0 +1,247 @@
+#include "movie.h"
+#include "GBA_Cpu.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <fmt/core.h>
+
+namespace
+{
+    /** Memory a run can write, base and size. */
+    constexpr std::pair<uint32_t, uint32_t> hashed_regions[] =
+    {
+        { 0x02000000, 0x40000 },    // EWRAM
+        { 0x03000000, 0x8000 },     // IWRAM
+        { 0x04000000, 0x400 },      // IO registers
+        { 0x05000000, 0x400 },      // Palette RAM
+        { 0x06000000, 0x18000 },    // VRAM
+        { 0x07000000, 0x400 },      // OAM
+        { 0x0E000000, 0x10000 }     // SRAM
+    };
+
+    /** FNV-1a, as DisassemblyIndex::hash_rom. */
+    class StateHash
+    {
+    public:
+        void add(const void* data, size_t size)
+        {
+            auto bytes = static_cast<const uint8_t*>(data);
+            for (size_t i = 0; i < size; i++)
+                hash = (hash ^ bytes[i]) * 0x100000001B3;
+        }
+
+        template<typename T>
+        void add(const T& value)
+        {
+            add(&value, sizeof(value));
+        }
+
+        uint64_t value() const { return hash; }
+    private:
+        uint64_t hash = 0xCBF29CE484222325;
+    };
+}
+
+InputMovie InputMovie::load(const std::string& path)
+{
+    std::ifstream file{ path };
+    if (!file.is_open())
+    {
+        throw std::runtime_error{ fmt::format("Could not open movie {}", path) };
+    }
+
+    InputMovie movie;
+    std::string line;
+    uint32_t line_number = 0;
+    while (std::getline(file, line))
+    {
+        line_number++;
+        std::istringstream fields{ line };
+        std::string tag;
+        if (!(fields >> tag) || tag[0] == '#')
+        {
+            continue;
+        }
+
+        bool valid = true;
+        if (tag == "rom")
+        {
+            valid = static_cast<bool>(fields >> std::hex >> movie.rom_hash);
+        }
+        else if (tag == "interval")
+        {
+            valid = fields >> movie.hash_interval && movie.hash_interval > 0;
+        }
+        else if (tag == "k")
+        {
+            uint32_t keys = 0, count = 0;
+            valid = fields >> std::hex >> keys >> std::dec >> count && keys <= io::keys_none;
+            if (valid)
+                movie.keys.insert(movie.keys.end(), count, static_cast<uint16_t>(keys));
+        }
+        else if (tag == "h")
+        {
+            uint32_t frame = 0;
+            uint64_t hash = 0;
+            valid = static_cast<bool>(fields >> frame >> std::hex >> hash);
+            movie.hashes[frame] = hash;
+        }
+        else
+        {
+            valid = false;
+        }
+
+        // Nothing may follow the fields
+        if (!valid || !(fields >> std::ws).eof())
+        {
+            throw std::runtime_error{ fmt::format("{}:{}: invalid movie line", path, line_number) };
+        }
+    }
+    return movie;
+}
+
+void InputMovie::save(const std::string& path) const
+{
+    std::ofstream file{ path };
+    if (!file.is_open())
+    {
+        throw std::runtime_error{ fmt::format("Could not open {}", path) };
+    }
+
+    file << fmt::format("rom {:016x}\ninterval {}\n", rom_hash, hash_interval);
+
+    // Runs of keys and hashes in frame order, a run of keys cut where a hash falls inside it
+    auto hash = hashes.begin();
+    for (size_t first = 0; first < keys.size(); )
+    {
+        for (; hash != hashes.end() && hash->first <= first; hash++)
+            file << fmt::format("h {} {:016x}\n", hash->first, hash->second);
+
+        auto last = first + 1;
+        while (last < keys.size() && keys[last] == keys[first] && (hash == hashes.end() || last < hash->first))
+            last++;
+        file << fmt::format("k {:x} {}\n", keys[first], last - first);
+        first = last;
+    }
+    for (; hash != hashes.end(); hash++)
+        file << fmt::format("h {} {:016x}\n", hash->first, hash->second);
+
+    if (!file)
+    {
+        throw std::runtime_error{ fmt::format("Could not write {}", path) };
+    }
+}
+
+uint64_t hash_state(const GBA_Cpu& cpu)
+{
+    StateHash hash;
+    hash.add(cpu.R);
+    hash.add(cpu.CPSR);
+    hash.add(cpu.banked_R8_R12);
+    hash.add(cpu.banked_R13_R14);
+    hash.add(cpu.SPSR);
+    hash.add(cpu.cycles);
+    hash.add(cpu.halted);
+    hash.add(cpu.intr_wait_flags);
+
+    auto& memory = cpu.memory;
+    for (auto& [base, size] : hashed_regions)
+        hash.add(memory.pointer(base), size);
+
+    // Field by field, the state has padding and a std::function. The keys about to be latched
+    // aren't part of the run yet, KEYINPUT is
+    auto& state = memory.io_state;
+    hash.add(state.timer_reload);
+    hash.add(state.timer_counter);
+    hash.add(state.timer_prescaler);
+    for (auto& fifo : state.sound_FIFO)
+    {
+        hash.add(fifo.data);
+        hash.add(fifo.head);
+        hash.add(fifo.count);
+    }
+    for (auto& channel : state.DMA)
+    {
+        hash.add(channel.source);
+        hash.add(channel.destination);
+    }
+    hash.add(state.line_cycle);
+    hash.add(state.interrupts.pending);
+    hash.add(state.interrupts.cpu_irq_disabled);
+    hash.add(state.frame);
+    return hash.value();
+}
+
+MovieSession::MovieSession(GBA_Cpu& cpu, InputMovie& movie, Mode mode)
+    : cpu(cpu), movie(movie), mode(mode), first_frame(cpu.memory.io_state.frame)
+{
+    auto rom_hash = DisassemblyIndex::hash_rom(cpu.memory);
+    if (mode == Mode::PLAY)
+    {
+        if (movie.rom_hash != rom_hash)
+        {
+            throw std::runtime_error{ fmt::format("The movie was recorded on ROM {:016x}, not this one ({:016x})",
+                                                  movie.rom_hash, rom_hash) };
+        }
+        if (movie.keys.empty())
+        {
+            throw std::runtime_error{ "The movie has no frames" };
+        }
+    }
+    else
+    {
+        movie.rom_hash = rom_hash;
+        movie.keys.clear();
+        movie.hashes.clear();
+    }
+
+    // The running frame is the first one, its keys are latched right away
+    start_frame();
+    io::latch_keypad(cpu.memory);
+    cpu.memory.io_state.frame_handler = [this]()
+    {
+        frame = this->cpu.memory.io_state.frame - first_frame;
+        start_frame();
+    };
+}
+
+MovieSession::~MovieSession()
+{
+    cpu.memory.io_state.frame_handler = nullptr;
+}
+
+void MovieSession::start_frame()
+{
+    auto& keypad = cpu.memory.io_state.keypad;
+    if (mode == Mode::RECORD)
+    {
+        movie.keys.push_back(keypad);
+        if (frame % movie.hash_interval == 0)
+            movie.hashes[frame] = hash_state(cpu);
+        return;
+    }
+
+    if (ended || diverged)
+    {
+        return;
+    }
+    if (frame >= movie.keys.size())
+    {
+        ended = true;
+        cpu.stop();
+        return;
+    }
+
+    auto expected = movie.hashes.find(frame);
+    if (expected != movie.hashes.end())
+    {
+        auto actual = hash_state(cpu);
+        if (actual != expected->second)
+        {
+            diverged = Divergence{ frame, expected->second, actual };
+            cpu.stop();
+            return;
+        }
+    }
+    keypad = movie.keys[frame];
+}
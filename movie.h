@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+class GBA_Cpu;
+
+/**
+ * @brief Keys held on each frame of a run, and hashes of the machine state along it.
+ *
+ * Input only reaches KEYINPUT as a frame starts (see io::State::keypad), so replaying the keys
+ * of every frame on the same ROM, from power on, repeats the run exactly. Text file, keys run
+ * length encoded:
+ *      rom 0123456789abcdef        Hash of the ROM the movie was recorded on, see DisassemblyIndex::hash_rom
+ *      interval 60                 Frames between two state hashes
+ *      k 3ff 120                   KEYINPUT 0x3ff on the next 120 frames
+ *      h 120 fedcba9876543210      State hash as frame 120 starts, see hash_state
+ */
+struct InputMovie
+{
+    static constexpr uint32_t default_hash_interval = 60;
+
+    uint64_t rom_hash = 0;
+    uint32_t hash_interval = default_hash_interval;
+    /** KEYINPUT of each frame. */
+    std::vector<uint16_t> keys;
+    /** State hashes by frame. */
+    std::map<uint32_t, uint64_t> hashes;
+
+    /**
+     * @throws std::runtime_error If the file can't be read or isn't a movie.
+     */
+    static InputMovie load(const std::string& path);
+
+    /**
+     * @throws std::runtime_error If the file can't be written.
+     */
+    void save(const std::string& path) const;
+};
+
+/**
+ * @brief Hash of everything a run can change: registers, cycles, RAM, IO, VRAM, OAM, SRAM and
+ * the internal state of the IO registers.
+ */
+uint64_t hash_state(const GBA_Cpu& cpu);
+
+/**
+ * @brief Records the keys of a run to a movie, or drives them from one, for as long as it lives.
+ *
+ * Frames count from the one running when the session starts, which must be at power on for a
+ * replay to match. A replay stops the cpu once the movie runs out of frames, or on the first
+ * frame whose state hash differs from the recorded one.
+ */
+class MovieSession
+{
+public:
+    enum class Mode { RECORD, PLAY };
+
+    /** First frame whose state didn't match the movie. */
+    struct Divergence
+    {
+        uint32_t frame;
+        uint64_t expected;
+        uint64_t actual;
+    };
+
+    /**
+     * @throws std::runtime_error When playing a movie recorded on another ROM, or without frames.
+     */
+    MovieSession(GBA_Cpu& cpu, InputMovie& movie, Mode mode);
+    ~MovieSession();
+    MovieSession(const MovieSession&) = delete;
+    MovieSession& operator=(const MovieSession&) = delete;
+
+    /** Frames run since the session started, the one running included. */
+    uint32_t frames() const { return ended ? frame : frame + 1; }
+    /** Whether a replay used up the movie. */
+    bool finished() const { return ended; }
+    const std::optional<Divergence>& divergence() const { return diverged; }
+
+private:
+    void start_frame();
+
+    GBA_Cpu& cpu;
+    InputMovie& movie;
+    Mode mode;
+    uint32_t first_frame;
+    uint32_t frame = 0;
+    bool ended = false;
+    std::optional<Divergence> diverged;
+};
@@ -1,34 +1,41 @@
 #include "opcodes.h"
 #include "GBA_Cpu.h"
-#include "assembly.h"
 #include "bit_utils.h"
+#include "bios.h"
+#include "decoder.h"
 #include <iostream>
 #include <cassert>
+#include <utility>
 
+template<bool _I, bool _P, bool _U, bool _B, bool _W>
 bool execute_LDR_immediate(GBA_Cpu& cpu, uint32_t self)
 {
     assert(is_LDR_immediate(self));
     uint8_t condition = (self >> 28);
     if (!cpu.test_cond(condition))
+    {
+        cpu.fetch_next();
         return true;
-    bool _I = (self >> 25) & 1; // 1=Register 0=Imm
-    //bool _P = (self >> 24) & 1; // 1=Pre-indexed 0=Post-indexed
-    bool _U = (self >> 23) & 1; // 1=Add offset 0=Substract offset
-    bool _B = (self >> 22) & 1; // 1=u8 0=i32
-    //bool _W = (self >> 21) & 1; // P=1 1=Write back P=0 1=User mode access
-            
+    }
     uint8_t _Rn = (self >> 16) & 0xF; // Base register
     uint8_t _Rd = (self >> 12) & 0xF; // Destination register
     int offset = self & 0xFFF;
             
-    if (!_I) {
-        //std::cout << disassemble_LDR_STR_immediate(self);
+    if constexpr (!_I) {
                 
-        if (!_U)
+        if constexpr (!_U)
             offset = -offset;
         
-        if (!_B) {
-            cpu.R[_Rd] = cpu.memory.read_word(cpu.R[_Rn] + offset);
+        if constexpr (!_B) {
+            // Post-indexed transfers access the base, then always write the offset address back
+            uint32_t offset_address = cpu.R[_Rn] + offset;
+            uint32_t address = _P ? offset_address : cpu.R[_Rn];
+            // A misaligned load reads the aligned word, rotated so the addressed byte comes first
+            auto value = rotate_right(cpu.load<uint32_t>(address), (address & 3) * 8);
+            if constexpr (_W || !_P)
+                cpu.R[_Rn] = offset_address;
+            cpu.R[_Rd] = value;
+            cpu.cycles++; // Internal cycle writing Rd
             cpu.fetch_next();
             return true;
         }
@@ -39,12 +46,15 @@ bool execute_LDR_immediate(GBA_Cpu& cpu, uint32_t self)
 }
 
 
+template<bool _L>
 bool execute_B(GBA_Cpu& cpu, uint32_t self)
 {
     uint8_t condition = (self >> 28);
     if (!cpu.test_cond(condition))
+    {
+        cpu.fetch_next();
         return true;
-    // std::cout << disassemble_B(cpu, self);
+    }
     if (condition == 0x0F) // BLX
     {
         // uint32_t _25bit_offset = executing & 0x01FFFFFF;
@@ -54,12 +64,10 @@ bool execute_B(GBA_Cpu& cpu, uint32_t self)
     }
     else
     {
-        bool _L = (self >> 24) & 1; // 1=BL 0=B
-        
         uint32_t _24bit_offset = self & 0x00FFFFFF;
-        if (_L) // BL
+        if constexpr (_L) // BL
         {
-            cpu.R[14] = cpu.R[15] + cpu.instruction_size; // Save the address
+            cpu.R[14] = cpu.R[15] - cpu.instruction_size; // Address of the next instruction
         }
 
         // The actual jump
@@ -70,33 +78,42 @@ bool execute_B(GBA_Cpu& cpu, uint32_t self)
     return true;
 }
 
+namespace
+{
+    void branch_exchange(GBA_Cpu& cpu, uint32_t target)
+    {
+        if (target & 1)
+        {
+            cpu.PC = target & ~1u;
+            cpu.set_mode(GBA_Cpu::ExecutionMode::THUMB);
+        }
+        else
+        {
+            cpu.PC = target & ~3u;
+            cpu.set_mode(GBA_Cpu::ExecutionMode::ARM);
+        }
+        cpu.flush_pipeline();
+    }
+}
+
 bool execute_BX(GBA_Cpu& cpu, uint32_t self)
 {
-    assert(is_BX(self));
-    //std::cout << disassemble_BX(cpu, self);
+    if (!is_BX(self))
+        return false;
     uint8_t condition = (self >> 28);
     if (!cpu.test_cond(condition))
+    {
+        cpu.fetch_next();
         return true;
+    }
     uint8_t _B = (self >> 4) & 0x0F;
     uint8_t _Rn = self & 0x0F;
     bool _T = cpu.R[_Rn] & 1; // 1=Thumb 0=Arm
     
     if (_B == 0b0001)
     {
-        if (_T)
-        {
-            cpu.PC = cpu.R[_Rn] - 1;
-            cpu.set_mode(GBA_Cpu::ExecutionMode::THUMB);
-            cpu.flush_pipeline();
-            return true;
-        }
-        else
-        {
-            cpu.PC = cpu.R[_Rn];
-            cpu.flush_pipeline();
-            return true;
-        }
-        
+        branch_exchange(cpu, cpu.R[_Rn]);
+        return true;
     }
     else if (_B == 0b0010)
     {
@@ -125,19 +142,20 @@ bool execute_BX(GBA_Cpu& cpu, uint32_t self)
     return false;
 }
 
+template<bool _S>
 bool execute_ADD(GBA_Cpu& cpu, uint32_t self)
 {
     assert(is_ADD(self));
     uint8_t condition = (self >> 28);
     if (!cpu.test_cond(condition))
+    {
+        cpu.fetch_next();
         return true;
-    //std::cout << disassemble_ADD(self);
-    bool _I = (self >> 25) & 1; // 2nd operand is 1=Immediate 0=Register
-    bool _S = (self >> 20) & 1; // 0=ADD 1=ADDS
+    }
     uint8_t dest = (self >> 12) & 0x0F;
     uint8_t op_1 = (self >> 16) & 0x0F;
     
-    if (!_S && _I) {
+    if constexpr (!_S) {
         uint8_t shift = (self >> 8) & 0x0F;
         uint8_t immediate = self & 0xFF;
         
@@ -149,30 +167,30 @@ bool execute_ADD(GBA_Cpu& cpu, uint32_t self)
     return false;
 }
 
+template<bool _I, bool _P, bool _U, bool _B, bool _W>
 bool execute_STR_immediate(GBA_Cpu& cpu, uint32_t self)
 {
     assert(is_STR_immediate(self));
     uint8_t condition = (self >> 28);
     if (!cpu.test_cond(condition))
+    {
+        cpu.fetch_next();
         return true;
-    bool _I = (self >> 25) & 1; // 1=Register 0=Imm
-    //bool _P = (self >> 24) & 1; // 1=Pre-indexed 0=Post-indexed
-    bool _U = (self >> 23) & 1; // 1=Add offset 0=Substract offset
-    bool _B = (self >> 22) & 1; // 1=u8 0=i32
-    //bool _W = (self >> 21) & 1; // P=1 1=Write back P=0 1=User mode access
-            
+    }
     uint8_t _Rn = (self >> 16) & 0xF; // Base register
     uint8_t _Rd = (self >> 12) & 0xF; // Destination register
     int offset = self & 0xFFF;
             
-    if (!_I) {
-        //std::cout << disassemble_LDR_STR_immediate(self);
+    if constexpr (!_I) {
                 
-        if (!_U)
+        if constexpr (!_U)
             offset = -offset;
         
-        if (!_B) {
-            cpu.memory.write_word(cpu.R[_Rn] + offset, cpu.R[_Rd]);
+        if constexpr (!_B) {
+            uint32_t offset_address = cpu.R[_Rn] + offset;
+            cpu.store<uint32_t>(_P ? offset_address : cpu.R[_Rn], cpu.R[_Rd]);
+            if constexpr (_W || !_P)
+                cpu.R[_Rn] = offset_address;
             cpu.fetch_next();
             return true;
         }
@@ -182,20 +200,22 @@ bool execute_STR_immediate(GBA_Cpu& cpu, uint32_t self)
     return false;
 }
 
+template<bool _I, bool _S>
 bool execute_MOV(GBA_Cpu& cpu, uint32_t self)
 {
-    assert(is_MOV(self));
+    if (!is_MOV(self)) // Rn must be 0
+        return false;
     uint8_t condition = self >> 28;
     if (!cpu.test_cond(condition))
+    {
+        cpu.fetch_next();
         return true;
-    //std::cout << disassemble_MOV(self);
-    bool _I = (self >> 25) & 1;
-    bool _S = (self >> 20) & 1;
+    }
     uint8_t _Rd = (self >> 12) & 0x0F;
     uint8_t shift = (self >> 8) & 0x0F;
     uint8_t immediate = self & 0xFF;
         
-    if (_I && !_S)
+    if constexpr (_I && !_S)
     {
         uint32_t op_2 = rotr32_shiftsq(immediate, shift);
         cpu.R[_Rd] = op_2;
@@ -206,36 +226,119 @@ bool execute_MOV(GBA_Cpu& cpu, uint32_t self)
     return false;
 }
 
-bool execute_LDR_thumb_1(GBA_Cpu& cpu, uint16_t self)
+bool execute_SWI(GBA_Cpu& cpu, uint32_t self)
+{
+    assert(is_SWI(self));
+    uint8_t condition = (self >> 28);
+    if (!cpu.test_cond(condition))
+    {
+        cpu.fetch_next();
+        return true;
+    }
+    uint8_t comment = (self >> 16) & 0xFF;
+
+    if (!execute_bios_call(cpu, comment))
+        return false;
+
+    cpu.fetch_next();
+    return true;
+}
+
+template<bool _P>
+bool execute_MRS(GBA_Cpu& cpu, uint32_t self)
+{
+    if (!is_MRS(self))
+        return false;
+    uint8_t condition = (self >> 28);
+    if (!cpu.test_cond(condition))
+    {
+        cpu.fetch_next();
+        return true;
+    }
+    uint8_t _Rd = (self >> 12) & 0x0F;
+
+    if constexpr (_P)
+        cpu.R[_Rd] = cpu.current_SPSR();
+    else
+        cpu.R[_Rd] = cpu.CPSR;
+    cpu.fetch_next();
+    return true;
+}
+
+template<bool _I, bool _P>
+bool execute_MSR(GBA_Cpu& cpu, uint32_t self)
+{
+    if (!is_MSR(self))
+        return false;
+    uint8_t condition = (self >> 28);
+    if (!cpu.test_cond(condition))
+    {
+        cpu.fetch_next();
+        return true;
+    }
+    uint8_t fields = (self >> 16) & 0x0F;
+
+    uint32_t value;
+    if constexpr (_I)
+        value = rotr32_shiftsq(self & 0xFF, (self >> 8) & 0x0F);
+    else
+        value = cpu.R[self & 0x0F];
+
+    uint32_t mask = 0;
+    if (fields & 0b1000) mask |= 0xFF000000; // Flags
+    if (fields & 0b0100) mask |= 0x00FF0000; // Status
+    if (fields & 0b0010) mask |= 0x0000FF00; // eXtension
+    if (fields & 0b0001) mask |= 0x000000FF; // Control
+
+    if constexpr (_P)
+    {
+        auto& spsr = cpu.current_SPSR();
+        spsr = (spsr & ~mask) | (value & mask);
+    }
+    else
+    {
+        if ((cpu.CPSR & 0x1F) == GBA_Cpu::USR)
+            mask &= 0xFF000000;
+        mask &= ~0x20u; // The T bit can't be changed by MSR
+
+        cpu.write_CPSR((cpu.CPSR & ~mask) | (value & mask));
+    }
+
+    cpu.fetch_next();
+    return true;
+}
+
+template<uint8_t _V>
+bool execute_LDR_thumb_1(GBA_Cpu& cpu, uint32_t self)
 {
     assert(is_LDR_thumb_1(self));
-    //std::cout << disassemble_LDR_thumb_1(self);
-    uint8_t _V = (self >> 6) & 0x1F;
     uint8_t _Rs = (self >> 3) & 0x07;
     uint8_t _Rd = self & 0x07;
 
-    cpu.R[_Rd] = cpu.R[_Rs] + (_V * 4);
+    uint32_t address = cpu.R[_Rs] + (_V * 4);
+    cpu.R[_Rd] = rotate_right(cpu.load<uint32_t>(address), (address & 3) * 8);
+    cpu.cycles++; // Internal cycle writing Rd
     cpu.fetch_next();
     return true;
 }
 
-bool execute_LDR_thumb_3(GBA_Cpu& cpu, uint16_t self)
+template<uint8_t _Rd>
+bool execute_LDR_thumb_3(GBA_Cpu& cpu, uint32_t self)
 {
     assert(is_LDR_thumb_3(self));
-    //std::cout << disassemble_LDR_thumb_3(self);
     uint8_t _V = self & 0xFF;
-    uint8_t _Rd = (self >> 8) & 0x07;
 
-    cpu.R[_Rd] = cpu.PC + (_V * 4);
+    // PC relative loads take PC with bit 1 cleared, the literal is always word aligned
+    cpu.R[_Rd] = cpu.load<uint32_t>((cpu.PC & ~2u) + (_V * 4));
+    cpu.cycles++; // Internal cycle writing Rd
     cpu.fetch_next();
     return true;
 }
 
-bool execute_LSLS_thumb_1(GBA_Cpu& cpu, uint16_t self)
+template<uint8_t _V>
+bool execute_LSLS_thumb_1(GBA_Cpu& cpu, uint32_t self)
 {
     assert(is_LSLS_thumb_1(self));
-    //std::cout << disassemble_LSLS_thumb_1(self);
-    uint8_t _V = (self >> 6) & 0x1F;
     uint8_t _Rn = (self >> 3) & 0x07;
     uint8_t _Rd = self & 0x07;
 
@@ -245,7 +348,8 @@ bool execute_LSLS_thumb_1(GBA_Cpu& cpu, uint16_t self)
     
     cpsr.zero_flag = value == 0;
     cpsr.sign_flag = (value >> 31) & 1;
-    cpsr.carry_flag = value < cpu.R[_Rn];
+    if constexpr (_V != 0)
+        cpsr.carry_flag = (cpu.R[_Rn] >> (32 - _V)) & 1; // Last bit shifted out, LSL #0 keeps it
     
     cpu.R[_Rd] = value;
     cpu.CPSR = static_cast<uint32_t>(cpsr);
@@ -253,42 +357,42 @@ bool execute_LSLS_thumb_1(GBA_Cpu& cpu, uint16_t self)
     return true;
 }
 
-bool execute_B_thumb_1(GBA_Cpu& cpu, uint16_t self)
+template<uint8_t condition>
+bool execute_B_thumb_1(GBA_Cpu& cpu, uint32_t self)
 {
     assert(is_B_thumb_1(self));
-    uint8_t condition = (self >> 8) & 0x0F;
     if (!cpu.test_cond(condition))
+    {
+        cpu.fetch_next();
         return true;
-    //std::cout << disassemble_B_thumb_1(cpu, self);
-    uint8_t target = self & 0xFF;
+    }
+    uint32_t target = sign_extend<uint32_t>(self & 0xFF, 8);
     
     cpu.PC += target * 2;
     cpu.flush_pipeline();
     return true;
 }
 
-bool execute_B_thumb_2(GBA_Cpu& cpu, uint16_t self)
+bool execute_B_thumb_2(GBA_Cpu& cpu, uint32_t self)
 {
     assert(is_B_thumb_2(self));
-    //std::cout << disassemble_B_thumb_2(cpu, self);
-    uint16_t target = self & 0x7FF;
+    uint32_t target = sign_extend<uint32_t>(self & 0x7FF, 11);
     
     cpu.PC += target * 2;
     cpu.flush_pipeline();
     return true;
 }
 
-bool execute_MOVS_thumb_1(GBA_Cpu& cpu, uint16_t self)
+template<uint8_t Rd>
+bool execute_MOVS_thumb_1(GBA_Cpu& cpu, uint32_t self)
 {
     assert(is_MOVS_thumb_1(self));
-    //std::cout << disassemble_MOVS_thumb_1(self);
     
-    uint8_t Rd = (self >> 10) & 0x07;
     uint8_t value = (self & 0xFF);
     
     GBA_Cpu::CPSR_pack cpsr{ cpu.CPSR };
 
-    cpsr.sign_flag = static_cast<int8_t>(value) < 0;
+    cpsr.sign_flag = false; // The immediate is zero extended
     cpsr.zero_flag = value == 0;
 
     cpu.CPSR = static_cast<uint32_t>(cpsr);
@@ -301,7 +405,6 @@ bool execute_MOVS_thumb_1(GBA_Cpu& cpu, uint16_t self)
 bool execute_MOVS_thumb_2(GBA_Cpu& cpu, uint16_t self)
 {
     assert(is_MOVS_thumb_2(self));
-    //std::cout << disassemble_MOVS_thumb_2(self);
 
     uint8_t Rs = (self >> 3) & 0x07;
     uint8_t Rd = self & 0x07;
@@ -323,7 +426,6 @@ bool execute_MOVS_thumb_2(GBA_Cpu& cpu, uint16_t self)
 bool execute_MOVS_thumb_3(GBA_Cpu& cpu, uint16_t self)
 {
     assert(is_MOVS_thumb_3(self));
-    //std::cout << disassemble_MOVS_thumb_3(self);
 
     uint8_t Rs = (self & 0x80) | ((self >> 3) & 0x07);
     uint8_t Rd = (self & 0x40) | (self & 0x07);
@@ -332,3 +434,220 @@ bool execute_MOVS_thumb_3(GBA_Cpu& cpu, uint16_t self)
 
     return true;
 }
+
+bool execute_SWI_thumb(GBA_Cpu& cpu, uint32_t self)
+{
+    assert(is_SWI_thumb(self));
+    uint8_t comment = self & 0xFF;
+
+    if (!execute_bios_call(cpu, comment))
+        return false;
+
+    cpu.fetch_next();
+    return true;
+}
+
+template<bool _H>
+bool execute_BL_thumb(GBA_Cpu& cpu, uint32_t self)
+{
+    assert(is_BL_thumb(self));
+    uint32_t offset = self & 0x7FF;
+
+    if constexpr (!_H)
+    {
+        cpu.LR = cpu.PC + (sign_extend<uint32_t>(offset, 11) << 12);
+        cpu.fetch_next();
+        return true;
+    }
+    else
+    {
+        auto next = cpu.PC - cpu.instruction_size; // PC is 2 instructions ahead of the second half
+        cpu.PC = (cpu.LR + (offset << 1)) & ~1u;
+        cpu.LR = next | 1;
+        cpu.flush_pipeline();
+        return true;
+    }
+}
+
+bool execute_BX_thumb(GBA_Cpu& cpu, uint32_t self)
+{
+    if (!is_BX_thumb(self))
+        return false;
+    uint8_t _Rs = (self >> 3) & 0x0F;
+
+    branch_exchange(cpu, cpu.R[_Rs]);
+    return true;
+}
+
+bool execute_fused_thumb(GBA_Cpu& cpu, ThumbFusion fusion, uint32_t pair)
+{
+    auto first = static_cast<uint16_t>(pair);
+    auto second = static_cast<uint16_t>(pair >> 16);
+
+    switch (fusion)
+    {
+        case ThumbFusion::BL:
+        {
+            // PC of the first half is the address after the pair, where the call returns
+            auto offset = (sign_extend<uint32_t>(first & 0x7FF, 11) << 12) + ((second & 0x7FF) << 1);
+            auto next = cpu.PC;
+            cpu.PC += offset;
+            cpu.LR = next | 1;
+            cpu.flush_pipeline();
+            return true;
+        }
+        case ThumbFusion::LDR_BX:
+        {
+            uint8_t _Rd = (first >> 8) & 0x07;
+            cpu.R[_Rd] = cpu.load<uint32_t>((cpu.PC & ~2u) + (first & 0xFF) * 4);
+            cpu.cycles++; // Internal cycle writing Rd
+            branch_exchange(cpu, cpu.R[_Rd]);
+            return true;
+        }
+        case ThumbFusion::MOVS_LSLS:
+        {
+            uint8_t _Rd = (first >> 8) & 0x07;
+            uint8_t _V = (second >> 6) & 0x1F;
+            uint32_t immediate = first & 0xFF;
+            uint32_t value = immediate << _V;
+
+            GBA_Cpu::CPSR_pack cpsr{ cpu.CPSR };
+            cpsr.zero_flag = value == 0;
+            cpsr.sign_flag = (value >> 31) & 1;
+            if (_V != 0)
+                cpsr.carry_flag = (immediate >> (32 - _V)) & 1;
+
+            cpu.R[_Rd] = value;
+            cpu.CPSR = static_cast<uint32_t>(cpsr);
+            cpu.fetch_next();
+            cpu.fetch_next();
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+namespace
+{
+    bool execute_unhandled(GBA_Cpu&, uint32_t)
+    {
+        return false;
+    }
+
+    /**
+     * Handler of the ARM opcodes with bits [20, 27] and [4, 7] as in index, see decode_arm. The
+     * flags there become template arguments. Only the combinations used are instantiated.
+     */
+    template<uint32_t index>
+    constexpr Handler make_arm_handler()
+    {
+        constexpr bool _I = (index >> 9) & 1;  // Bit 25
+        constexpr bool _P = (index >> 8) & 1;  // Bit 24, also L of B/BL
+        constexpr bool _U = (index >> 7) & 1;  // Bit 23
+        constexpr bool _B = (index >> 6) & 1;  // Bit 22, also SPSR/CPSR of MRS/MSR
+        constexpr bool _W = (index >> 5) & 1;  // Bit 21
+        constexpr bool _L = (index >> 4) & 1;  // Bit 20, also S of data processing
+        constexpr uint32_t operation = (index >> 5) & 0x0F; // Bits [21, 24] of data processing
+
+        switch (classify_arm(index))
+        {
+            case ArmInstruction::SingleDataTransfer:
+                if constexpr (_L)
+                    return { OpcodeHandler::LDR_immediate, &execute_LDR_immediate<_I, _P, _U, _B, _W> };
+                else
+                    return { OpcodeHandler::STR_immediate, &execute_STR_immediate<_I, _P, _U, _B, _W> };
+            case ArmInstruction::MRS:
+                return { OpcodeHandler::MRS, &execute_MRS<_B> };
+            case ArmInstruction::MSR:
+                return { OpcodeHandler::MSR, &execute_MSR<_I, _B> };
+            case ArmInstruction::Branch:
+                return { OpcodeHandler::B, &execute_B<_P> };
+            case ArmInstruction::DataProcessing:
+                if constexpr (operation == 0b0100 && _I)
+                    return { OpcodeHandler::ADD, &execute_ADD<_L> };
+                if constexpr (operation == 0b1101)
+                    return { OpcodeHandler::MOV, &execute_MOV<_I, _L> };
+                break;
+            case ArmInstruction::BX:
+                return { OpcodeHandler::BX, &execute_BX };
+            case ArmInstruction::SoftwareInterrupt:
+                return { OpcodeHandler::SWI, &execute_SWI };
+            default:
+                break;
+        }
+        return { OpcodeHandler::UNHANDLED, &execute_unhandled };
+    }
+
+    /** Handler of the THUMB opcodes with bits [6, 15] as in index, see decode_thumb. */
+    template<uint32_t index>
+    constexpr Handler make_thumb_handler()
+    {
+        constexpr uint32_t opcode = index << 6;
+        constexpr uint8_t offset = (opcode >> 6) & 0x1F;     // Immediate of LSLS and LDR Rd, [Rb, #imm5]
+        constexpr uint8_t high = (opcode >> 8) & 0x07;       // Rd of the 8 bit immediate formats
+        constexpr uint8_t condition = (opcode >> 8) & 0x0F;
+
+        switch (classify_thumb(index))
+        {
+            case ThumbInstruction::MoveShifted:
+                if constexpr (is_LSLS_thumb_1(opcode))
+                    return { OpcodeHandler::LSLS_thumb_1, &execute_LSLS_thumb_1<offset> };
+                break;
+            case ThumbInstruction::Immediate:
+                if constexpr (is_MOVS_thumb_1(opcode))
+                    return { OpcodeHandler::MOVS_thumb_1, &execute_MOVS_thumb_1<high> };
+                break;
+            case ThumbInstruction::LoadPC:
+                return { OpcodeHandler::LDR_thumb_3, &execute_LDR_thumb_3<high> };
+            case ThumbInstruction::LoadStoreImmediate:
+                if constexpr (is_LDR_thumb_1(opcode))
+                    return { OpcodeHandler::LDR_thumb_1, &execute_LDR_thumb_1<offset> };
+                break;
+            case ThumbInstruction::ConditionalBranch:
+                return { OpcodeHandler::B_thumb_1, &execute_B_thumb_1<condition> };
+            case ThumbInstruction::SoftwareInterrupt:
+                return { OpcodeHandler::SWI_thumb, &execute_SWI_thumb };
+            case ThumbInstruction::Branch:
+                if constexpr (is_B_thumb_2(opcode))
+                    return { OpcodeHandler::B_thumb_2, &execute_B_thumb_2 };
+                break;
+            case ThumbInstruction::HiRegister:
+                if constexpr ((opcode & 0xFF80) == 0x4700)
+                    return { OpcodeHandler::BX_thumb, &execute_BX_thumb };
+                break;
+            case ThumbInstruction::LongBranchPrefix:
+                return { OpcodeHandler::BL_thumb, &execute_BL_thumb<false> };
+            case ThumbInstruction::LongBranchSuffix:
+                return { OpcodeHandler::BL_thumb, &execute_BL_thumb<true> };
+            default:
+                break;
+        }
+        return { OpcodeHandler::UNHANDLED, &execute_unhandled };
+    }
+
+    template<size_t... index>
+    constexpr std::array<Handler, sizeof...(index)> make_arm_handlers(std::index_sequence<index...>)
+    {
+        return { make_arm_handler<index>()... };
+    }
+
+    template<size_t... index>
+    constexpr std::array<Handler, sizeof...(index)> make_thumb_handlers(std::index_sequence<index...>)
+    {
+        return { make_thumb_handler<index>()... };
+    }
+
+    constexpr auto arm_handlers = make_arm_handlers(std::make_index_sequence<arm_decode_table.size()>{});
+    constexpr auto thumb_handlers = make_thumb_handlers(std::make_index_sequence<thumb_decode_table.size()>{});
+}
+
+const Handler& arm_handler(uint32_t opcode)
+{
+    return arm_handlers[((opcode >> 16) & 0xFF0) | ((opcode >> 4) & 0x0F)];
+}
+
+const Handler& thumb_handler(uint16_t opcode)
+{
+    return thumb_handlers[opcode >> 6];
+}
@@ -13,10 +13,11 @@ class GBA_Cpu;
  * @param self The opcode to be executed.
  * @return True if the opcode was handled
  */
+template<bool _I, bool _P, bool _U, bool _B, bool _W>
 bool execute_LDR_immediate(GBA_Cpu& cpu, uint32_t self);
 
 
-inline bool is_LDR_immediate(uint32_t self)
+constexpr bool is_LDR_immediate(uint32_t self)
 {
     return (self & 0xc100000) == 0x4100000;
 }
@@ -30,74 +31,143 @@ inline bool is_LDR_immediate(uint32_t self)
  * @param self The opcode to be executed.
  * @return bool if the opcode was handled
  */
+template<bool _L>
 bool execute_B(GBA_Cpu& cpu, uint32_t self);
 
-inline bool is_B(uint32_t self)
+constexpr bool is_B(uint32_t self)
 {
     return (self & 0x0E000000) == 0x0A000000;
 }
 
 bool execute_BX(GBA_Cpu& cpu, uint32_t self);
 
-inline bool is_BX(uint32_t self)
+constexpr bool is_BX(uint32_t self)
 {
     return ((self >> 8) & 0x0FFFFF) == 0b00010010111111111111;
 }
 
+template<bool _S>
 bool execute_ADD(GBA_Cpu& cpu, uint32_t self);
 
-inline bool is_ADD(uint32_t self)
+constexpr bool is_ADD(uint32_t self)
 {
     return (self & 0xFE00000) == 0x02800000;
 }
 
+template<bool _I, bool _P, bool _U, bool _B, bool _W>
 bool execute_STR_immediate(GBA_Cpu& cpu, uint32_t self);
 
-inline bool is_STR_immediate(uint32_t self)
+constexpr bool is_STR_immediate(uint32_t self)
 {
     return (self & 0xc100000) == 0x4000000;
 }
 
+template<bool _I, bool _S>
 bool execute_MOV(GBA_Cpu& cpu, uint32_t self);
 
-inline bool is_MOV(uint32_t self)
+constexpr bool is_MOV(uint32_t self)
 {
     return (self & 0xDEF0000) == 0x1A00000;
 }
 
-bool execute_LDR_thumb_1(GBA_Cpu& cpu, uint16_t self);
+/**
+ * @brief SWI : Software interrupt
+ * 
+ * The BIOS is high level emulated, so instead of entering SVC mode the call is forwarded
+ * to execute_bios_call with the comment field [16, 23].
+ * 
+ * @param cpu The cpu who's executing this instruction.
+ * @param self The opcode to be executed.
+ * @return bool if the opcode was handled
+ */
+bool execute_SWI(GBA_Cpu& cpu, uint32_t self);
 
-inline bool is_LDR_thumb_1(uint16_t self)
+constexpr bool is_SWI(uint32_t self)
+{
+    return (self & 0x0F000000) == 0x0F000000;
+}
+
+/**
+ * @brief MRS : Move PSR to register
+ * 
+ * Encoding
+ * [12, 15] Destination register
+ * [22] 1=SPSR 0=CPSR
+ * 
+ * @param cpu The cpu who's executing this instruction.
+ * @param self The opcode to be executed.
+ * @return bool if the opcode was handled
+ */
+template<bool _P>
+bool execute_MRS(GBA_Cpu& cpu, uint32_t self);
+
+constexpr bool is_MRS(uint32_t self)
+{
+    return (self & 0x0FBF0FFF) == 0x010F0000;
+}
+
+/**
+ * @brief MSR : Move to PSR
+ * 
+ * MSR are instructions used for moving values (bit[25]=1) or register values (bit[25]=0)
+ * to the specified PSR (bit[22] 1=SPSR 0=CPSR). Which fields will be written to is marked by bit[16..19], where:
+ *      bit[16]=Control
+ *      bit[17]=eXtension
+ *      bit[18]=Status
+ *      bit[19]=Flags
+ * 
+ * Writes to the CPSR mode bits switch the banked registers. In User mode only the flags can be written.
+ * 
+ * @param cpu The cpu who's executing this instruction.
+ * @param self The opcode to be executed.
+ * @return bool if the opcode was handled
+ */
+template<bool _I, bool _P>
+bool execute_MSR(GBA_Cpu& cpu, uint32_t self);
+
+constexpr bool is_MSR(uint32_t self)
+{
+    return (self & 0x0FB0FFF0) == 0x0120F000   // Register
+        || (self & 0x0FB0F000) == 0x0320F000;  // Immediate
+}
+
+template<uint8_t _V>
+bool execute_LDR_thumb_1(GBA_Cpu& cpu, uint32_t self);
+
+constexpr bool is_LDR_thumb_1(uint16_t self)
 {
     return (self & 0xF800) == 0x6800;
 }
 
-bool execute_LDR_thumb_3(GBA_Cpu& cpu, uint16_t self);
+template<uint8_t _Rd>
+bool execute_LDR_thumb_3(GBA_Cpu& cpu, uint32_t self);
 
-inline bool is_LDR_thumb_3(uint16_t self)
+constexpr bool is_LDR_thumb_3(uint16_t self)
 {
     return (self & 0xF800) == 0x4800;
 }
 
-bool execute_LSLS_thumb_1(GBA_Cpu& cpu, uint16_t self);
+template<uint8_t _V>
+bool execute_LSLS_thumb_1(GBA_Cpu& cpu, uint32_t self);
 
-inline bool is_LSLS_thumb_1(uint16_t self)
+constexpr bool is_LSLS_thumb_1(uint16_t self)
 {
     return (self & 0xF800) == 0x0000;
 }
 
-bool execute_B_thumb_1(GBA_Cpu& cpu, uint16_t self);
+template<uint8_t condition>
+bool execute_B_thumb_1(GBA_Cpu& cpu, uint32_t self);
 
-inline bool is_B_thumb_1(uint16_t self)
+constexpr bool is_B_thumb_1(uint16_t self)
 {
     return (self & 0xF000) == 0xD000;
 }
 
-bool execute_B_thumb_2(GBA_Cpu& cpu, uint16_t self);
+bool execute_B_thumb_2(GBA_Cpu& cpu, uint32_t self);
 
-inline bool is_B_thumb_2(uint16_t self)
+constexpr bool is_B_thumb_2(uint16_t self)
 {
-    return (self & 0xF100) == 0xE000;
+    return (self & 0xF800) == 0xE000;
 }
 
 /**
@@ -118,9 +188,10 @@ inline bool is_B_thumb_2(uint16_t self)
  * @param self p_self: The opcode to be executed.
  * @return bool Whether the opcode was handled.
  */
-bool execute_MOVS_thumb_1(GBA_Cpu& cpu, uint16_t self);
+template<uint8_t Rd>
+bool execute_MOVS_thumb_1(GBA_Cpu& cpu, uint32_t self);
 
-inline bool is_MOVS_thumb_1(uint16_t self)
+constexpr bool is_MOVS_thumb_1(uint16_t self)
 {
     return (self & 0xF800) == 0x2000;
 }
@@ -146,7 +217,7 @@ inline bool is_MOVS_thumb_1(uint16_t self)
  */
 bool execute_MOVS_thumb_2(GBA_Cpu& cpu, uint16_t self);
 
-inline bool is_MOVS_thumb_2(uint16_t self)
+constexpr bool is_MOVS_thumb_2(uint16_t self)
 {
     return (self & 0xF100) == 0xE000;
 }
@@ -174,14 +245,170 @@ inline bool is_MOVS_thumb_2(uint16_t self)
  */
 bool execute_MOVS_thumb_3(GBA_Cpu& cpu, uint16_t self);
 
-inline bool is_MOVS_thumb_3(uint16_t self)
+constexpr bool is_MOVS_thumb_3(uint16_t self)
 {
     return (self & 0xF100) == 0xE000;
 }
 
 /**
- * @brief Executes a long branch with link.
+ * @brief Executes a software interrupt.
+ * 
+ * Syntax: SWI #imm8
+ * 
+ * Encoding
+ * [0, 7] Comment field (BIOS function number)
+ * [8, 15] Must be 0b11011111 for this instruction
+ * 
+ * @param cpu p_cpu: The cpu who's executing this instruction.
+ * @param self p_self: The opcode to be executed.
+ * @return bool Whether the opcode was handled.
+ */
+bool execute_SWI_thumb(GBA_Cpu& cpu, uint32_t self);
+
+constexpr bool is_SWI_thumb(uint16_t self)
+{
+    return (self & 0xFF00) == 0xDF00;
+}
+
+/**
+ * @brief Executes one half of a long branch with link.
+ *
+ * Syntax: BL label
+ *
+ * The first half adds the high part of the offset to PC into LR, the second one branches to
+ * LR plus the low part and leaves the address of the next instruction, with bit 0 set, in LR.
+ *
+ * Encoding
+ * [0, 10] Offset, bits [12, 22] for the first half and [1, 11] for the second
+ * [11] 0=First half 1=Second half
+ * [12, 15] Must be 0b1111 for this instruction
  *
- * Syntax: 
+ * @param cpu p_cpu: The cpu who's executing this instruction.
+ * @param self p_self: The opcode to be executed.
+ * @return bool Whether the opcode was handled.
+ */
+template<bool _H>
+bool execute_BL_thumb(GBA_Cpu& cpu, uint32_t self);
+
+constexpr bool is_BL_thumb(uint16_t self)
+{
+    return (self & 0xF000) == 0xF000;
+}
+
+/**
+ * @brief Executes a branch and exchange.
+ *
+ * Syntax: BX Rs
+ *
+ * Bit 0 of Rs selects the instruction set of the target: 1=THUMB 0=ARM.
+ *
+ * Encoding
+ * [3, 6] Register number (R0..R15)
+ * [7, 15] Must be 0b010001110 for this instruction
+ *
+ * @param cpu p_cpu: The cpu who's executing this instruction.
+ * @param self p_self: The opcode to be executed.
+ * @return bool Whether the opcode was handled.
+ */
+bool execute_BX_thumb(GBA_Cpu& cpu, uint32_t self);
+
+constexpr bool is_BX_thumb(uint16_t self)
+{
+    return (self & 0xFF87) == 0x4700;
+}
+
+/**
+ * @brief Pairs of THUMB instructions executed as one.
+ */
+enum class ThumbFusion : uint8_t
+{
+    NONE,
+    BL,             // Both halves of BL
+    LDR_BX,         // LDR Rd, [PC, #imm8] then BX Rd, a call or jump through a literal
+    MOVS_LSLS       // MOVS Rd, #imm8 then LSLS Rd, Rd, #imm5, a constant materialised
+};
+
+/**
+ * @brief Pair the first and second instructions form, if they can be executed as one.
+ */
+inline ThumbFusion fuse_thumb(uint16_t first, uint16_t second)
+{
+    if ((first & 0xF800) == 0xF000 && (second & 0xF800) == 0xF800)
+        return ThumbFusion::BL;
+
+    auto first_Rd = (first >> 8) & 0x07;
+    if (is_LDR_thumb_3(first) && is_BX_thumb(second) && ((second >> 3) & 0x0F) == first_Rd)
+        return ThumbFusion::LDR_BX;
+    if (is_MOVS_thumb_1(first) && is_LSLS_thumb_1(second) && (second & 0x07) == first_Rd && ((second >> 3) & 0x07) == first_Rd)
+        return ThumbFusion::MOVS_LSLS;
+
+    return ThumbFusion::NONE;
+}
+
+/**
+ * @brief Executes a pair of instructions as one, with the same effect as executing them in order.
+ *
+ * PC must be that of the first instruction, the cycles of the opcode fetches are left to the caller.
+ *
+ * @param cpu p_cpu: The cpu who's executing the pair.
+ * @param fusion The pair fuse_thumb found.
+ * @param pair The first opcode in the low half, the second in the high half.
+ * @return bool Whether the pair was handled.
+ */
+bool execute_fused_thumb(GBA_Cpu& cpu, ThumbFusion fusion, uint32_t pair);
+
+/**
+ * @brief Handlers the interpreter dispatches opcodes to, one per execute_ function.
+ */
+enum class OpcodeHandler : uint8_t
+{
+    UNHANDLED,
+    LDR_immediate,
+    STR_immediate,
+    MRS,
+    MSR,
+    B,
+    ADD,
+    MOV,
+    BX,
+    SWI,
+    LSLS_thumb_1,
+    MOVS_thumb_1,
+    LDR_thumb_3,
+    LDR_thumb_1,
+    B_thumb_1,
+    SWI_thumb,
+    B_thumb_2,
+    BX_thumb,
+    BL_thumb,
+    COUNT
+};
+
+/** Handler function, THUMB handlers take the opcode in the low half. */
+typedef bool (*HandlerFunction)(GBA_Cpu& cpu, uint32_t opcode);
+
+/**
+ * @brief Entry of the dispatch tables.
+ */
+struct Handler
+{
+    OpcodeHandler kind;
+    HandlerFunction execute;    // Returns false for the opcodes the interpreter doesn't handle
+};
+
+/**
+ * @brief Handler of an ARM opcode, looked up from bits [20, 27] and [4, 7] as decode_arm does.
+ * 
+ * The flags among those bits (I, P, U, B, W, L, S) are template arguments of the handlers, the
+ * table holding the instantiation for each combination. Only the other bits are tested as the
+ * handler executes.
+ */
+const Handler& arm_handler(uint32_t opcode);
+
+/**
+ * @brief Handler of a THUMB opcode, looked up from bits [6, 15] as decode_thumb does.
+ * 
+ * Conditions, shift amounts, immediate offsets and the registers of the 8 bit immediate formats
+ * come as template arguments.
  */
-bool execute_BL_thumb(GBA_Cpu& cpu, uint16_t self);
\ No newline at end of file
+const Handler& thumb_handler(uint16_t opcode);
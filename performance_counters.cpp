@@ -0,0 +1,97 @@
+#include "performance_counters.h"
+#include <fmt/core.h>
+
+namespace
+{
+    constexpr const char* class_names[] = { "ALU", "load/store", "branch", "mode switch" };
+    static_assert(std::size(class_names) == static_cast<size_t>(InstructionClass::COUNT));
+
+    constexpr const char* region_names[PerformanceCounters::region_count] =
+    {
+        "BIOS", "unused", "EWRAM", "IWRAM", "IO", "palette", "VRAM", "OAM",
+        "ROM 0", "ROM 0", "ROM 1", "ROM 1", "ROM 2", "ROM 2", "SRAM", "unused"
+    };
+
+    double percent(uint64_t part, uint64_t total)
+    {
+        return total == 0 ? 0.0 : 100.0 * static_cast<double>(part) / static_cast<double>(total);
+    }
+}
+
+InstructionClass instruction_class(OpcodeHandler kind)
+{
+    switch (kind)
+    {
+        case OpcodeHandler::LDR_immediate:
+        case OpcodeHandler::STR_immediate:
+        case OpcodeHandler::LDR_thumb_3:
+        case OpcodeHandler::LDR_thumb_1:
+            return InstructionClass::LOAD_STORE;
+        case OpcodeHandler::B:
+        case OpcodeHandler::BX:
+        case OpcodeHandler::B_thumb_1:
+        case OpcodeHandler::B_thumb_2:
+        case OpcodeHandler::BX_thumb:
+        case OpcodeHandler::BL_thumb:
+            return InstructionClass::BRANCH;
+        case OpcodeHandler::MRS:
+        case OpcodeHandler::MSR:
+        case OpcodeHandler::SWI:
+        case OpcodeHandler::SWI_thumb:
+            return InstructionClass::MODE_SWITCH;
+        default:
+            return InstructionClass::ALU;
+    }
+}
+
+uint64_t PerformanceCounters::instructions() const
+{
+    uint64_t total = 0;
+    for (auto count : handlers)
+        total += count;
+    return total;
+}
+
+uint64_t PerformanceCounters::instructions(InstructionClass kind) const
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < handlers.size(); i++)
+    {
+        if (instruction_class(static_cast<OpcodeHandler>(i)) == kind)
+            total += handlers[i];
+    }
+    return total;
+}
+
+std::string PerformanceCounters::report() const
+{
+    if (!enabled)
+    {
+        return "Built without performance counters, configure with -DGBA_PERF_COUNTERS=ON\n";
+    }
+
+    auto total = instructions();
+    std::string text = fmt::format("{:<20}{:>14}\n", "instructions", total);
+    for (size_t i = 0; i < static_cast<size_t>(InstructionClass::COUNT); i++)
+    {
+        auto count = instructions(static_cast<InstructionClass>(i));
+        text += fmt::format("  {:<18}{:>14}  {:>5.1f}%\n", class_names[i], count, percent(count, total));
+    }
+    text += fmt::format("{:<20}{:>14}  {:>5.1f}%\n", "fused pairs", fused_pairs, percent(2 * fused_pairs, total));
+    text += fmt::format("{:<20}{:>14}\n", "unhandled opcodes", unhandled);
+    text += fmt::format("{:<20}{:>14}\n", "BIOS calls", bios_calls);
+    text += fmt::format("{:<20}{:>14}  {:>5.1f}%\n", "pipeline flushes", pipeline_flushes, percent(pipeline_flushes, total));
+    text += fmt::format("{:<20}{:>14}\n", "code window refills", code_window_refills);
+
+    text += fmt::format("{:<20}{:>14}{:>14}\n", "memory", "reads", "writes");
+    for (size_t region = 0; region < region_count; region++)
+    {
+        if (reads[region] != 0 || writes[region] != 0)
+            text += fmt::format("  {:<3x}{:<15}{:>14}{:>14}\n", region, region_names[region], reads[region], writes[region]);
+    }
+
+    text += fmt::format("{:<20}{:>14}  {} hit\n", "break point checks", break_point_checks, break_point_hits);
+    text += fmt::format("{:<20}{:>14}  {:>5.1f}% hit\n", "decode cache", decode_hits + decode_misses,
+                        percent(decode_hits, decode_hits + decode_misses));
+    return text;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "opcodes.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Set by the CMake option of the same name. With 0 the counting is compiled out of the
+// interpreter, the counters stay at 0
+#ifndef GBA_PERF_COUNTERS
+#define GBA_PERF_COUNTERS 1
+#endif
+
+/** Coarse classes of the handlers, see instruction_class. */
+enum class InstructionClass : uint8_t
+{
+    ALU,
+    LOAD_STORE,
+    BRANCH,
+    MODE_SWITCH,    // PSR transfers and SWI, which may change the processor mode
+    COUNT
+};
+
+InstructionClass instruction_class(OpcodeHandler kind);
+
+/**
+ * @brief What the interpreter did, counted as it runs. See GBA_Cpu::counters.
+ *
+ * Both backends count the same events, except for the decode cache, which only the threaded
+ * backend has. Instructions run with the REPL execute command are counted too.
+ */
+struct PerformanceCounters
+{
+    static constexpr bool enabled = GBA_PERF_COUNTERS != 0;
+    /** Memory regions, by address bits [24, 27]. */
+    static constexpr size_t region_count = 16;
+
+    /** Instructions executed by each handler kind. A failed condition counts as executed. */
+    std::array<uint64_t, static_cast<size_t>(OpcodeHandler::COUNT)> handlers{};
+    /** THUMB pairs executed as one, each counting its two instructions in handlers. */
+    uint64_t fused_pairs = 0;
+    uint64_t unhandled = 0;
+    /** Runs of the high level emulated BIOS: the SWIs it implements and the IRQ dispatcher entries and returns. */
+    uint64_t bios_calls = 0;
+    uint64_t pipeline_flushes = 0;
+    /** Times the fetch left the code window and resolved it again. */
+    uint64_t code_window_refills = 0;
+    /** Data reads and writes of the instructions, by region. */
+    std::array<uint64_t, region_count> reads{};
+    std::array<uint64_t, region_count> writes{};
+    /**
+     * Instructions whose address was looked up among the break points, once each, and those that
+     * had one. Nothing is looked up while there are no break points.
+     */
+    uint64_t break_point_checks = 0;
+    uint64_t break_point_hits = 0;
+    /** Lookups of the decoded instructions of the threaded backend. */
+    uint64_t decode_hits = 0;
+    uint64_t decode_misses = 0;
+
+    uint64_t instructions() const;
+    uint64_t instructions(InstructionClass kind) const;
+
+    void reset()
+    {
+        *this = {};
+    }
+
+    /** The counters as a table, the lines the stats command prints. */
+    std::string report() const;
+};
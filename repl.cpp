@@ -1,213 +1,522 @@
 #include "repl.h"
-#include "repl.h"
-#include "repl.h"
 #include <algorithm>
 #include <stdexcept>
 #include <cctype>
 #include <charconv>
-#include "string_utils.h"
+#include "disassembly_search.h"
 #include <fmt/core.h>
 
-REPL_Command::REPL_Command(std::string name, std::vector<REPL_Argument>&& expected_arguments, REPL_Procedure procedure)
-    :
-    name(name),
-    expected_arguments(std::move(expected_arguments)),
-    procedure(procedure)
+namespace
 {
-}
+    const char* type_name(REPL_ArgumentType type)
+    {
+        switch (type)
+        {
+            case REPL_ArgumentType::POINTER:    return "pointer";
+            case REPL_ArgumentType::INTEGER:    return "integer";
+            case REPL_ArgumentType::RANGE:      return "range";
+            case REPL_ArgumentType::STRING:     return "string";
+            case REPL_ArgumentType::PATTERN:    return "pattern";
+            case REPL_ArgumentType::CONDITION:  return "condition";
+            case REPL_ArgumentType::INSTRUCTION: return "instruction";
+            default:                            return "argument";
+        }
+    }
 
-std::vector<std::string> REPL::split_tokens(const std::string& source) const
-{
-    size_t i = source.find(' ');
-    size_t j = 0;
-    std::vector<std::string> tokens;
-    
-    while (i != std::string::npos)
+    bool equals_ignore_case(std::string_view a, std::string_view b)
     {
-        tokens.emplace_back(source.substr(j, i - j));
-        j = i + 1;
-        i = source.find(' ', j);
+        return a.size() == b.size()
+            && std::equal(a.begin(), a.end(), b.begin(),
+                          [](unsigned char x, unsigned char y) { return std::tolower(x) == std::tolower(y); });
     }
-    
-    tokens.emplace_back(source.substr(j));
-    return tokens;
-}
 
-const REPL_Command& REPL::find_command(const REPL_Signature& signature) const
-{
-    auto command = std::find_if(commands.begin(), commands.end(), [&](auto& command) { return command.name == signature[0]; });
-    if (command == commands.end())
+    bool is_name_character(char c)
     {
-        throw std::runtime_error{"Could not find requested command"};
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
     }
-    
-    if (!std::equal(command->expected_arguments.begin(), command->expected_arguments.end(),
-                    signature.begin() + 1,
-                     [&](auto& expected_argument, auto& signature_argument) -> bool
-                     {
-                         switch (expected_argument.type)
-                         {
-                            case REPL_ArgumentType::INTEGER:
-                                return REPL_Argument::is_integer(signature_argument);
-                            case REPL_ArgumentType::RANGE:
-                                 return REPL_Argument::is_range(signature_argument);
-                            case REPL_ArgumentType::POINTER:
-                                 return REPL_Argument::is_pointer(signature_argument);
-                            default:
-                                return false;
-                         }
-                     }))
-    {
-        throw std::runtime_error{"Invalid signature"};
-    }
-    
-    return *command;
-}
 
-bool REPL::running() const
-{
-    return !stop;
-}
+    /** Register named by $r0-$r15, $sp, $lr or $pc, -1 if name isn't one. */
+    int register_index(std::string_view name)
+    {
+        if (equals_ignore_case(name, "sp")) return 13;
+        if (equals_ignore_case(name, "lr")) return 14;
+        if (equals_ignore_case(name, "pc")) return 15;
 
-void REPL::process_command(GBA_Cpu& cpu)
-{
-    std::string source;
-    std::getline(std::cin, source);
+        if (name.size() < 2 || std::tolower(static_cast<unsigned char>(name[0])) != 'r')
+            return -1;
 
-    if (source == "continue")
-    {
-        stop = true;
-        return;
+        unsigned index;
+        auto end = name.data() + name.size();
+        auto result = std::from_chars(name.data() + 1, end, index);
+        return result.ptr == end && result.ec == std::errc{} && index < 16 ? static_cast<int>(index) : -1;
     }
 
-    auto tokens = split_tokens(source);
-    auto command = find_command(tokens);
-    (cpu.*command.procedure)(tokens);
-}
+    /**
+     * Evaluates the address expressions of POINTER and RANGE arguments, consuming the text
+     * as it goes.
+     */
+    class ExpressionParser
+    {
+    public:
+        ExpressionParser(std::string_view text, const GBA_Cpu& cpu, const std::map<std::string, uint32_t, std::less<>>& variables)
+            : text(text),
+              cpu(cpu),
+              variables(variables)
+        {
+        }
+
+        bool empty()
+        {
+            skip_spaces();
+            return text.empty();
+        }
 
+        bool consume(char c)
+        {
+            skip_spaces();
+            if (text.empty() || text.front() != c)
+                return false;
+            text.remove_prefix(1);
+            return true;
+        }
 
-bool REPL_Argument::is_integer(const std::string& argument)
+        /** term { (+|-) offset } */
+        uint32_t expression()
+        {
+            auto value = term();
+            while (!empty())
+            {
+                if (consume('+'))
+                    value += offset();
+                else if (consume('-'))
+                    value -= offset();
+                else
+                    break;
+            }
+            return value;
+        }
+
+        /** Number with an optional i/w/h unit. */
+        uint32_t offset()
+        {
+            auto value = number();
+            char unit = text.empty() ? '\0' : text.front();
+            if (unit == 'i')
+                value *= cpu.instruction_size;
+            else if (unit == 'w')
+                value *= 4;
+            else if (unit == 'h')
+                value *= 2;
+            else
+                return value;
+
+            text.remove_prefix(1);
+            return value;
+        }
+
+    private:
+        void skip_spaces()
+        {
+            while (!text.empty() && text.front() == ' ')
+                text.remove_prefix(1);
+        }
+
+        uint32_t term()
+        {
+            if (consume('\\'))
+                return raw_value();
+            if (!consume('$'))
+                return offset();
+
+            size_t length = 0;
+            while (length < text.size() && is_name_character(text[length]))
+                length++;
+            auto name = text.substr(0, length);
+            text.remove_prefix(length);
+
+            auto index = register_index(name);
+            if (index >= 0)
+                return cpu.R[index];
+            if (equals_ignore_case(name, "rom"))
+                return GBA_Memory::rom_base;
+
+            auto variable = variables.find(name);
+            if (variable == variables.end())
+                throw std::runtime_error{ fmt::format("Unknown variable ${}", name) };
+            return variable->second;
+        }
+
+        /** Raw values: \wXXXXXXXX, \hXXXX or \bXX_XX_XX_XX. Bytes are in memory order, \b1f_00_0a_e3 is \we30a001f. */
+        uint32_t raw_value()
+        {
+            char unit = text.empty() ? '\0' : text.front();
+            if (unit != 'b' && unit != 'h' && unit != 'w')
+                throw std::runtime_error{ fmt::format("Expected b, h or w after \\: {}", text) };
+            text.remove_prefix(1);
+
+            if (unit != 'b')
+                return hex_digits(unit == 'h' ? 4 : 8);
+
+            uint32_t value = 0;
+            for (uint32_t shift = 0; shift < 32; shift += 8)
+            {
+                value |= hex_digits(2) << shift;
+                if (!consume('_'))
+                    break;
+            }
+            return value;
+        }
+
+        uint32_t hex_digits(size_t max_digits)
+        {
+            uint32_t value = 0;
+            auto end = text.data() + std::min(text.size(), max_digits);
+            auto result = std::from_chars(text.data(), end, value, 16);
+            if (result.ec != std::errc{})
+                throw std::runtime_error{ fmt::format("Could not parse value {}", text) };
+
+            text.remove_prefix(result.ptr - text.data());
+            return value;
+        }
+
+        uint32_t number()
+        {
+            skip_spaces();
+            uint32_t value = 0;
+            std::from_chars_result result;
+            const auto end = text.data() + text.size();
+
+            if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X'))
+                result = std::from_chars(text.data() + 2, end, value, 16);
+            else
+                result = std::from_chars(text.data(), end, value);
+
+            if (result.ec != std::errc{})
+                throw std::runtime_error{ fmt::format("Could not parse value {}", text) };
+
+            text.remove_prefix(result.ptr - text.data());
+            return value;
+        }
+
+        std::string_view text;
+        const GBA_Cpu& cpu;
+        const std::map<std::string, uint32_t, std::less<>>& variables;
+    };
+
+    /** Text between the brackets of [...], empty optional if argument isn't bracketed. */
+    std::optional<std::string_view> bracketed(std::string_view argument)
+    {
+        if (argument.size() < 2 || argument.front() != '[' || argument.back() != ']')
+            return std::nullopt;
+        argument = argument.substr(1, argument.size() - 2);
+
+        auto first = argument.find_first_not_of(' ');
+        if (first == std::string_view::npos)
+            return std::string_view{};
+        auto last = argument.find_last_not_of(' ');
+        return argument.substr(first, last - first + 1);
+    }
+}
+
+std::optional<REPL_Instruction> REPL_Instruction::parse(std::string_view argument)
 {
-    if (argument.find("0x") == 0)
+    if (argument.size() < 3 || argument.back() != ')')
+        return std::nullopt;
+
+    REPL_Instruction instruction;
+    if (argument.front() == 'T')
+        instruction.set = InstructionSet::THUMB;
+    else if (argument.front() != '$')
+        return std::nullopt;
+    argument.remove_prefix(1);
+
+    if (argument.front() == 'V')
     {
-        auto count = std::count_if(argument.begin() + 2, argument.end(), [](unsigned char c){ return std::isxdigit(c); });
-       
-        return static_cast<size_t>(count) == argument.size() - 2;
+        instruction.binding = Binding::VARIABLES;
+        argument.remove_prefix(1);
     }
-    else
+    else if (argument.substr(0, 2) == "{}")
     {
-        return static_cast<size_t>(std::count_if(argument.begin(), argument.end(), [](unsigned char c){ return std::isdigit(c); })) == argument.size();
+        instruction.binding = Binding::INTERPOLATION;
+        argument.remove_prefix(2);
     }
-}
 
-bool REPL_Argument::is_pointer(const std::string& argument)
-{
-    return argument.size() > 3
-        && argument[0] == '['
-        && argument.find(':') == std::string::npos
-        && argument[argument.size() - 1] == ']';
+    if (argument.size() < 3 || argument.front() != '(')
+        return std::nullopt;
+    instruction.text = argument.substr(1, argument.size() - 2);
+    return instruction;
 }
 
-bool REPL_Argument::is_range(const std::string& argument)
+size_t REPL::split_tokens(std::string_view source, REPL_Tokens& tokens) const
 {
-    return argument.size() > 3
-        && argument[0] == '['
-        && argument.find(':') != std::string::npos
-        && argument[argument.size() - 1] == ']';
+    size_t count = 0;
+    size_t j = 0;
+    int depth = 0; // Spaces inside parentheses or brackets, as in $(ADD R0, R1, R2), don't split tokens
+
+    auto push = [&](size_t end)
+    {
+        if (end == j)
+            return; // Repeated spaces
+        if (count == tokens.size())
+            throw std::runtime_error{ "Too many arguments" };
+        tokens[count++] = source.substr(j, end - j);
+    };
+
+    for (size_t i = 0; i < source.size(); i++)
+    {
+        if (source[i] == '(' || source[i] == '[')
+        {
+            depth++;
+        }
+        else if ((source[i] == ')' || source[i] == ']') && depth > 0)
+        {
+            depth--;
+        }
+        else if (source[i] == ' ' && depth == 0)
+        {
+            push(i);
+            j = i + 1;
+        }
+    }
+
+    push(source.size());
+    return count;
 }
 
-uint32_t REPL_Argument::get_integer(const std::string& argument)
+const REPL_Command& REPL::find_command(std::string_view name) const
 {
-    uint32_t value;
-    std::from_chars_result result;
-    const auto end = argument.c_str() + argument.size();
-    
-    if (argument.find("0x") == 0)
+    auto slot = command_table.slots[command_slot(name, command_table.seed)];
+    if (slot == repl_empty_slot || commands[slot].name != name)
     {
-        result = std::from_chars(argument.c_str() + 2, end, value, 16);
+        throw std::runtime_error{"Could not find requested command"};
     }
-    else
+
+    return commands[slot];
+}
+
+void REPL::check_signature(const REPL_Command& command, const REPL_Tokens& tokens, size_t count) const
+{
+    auto argument_count = count - 1;
+    bool has_store = command.yields && argument_count == command.argument_count + 1;
+    if ((argument_count < command.required_count || argument_count > command.argument_count) && !has_store)
     {
-        result = std::from_chars(argument.c_str(), end, value);
+        if (command.required_count == command.argument_count)
+            throw std::runtime_error{ fmt::format("Invalid signature, {} takes {} arguments", command.name, command.argument_count) };
+        throw std::runtime_error{ fmt::format("Invalid signature, {} takes {} to {} arguments", command.name,
+                                              command.required_count, command.argument_count) };
     }
-    
-    if (result.ptr == end)
+
+    for (size_t i = 0; i < std::min(argument_count, command.argument_count); i++)
     {
-        return value;
+        auto& expected = command.expected_arguments[i];
+        auto text = tokens[i + 1];
+        auto inner = bracketed(text);
+        bool valid = true;
+
+        switch (expected.type)
+        {
+            case REPL_ArgumentType::INTEGER:
+                valid = !inner && !text.empty();
+                break;
+            case REPL_ArgumentType::POINTER:
+                valid = inner && !inner->empty() && inner->find(':') == std::string_view::npos;
+                break;
+            case REPL_ArgumentType::RANGE:
+                valid = inner.has_value();
+                break;
+            case REPL_ArgumentType::STRING:
+                valid = !text.empty();
+                break;
+            case REPL_ArgumentType::PATTERN:
+                valid = InstructionMatcher::is_pattern(text);
+                break;
+            case REPL_ArgumentType::CONDITION:
+                valid = text.size() > 2 && text.front() == '(' && text.back() == ')';
+                break;
+            case REPL_ArgumentType::INSTRUCTION:
+                valid = REPL_Instruction::parse(text).has_value();
+                break;
+        }
+
+        if (!valid)
+        {
+            throw std::runtime_error{ fmt::format("Invalid signature, {} must be a {}: {}", expected.name, type_name(expected.type), text) };
+        }
     }
-    else
+
+    if (has_store)
     {
-        throw std::runtime_error{"Could not parse value"};
+        auto text = tokens[count - 1];
+        auto inner = bracketed(text);
+        if (!inner || inner->size() < 2 || inner->front() != '$'
+            || !std::all_of(inner->begin() + 1, inner->end(), is_name_character))
+        {
+            throw std::runtime_error{ fmt::format("Invalid store argument {}, expected [$register] or [$variable]", text) };
+        }
+        if (equals_ignore_case(inner->substr(1), "rom"))
+        {
+            throw std::runtime_error{"$ROM can't be stored to"};
+        }
     }
 }
 
-uint32_t REPL_Argument::get_pointer(std::string argument)
+REPL_Arguments REPL::parse_arguments(const REPL_Command& command, const REPL_Tokens& tokens, size_t count,
+                                     const GBA_Cpu& cpu) const
 {
-    argument = argument.substr(1, argument.size() - 2); // Remove brackets
-    lr_trim<' '>(argument);
-    
-    uint32_t value;
-    std::from_chars_result result;
-    const auto end = argument.c_str() + argument.size();
-    
-    if (argument.find("0x") == 0)
+    check_signature(command, tokens, count);
+
+    REPL_Arguments arguments;
+    arguments.count = count - 1;
+
+    for (size_t i = 0; i < std::min(arguments.count, command.argument_count); i++)
     {
-        result = std::from_chars(argument.c_str() + 2, end, value, 16);
+        auto& expected = command.expected_arguments[i];
+        auto& value = arguments.values[i];
+        auto text = tokens[i + 1];
+        value.text = text;
+
+        auto invalid = [&]()
+        {
+            return std::runtime_error{ fmt::format("Invalid signature, {} must be a {}: {}", expected.name, type_name(expected.type), text) };
+        };
+
+        switch (expected.type)
+        {
+            case REPL_ArgumentType::INTEGER:
+            {
+                ExpressionParser parser{ text, cpu, variables };
+                value.value = parser.expression();
+                if (!parser.empty())
+                    throw invalid();
+                break;
+            }
+            case REPL_ArgumentType::POINTER:
+            {
+                ExpressionParser parser{ *bracketed(text), cpu, variables };
+                value.value = parser.expression();
+                if (!parser.empty())
+                    throw invalid();
+                break;
+            }
+            case REPL_ArgumentType::RANGE:
+            {
+                auto inner = *bracketed(text);
+                if (inner.empty())
+                {
+                    value.value = GBA_Memory::rom_base;
+                    value.end = GBA_Memory::rom_base + cpu.memory.rom_size;
+                    break;
+                }
+
+                ExpressionParser parser{ inner, cpu, variables };
+                value.value = parser.expression();
+                if (parser.empty())
+                {
+                    value.end = value.value + 1;
+                    break;
+                }
+                if (!parser.consume(':'))
+                    throw std::runtime_error{"Expected a colon"};
+                value.end = parser.consume('+') ? value.value + parser.offset() : parser.expression();
+                if (!parser.empty())
+                    throw invalid();
+                break;
+            }
+            case REPL_ArgumentType::STRING:
+            case REPL_ArgumentType::PATTERN:
+            case REPL_ArgumentType::CONDITION:
+            case REPL_ArgumentType::INSTRUCTION:
+                break;
+        }
     }
-    else
+
+    if (arguments.count > command.argument_count)
     {
-        result = std::from_chars(argument.c_str(), end, value);
+        auto name = bracketed(tokens[count - 1])->substr(1);
+        auto index = register_index(name);
+        if (index >= 0)
+        {
+            arguments.store.kind = REPL_Store::Kind::REGISTER;
+            arguments.store.register_index = static_cast<uint8_t>(index);
+        }
+        else
+        {
+            arguments.store.kind = REPL_Store::Kind::VARIABLE;
+            arguments.store.variable = name;
+        }
     }
-    
-    if (result.ptr == end)
+
+    return arguments;
+}
+
+std::optional<uint32_t> REPL::execute(const REPL_Command& command, const REPL_Tokens& tokens, size_t count, GBA_Cpu& cpu)
+{
+    auto arguments = parse_arguments(command, tokens, count, cpu);
+    arguments.variables = &variables;
+    auto result = (cpu.*command.procedure)(arguments);
+    if (!result)
     {
-        return value;
+        return std::nullopt;
     }
-    else
+
+    switch (arguments.store.kind)
     {
-        throw std::runtime_error{"Could not parse value"};
+        case REPL_Store::Kind::NONE:
+            return result;
+        case REPL_Store::Kind::REGISTER:
+            cpu.R[arguments.store.register_index] = *result;
+            if (arguments.store.register_index == 15)
+                cpu.flush_pipeline();
+            break;
+        case REPL_Store::Kind::VARIABLE:
+        {
+            auto variable = variables.find(arguments.store.variable);
+            if (variable != variables.end())
+                variable->second = *result;
+            else
+                variables.emplace(arguments.store.variable, *result);
+            break;
+        }
     }
+
+    return std::nullopt;
 }
 
-std::pair<uint32_t, uint32_t> REPL_Argument::get_range(const std::string& argument)
+void REPL::execute(std::string_view source, GBA_Cpu& cpu)
 {
-    auto start = argument.c_str() + 1;
-    auto end = argument.c_str() + argument.size() - 1;
-    std::pair<uint32_t, uint32_t> value;
-    std::from_chars_result result;
-    
-    if (argument.find("0x") == 1)
-    {
-        result = std::from_chars(start + 2, end, value.first, 16);
-    }   
-    else
-    {
-        result = std::from_chars(start, end, value.first);
-    }
-    
-    if (result.ptr == end || *result.ptr != ':')
+    REPL_Tokens tokens;
+    auto count = split_tokens(source, tokens);
+    if (count == 0)
     {
-        throw std::runtime_error{"Expected a colon"};
+        return;
     }
-    
-    if (std::string_view{ result.ptr + 1 }.find("0x") == 0)
+
+    auto result = execute(find_command(tokens[0]), tokens, count, cpu);
+    if (result)
     {
-        result = std::from_chars(result.ptr + 3, end, value.second, 16);
+        std::cout << fmt::format("{:#x}", *result) << std::endl;
     }
-    else
+}
+
+bool REPL::running() const
+{
+    return !stop;
+}
+
+void REPL::process_command(GBA_Cpu& cpu)
+{
+    if (!std::getline(std::cin, line) || line == "continue")
     {
-        result = std::from_chars(result.ptr + 1, end, value.second);
+        stop = true;
+        return;
     }
-    
-    if (result.ptr == end)
+
+    try
     {
-        return value;
+        execute(line, cpu);
     }
-    else
+    catch (std::runtime_error& e)
     {
-        throw std::runtime_error{fmt::format("Could not parse value {}. Remove this character: {}({})",
-                                             argument,
-                                             result.ptr[0],
-                                             std::distance(argument.c_str(), result.ptr))};
+        std::cout << RED << e.what() << RESET << std::endl;
     }
 }
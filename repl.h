@@ -1,64 +1,277 @@
 #pragma once
 
 #include <string_view>
-#include <vector>
 #include <array>
+#include <map>
+#include <optional>
 #include <string>
 #include "GBA_Cpu.h"
+#include "decoder.h"
 
 enum class REPL_ArgumentType
 {
     POINTER = 1,
     INTEGER = 1 << 1,
     RANGE = 1 << 2,
-    STRING = 1 << 3
+    STRING = 1 << 3,
+    PATTERN = 1 << 4,
+    CONDITION = 1 << 5,
+    INSTRUCTION = 1 << 6
 };
 
+/** Most arguments a command takes, not counting the store argument. */
+constexpr size_t repl_max_arguments = 4;
+/** Command name, arguments and store argument. */
+constexpr size_t repl_max_tokens = repl_max_arguments + 2;
+
 struct REPL_Argument
 {
 public:
     REPL_ArgumentType type;
-    std::string name;
-    std::string description;
-public:
-    static bool is_pointer(const std::string& argument);
-    static bool is_integer(const std::string& argument);
-    static bool is_range(const std::string& argument);
-    
-    static uint32_t get_integer(const std::string& argument);
-    static uint32_t get_pointer(std::string argument);
-    static std::pair<uint32_t, uint32_t> get_range(const std::string& argument);
+    std::string_view name;
+    std::string_view description;
+    bool optional = false;  // Optional arguments come last, commands taking them yield nothing
+};
+
+/**
+ * @brief An argument parsed as its REPL_Argument type.
+ *
+ * Syntax
+ * INTEGER    0x10, 16, $r0, \we30a001f, \b1f_00_0a_e3
+ * POINTER    [0x08000000], [$pc-2i], [$myVar+4w]
+ * RANGE      [0xFF00:0xFFFF], [0xFF00:+4i], [0xFF00] (that address alone), [] (the whole ROM)
+ * CONDITION  (r0 == 0x80 && [0x03000010] > 5), compiled by the command taking it
+ * INSTRUCTION $(ADD r0, r1, #4), T(LSLS r0, r1, #2), see REPL_Instruction
+ *
+ * Addresses are expressions: a number, a register ($r0-$r15, $sp, $lr, $pc), $ROM or a variable,
+ * followed by any amount of +/- offsets. Offsets may be scaled with a suffix: Ni instructions
+ * (2 bytes in THUMB mode, 4 in ARM mode), Nw words, Nh halfwords. A range end starting with +
+ * is relative to its start.
+ */
+struct REPL_Value
+{
+    std::string_view text;  // As written. STRING and PATTERN arguments are taken from here
+    uint32_t value = 0;     // INTEGER, POINTER and the start of RANGE
+    uint32_t end = 0;       // End of RANGE (exclusive)
+};
+
+/**
+ * @brief Where a command stores the value it yields.
+ *
+ * A command that yields a value may take one last argument, [$r1] or [$myVar], instead of
+ * printing it. Variables are created by storing to them.
+ */
+struct REPL_Store
+{
+    enum class Kind : uint8_t { NONE, REGISTER, VARIABLE };
+
+    Kind kind = Kind::NONE;
+    uint8_t register_index = 0;
+    std::string_view variable;
+};
+
+/**
+ * @brief Arguments of a command, parsed without allocating.
+ *
+ * Text is viewed from the command line, which must outlive the arguments.
+ */
+struct REPL_Arguments
+{
+    std::array<REPL_Value, repl_max_arguments> values;
+    size_t count = 0;
+    REPL_Store store;
+    /** Variables of the REPL running the command, for commands compiling expressions. */
+    std::map<std::string, uint32_t, std::less<>>* variables = nullptr;
+
+    const REPL_Value& operator[](size_t index) const { return values[index]; }
+};
+
+/**
+ * @brief Instruction argument, assembled by the command taking it.
+ *
+ * $(...) is an ARM instruction and T(...) a THUMB one. $V(ADD $z, $x, #1) binds each $variable
+ * to a register, ${}(ADD r0, r0, #{step}) replaces each {variable} by its value. TV(...) and
+ * T{}(...) do the same in THUMB.
+ */
+struct REPL_Instruction
+{
+    enum class Binding : uint8_t { NONE, VARIABLES, INTERPOLATION };
+
+    InstructionSet set = InstructionSet::ARM;
+    Binding binding = Binding::NONE;
+    std::string_view text;  // Inside the parentheses
+
+    /** @return std::optional<REPL_Instruction> Nothing if argument isn't an instruction. */
+    static std::optional<REPL_Instruction> parse(std::string_view argument);
 };
 
-typedef std::vector<std::string> REPL_Signature;
-typedef void (GBA_Cpu::*REPL_Procedure)(const REPL_Signature&) const;
+typedef std::array<std::string_view, repl_max_tokens> REPL_Tokens;
+typedef std::optional<uint32_t> (GBA_Cpu::*REPL_Procedure)(const REPL_Arguments&);
 
 class REPL_Command
 {
 public:
-    REPL_Command(std::string name, std::vector<REPL_Argument>&& expected_arguments, REPL_Procedure procedure);
+    constexpr REPL_Command(std::string_view name, std::initializer_list<REPL_Argument> arguments,
+                           REPL_Procedure procedure, bool yields = false)
+        : name(name),
+          procedure(procedure),
+          yields(yields)
+    {
+        for (auto& argument : arguments)
+        {
+            expected_arguments[argument_count++] = argument;
+            if (!argument.optional)
+                required_count++;
+        }
+    }
 public:
-    std::string name;
-    std::vector<REPL_Argument> expected_arguments;
+    std::string_view name;
+    std::array<REPL_Argument, repl_max_arguments> expected_arguments{};
+    size_t argument_count = 0;
+    size_t required_count = 0;
     REPL_Procedure procedure;
+    bool yields;    // Returns a value which can be stored
+};
+
+/** The command hash table has 2^repl_command_slot_bits slots, well above the amount of commands. */
+constexpr uint32_t repl_command_slot_bits = 7;
+constexpr size_t repl_command_slots = size_t(1) << repl_command_slot_bits;
+constexpr uint8_t repl_empty_slot = 0xFF;
+
+/**
+ * @brief Slot of a command name, for a given seed of the hash.
+ *
+ * FNV-1a, the slot is taken from the top bits since the low ones barely depend on the seed.
+ */
+constexpr size_t command_slot(std::string_view name, uint32_t seed)
+{
+    uint32_t hash = 0x811C9DC5 ^ seed;
+    for (char c : name)
+        hash = (hash ^ static_cast<uint8_t>(c)) * 0x01000193;
+    return hash >> (32 - repl_command_slot_bits);
+}
+
+/**
+ * @brief Perfect hash of the command names: every name lands on its own slot.
+ */
+struct REPL_CommandTable
+{
+    uint32_t seed = 0;
+    std::array<uint8_t, repl_command_slots> slots{};
 };
 
+/**
+ * @brief Finds, at compile time, a seed for which no two command names collide.
+ */
+template<size_t N>
+constexpr REPL_CommandTable make_command_table(const std::array<REPL_Command, N>& commands)
+{
+    static_assert(N < repl_command_slots, "Too many commands for the hash table");
+
+    for (uint32_t seed = 0; ; seed++)
+    {
+        REPL_CommandTable table{ seed, {} };
+        for (auto& slot : table.slots)
+            slot = repl_empty_slot;
+
+        bool collision = false;
+        for (size_t i = 0; i < N && !collision; i++)
+        {
+            auto& slot = table.slots[command_slot(commands[i].name, seed)];
+            collision = slot != repl_empty_slot;
+            slot = static_cast<uint8_t>(i);
+        }
+
+        if (!collision)
+            return table;
+    }
+}
+
 class REPL
 {
 public:
-    std::vector<std::string> split_tokens(const std::string& source) const;
-    const REPL_Command& find_command(const REPL_Signature& signature) const;
+    /**
+     * @brief Splits a command line on spaces, keeping parenthesized and bracketed groups together.
+     *
+     * @return size_t Amount of tokens.
+     * @throws std::runtime_error If there are more than repl_max_tokens tokens.
+     */
+    size_t split_tokens(std::string_view source, REPL_Tokens& tokens) const;
+    const REPL_Command& find_command(std::string_view name) const;
+
+    /**
+     * @brief Checks the amount and the shape of the arguments, without evaluating them.
+     *
+     * @throws std::runtime_error If they don't match the command signature.
+     */
+    void check_signature(const REPL_Command& command, const REPL_Tokens& tokens, size_t count) const;
+
+    /**
+     * @brief Parses the tokens following the command name.
+     *
+     * @throws std::runtime_error If they don't match the command signature.
+     */
+    REPL_Arguments parse_arguments(const REPL_Command& command, const REPL_Tokens& tokens, size_t count,
+                                   const GBA_Cpu& cpu) const;
+
+    /**
+     * @brief Runs an already split command, storing the value it yields if asked to.
+     *
+     * @return std::optional<uint32_t> The yielded value, if it wasn't stored.
+     */
+    std::optional<uint32_t> execute(const REPL_Command& command, const REPL_Tokens& tokens, size_t count, GBA_Cpu& cpu);
+
+    /**
+     * @brief Runs a command line, storing or printing the value it yields.
+     */
+    void execute(std::string_view source, GBA_Cpu& cpu);
+
     bool running() const;
     void process_command(GBA_Cpu& cpu);
 public:
     bool stop = false;
-    const std::array<REPL_Command, 4> commands = {
+    std::map<std::string, uint32_t, std::less<>> variables;
+
+    static constexpr std::array<REPL_Command, 34> commands = {
         REPL_Command("find",
                     {
                         { REPL_ArgumentType::INTEGER, "value", "Value to be found" },
                         { REPL_ArgumentType::RANGE, "address", "Address range to be searched" }
                     },
-                    &GBA_Cpu::find_command),
+                    &GBA_Cpu::find_command, true),
+        REPL_Command("readb",
+                    {
+                        { REPL_ArgumentType::POINTER, "address", "Address of the byte to be read" }
+                    },
+                    &GBA_Cpu::readb_command, true),
+        REPL_Command("readh",
+                    {
+                        { REPL_ArgumentType::POINTER, "address", "Address of the halfword to be read" }
+                    },
+                    &GBA_Cpu::readh_command, true),
+        REPL_Command("readw",
+                    {
+                        { REPL_ArgumentType::POINTER, "address", "Address of the word to be read" }
+                    },
+                    &GBA_Cpu::readw_command, true),
+        REPL_Command("fillb",
+                    {
+                        { REPL_ArgumentType::INTEGER, "value", "Byte written to every address of the range" },
+                        { REPL_ArgumentType::RANGE, "address", "Address range to be filled" }
+                    },
+                    &GBA_Cpu::fillb_command),
+        REPL_Command("fillh",
+                    {
+                        { REPL_ArgumentType::INTEGER, "value", "Halfword written to every aligned address of the range" },
+                        { REPL_ArgumentType::RANGE, "address", "Address range to be filled" }
+                    },
+                    &GBA_Cpu::fillh_command),
+        REPL_Command("fillw",
+                    {
+                        { REPL_ArgumentType::INTEGER, "value", "Word written to every aligned address of the range" },
+                        { REPL_ArgumentType::RANGE, "address", "Address range to be filled" }
+                    },
+                    &GBA_Cpu::fillw_command),
         REPL_Command("dump",
                     {
                         { REPL_ArgumentType::RANGE, "address", "Address range to be printed" }
@@ -73,8 +286,132 @@ public:
                     {
                         { REPL_ArgumentType::RANGE, "address", "Address range to be disassembled" }
                     },
-                    & GBA_Cpu::disst_command)
+                    & GBA_Cpu::disst_command),
+        REPL_Command("uncomp",
+                    {
+                        { REPL_ArgumentType::POINTER, "source", "Address of the compressed stream header" },
+                        { REPL_ArgumentType::POINTER, "destination", "Address where the stream is decompressed to" }
+                    },
+                    &GBA_Cpu::uncomp_command),
+        REPL_Command("uncompf",
+                    {
+                        { REPL_ArgumentType::POINTER, "source", "Address of the compressed stream header" },
+                        { REPL_ArgumentType::STRING, "file", "File where the stream is decompressed to" }
+                    },
+                    &GBA_Cpu::uncompf_command),
+        REPL_Command("scanlz",
+                    {
+                        { REPL_ArgumentType::RANGE, "address", "Address range to be searched for LZ77 streams" }
+                    },
+                    &GBA_Cpu::scanlz_command),
+        REPL_Command("finda",
+                    {
+                        { REPL_ArgumentType::PATTERN, "pattern", "$(structured pattern) or $$(regex) to be matched" },
+                        { REPL_ArgumentType::RANGE, "address", "Address range to be searched as ARM code" }
+                    },
+                    &GBA_Cpu::finda_command),
+        REPL_Command("findt",
+                    {
+                        { REPL_ArgumentType::PATTERN, "pattern", "$(structured pattern) or $$(regex) to be matched" },
+                        { REPL_ArgumentType::RANGE, "address", "Address range to be searched as THUMB code" }
+                    },
+                    &GBA_Cpu::findt_command),
+        REPL_Command("entry",
+                    {
+                        { REPL_ArgumentType::POINTER, "address", "Function entry point, bit 0 set for THUMB code" }
+                    },
+                    &GBA_Cpu::entry_command),
+        REPL_Command("funcs",
+                    {
+                        { REPL_ArgumentType::RANGE, "address", "Address range whose functions are listed" }
+                    },
+                    &GBA_Cpu::funcs_command),
+        REPL_Command("func",
+                    {
+                        { REPL_ArgumentType::POINTER, "address", "Address inside the function" }
+                    },
+                    &GBA_Cpu::func_command),
+        REPL_Command("callers",
+                    {
+                        { REPL_ArgumentType::POINTER, "address", "Address inside the called function" }
+                    },
+                    &GBA_Cpu::callers_command),
+        REPL_Command("callees",
+                    {
+                        { REPL_ArgumentType::POINTER, "address", "Address inside the calling function" }
+                    },
+                    &GBA_Cpu::callees_command),
+        REPL_Command("trigger",
+                    {
+                        { REPL_ArgumentType::STRING, "handler", "break, intercept (skip the instruction after the REPL) or warn" },
+                        { REPL_ArgumentType::STRING, "kind", "exec, read, write or access" },
+                        { REPL_ArgumentType::RANGE, "address", "Instructions or memory the trigger watches" },
+                        { REPL_ArgumentType::CONDITION, "condition", "Condition the hit must meet", true }
+                    },
+                    &GBA_Cpu::trigger_command),
+        REPL_Command("triggers", {}, &GBA_Cpu::triggers_command),
+        REPL_Command("untrigger",
+                    {
+                        { REPL_ArgumentType::INTEGER, "id", "Id of the trigger to be removed" }
+                    },
+                    &GBA_Cpu::untrigger_command),
+        REPL_Command("execute",
+                    {
+                        { REPL_ArgumentType::INSTRUCTION, "instruction", "Instruction executed in place of the next one, which still runs" }
+                    },
+                    &GBA_Cpu::execute_command),
+        REPL_Command("ass",
+                    {
+                        { REPL_ArgumentType::INSTRUCTION, "instructions", "$(...) or T(...), more lines appended as (...)" },
+                        { REPL_ArgumentType::POINTER, "address", "Address the code is written to" }
+                    },
+                    &GBA_Cpu::ass_command, true),
+        REPL_Command("assf",
+                    {
+                        { REPL_ArgumentType::STRING, "file", "Assembly source, see assemble_program" },
+                        { REPL_ArgumentType::POINTER, "address", "Address the code is written to" }
+                    },
+                    &GBA_Cpu::assf_command),
+        REPL_Command("coverage",
+                    {
+                        { REPL_ArgumentType::STRING, "action", "on, off or clear the executed instructions recorded" }
+                    },
+                    &GBA_Cpu::coverage_command),
+        REPL_Command("covranges",
+                    {
+                        { REPL_ArgumentType::RANGE, "address", "Address range whose executed ranges are listed" }
+                    },
+                    &GBA_Cpu::covranges_command, true),
+        REPL_Command("covsave",
+                    {
+                        { REPL_ArgumentType::STRING, "file", "File the coverage bitmap is written to" }
+                    },
+                    &GBA_Cpu::covsave_command),
+        REPL_Command("covmerge",
+                    {
+                        { REPL_ArgumentType::STRING, "file", "Coverage bitmap saved by covsave, added to the current one" }
+                    },
+                    &GBA_Cpu::covmerge_command),
+        REPL_Command("covlist",
+                    {
+                        { REPL_ArgumentType::RANGE, "address", "Address range to be listed" },
+                        { REPL_ArgumentType::STRING, "file", "Annotated listing, an lcov tracefile of it goes to file.info" }
+                    },
+                    &GBA_Cpu::covlist_command),
+        REPL_Command("stats",
+                    {
+                        { REPL_ArgumentType::STRING, "action", "reset to zero the counters instead of printing them", true }
+                    },
+                    &GBA_Cpu::stats_command),
+        REPL_Command("keys",
+                    {
+                        { REPL_ArgumentType::STRING, "keys", "Keys held from the next frame on, as A+B+START, or none" }
+                    },
+                    &GBA_Cpu::keys_command, true),
+        REPL_Command("frame", {}, &GBA_Cpu::frame_command, true)
     };
-};
-
 
+    static constexpr REPL_CommandTable command_table = make_command_table(commands);
+private:
+    std::string line;   // Reused by process_command
+};
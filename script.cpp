@@ -0,0 +1,306 @@
+#include "script.h"
+#include <fmt/core.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+namespace
+{
+    /** Signature of the break directive. It has no procedure, its address is only evaluated. */
+    constexpr REPL_Command break_directive("break",
+                                           {
+                                               { REPL_ArgumentType::POINTER, "address", "Instruction the following commands run at" }
+                                           },
+                                           nullptr);
+
+    /** Drops a # comment, unless it is inside parentheses or brackets, and the surrounding blanks. */
+    std::string_view strip_line(std::string_view line)
+    {
+        int depth = 0;
+        for (size_t i = 0; i < line.size(); i++)
+        {
+            if (line[i] == '(' || line[i] == '[')
+                depth++;
+            else if (line[i] == ')' || line[i] == ']')
+                depth--;
+            else if (line[i] == '#' && depth <= 0)
+            {
+                line = line.substr(0, i);
+                break;
+            }
+        }
+
+        auto is_blank = [](char c) { return c == ' ' || c == '\t' || c == '\r'; };
+        while (!line.empty() && is_blank(line.front()))
+            line.remove_prefix(1);
+        while (!line.empty() && is_blank(line.back()))
+            line.remove_suffix(1);
+        return line;
+    }
+
+    std::string json_string(std::string_view text)
+    {
+        std::string escaped = "\"";
+        for (char c : text)
+        {
+            switch (c)
+            {
+                case '"':  escaped += "\\\""; break;
+                case '\\': escaped += "\\\\"; break;
+                case '\n': escaped += "\\n"; break;
+                case '\r': escaped += "\\r"; break;
+                case '\t': escaped += "\\t"; break;
+                default:
+                    if (static_cast<uint8_t>(c) < 0x20)
+                        escaped += fmt::format("\\u{:04x}", static_cast<uint8_t>(c));
+                    else
+                        escaped += c;
+            }
+        }
+        return escaped += '"';
+    }
+
+    /** Redirects std::cout into a buffer for as long as it lives. */
+    class CapturedOutput
+    {
+    public:
+        CapturedOutput() : previous(std::cout.rdbuf(buffer.rdbuf())) {}
+        ~CapturedOutput() { std::cout.rdbuf(previous); }
+        CapturedOutput(const CapturedOutput&) = delete;
+        CapturedOutput& operator=(const CapturedOutput&) = delete;
+
+        std::string text() const { return buffer.str(); }
+    private:
+        std::ostringstream buffer;
+        std::streambuf* previous;
+    };
+}
+
+REPL_Script::REPL_Script(const std::string& path)
+    : text(std::make_unique<std::string>())
+{
+    std::ifstream file{ path };
+    if (!file.is_open())
+    {
+        throw std::runtime_error(fmt::format("Could not open script {}", path));
+    }
+    text->assign(std::istreambuf_iterator<char>{ file }, std::istreambuf_iterator<char>{});
+
+    REPL repl;
+    std::string errors;
+    std::string_view remaining{ *text };
+    uint32_t line_number = 0;
+    blocks.emplace_back();
+
+    while (!remaining.empty())
+    {
+        auto line_end = remaining.find('\n');
+        auto line = strip_line(remaining.substr(0, line_end));
+        remaining.remove_prefix(line_end == std::string_view::npos ? remaining.size() : line_end + 1);
+        line_number++;
+
+        try
+        {
+            Command command;
+            command.line = line_number;
+            command.source = line;
+            command.count = repl.split_tokens(line, command.tokens);
+            if (command.count == 0)
+            {
+                continue;
+            }
+
+            if (command.tokens[0] == "break")
+            {
+                repl.check_signature(break_directive, command.tokens, command.count);
+                blocks.push_back({ command, {} });
+                continue;
+            }
+
+            if (command.tokens[0] == "exit")
+            {
+                if (command.count != 1)
+                {
+                    throw std::runtime_error("exit takes no arguments");
+                }
+            }
+            else
+            {
+                command.command = &repl.find_command(command.tokens[0]);
+                repl.check_signature(*command.command, command.tokens, command.count);
+            }
+            blocks.back().commands.push_back(command);
+        }
+        catch (std::runtime_error& e)
+        {
+            if (!errors.empty())
+                errors += '\n';
+            errors += fmt::format("{}:{}: {}", path, line_number, e.what());
+        }
+    }
+
+    if (!errors.empty())
+    {
+        throw std::runtime_error(errors);
+    }
+}
+
+REPL_Script::REPL_Script()
+    : text(std::make_unique<std::string>())
+{
+    blocks.emplace_back();
+}
+
+void REPL_Script::run(const std::string& rom_path, std::ostream& output, const RunOptions& options) const
+{
+    auto rom = json_string(rom_path);
+    std::ifstream gba_file{ rom_path, std::ios::binary };
+    if (!gba_file.is_open())
+    {
+        output << fmt::format("{{\"rom\":{},\"event\":\"error\",\"error\":\"Could not open rom file\"}}", rom)
+               << std::endl;
+        return;
+    }
+
+    GBA_Memory memory;
+    memory.load_rom(gba_file, nullptr);
+    GBA_Cpu cpu{ memory };
+    cpu.trace = options.trace;
+    cpu.backend = options.backend;
+    cpu.enable_coverage(!options.coverage_path.empty());
+
+    // From power on, before any command, so that a replay starts from the state the recording did
+    InputMovie movie;
+    std::optional<MovieSession> movie_session;
+    try
+    {
+        if (!options.play_path.empty())
+        {
+            movie = InputMovie::load(options.play_path);
+            movie_session.emplace(cpu, movie, MovieSession::Mode::PLAY);
+        }
+        else if (!options.record_path.empty())
+        {
+            movie.hash_interval = std::max(1u, options.hash_interval);
+            movie_session.emplace(cpu, movie, MovieSession::Mode::RECORD);
+        }
+    }
+    catch (std::runtime_error& e)
+    {
+        output << fmt::format("{{\"rom\":{},\"event\":\"error\",\"error\":{}}}", rom, json_string(e.what())) << std::endl;
+        return;
+    }
+
+    // Variables persist along the whole run, so blocks can keep counters or hand values to each other
+    REPL repl;
+    bool exited = false;
+    std::vector<uint32_t> break_addresses(blocks.size());
+    std::vector<uint32_t> hits(blocks.size());
+
+    auto run_block = [&](size_t index)
+    {
+        auto& block = blocks[index];
+        auto instruction_address = cpu.PC - cpu.instruction_size * 2;
+        auto break_address = index == 0 ? std::string{ "null" } : std::to_string(break_addresses[index]);
+        hits[index]++;
+
+        for (auto& command : block.commands)
+        {
+            if (!command.command)
+            {
+                exited = true;
+                return;
+            }
+
+            std::optional<uint32_t> result;
+            std::string error = "null";
+            std::string captured;
+            {
+                CapturedOutput capture;
+                try
+                {
+                    result = repl.execute(*command.command, command.tokens, command.count, cpu);
+                }
+                catch (std::runtime_error& e)
+                {
+                    error = json_string(e.what());
+                }
+                captured = capture.text();
+            }
+
+            output << fmt::format("{{\"rom\":{},\"event\":\"command\",\"line\":{},\"command\":{},\"break\":{},"
+                                  "\"hit\":{},\"pc\":{},\"cycles\":{},\"yield\":{},\"output\":{},\"error\":{}}}",
+                                  rom, command.line, json_string(command.source), break_address,
+                                  hits[index], instruction_address, cpu.cycles,
+                                  result ? std::to_string(*result) : "null", json_string(captured), error)
+                   << std::endl;
+        }
+    };
+
+    for (size_t i = 1; i < blocks.size(); i++)
+    {
+        auto& directive = blocks[i].directive;
+        break_addresses[i] = repl.parse_arguments(break_directive, directive.tokens, directive.count, cpu)[0].value;
+        if (std::find(cpu.break_points.begin(), cpu.break_points.end(), break_addresses[i]) == cpu.break_points.end())
+        {
+            cpu.add_break_point(break_addresses[i]);
+        }
+    }
+
+    cpu.break_handler = [&](GBA_Cpu&, uint32_t instruction_address)
+    {
+        for (size_t i = 1; i < blocks.size() && !exited; i++)
+        {
+            if (break_addresses[i] == instruction_address)
+                run_block(i);
+        }
+        if (exited)
+            cpu.stop();
+    };
+
+    run_block(0);
+
+    std::string_view reason = "exit";
+    if (!exited)
+    {
+        if (!cpu.run(options.max_cycles))
+            reason = "unhandled opcode";
+        else if (movie_session && movie_session->divergence())
+            reason = "divergence";
+        else if (movie_session && movie_session->finished())
+            reason = "movie end";
+        else if (!exited)
+            reason = "cycle limit";
+    }
+
+    std::string frames;
+    if (movie_session)
+    {
+        frames = fmt::format(",\"frames\":{}", movie_session->frames());
+        if (auto& divergence = movie_session->divergence())
+        {
+            frames += fmt::format(",\"divergence\":{{\"frame\":{},\"expected\":\"{:016x}\",\"actual\":\"{:016x}\"}}",
+                                  divergence->frame, divergence->expected, divergence->actual);
+        }
+        if (!options.record_path.empty() && options.play_path.empty())
+            movie.save(options.record_path);
+    }
+
+    std::string covered;
+    if (!options.coverage_path.empty())
+    {
+        // Merged into the map earlier runs left, so a suite of scripts adds up to one map
+        auto& coverage = cpu.flush_coverage();
+        covered = fmt::format(",\"covered\":{}", coverage.count(CoverageMap::areas[0].base, CoverageMap::areas[0].base + memory.rom_size));
+        if (std::ifstream{ options.coverage_path }.good())
+            coverage.merge_file(options.coverage_path);
+        coverage.save(options.coverage_path);
+    }
+
+    output << fmt::format("{{\"rom\":{},\"event\":\"end\",\"reason\":\"{}\",\"cycles\":{},\"pc\":{}{}{}}}",
+                          rom, reason, cpu.cycles, cpu.PC - cpu.instruction_size * 2, covered, frames)
+           << std::endl;
+}
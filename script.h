@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "repl.h"
+#include "movie.h"
+
+/**
+ * @brief A file of REPL commands, compiled once and run over any amount of ROMs without a prompt.
+ *
+ * One command per line, # starts a comment:
+ *      fillw 0 [0x02000000:+16w]       Commands before the first break run once, before the first instruction
+ *      break [0x080001c4]              Commands after a break run each time that instruction is about to execute
+ *      readw [$r0] [$value]
+ *      dissa [$pc-2i:+4i]
+ *      exit                            Ends the run of the current ROM
+ *
+ * Lines are split, their commands looked up and their signatures checked when the script is
+ * compiled, so every mistake is reported with its line before any ROM runs. Only the argument
+ * expressions ($r0, variables...) are evaluated when a command runs.
+ *
+ * Results are streamed as JSON lines, one object per command run:
+ *      {"rom":"a.gba","event":"command","line":3,"command":"readw [$r0] [$value]","break":134218180,
+ *       "hit":1,"pc":134218180,"cycles":1520,"yield":null,"output":"","error":null}
+ * and one when the ROM stops, with "event":"end" and the reason: exit, unhandled opcode, cycle limit,
+ * movie end or divergence, plus the amount of ROM halfwords executed ("covered") when recording coverage,
+ * and the frames run ("frames") and the first frame that diverged ("divergence") with a movie.
+ */
+class REPL_Script
+{
+public:
+    /**
+     * @brief Compiles a command file.
+     *
+     * @throws std::runtime_error If the file can't be read or has invalid lines, listing all of them.
+     */
+    explicit REPL_Script(const std::string& path);
+
+    /** A script without commands, the ROM just runs. */
+    REPL_Script();
+
+    struct RunOptions
+    {
+        /** Cycles after which the run stops, 0 for no limit. */
+        uint64_t max_cycles = 0;
+        /** Print every executed instruction, as the interactive mode does. */
+        bool trace = false;
+        /** Interpreter the ROM runs with. */
+        GBA_Cpu::Backend backend = GBA_Cpu::Backend::SWITCH;
+        /** Coverage map the instructions executed are merged into, none if empty. */
+        std::string coverage_path;
+        /** Movie the keys of each frame are recorded to, none if empty. */
+        std::string record_path;
+        /** Movie whose keys drive the run, which ends with it. None if empty. */
+        std::string play_path;
+        /** Frames between the state hashes of a recorded movie. */
+        uint32_t hash_interval = InputMovie::default_hash_interval;
+    };
+
+    /**
+     * @brief Runs a ROM under the script.
+     *
+     * The ROM runs until an exit command, an unhandled opcode, max_cycles or the end of the movie
+     * played. Errors of a command are written to its record and the run goes on, a movie that
+     * can't be played or recorded gives an "error" record instead of the "end" one.
+     *
+     * @param rom_path ROM to be loaded.
+     * @param output Stream the JSON records are written to.
+     */
+    void run(const std::string& rom_path, std::ostream& output, const RunOptions& options) const;
+
+private:
+    struct Command
+    {
+        uint32_t line = 0;
+        std::string_view source;
+        const REPL_Command* command = nullptr;  // nullptr for exit
+        REPL_Tokens tokens;
+        size_t count = 0;
+    };
+
+    /** Commands run at a break point. The first block runs at startup and has no break directive. */
+    struct Block
+    {
+        Command directive;
+        std::vector<Command> commands;
+    };
+
+    std::unique_ptr<std::string> text;  // Commands view into it
+    std::vector<Block> blocks;
+};
@@ -6,18 +6,16 @@ template<char space = ' '>
 void left_trim(std::string& input)
 {
     size_t i = 0;
-    if (input.size() == 0) return;
-    while(input[i] == space && i < input.size()) i++;
+    while(i < input.size() && input[i] == space) i++;
     input = input.substr(i);
 }
 
 template<char space = ' '>
 void right_trim(std::string& input)
 {
-    if (input.size() == 0) return;
-    auto i = input.size() - 1;
-    while(input[i] == space && i >= 0) i--;
-    input.resize(i + 1);
+    auto i = input.size();
+    while(i > 0 && input[i - 1] == space) i--;
+    input.resize(i);
 }
 
 template<char lspace = ' ', char rspace = ' '>
@@ -31,18 +29,16 @@ template<char space = ' '>
 std::string left_trim_cp(const std::string& input)
 {
     size_t i = 0;
-    if (input.size() == 0) return "";
-    while(input[i] == space && i < input.size()) i++;
+    while(i < input.size() && input[i] == space) i++;
     return input.substr(i);
 }
 
 template<char space = ' '>
 std::string right_trim_cp(const std::string& input)
 {
-    if (input.size() == 0) return "";
-    size_t i = input.size() - 1;
-    while(input[i] == space && i >= 0) i--;
-    return input.substr(0, i + 1);
+    size_t i = input.size();
+    while(i > 0 && input[i - 1] == space) i--;
+    return input.substr(0, i);
 }
 template<char lspace = ' ', char rspace = ' '>
 std::string lr_trim_cp(const std::string& input)
@@ -0,0 +1,236 @@
+#include "GBA_Cpu.h"
+#include "bios.h"
+#include <algorithm>
+#include <iterator>
+
+// Computed goto (&&label, goto *address) is a GNU extension. Compilers without it dispatch the
+// pre-decoded handlers with a switch instead. -Wpedantic is only silenced around the two blocks using it
+#if defined(__GNUC__)
+#define THREADED_COMPUTED_GOTO
+#endif
+
+bool GBA_Cpu::run_threaded(uint64_t cycle_limit)
+{
+    if (decoded_instructions.empty())
+    {
+        decoded_instructions.resize(size_t{ 1 } << decoded_instruction_bits);
+    }
+
+#ifdef THREADED_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+    static const void* const handler_labels[] =
+    {
+        &&handle_UNHANDLED,
+        &&handle_LDR_immediate,
+        &&handle_STR_immediate,
+        &&handle_MRS,
+        &&handle_MSR,
+        &&handle_B,
+        &&handle_ADD,
+        &&handle_MOV,
+        &&handle_BX,
+        &&handle_SWI,
+        &&handle_LSLS_thumb_1,
+        &&handle_MOVS_thumb_1,
+        &&handle_LDR_thumb_3,
+        &&handle_LDR_thumb_1,
+        &&handle_B_thumb_1,
+        &&handle_SWI_thumb,
+        &&handle_B_thumb_2,
+        &&handle_BX_thumb,
+        &&handle_BL_thumb
+    };
+#pragma GCC diagnostic pop
+    static_assert(std::size(handler_labels) == static_cast<size_t>(OpcodeHandler::COUNT));
+#endif
+
+    uint32_t pc = 0;
+    uint64_t start_cycles = 0;
+    DecodedInstruction* instruction = nullptr;
+
+    auto finished = [&]()
+    {
+        return stop_requested || (cycle_limit != 0 && cycles >= cycle_limit);
+    };
+
+    // Tracing, watchpoints, break points, triggers and coverage only change from the REPL or a break handler,
+    // which run inside cycle(), so they're looked at again after each instruction it executes
+    bool stepping = false;
+    bool checking = false;
+    bool covering = false;
+    auto refresh = [&]()
+    {
+        stepping = trace || !memory.watchpoints.empty();
+        checking = !break_points.empty() || !triggers.empty();
+        covering = coverage_enabled;
+    };
+    refresh();
+
+    // Fetches and decodes the next instruction, nullptr if cycle() has to execute it
+    auto next = [&]() -> DecodedInstruction*
+    {
+        auto address = PC - instruction_size * 2;
+        if (stepping || halted || memory.io_state.interrupts.pending || address < bios_size)
+        {
+            return nullptr;
+        }
+        if (checking)
+        {
+            // cycle() looks the address up again, so only the instructions executed here count a check
+            if (exec_trigger_pages[(address >> trigger_page_bits) % exec_trigger_pages.size()]
+                || std::find(break_points.begin(), break_points.end(), address) != break_points.end())
+            {
+                return nullptr;
+            }
+            if constexpr (PerformanceCounters::enabled)
+                counters.break_point_checks += !break_points.empty();
+        }
+
+        pc = PC;
+        start_cycles = cycles;
+        executing = fetch_opcode(address);
+        if (covering)
+            track_coverage(address);
+
+        auto key = address | (mode == ExecutionMode::THUMB ? 1u : 0u);
+        auto& decoded = decoded_instructions[(address >> 1) & ((1u << decoded_instruction_bits) - 1)];
+        auto hit = decoded.key == key && decoded.opcode == executing;
+        if constexpr (PerformanceCounters::enabled)
+        {
+            counters.decode_hits += hit;
+            counters.decode_misses += !hit;
+        }
+        if (!hit)
+        {
+            decoded.key = key;
+            decoded.opcode = executing;
+            auto& handler = mode == ExecutionMode::ARM ? arm_handler(executing)
+                                                       : thumb_handler(static_cast<uint16_t>(executing));
+            decoded.handler = handler.kind;
+            decoded.execute = handler.execute;
+#ifdef THREADED_COMPUTED_GOTO
+            decoded.target = handler_labels[static_cast<size_t>(handler.kind)];
+#endif
+        }
+        return &decoded;
+    };
+
+    // Charges the cycles of an executed instruction, as cycle() does
+    auto retire = [&]()
+    {
+        if constexpr (PerformanceCounters::enabled)
+            counters.handlers[static_cast<size_t>(instruction->handler)]++;
+        cycles += fetch_cycles(pc);
+        io::tick(memory, static_cast<uint32_t>(cycles - start_cycles));
+    };
+
+    auto report_unhandled = [&]()
+    {
+        if constexpr (PerformanceCounters::enabled)
+            counters.unhandled++;
+        std::cout << "Unhandled opcode: " << debug_info() << std::endl;
+        io::tick(memory, static_cast<uint32_t>(cycles - start_cycles));
+    };
+
+#ifdef THREADED_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+    // Every kind of handler has its own label, ending in its own dispatch of the next instruction,
+    // so each of those jumps is predicted from the instructions that usually follow that kind.
+    //
+    // Kinds with a single handler call it directly. The others are templates on encoding bits
+    // (see arm_handler), one label can't name every instantiation, so they still call the one
+    // stored in the decoded instruction: a second indirect branch, though one per label, predicted
+    // per kind rather than shared by all instructions
+#define DISPATCH()                              \
+    if (finished())                             \
+        return true;                            \
+    if ((instruction = next()) == nullptr)      \
+        goto slow_path;                         \
+    goto *instruction->target
+
+#define RETIRE(handled)                         \
+    if (!(handled))                             \
+        goto unhandled;                         \
+    retire();                                   \
+    DISPATCH()
+
+#define HANDLER(kind)                           \
+    handle_##kind:                              \
+    RETIRE(instruction->execute(*this, executing));
+
+#define DIRECT_HANDLER(kind)                    \
+    handle_##kind:                              \
+    RETIRE(execute_##kind(*this, executing));
+
+    DISPATCH();
+
+    HANDLER(LDR_immediate)
+    HANDLER(STR_immediate)
+    HANDLER(MRS)
+    HANDLER(MSR)
+    HANDLER(B)
+    HANDLER(ADD)
+    HANDLER(MOV)
+    DIRECT_HANDLER(BX)
+    DIRECT_HANDLER(SWI)
+    HANDLER(LSLS_thumb_1)
+    HANDLER(MOVS_thumb_1)
+    HANDLER(LDR_thumb_3)
+    HANDLER(LDR_thumb_1)
+    HANDLER(B_thumb_1)
+    DIRECT_HANDLER(SWI_thumb)
+    DIRECT_HANDLER(B_thumb_2)
+    DIRECT_HANDLER(BX_thumb)
+    HANDLER(BL_thumb)
+
+slow_path:
+    if (!cycle())
+        return false;
+    refresh();
+    DISPATCH();
+
+handle_UNHANDLED:
+unhandled:
+    report_unhandled();
+    return false;
+
+#undef DIRECT_HANDLER
+#undef HANDLER
+#undef RETIRE
+#undef DISPATCH
+#pragma GCC diagnostic pop
+#else
+    while (!finished())
+    {
+        instruction = next();
+        if (instruction == nullptr)
+        {
+            if (!cycle())
+                return false;
+            refresh();
+            continue;
+        }
+
+        // The same split as the labels above
+        bool handled;
+        switch (instruction->handler)
+        {
+            case OpcodeHandler::BX:         handled = execute_BX(*this, executing); break;
+            case OpcodeHandler::SWI:        handled = execute_SWI(*this, executing); break;
+            case OpcodeHandler::SWI_thumb:  handled = execute_SWI_thumb(*this, executing); break;
+            case OpcodeHandler::B_thumb_2:  handled = execute_B_thumb_2(*this, executing); break;
+            case OpcodeHandler::BX_thumb:   handled = execute_BX_thumb(*this, executing); break;
+            default:                        handled = instruction->execute(*this, executing); break;
+        }
+        if (!handled)
+        {
+            report_unhandled();
+            return false;
+        }
+        retire();
+    }
+    return true;
+#endif
+}
@@ -0,0 +1,344 @@
+#include "trigger.h"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <optional>
+#include <stdexcept>
+#include <fmt/core.h>
+#include "GBA_Cpu.h"
+
+namespace
+{
+    struct BinaryOperator
+    {
+        std::string_view token;
+        int precedence;
+        Condition::Op op;
+    };
+
+    /** Two character operators first, so that && isn't taken for &. */
+    constexpr std::array<BinaryOperator, 18> binary_operators = { {
+        { "||", 1, Condition::Op::LOGICAL_OR },
+        { "&&", 2, Condition::Op::LOGICAL_AND },
+        { "==", 6, Condition::Op::EQUAL },
+        { "!=", 6, Condition::Op::NOT_EQUAL },
+        { "<=", 7, Condition::Op::LESS_EQUAL },
+        { ">=", 7, Condition::Op::GREATER_EQUAL },
+        { "<<", 8, Condition::Op::SHIFT_LEFT },
+        { ">>", 8, Condition::Op::SHIFT_RIGHT },
+        { "|", 3, Condition::Op::OR },
+        { "^", 4, Condition::Op::XOR },
+        { "&", 5, Condition::Op::AND },
+        { "<", 7, Condition::Op::LESS },
+        { ">", 7, Condition::Op::GREATER },
+        { "+", 9, Condition::Op::ADD },
+        { "-", 9, Condition::Op::SUBTRACT },
+        { "*", 10, Condition::Op::MULTIPLY },
+        { "/", 10, Condition::Op::DIVIDE },
+        { "%", 10, Condition::Op::MODULO }
+    } };
+
+    bool is_name_character(char c)
+    {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+    }
+
+    /** Register named by r0-r15, sp, lr or pc, -1 if name isn't one. */
+    int register_number(std::string_view name)
+    {
+        if (name == "sp") return 13;
+        if (name == "lr") return 14;
+        if (name == "pc") return 15;
+        if (name.size() < 2 || name[0] != 'r')
+            return -1;
+
+        unsigned index;
+        auto end = name.data() + name.size();
+        auto result = std::from_chars(name.data() + 1, end, index);
+        return result.ptr == end && result.ec == std::errc{} && index < 16 ? static_cast<int>(index) : -1;
+    }
+
+    /**
+     * Precedence climbing compiler, emitting the operations in postfix order.
+     */
+    class ConditionCompiler
+    {
+    public:
+        ConditionCompiler(std::string_view text, const std::map<std::string, uint32_t, std::less<>>& variables,
+                          std::vector<Condition::Operation>& code)
+            : text(text),
+              variables(variables),
+              code(code)
+        {
+        }
+
+        void compile()
+        {
+            binary(0);
+            skip_spaces();
+            if (!text.empty())
+                throw std::runtime_error{ fmt::format("Unexpected {} in condition", text) };
+        }
+    private:
+        void binary(int min_precedence)
+        {
+            unary();
+            for (;;)
+            {
+                skip_spaces();
+                auto found = std::find_if(binary_operators.begin(), binary_operators.end(),
+                                          [&](const BinaryOperator& candidate) { return text.substr(0, candidate.token.size()) == candidate.token; });
+                if (found == binary_operators.end() || found->precedence < min_precedence)
+                    return;
+
+                text.remove_prefix(found->token.size());
+                binary(found->precedence + 1);
+                emit(found->op);
+            }
+        }
+
+        void unary()
+        {
+            if (consume('!'))
+                unary(), emit(Condition::Op::NOT);
+            else if (consume('~'))
+                unary(), emit(Condition::Op::COMPLEMENT);
+            else if (consume('-'))
+                unary(), emit(Condition::Op::NEGATE);
+            else
+                primary();
+        }
+
+        void primary()
+        {
+            skip_spaces();
+            if (consume('('))
+            {
+                binary(0);
+                expect(')');
+                return;
+            }
+
+            if (auto load = load_operation())
+            {
+                binary(0);
+                expect(']');
+                emit(*load);
+                return;
+            }
+
+            if (!text.empty() && std::isdigit(static_cast<unsigned char>(text.front())))
+            {
+                emit(Condition::Op::CONSTANT, number());
+                return;
+            }
+
+            bool is_variable = consume('$');
+            size_t length = 0;
+            while (length < text.size() && is_name_character(text[length]))
+                length++;
+            auto name = text.substr(0, length);
+            text.remove_prefix(length);
+            if (name.empty())
+                throw std::runtime_error{ fmt::format("Expected a value in condition: {}", text) };
+
+            auto index = register_number(name);
+            if (index >= 0)
+                emit(Condition::Op::REGISTER, index);
+            else if (!is_variable && name == "hits")
+                emit(Condition::Op::HITS);
+            else if (!is_variable && name == "address")
+                emit(Condition::Op::ADDRESS);
+            else if (auto variable = variables.find(name); is_variable && variable != variables.end())
+                emit(Condition::Op::CONSTANT, variable->second);
+            else
+                throw std::runtime_error{ fmt::format("Unknown {} {} in condition", is_variable ? "variable" : "name", name) };
+        }
+
+        /** Consumes [, b[, h[ or w[, returning the load they start. */
+        std::optional<Condition::Op> load_operation()
+        {
+            if (consume('['))
+                return Condition::Op::LOAD_WORD;
+            if (text.size() < 2 || text[1] != '[')
+                return std::nullopt;
+
+            Condition::Op op;
+            switch (text[0])
+            {
+                case 'b': op = Condition::Op::LOAD_BYTE; break;
+                case 'h': op = Condition::Op::LOAD_HALFWORD; break;
+                case 'w': op = Condition::Op::LOAD_WORD; break;
+                default: return std::nullopt;
+            }
+            text.remove_prefix(2);
+            return op;
+        }
+
+        uint32_t number()
+        {
+            uint32_t value = 0;
+            std::from_chars_result result;
+            const auto end = text.data() + text.size();
+
+            if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X'))
+                result = std::from_chars(text.data() + 2, end, value, 16);
+            else
+                result = std::from_chars(text.data(), end, value);
+
+            if (result.ec != std::errc{})
+                throw std::runtime_error{ fmt::format("Could not parse value {}", text) };
+
+            text.remove_prefix(result.ptr - text.data());
+            return value;
+        }
+
+        void emit(Condition::Op op, uint32_t operand = 0)
+        {
+            switch (op)
+            {
+                case Condition::Op::CONSTANT:
+                case Condition::Op::REGISTER:
+                case Condition::Op::HITS:
+                case Condition::Op::ADDRESS:
+                    depth++;
+                    break;
+                case Condition::Op::LOAD_BYTE:
+                case Condition::Op::LOAD_HALFWORD:
+                case Condition::Op::LOAD_WORD:
+                case Condition::Op::NEGATE:
+                case Condition::Op::NOT:
+                case Condition::Op::COMPLEMENT:
+                    break;
+                default:
+                    depth--;
+                    break;
+            }
+
+            if (depth > condition_max_depth)
+                throw std::runtime_error{ "Condition is too deep" };
+            code.push_back({ op, operand });
+        }
+
+        void skip_spaces()
+        {
+            while (!text.empty() && text.front() == ' ')
+                text.remove_prefix(1);
+        }
+
+        bool consume(char c)
+        {
+            skip_spaces();
+            if (text.empty() || text.front() != c)
+                return false;
+            text.remove_prefix(1);
+            return true;
+        }
+
+        void expect(char c)
+        {
+            if (!consume(c))
+                throw std::runtime_error{ fmt::format("Expected {} in condition", c) };
+        }
+
+        std::string_view text;
+        const std::map<std::string, uint32_t, std::less<>>& variables;
+        std::vector<Condition::Operation>& code;
+        size_t depth = 0;
+    };
+
+    uint32_t load(const GBA_Memory& memory, uint32_t address, uint32_t size)
+    {
+        if (memory.contiguous_size(address) < size)
+            return 0;
+
+        switch (size)
+        {
+            case 1:     return memory.read_byte(address);
+            case 2:     return memory.read_halfword(address);
+            default:    return memory.read_word(address);
+        }
+    }
+
+    uint32_t apply(Condition::Op op, uint32_t left, uint32_t right)
+    {
+        switch (op)
+        {
+            case Condition::Op::MULTIPLY:       return left * right;
+            case Condition::Op::DIVIDE:         return right ? left / right : 0;
+            case Condition::Op::MODULO:         return right ? left % right : 0;
+            case Condition::Op::ADD:            return left + right;
+            case Condition::Op::SUBTRACT:       return left - right;
+            case Condition::Op::SHIFT_LEFT:     return right < 32 ? left << right : 0;
+            case Condition::Op::SHIFT_RIGHT:    return right < 32 ? left >> right : 0;
+            case Condition::Op::LESS:           return left < right;
+            case Condition::Op::LESS_EQUAL:     return left <= right;
+            case Condition::Op::GREATER:        return left > right;
+            case Condition::Op::GREATER_EQUAL:  return left >= right;
+            case Condition::Op::EQUAL:          return left == right;
+            case Condition::Op::NOT_EQUAL:      return left != right;
+            case Condition::Op::AND:            return left & right;
+            case Condition::Op::XOR:            return left ^ right;
+            case Condition::Op::OR:             return left | right;
+            case Condition::Op::LOGICAL_AND:    return left && right;
+            case Condition::Op::LOGICAL_OR:     return left || right;
+            default:                            return 0;
+        }
+    }
+}
+
+Condition::Condition(std::string_view source, const std::map<std::string, uint32_t, std::less<>>& variables)
+    : source(source)
+{
+    ConditionCompiler{ source, variables, code }.compile();
+}
+
+bool Condition::evaluate(const GBA_Cpu& cpu, const ConditionContext& context) const
+{
+    if (code.empty())
+    {
+        return true;
+    }
+
+    // Loads go through the regular accessors, they must not count as watched accesses
+    auto watch_hit = cpu.memory.watch_hit;
+
+    std::array<uint32_t, condition_max_depth> stack;
+    size_t top = 0;
+    for (auto& operation : code)
+    {
+        switch (operation.op)
+        {
+            case Op::CONSTANT:      stack[top++] = operation.operand; break;
+            case Op::REGISTER:      stack[top++] = cpu.R[operation.operand]; break;
+            case Op::HITS:          stack[top++] = context.hits; break;
+            case Op::ADDRESS:       stack[top++] = context.address; break;
+            case Op::LOAD_BYTE:     stack[top - 1] = load(cpu.memory, stack[top - 1], 1); break;
+            case Op::LOAD_HALFWORD: stack[top - 1] = load(cpu.memory, stack[top - 1], 2); break;
+            case Op::LOAD_WORD:     stack[top - 1] = load(cpu.memory, stack[top - 1], 4); break;
+            case Op::NEGATE:        stack[top - 1] = 0u - stack[top - 1]; break;
+            case Op::NOT:           stack[top - 1] = !stack[top - 1]; break;
+            case Op::COMPLEMENT:    stack[top - 1] = ~stack[top - 1]; break;
+            default:
+                top--;
+                stack[top - 1] = apply(operation.op, stack[top - 1], stack[top]);
+                break;
+        }
+    }
+
+    cpu.memory.watch_hit = watch_hit;
+    return stack[0] != 0;
+}
+
+std::string Trigger::description() const
+{
+    constexpr std::array<std::string_view, 3> handler_names = { "break", "intercept", "warn" };
+    constexpr std::array<std::string_view, 4> kind_names = { "exec", "read", "write", "access" };
+
+    auto text = fmt::format("#{} {} {} [{:#010x}:{:#010x}]", id, handler_names[static_cast<size_t>(handler)],
+                            kind_names[static_cast<size_t>(kind)], begin, end);
+    if (!condition.empty())
+        text += ' ' + condition.text();
+    return text + fmt::format(" hits={}", hits);
+}
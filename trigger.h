@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class GBA_Cpu;
+
+/** Most values a condition keeps on its stack while evaluated. */
+constexpr size_t condition_max_depth = 16;
+
+/** Values a condition is evaluated against, besides the cpu. */
+struct ConditionContext
+{
+    uint32_t hits;      // Matches of the trigger so far, this one included
+    uint32_t address;   // Instruction or memory address that matched
+};
+
+/**
+ * @brief Condition of a trigger, compiled once to a stack bytecode.
+ *
+ * C like expression over unsigned 32 bit values:
+ *      operands    0x80, 128, r0-r15, sp, lr, pc (with or without $), $variable, hits, address
+ *      memory      [expr] or w[expr] reads a word, h[expr] a halfword, b[expr] a byte
+ *      operators   unary ! ~ -, then * / %, + -, << >>, < <= > >=, == !=, &, ^, |, &&, || as in C
+ *
+ * Variables are bound to their value when compiled. Reads outside memory and divisions by zero
+ * yield 0. Evaluating never changes the cpu nor the memory.
+ */
+class Condition
+{
+public:
+    enum class Op : uint8_t
+    {
+        CONSTANT, REGISTER, HITS, ADDRESS,
+        LOAD_BYTE, LOAD_HALFWORD, LOAD_WORD,
+        NEGATE, NOT, COMPLEMENT,
+        MULTIPLY, DIVIDE, MODULO, ADD, SUBTRACT, SHIFT_LEFT, SHIFT_RIGHT,
+        LESS, LESS_EQUAL, GREATER, GREATER_EQUAL, EQUAL, NOT_EQUAL,
+        AND, XOR, OR, LOGICAL_AND, LOGICAL_OR
+    };
+
+    struct Operation
+    {
+        Op op;
+        uint32_t operand;   // Value of CONSTANT, index of REGISTER
+    };
+
+    /** Always true. */
+    Condition() = default;
+
+    /**
+     * @throws std::runtime_error If the expression is invalid or too deep.
+     */
+    Condition(std::string_view source, const std::map<std::string, uint32_t, std::less<>>& variables);
+
+    bool evaluate(const GBA_Cpu& cpu, const ConditionContext& context) const;
+
+    bool empty() const { return code.empty(); }
+    const std::string& text() const { return source; }
+private:
+    std::vector<Operation> code;
+    std::string source;
+};
+
+/**
+ * @brief Action taken when an instruction or a memory access hits an address range and the
+ * condition holds.
+ *
+ * Exec triggers are checked before the instruction executes. Memory triggers are checked after
+ * the accessing instruction, so [address] already holds a written value.
+ */
+struct Trigger
+{
+    enum class Handler : uint8_t { BREAK, INTERCEPT, WARN };
+    enum class Kind : uint8_t { EXEC, READ, WRITE, ACCESS };
+
+    uint32_t id = 0;
+    Handler handler = Handler::BREAK;
+    Kind kind = Kind::EXEC;
+    uint32_t begin = 0;
+    uint32_t end = 0;   // Exclusive
+    Condition condition;
+    /** Times the range was hit, whether the condition held or not. */
+    uint32_t hits = 0;
+
+    bool contains(uint32_t address) const { return begin <= address && address < end; }
+    std::string description() const;
+};